@@ -1,8 +1,11 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #if defined(HJSON_PRESENT)
 #include <hjson.h>
@@ -16,6 +19,8 @@ class PoolAllocator;
 class SymbolTable;
 
 class CBufParser {
+  friend class CBufConversion;
+
 protected:
   ast_global* ast = nullptr;
   const unsigned char* buffer = nullptr;
@@ -61,6 +66,9 @@ public:
   unsigned int PrintCSV(const char* st_name, const unsigned char* buffer, size_t buf_size,
                         const char* ename = nullptr);
   unsigned int FillJstr(const char* st_name, const unsigned char* buffer, size_t buf_size, std::string& jstr);
+  // Walk a message without converting it, returns the bytes it takes or 0 if the buffer does
+  // not hold a valid st_name
+  unsigned int Validate(const char* st_name, const unsigned char* buffer, size_t buf_size);
   // Read a cbuf by name st_name (should have been parsed) from input stream buffer and write it to cbuf
   // parsed on dst_parser with name dst_name, on the bytes represented by dst_buf and dst_size
   unsigned int FastConversion(const char* st_name, const unsigned char* buffer, size_t buf_size,
@@ -73,6 +81,61 @@ public:
 #endif
 };
 
+// Conversion of a struct written with one version of its metadata to another, resolved once
+// into a list of operations per struct: copy the bytes as they are, convert them, or skip
+// them. Unlike FastConversion, no names are looked up per message. Plans are shared by the
+// whole process, see get, and can convert from several threads at once
+class CBufConversion {
+public:
+  // Plan to convert st_name from src_metadata, of hash src_hash, to dst_metadata. Built on
+  // first use and kept for the life of the process. Null if it cannot be built, as when the
+  // metadata does not parse or a field changed to an incompatible type
+  static std::shared_ptr<const CBufConversion> get(uint64_t src_hash, const std::string& src_metadata,
+                                                   uint64_t dst_hash, const std::string& dst_metadata,
+                                                   const std::string& st_name);
+
+  // Convert the message on buffer into dst_buf, returns the bytes consumed or 0 on failure
+  unsigned int Convert(const unsigned char* buffer, size_t buf_size, unsigned char* dst_buf,
+                       size_t dst_size) const;
+
+  ~CBufConversion();
+
+private:
+  struct Op {
+    enum Kind { SKIP, COPY, CONVERT, STRING, SHORT_STRING, STRUCT };
+    Kind kind = SKIP;
+    const ast_element* src = nullptr;
+    ast_element* dst = nullptr;
+    // Bytes copied, for COPY
+    size_t copy_size = 0;
+    // Type of the source values, enums as u32, for CONVERT and SKIP
+    int src_type = 0;
+    // Plan of the struct on structs_, for STRUCT and SKIP of structs, and the plan to skip
+    // it, for STRUCT when the source array is larger
+    int inner = -1;
+    int skip_inner = -1;
+  };
+  struct StructPlan {
+    const ast_struct* src = nullptr;
+    // Null when only skipping the struct
+    const ast_struct* dst = nullptr;
+    std::vector<Op> ops;
+  };
+
+  std::unique_ptr<CBufParser> src_parser_;
+  std::unique_ptr<CBufParser> dst_parser_;
+  std::vector<StructPlan> structs_;
+
+  CBufConversion();
+  bool build(const std::string& src_metadata, const std::string& dst_metadata, const std::string& st_name);
+  // Index on structs_ of the plan from src to dst, -1 if the conversion is not supported
+  int build_struct(const ast_struct* src, const ast_struct* dst);
+  bool convert_struct(int plan, const unsigned char*& buffer, size_t& buf_size, unsigned char* dst_buf) const;
+  bool skip_op(const Op& op, const unsigned char*& buffer, size_t& buf_size) const;
+  bool convert_struct_element(const Op& op, const unsigned char*& buffer, size_t& buf_size,
+                              unsigned char* dst_buf) const;
+};
+
 #if defined(HJSON_PRESENT)
 
 template <typename T>
@@ -10,6 +10,8 @@
 /// 4 bits, a 'variant' number is stored to differentiate
 /// messages of the same type.
 /// The lower 28 bits are the size of a packet
+/// Sizes too large for those bits have to be stored as 0, streams
+/// carry the real size on a header record before the packet
 ///
 #pragma pack(push, 1)
 struct cbuf_preamble {
@@ -32,6 +34,9 @@ struct cbuf_preamble {
     }
   }
 
+  // Largest size that can be stored, which depends on having a variant
+  uint32_t maxSize() const { return _hasVariant() ? 0x07FFFFFF : 0x7FFFFFFF; }
+
   void setSize(uint32_t sz) {
     if (_hasVariant()) {
       assert(sz < 0x07FFFFFF);
@@ -52,13 +52,13 @@ static bool name_in_filter(const std::vector<std::string>& filters, const std::s
 }
 
 PyObject* CBufReaderPython::getMessage(PyObject* module) {
+  if (start_seek_pending_) seekToStartTime();
   while (!finish_reading) {
     if (!computeNextSi()) return nullptr;
 
     auto nhash = next_si->cis->get_next_hash();
     cbuf_istream* next_cis = next_si->cis;
-    auto str = next_cis->get_string_for_hash(nhash);
-    // check if the topic name for this message has a namespace
+    uint32_t type = type_ids_.of(next_cis, nhash);
 
     auto msize = next_cis->get_next_size();
     if (msize == 0 || !next_cis->check_next_preamble()) {
@@ -66,10 +66,17 @@ PyObject* CBufReaderPython::getMessage(PyObject* module) {
       return nullptr;
     }
 
+    // Messages without metadata are parsed as the type with an empty name, as before
+    if (type == CBufTypeIds::NONE) type = type_ids_.add("");
+    if (type >= msg_infos_.size()) msg_infos_.resize(type + 1);
+    MessageInfo& info = msg_infos_[type];
+    const std::string& str = type_ids_.name(type);
+    if (info.in_filter < 0) info.in_filter = name_in_filter(msg_name_filter_, str) ? 1 : 0;
+
     // Check for the role filter applying to the cbuf is done on open
     // Check if early or late applies
     // Check if message name filter applies
-    if (!is_valid_early(next_cis->get_next_timestamp()) || !name_in_filter(msg_name_filter_, str)) {
+    if (!is_valid_early(next_cis->get_next_timestamp()) || info.in_filter == 0) {
       if (!next_cis->skip_message()) {
         finish_reading = true;
         return nullptr;
@@ -81,17 +88,16 @@ PyObject* CBufReaderPython::getMessage(PyObject* module) {
     // Check if we have an entry on the map
     //   if not, we need to create one, create a parser, look for a type or create it if not
     bool skip_msg_due_to_parsing = false;
-    if (msg_map_.contains(str) == 0) {
+    if (info.parser == nullptr) {
       // TODO: Find a way so we can load multiple messages but have few parsers
-      msg_map_[str].parser = new CBufParserPy();
-      auto* parser = msg_map_[str].parser;
+      info.parser = new CBufParserPy();
 
-      if (!parser->ParseMetadata(next_cis->get_meta_string_for_hash(nhash), str)) {
+      if (!info.parser->ParseMetadata(next_cis->get_meta_string_for_hash(nhash), str)) {
         error_string_ = "metadata could not be parsed for message " + str;
-        msg_map_[str].parsing_failed = true;
+        info.parsing_failed = true;
         skip_msg_due_to_parsing = true;
       }
-    } else if (msg_map_[str].parsing_failed) {
+    } else if (info.parsing_failed) {
       skip_msg_due_to_parsing = true;
     }
 
@@ -105,7 +111,7 @@ PyObject* CBufReaderPython::getMessage(PyObject* module) {
     }
 
     PyObject* return_obj = nullptr;
-    auto& parser = msg_map_[str].parser;
+    auto& parser = info.parser;
     const char* source_file = nullptr;
     for (const auto& str : source_filters_) {
       if (next_cis->filename().find(str) != std::string::npos) {
@@ -146,6 +152,7 @@ bool CBufReaderPython::openMemory(const char* filename, const char* data, size_t
   input_streams[0]->cis->open_memory((const unsigned char*)data, size);
   // We have to mark finish_reading as false as we could have consumed previous data
   finish_reading = false;
+  streams_moved_ = true;
   is_opened = true;
   return true;
 }
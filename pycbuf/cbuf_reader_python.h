@@ -2,7 +2,6 @@
 
 #include <Python.h>
 
-#include <unordered_map>
 #include <vector>
 
 #include "CBufParserPy.h"
@@ -13,9 +12,12 @@ class CBufReaderPython : public CBufReaderBase {
     CBufParserPy* parser = nullptr;
     PyObject* pytype = nullptr;
     bool parsing_failed = false;
+    // Whether the type passes msg_name_filter_, -1 until checked
+    int in_filter = -1;
   };
 
-  std::unordered_map<std::string, MessageInfo> msg_map_;
+  // Indexed by the ids of the types on type_ids_
+  std::vector<MessageInfo> msg_infos_;
   std::vector<std::string> msg_name_filter_;
 
   // This cis is used when parsing binary arrays
@@ -29,11 +31,16 @@ public:
   CBufReaderPython(const Options& options = Options())
       : CBufReaderBase(options) {}
 
-  void setMessageFilter(const std::vector<std::string>& msg_filter) { msg_name_filter_ = msg_filter; }
+  void setMessageFilter(const std::vector<std::string>& msg_filter) {
+    msg_name_filter_ = msg_filter;
+    for (auto& info : msg_infos_) {
+      info.in_filter = -1;
+    }
+  }
   const std::vector<std::string>& getMessageFilter() const { return msg_name_filter_; }
 
   //
-  void set_start_time(double time) { startTime = time; }
+  void set_start_time(double time) { setStartTime(time); }
   void set_end_time(double time) { endTime = time; }
   double get_start_time() { return startTime; }
   double get_end_time() { return endTime; }
@@ -5,6 +5,8 @@
 #include <string.h>
 
 #include <cmath>
+#include <map>
+#include <mutex>
 // Vector is here only for conversions
 #include <vector>
 
@@ -148,6 +150,7 @@ static bool processArraySize(const ast_element* elem, const u8*& bin_buffer, siz
   if (elem->array_suffix) {
     if (elem->is_dynamic_array || elem->is_compact_array) {
       // This is a dynamic array
+      if (buf_size < sizeof(array_size)) return false;
       array_size = *(u32*)bin_buffer;
       bin_buffer += sizeof(array_size);
       buf_size -= sizeof(array_size);
@@ -548,6 +551,7 @@ static bool process_element_enum(const ast_element* elem, const u8*& bin_buffer,
 
 template <class T>
 bool skip_element(const u8*& bin_buffer, size_t& buf_size, u32 array_size) {
+  if (buf_size < sizeof(T) * size_t(array_size)) return false;
   bin_buffer += sizeof(T) * array_size;
   buf_size -= sizeof(T) * array_size;
   return true;
@@ -556,10 +560,12 @@ bool skip_element(const u8*& bin_buffer, size_t& buf_size, u32 array_size) {
 bool skip_string(const u8*& bin_buffer, size_t& buf_size, u32 array_size) {
   for (u32 i = 0; i < array_size; i++) {
     // Read the size of the string
+    if (buf_size < sizeof(u32)) return false;
     u32 str_size = *(const u32*)bin_buffer;
     bin_buffer += sizeof(u32);
     buf_size -= sizeof(u32);
     // Read the characters
+    if (buf_size < str_size) return false;
     bin_buffer += str_size;
     buf_size -= str_size;
   }
@@ -567,6 +573,7 @@ bool skip_string(const u8*& bin_buffer, size_t& buf_size, u32 array_size) {
 }
 
 bool skip_short_string(const u8*& bin_buffer, size_t& buf_size, u32 array_size) {
+  if (buf_size < sizeof(char) * 16 * size_t(array_size)) return false;
   bin_buffer += sizeof(char) * 16 * array_size;
   buf_size -= sizeof(char) * 16 * array_size;
   return true;
@@ -1965,6 +1972,7 @@ bool CBufParser::SkipStructInternal(const ast_struct* st) {
   // All structs have a preamble, skip it
   if (!st->naked) {
     u32 sizeof_preamble = sizeof(cbuf_preamble);  // 8 bytes hash, 4 bytes size
+    if (buf_size < sizeof_preamble) return false;
     buffer += sizeof_preamble;
     buf_size -= sizeof_preamble;
   }
@@ -2212,4 +2220,298 @@ unsigned int CBufParser::FastConversion(const char* st_name, const unsigned char
   return buf_size - this->buf_size;
 }
 
+unsigned int CBufParser::Validate(const char* st_name, const unsigned char* buffer, size_t buf_size) {
+  if (!isParsed()) return 0;
+  auto* st = decompose_and_find(st_name);
+  if (st == nullptr) return 0;
+  this->buffer = buffer;
+  this->buf_size = buf_size;
+  success = true;
+  if (!SkipStructInternal(st)) {
+    this->buffer = nullptr;
+    return 0;
+  }
+  this->buffer = nullptr;
+  return buf_size - this->buf_size;
+}
+
 bool CBufParser::isEnum(const ast_element* elem) const { return sym->find_enum(elem) != nullptr; }
+
+CBufConversion::CBufConversion() {}
+
+CBufConversion::~CBufConversion() {}
+
+std::shared_ptr<const CBufConversion> CBufConversion::get(uint64_t src_hash, const std::string& src_metadata,
+                                                          uint64_t dst_hash, const std::string& dst_metadata,
+                                                          const std::string& st_name) {
+  static std::mutex plans_mutex;
+  static std::map<std::pair<uint64_t, uint64_t>, std::shared_ptr<const CBufConversion>> plans;
+
+  std::lock_guard<std::mutex> lock(plans_mutex);
+  auto key = std::make_pair(src_hash, dst_hash);
+  auto it = plans.find(key);
+  if (it != plans.end()) return it->second;
+
+  // Plans that cannot be built are remembered too, so the metadata is only parsed once
+  std::shared_ptr<CBufConversion> plan(new CBufConversion());
+  if (!plan->build(src_metadata, dst_metadata, st_name)) plan.reset();
+  plans.emplace(key, plan);
+  return plan;
+}
+
+bool CBufConversion::build(const std::string& src_metadata, const std::string& dst_metadata,
+                           const std::string& st_name) {
+  src_parser_ = std::make_unique<CBufParser>();
+  dst_parser_ = std::make_unique<CBufParser>();
+  if (!src_parser_->ParseMetadata(src_metadata, st_name)) return false;
+  if (!dst_parser_->ParseMetadata(dst_metadata, st_name)) return false;
+  auto* src_st = src_parser_->decompose_and_find(st_name.c_str());
+  auto* dst_st = dst_parser_->decompose_and_find(st_name.c_str());
+  if (src_st == nullptr || dst_st == nullptr) return false;
+  // Offsets on the destination are needed, with those of every struct in it
+  if (!computeSizes(dst_st, dst_parser_->sym)) return false;
+  return build_struct(src_st, dst_st) == 0;
+}
+
+int CBufConversion::build_struct(const ast_struct* src, const ast_struct* dst) {
+  for (size_t i = 0; i < structs_.size(); i++) {
+    if (structs_[i].src == src && structs_[i].dst == dst) return int(i);
+  }
+  int index = int(structs_.size());
+  structs_.push_back({src, dst, {}});
+
+  std::vector<Op> ops;
+  for (auto* elem : src->elements) {
+    Op op;
+    op.src = elem;
+    op.src_type = elem->type;
+    const ast_struct* inner_src = nullptr;
+    if (elem->type == TYPE_CUSTOM) {
+      if (src_parser_->isEnum(elem)) {
+        op.src_type = TYPE_U32;
+      } else {
+        inner_src = src_parser_->sym->find_struct(elem);
+        // Inconsistent metadata
+        if (inner_src == nullptr) return -1;
+      }
+    }
+
+    ast_element* dst_elem = dst != nullptr ? find_elem_by_name(dst, elem->name) : nullptr;
+    if (dst_elem == nullptr) {
+      op.kind = Op::SKIP;
+      if (inner_src != nullptr) {
+        op.inner = build_struct(inner_src, nullptr);
+        if (op.inner < 0) return -1;
+      }
+      ops.push_back(op);
+      continue;
+    }
+
+    op.dst = dst_elem;
+    // Conversions from non array to array or viceversa are not supported
+    if ((elem->array_suffix != nullptr) != (dst_elem->array_suffix != nullptr)) return -1;
+    if (inner_src != nullptr) {
+      auto* inner_dst = dst_parser_->sym->find_struct(dst_elem);
+      // Struct to non struct is not a supported conversion
+      if (inner_dst == nullptr) return -1;
+      op.kind = Op::STRUCT;
+      op.inner = build_struct(inner_src, inner_dst);
+      op.skip_inner = build_struct(inner_src, nullptr);
+      if (op.inner < 0 || op.skip_inner < 0) return -1;
+    } else if (op.src_type == TYPE_STRING) {
+      op.kind = Op::STRING;
+    } else if (op.src_type == TYPE_SHORT_STRING) {
+      op.kind = Op::SHORT_STRING;
+    } else {
+      int dst_type = dst_elem->type;
+      if (dst_type == TYPE_CUSTOM && dst_parser_->isEnum(dst_elem)) dst_type = TYPE_U32;
+      bool static_arrays = elem->array_suffix != nullptr && !elem->is_dynamic_array &&
+                           !elem->is_compact_array && !dst_elem->is_dynamic_array &&
+                           !dst_elem->is_compact_array &&
+                           elem->array_suffix->size == dst_elem->array_suffix->size;
+      // Values of the same type, alone or on arrays of the same size, are the same bytes
+      if (op.src_type == dst_type && (elem->array_suffix == nullptr || static_arrays)) {
+        op.kind = Op::COPY;
+        op.copy_size = dst_elem->csize;
+      } else {
+        op.kind = Op::CONVERT;
+      }
+    }
+    ops.push_back(op);
+  }
+  structs_[index].ops = std::move(ops);
+  return index;
+}
+
+unsigned int CBufConversion::Convert(const unsigned char* buffer, size_t buf_size, unsigned char* dst_buf,
+                                     size_t dst_size) const {
+  if (structs_.empty()) return 0;
+  size_t rem_size = buf_size;
+  if (!convert_struct(0, buffer, rem_size, dst_buf)) return 0;
+  return (unsigned int)(buf_size - rem_size);
+}
+
+bool CBufConversion::convert_struct(int plan, const unsigned char*& buffer, size_t& buf_size,
+                                    unsigned char* dst_buf) const {
+  const StructPlan& st = structs_[plan];
+  // All structs have a preamble
+  if (!st.src->naked) {
+    if (buf_size < sizeof(cbuf_preamble)) return false;
+    if (st.dst != nullptr && !st.dst->naked) {
+      *(cbuf_preamble*)dst_buf = *(const cbuf_preamble*)buffer;
+    }
+    buffer += sizeof(cbuf_preamble);
+    buf_size -= sizeof(cbuf_preamble);
+  }
+
+  for (const Op& op : st.ops) {
+    bool ok = true;
+    switch (op.kind) {
+      case Op::SKIP:
+        ok = skip_op(op, buffer, buf_size);
+        break;
+      case Op::COPY:
+        if (buf_size < op.copy_size) return false;
+        memcpy(dst_buf + op.dst->coffset, buffer, op.copy_size);
+        buffer += op.copy_size;
+        buf_size -= op.copy_size;
+        break;
+      case Op::CONVERT: {
+        auto convert = [&](auto value) {
+          return process_element_conversion<decltype(value)>(op.src, buffer, buf_size, *dst_parser_, op.dst,
+                                                             dst_buf + op.dst->coffset, op.dst->csize);
+        };
+        switch (op.src_type) {
+          case TYPE_U8:
+            ok = convert(u8());
+            break;
+          case TYPE_U16:
+            ok = convert(u16());
+            break;
+          case TYPE_U32:
+            ok = convert(u32());
+            break;
+          case TYPE_U64:
+            ok = convert(u64());
+            break;
+          case TYPE_S8:
+            ok = convert(s8());
+            break;
+          case TYPE_S16:
+            ok = convert(s16());
+            break;
+          case TYPE_S32:
+            ok = convert(s32());
+            break;
+          case TYPE_S64:
+            ok = convert(s64());
+            break;
+          case TYPE_F32:
+            ok = convert(f32());
+            break;
+          case TYPE_F64:
+            ok = convert(f64());
+            break;
+          case TYPE_BOOL:
+            ok = convert(bool());
+            break;
+          default:
+            ok = false;
+        }
+        break;
+      }
+      case Op::STRING:
+        ok = convert_element_string(op.src, buffer, buf_size, *dst_parser_, op.dst, dst_buf + op.dst->coffset,
+                                    op.dst->csize);
+        break;
+      case Op::SHORT_STRING:
+        ok = convert_element_short_string(op.src, buffer, buf_size, *dst_parser_, op.dst,
+                                          dst_buf + op.dst->coffset, op.dst->csize);
+        break;
+      case Op::STRUCT:
+        ok = convert_struct_element(op, buffer, buf_size, dst_buf + op.dst->coffset);
+        break;
+    }
+    if (!ok) return false;
+  }
+  return true;
+}
+
+bool CBufConversion::skip_op(const Op& op, const unsigned char*& buffer, size_t& buf_size) const {
+  u32 array_size = 1;
+  if (!processArraySize(op.src, buffer, buf_size, array_size)) return false;
+  switch (op.src_type) {
+    case TYPE_U8:
+    case TYPE_S8:
+    case TYPE_BOOL:
+      return skip_element<u8>(buffer, buf_size, array_size);
+    case TYPE_U16:
+    case TYPE_S16:
+      return skip_element<u16>(buffer, buf_size, array_size);
+    case TYPE_U32:
+    case TYPE_S32:
+    case TYPE_F32:
+      return skip_element<u32>(buffer, buf_size, array_size);
+    case TYPE_U64:
+    case TYPE_S64:
+    case TYPE_F64:
+      return skip_element<u64>(buffer, buf_size, array_size);
+    case TYPE_STRING:
+      return skip_string(buffer, buf_size, array_size);
+    case TYPE_SHORT_STRING:
+      return skip_short_string(buffer, buf_size, array_size);
+    case TYPE_CUSTOM:
+      for (u32 i = 0; i < array_size; i++) {
+        if (!convert_struct(op.inner, buffer, buf_size, nullptr)) return false;
+      }
+      return true;
+  }
+  return false;
+}
+
+bool CBufConversion::convert_struct_element(const Op& op, const unsigned char*& buffer, size_t& buf_size,
+                                            unsigned char* dst_buf) const {
+  const ast_element* dst_elem = op.dst;
+  const ast_struct* dst_st = structs_[op.inner].dst;
+  u32 array_size = 1;
+  if (!processArraySize(op.src, buffer, buf_size, array_size)) return false;
+
+  unsigned char* elem_dst_buf = dst_buf;
+  u32 typesize = dst_elem->typesize;
+  u32 dst_array_size = 0;
+  bool check_dst_array = false;
+  if (op.src->array_suffix) {
+    if (dst_elem->is_compact_array) {
+      // For compact arrays, write the num here on dst
+      *(u32*)elem_dst_buf = array_size;
+      elem_dst_buf += sizeof(array_size);
+    }
+    if (!dst_elem->is_dynamic_array) {
+      check_dst_array = true;
+      dst_array_size = dst_elem->array_suffix->size;
+    } else {
+      // Dynamic arrays of structs are allocated here, knowing std::vector is implemented as
+      // 3 pointers: start of vector, end of vector, end of allocation
+      u32 array_total_bytes = dst_st->csize * array_size;
+      unsigned char* array_mem_ptr = (unsigned char*)malloc(array_total_bytes);
+      memset(array_mem_ptr, 0, array_total_bytes);
+      unsigned char** vector_ptr = (unsigned char**)elem_dst_buf;
+      *vector_ptr = array_mem_ptr;
+      *(vector_ptr + 1) = array_mem_ptr + array_total_bytes;
+      *(vector_ptr + 2) = array_mem_ptr + array_total_bytes;
+      elem_dst_buf = array_mem_ptr;
+      typesize = dst_st->csize;
+    }
+  }
+
+  for (u32 i = 0; i < array_size; i++) {
+    if (check_dst_array && i >= dst_array_size) {
+      // The source array is bigger than the destination one
+      if (!convert_struct(op.skip_inner, buffer, buf_size, nullptr)) return false;
+    } else {
+      if (!convert_struct(op.inner, buffer, buf_size, elem_dst_buf)) return false;
+      elem_dst_buf += typesize;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <new>
+#include <string>
+
+#include "cbuf_reader.h"
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+#include "inctype.h"
+#include "test_stream_utils.h"
+
+namespace fs = std::filesystem;
+
+// Heap allocations on every thread, to check that some paths do not allocate. Every
+// replaceable allocation function is replaced, so none of them goes uncounted. Kept apart
+// from the other tests, as it changes how the whole binary allocates
+static thread_local size_t allocations = 0;
+
+static void* counted_alloc(size_t size, size_t alignment) {
+  allocations++;
+  if (size == 0) size = 1;
+  if (alignment <= alignof(std::max_align_t)) return malloc(size);
+  void* p = nullptr;
+  return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+}
+
+static void* counted_alloc_or_throw(size_t size, size_t alignment) {
+  void* p = counted_alloc(size, alignment);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size) { return counted_alloc_or_throw(size, 0); }
+void* operator new[](size_t size) { return counted_alloc_or_throw(size, 0); }
+void* operator new(size_t size, std::align_val_t al) { return counted_alloc_or_throw(size, size_t(al)); }
+void* operator new[](size_t size, std::align_val_t al) { return counted_alloc_or_throw(size, size_t(al)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size, 0); }
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, size_t(al));
+}
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, size_t(al));
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { free(p); }
+
+// Kept out of reach of the optimizer, which can leave out allocations it sees unused
+static void* volatile escaped = nullptr;
+
+TEST(Allocations, CountsEveryOverload) {
+  struct alignas(64) Aligned {
+    char c;
+  };
+  size_t before = allocations;
+  int* one = new int(1);
+  escaped = one;
+  delete one;
+  int* array = new int[4];
+  escaped = array;
+  delete[] array;
+  Aligned* aligned = new Aligned;
+  escaped = aligned;
+  delete aligned;
+  Aligned* aligned_array = new Aligned[2];
+  escaped = aligned_array;
+  delete[] aligned_array;
+  int* nothrow = new (std::nothrow) int(1);
+  escaped = nothrow;
+  delete nothrow;
+  EXPECT_EQ(allocations - before, 5u);
+}
+
+TEST(PullMessages, NoAllocationsOnceWarm) {
+  fs::path dir = fs::temp_directory_path() / ("pull_alloc." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const unsigned NUM_FILES = 2;
+  const unsigned PER_FILE = 500;
+  for (unsigned f = 0; f < NUM_FILES; f++) {
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file((dir / ("part" + std::to_string(f) + ".cb")).string().c_str()));
+    for (unsigned j = 0; j < PER_FILE; j++) {
+      unsigned val = j * NUM_FILES + f;
+      ASSERT_TRUE(write_inctype(cos, val, 1.7e9 + val * 0.01));
+    }
+    cos.close();
+  }
+
+  CBufReader reader(dir.string());
+  ASSERT_TRUE(reader.openUlog());
+  unsigned count = 0;
+  size_t warm_allocations = 0;
+  for (const auto& inc : reader.messages<messages::inctype>()) {
+    ASSERT_EQ(inc.val, count);
+    // Every file is mapped, with its metadata read, after the first messages
+    if (++count == 10) warm_allocations = allocations;
+  }
+  EXPECT_EQ(count, NUM_FILES * PER_FILE);
+  EXPECT_GT(warm_allocations, 0u);
+  EXPECT_EQ(allocations, warm_allocations);
+  fs::remove_all(dir);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
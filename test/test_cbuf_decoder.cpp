@@ -0,0 +1,353 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cbuf_reader.h"
+#include "cbuf_socket.h"
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+#include "image.h"
+#include "inctype.h"
+#include "test_stream_utils.h"
+
+namespace fs = std::filesystem;
+
+// Log with every kind of record: batches, repeats, deltas, and a footer
+static void write_mixed_log(const std::string& fname, unsigned num_messages) {
+  const double BASE_TS = 1.7e9;
+  cbuf_ostream cos;
+  cos.set_write_index(true);
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options batch_opts, repeat_opts, delta_opts;
+  batch_opts.batch_messages = 8;
+  batch_opts.batch_window = 1.0;
+  cos.set_type_options<messages::complex_thing>(batch_opts);
+  repeat_opts.suppress_repeats = true;
+  cos.set_type_options<messages::inctype>(repeat_opts);
+  delta_opts.delta_keyframe_interval = 5;
+  cos.set_type_options<messages::image>(delta_opts);
+
+  messages::image img;
+  for (unsigned i = 0; i < num_messages; i++) {
+    double ts = BASE_TS + i * 0.01;
+    ASSERT_TRUE(write_inctype(cos, i / 10, ts));
+    messages::complex_thing thing;
+    thing.one_val = i;
+    thing.preamble.packet_timest = ts;
+    ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+    char* ptr = thing.encode();
+    ASSERT_TRUE(cos.write_packet(ptr, thing.encode_size()));
+    thing.free_encode(ptr);
+    if (i % 3 == 0) {
+      img.rows = i;
+      img.pixels[i % sizeof(img.pixels)] = uint8_t(i);
+      ASSERT_TRUE(cos.serialize(&img));
+    }
+  }
+  cos.close();
+}
+
+TEST(IncrementalDecoder, ChunksOfAnySize) {
+  std::string fname = test_file("decoder");
+  write_mixed_log(fname, 120);
+  std::vector<uint8_t> data = read_whole_file(fname);
+
+  // Messages as seen by cbuf_istream
+  std::vector<std::vector<uint8_t>> expected;
+  cbuf_istream cis;
+  cis.set_expand_repeats(true);
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  while (!cis.empty_no_internal()) {
+    const uint8_t* ptr = cis.get_current_ptr();
+    expected.emplace_back(ptr, ptr + cis.get_next_size());
+    ASSERT_TRUE(cis.skip_message());
+  }
+  cis.close();
+  ASSERT_GT(expected.size(), 120u);
+
+  for (size_t max_chunk : {size_t(1), size_t(7), size_t(100), size_t(4096), data.size()}) {
+    cbuf_decoder dec;
+    dec.set_expand_repeats(true);
+    dec.set_keep_references(true);
+    unsigned seed = 42;
+    size_t pos = 0, count = 0, in_place = 0;
+    while (pos < data.size()) {
+      seed = seed * 1103515245 + 12345;
+      size_t chunk = std::min(data.size() - pos, 1 + (seed >> 8) % max_chunk);
+      // Copied so the decoder cannot rely on the bytes outliving the chunk
+      std::vector<uint8_t> buf(data.begin() + pos, data.begin() + pos + chunk);
+      dec.feed(buf.data(), buf.size());
+      cbuf_decoder::message msg;
+      while (dec.next(msg)) {
+        ASSERT_LT(count, expected.size());
+        ASSERT_EQ(msg.size, expected[count].size());
+        EXPECT_EQ(memcmp(msg.preamble, expected[count].data(), msg.size), 0) << "message " << count;
+        if ((const uint8_t*)msg.preamble >= buf.data() && (const uint8_t*)msg.preamble < buf.data() + buf.size()) {
+          in_place++;
+        }
+        count++;
+      }
+      pos += chunk;
+    }
+    EXPECT_EQ(count, expected.size()) << "chunks up to " << max_chunk;
+    EXPECT_EQ(dec.buffered_size(), 0u);
+    EXPECT_EQ(dec.corrupted_bytes(), 0u);
+    EXPECT_EQ(dec.get_string_for_hash(messages::image::TYPE_HASH), "messages::image");
+    if (max_chunk == data.size()) {
+      // Fed at once, every plain message is handed out in place
+      EXPECT_GT(in_place, 0u);
+    }
+  }
+
+  unlink(fname.c_str());
+}
+
+TEST(IncrementalDecoder, DeltasNeedTheirKeyframe) {
+  std::string fname = test_file("decoder_keyframes");
+  const unsigned NUM_MESSAGES = 20;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.delta_keyframe_interval = 5;
+  cos.set_type_options<messages::image>(opts);
+  messages::image img;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    img.rows = i;
+    img.pixels[i * 7] = uint8_t(i + 1);
+    ASSERT_TRUE(cos.serialize(&img));
+  }
+  cos.close();
+
+  // The second keyframe is lost, as on a gap of a growing file
+  std::vector<uint8_t> data = read_whole_file(fname);
+  unsigned keyframes = 0;
+  for (size_t pos = 0; pos < data.size();) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)(data.data() + pos);
+    if (pre->hash == messages::image::TYPE_HASH && ++keyframes == 2) {
+      data.erase(data.begin() + pos, data.begin() + pos + pre->size());
+      break;
+    }
+    pos += pre->size();
+  }
+  ASSERT_EQ(keyframes, 2u);
+
+  auto decode_rows = [&](bool keep_references) {
+    cbuf_decoder dec;
+    dec.set_keep_references(keep_references);
+    dec.feed(data.data(), data.size());
+    std::vector<uint32_t> rows;
+    cbuf_decoder::message msg;
+    while (dec.next(msg)) {
+      messages::image decoded;
+      EXPECT_TRUE(dec.decode(msg, &decoded));
+      rows.push_back(decoded.rows);
+    }
+    return rows;
+  };
+  // Deltas of the keyframe lost are dropped, not rebuilt from the one before
+  std::vector<uint32_t> expected = {0, 1, 2, 3, 4};
+  for (unsigned i = 10; i < NUM_MESSAGES; i++) expected.push_back(i);
+  EXPECT_EQ(decode_rows(true), expected);
+  // Keyframes are only kept once the type is seen on a delta
+  expected.erase(expected.begin() + 1, expected.begin() + 5);
+  EXPECT_EQ(decode_rows(false), expected);
+  unlink(fname.c_str());
+}
+
+TEST(SocketTransport, UnixSessionsResendMetadata) {
+  std::string path = test_file("socket");
+  const unsigned NUM_MESSAGES = 500;
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_unix_socket(path.c_str()));
+  EXPECT_TRUE(cis.is_live());
+  EXPECT_FALSE(cis.receive(0));
+
+  // Two senders one after the other, each on its own connection
+  std::thread sender([&] {
+    for (unsigned session = 0; session < 2; session++) {
+      cbuf_ostream cos;
+      cbuf_ostream::type_options opts;
+      opts.batch_messages = 32;
+      opts.batch_window = 1.0;
+      cos.set_type_options<messages::inctype>(opts);
+      if (!cos.open_unix_socket(path.c_str())) return;
+      for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+        messages::inctype msg;
+        msg.val = session * NUM_MESSAGES + i;
+        cos.serialize(&msg);
+      }
+      cos.close();
+    }
+  });
+
+  std::vector<uint32_t> vals;
+  auto start = std::chrono::steady_clock::now();
+  while (vals.size() < 2 * NUM_MESSAGES && elapsed_since(start) < 10) {
+    if (!cis.receive(100)) continue;
+    while (!cis.empty_no_internal()) {
+      messages::inctype msg;
+      ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::inctype::TYPE_HASH));
+      ASSERT_TRUE(cis.deserialize(&msg));
+      vals.push_back(msg.val);
+    }
+  }
+  sender.join();
+
+  ASSERT_EQ(vals.size(), 2 * NUM_MESSAGES);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  EXPECT_EQ(cis.get_string_for_hash(messages::inctype::TYPE_HASH), "messages::inctype");
+  cis.close();
+  EXPECT_FALSE(fs::exists(path));
+}
+
+TEST(SocketTransport, ReceiverOnItsOwn) {
+  cbuf_socket_receiver receiver;
+  ASSERT_TRUE(receiver.open("127.0.0.1", 0));
+  ASSERT_GT(receiver.local_port(), 0);
+  cbuf_decoder::message msg;
+  EXPECT_FALSE(receiver.next(msg));
+
+  const unsigned NUM_MESSAGES = 100;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_socket("127.0.0.1", receiver.local_port()));
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    messages::inctype inc;
+    inc.val = i;
+    ASSERT_TRUE(cos.serialize(&inc));
+  }
+  cos.close();
+
+  std::vector<uint32_t> vals;
+  while (vals.size() < NUM_MESSAGES && receiver.next(msg, 1000)) {
+    ASSERT_EQ(msg.preamble->hash, uint64_t(messages::inctype::TYPE_HASH));
+    messages::inctype inc;
+    ASSERT_TRUE(receiver.decode(msg, &inc));
+    vals.push_back(inc.val);
+  }
+  EXPECT_TRUE(receiver.is_connected());
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  // The sender is gone, the next one is accepted
+  EXPECT_FALSE(receiver.next(msg, 100));
+  EXPECT_FALSE(receiver.is_connected());
+}
+
+TEST(SocketTransport, TcpLoopbackDeltas) {
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_socket("127.0.0.1", 0));
+  int port = cis.local_port();
+  ASSERT_GT(port, 0);
+
+  const unsigned NUM_IMAGES = 50;
+  std::thread sender([&] {
+    cbuf_ostream cos;
+    cbuf_ostream::type_options opts;
+    opts.delta_keyframe_interval = 10;
+    cos.set_type_options<messages::image>(opts);
+    if (!cos.open_socket("127.0.0.1", port)) return;
+    messages::image img;
+    for (unsigned i = 0; i < NUM_IMAGES; i++) {
+      img.rows = i;
+      img.pixels[i] = uint8_t(i + 1);
+      cos.serialize(&img);
+    }
+    cos.flush();
+    cos.close();
+  });
+
+  std::vector<uint32_t> rows;
+  auto start = std::chrono::steady_clock::now();
+  while (rows.size() < NUM_IMAGES && elapsed_since(start) < 10) {
+    if (!cis.receive(100)) continue;
+    while (!cis.empty_no_internal()) {
+      messages::image img;
+      ASSERT_TRUE(cis.deserialize(&img));
+      // Deltas arrive rebuilt, with every change so far
+      for (unsigned i = 0; i <= img.rows; i++) {
+        ASSERT_EQ(img.pixels[i], uint8_t(i + 1));
+      }
+      rows.push_back(img.rows);
+    }
+  }
+  sender.join();
+  ASSERT_EQ(rows.size(), NUM_IMAGES);
+  EXPECT_EQ(rows.back(), NUM_IMAGES - 1);
+}
+
+TEST(SocketTransport, SenderReconnects) {
+  std::string path = test_file("reconnect");
+  cbuf_ostream cos;
+  cos.set_reconnect_period(0);
+  // Nobody listening yet, writes fail until the receiver shows up
+  EXPECT_FALSE(cos.open_unix_socket(path.c_str()));
+  EXPECT_TRUE(cos.is_open());
+  EXPECT_FALSE(cos.is_connected());
+  messages::inctype msg;
+  msg.val = 1;
+  EXPECT_FALSE(cos.serialize(&msg));
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_unix_socket(path.c_str()));
+  msg.val = 2;
+  EXPECT_TRUE(cos.serialize(&msg));
+  EXPECT_TRUE(cos.is_connected());
+  EXPECT_TRUE(cos.flush());
+
+  ASSERT_TRUE(cis.receive(1000));
+  messages::inctype got;
+  ASSERT_TRUE(cis.deserialize(&got));
+  EXPECT_EQ(got.val, 2u);
+  EXPECT_TRUE(cis.empty_no_internal());
+  cos.close();
+  cis.close();
+}
+
+TEST(SocketTransport, ReaderHandlersOnLiveStream) {
+  std::string path = test_file("reader_socket");
+  CBufReaderBase::Options options;
+  options.socket_timeout_ms = 100;
+  CBufReader reader(options);
+  std::vector<uint32_t> vals;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  ASSERT_TRUE(reader.openUnixSocket(path.c_str()));
+
+  const unsigned NUM_MESSAGES = 200;
+  std::thread sender([&] {
+    cbuf_ostream cos;
+    if (!cos.open_unix_socket(path.c_str())) return;
+    for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+      messages::inctype msg;
+      msg.val = i;
+      cos.serialize(&msg);
+    }
+    cos.close();
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  while (vals.size() < NUM_MESSAGES && elapsed_since(start) < 10) {
+    reader.processMessage();
+  }
+  sender.join();
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  // Nothing else arrives, reading waits and returns without finishing
+  EXPECT_FALSE(reader.processMessage());
+  reader.close();
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "cbuf_follow.h"
+#include "cbuf_reader.h"
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+#include "inctype.h"
+#include "test_stream_utils.h"
+
+namespace fs = std::filesystem;
+
+// Offset halfway through the first inctype at offset or after it, counting the inctypes before
+static size_t cut_in_message(const std::vector<uint8_t>& data, size_t offset, unsigned& complete) {
+  size_t pos = 0;
+  complete = 0;
+  for (;;) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)(data.data() + pos);
+    if (pre->hash == messages::inctype::TYPE_HASH) {
+      if (pos >= offset) return pos + pre->size() / 2;
+      complete++;
+    }
+    pos += pre->size();
+  }
+}
+
+TEST(FollowMode, PartialTailAndRotation) {
+  fs::path dir = fs::temp_directory_path() / ("follow." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const double BASE_TS = 1.7e9;
+  const unsigned PER_FILE = 100;
+
+  // Two files as written by a logger, appended below a piece at a time
+  std::vector<std::vector<uint8_t>> contents;
+  for (unsigned f = 0; f < 2; f++) {
+    std::string fname = test_file("follow_source");
+    cbuf_ostream cos;
+    cos.set_write_index(true);
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned j = 0; j < PER_FILE; j++) {
+      unsigned val = f * PER_FILE + j;
+      ASSERT_TRUE(write_inctype(cos, val, BASE_TS + val * 0.01));
+    }
+    cos.close();
+    contents.push_back(read_whole_file(fname));
+    unlink(fname.c_str());
+  }
+
+  CBufReaderBase::Options options;
+  options.follow = true;
+  options.socket_timeout_ms = 100;
+  CBufReader reader(dir.string(), options);
+  std::vector<uint32_t> vals;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  // Nothing written yet
+  ASSERT_TRUE(reader.openUlog());
+  EXPECT_FALSE(reader.processMessage());
+  auto read_until = [&](size_t count) {
+    auto start = std::chrono::steady_clock::now();
+    while (vals.size() < count && elapsed_since(start) < 10) {
+      reader.processMessage();
+    }
+  };
+
+  int fd = open((dir / "first.cb").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_NE(fd, -1);
+  unsigned complete;
+  size_t cut = cut_in_message(contents[0], contents[0].size() / 2, complete);
+  ASSERT_EQ(write(fd, contents[0].data(), cut), ssize_t(cut));
+  read_until(complete);
+  ASSERT_EQ(vals.size(), complete);
+  // The message written halfway is waited for, not taken as a corruption
+  EXPECT_FALSE(reader.processMessage());
+  EXPECT_EQ(vals.size(), complete);
+  size_t rest = contents[0].size() - cut;
+  ASSERT_EQ(write(fd, contents[0].data() + cut, rest), ssize_t(rest));
+  read_until(PER_FILE);
+  ASSERT_EQ(vals.size(), PER_FILE);
+
+  // The logger moves on to a new file
+  ::close(fd);
+  fd = open((dir / "second.cb").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_NE(fd, -1);
+  ASSERT_EQ(write(fd, contents[1].data(), contents[1].size()), ssize_t(contents[1].size()));
+  read_until(2 * PER_FILE);
+  ::close(fd);
+  ASSERT_EQ(vals.size(), 2 * PER_FILE);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  EXPECT_EQ(reader.num_corruptions, 0);
+  // Nothing else is written, reading waits and returns without finishing
+  EXPECT_FALSE(reader.processMessage());
+  reader.close();
+  fs::remove_all(dir);
+}
+
+TEST(FollowMode, FollowerOnItsOwn) {
+  const unsigned NUM_MESSAGES = 50;
+  std::string source = test_file("follower_source");
+  {
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file(source.c_str()));
+    for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, 1.7e9 + i * 0.01));
+    }
+  }
+  std::vector<uint8_t> content = read_whole_file(source);
+  unlink(source.c_str());
+
+  // A file outside any folder watched gets a watch of its own
+  std::string fname = test_file("follower");
+  int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_NE(fd, -1);
+  unsigned complete;
+  size_t cut = cut_in_message(content, content.size() / 3, complete);
+  ASSERT_EQ(write(fd, content.data(), cut), ssize_t(cut));
+
+  cbuf_istream cis;
+  cbuf_follower follower;
+  ASSERT_TRUE(follower.follow(&cis, fname));
+  EXPECT_TRUE(follower.is_following(&cis));
+  EXPECT_TRUE(cis.is_growing());
+  std::vector<uint32_t> vals;
+  auto read = [&] {
+    auto collect = [&](const messages::inctype& msg) { vals.push_back(msg.val); };
+    read_skipping_corruptions<messages::inctype>(cis, collect);
+  };
+  read();
+  EXPECT_EQ(vals.size(), complete);
+
+  // The rest but the last byte, the message cut short waits for it
+  size_t rest = content.size() - cut - 1;
+  ASSERT_EQ(write(fd, content.data() + cut, rest), ssize_t(rest));
+  EXPECT_TRUE(follower.wait(1000));
+  read();
+  EXPECT_EQ(vals.size(), NUM_MESSAGES - 1);
+  EXPECT_TRUE(follower.is_following(&cis));
+
+  // Written to the end and closed, the stream is read to the end as any file
+  ASSERT_EQ(write(fd, content.data() + content.size() - 1, 1), 1);
+  ::close(fd);
+  auto start = std::chrono::steady_clock::now();
+  while (follower.is_following(&cis) && elapsed_since(start) < 10) {
+    follower.wait(100);
+  }
+  EXPECT_FALSE(follower.is_following(&cis));
+  EXPECT_FALSE(cis.is_growing());
+  read();
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  follower.close();
+  unlink(fname.c_str());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
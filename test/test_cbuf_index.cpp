@@ -0,0 +1,408 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "cbuf_fsck.h"
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+#include "image.h"
+#include "inctype.h"
+#include "test_stream_utils.h"
+
+namespace fs = std::filesystem;
+
+TEST(FooterIndex, CountsAndSeek) {
+  std::string fname = test_file("index");
+  const unsigned NUM_MESSAGES = 2000;
+  // Batch timestamps are only exact with the resolution of a wall clock
+  const double BASE_TS = 1.7e9;
+
+  cbuf_ostream cos;
+  cos.set_write_index(true);
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 8;
+  opts.batch_window = 1.0;
+  cos.set_type_options<messages::complex_thing>(opts);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i * 0.01));
+    if (i % 4 == 0) {
+      messages::complex_thing thing;
+      thing.one_val = i;
+      thing.preamble.packet_timest = BASE_TS + i * 0.01;
+      ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+      char* ptr = thing.encode();
+      ASSERT_TRUE(cos.write_packet(ptr, thing.encode_size()));
+      thing.free_encode(ptr);
+    }
+  }
+  cos.close();
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  const CBufIndex* index = cis.get_index();
+  ASSERT_NE(index, nullptr);
+  const auto* inc_info = index->find_type(messages::inctype::TYPE_HASH);
+  ASSERT_NE(inc_info, nullptr);
+  EXPECT_EQ(inc_info->count, NUM_MESSAGES);
+  EXPECT_EQ(inc_info->bytes, NUM_MESSAGES * sizeof(messages::inctype));
+  EXPECT_EQ(inc_info->name, "messages::inctype");
+  const auto* thing_info = index->find_type(messages::complex_thing::TYPE_HASH);
+  ASSERT_NE(thing_info, nullptr);
+  EXPECT_EQ(thing_info->count, NUM_MESSAGES / 4);
+  EXPECT_EQ(thing_info->offsets.size(), (NUM_MESSAGES / 4 + 7) / 8);
+  EXPECT_EQ(index->start_time(), BASE_TS);
+
+  // Seeking on a fresh stream needs the metadata too
+  cbuf_istream seeker;
+  ASSERT_TRUE(seeker.open_file(fname.c_str()));
+  ASSERT_TRUE(seeker.seek_to_time(BASE_TS + 1234 * 0.01));
+  while (seeker.get_next_hash() != messages::inctype::TYPE_HASH) {
+    ASSERT_TRUE(seeker.skip_message());
+  }
+  EXPECT_NE(seeker.get_cstring_for_hash(messages::inctype::TYPE_HASH), nullptr);
+  messages::inctype inc;
+  ASSERT_TRUE(seeker.deserialize(&inc));
+  EXPECT_EQ(inc.val, 1234u);
+
+  // Reading everything skips the index records
+  unsigned incs = 0;
+  cis.reset_ptr();
+  while (!cis.empty_no_internal()) {
+    if (cis.get_next_hash() == messages::inctype::TYPE_HASH) incs++;
+    ASSERT_TRUE(cis.skip_message());
+  }
+  EXPECT_EQ(incs, NUM_MESSAGES);
+  cis.close();
+
+  // Without the footer, as if the writer crashed, seeking scans instead
+  fs::resize_file(fname, fs::file_size(fname) - 1);
+  cbuf_istream crashed;
+  ASSERT_TRUE(crashed.open_file(fname.c_str()));
+  EXPECT_EQ(crashed.get_index(), nullptr);
+  ASSERT_TRUE(crashed.seek_to_time(BASE_TS + 1500 * 0.01));
+  while (crashed.get_next_hash() != messages::inctype::TYPE_HASH) {
+    ASSERT_TRUE(crashed.skip_message());
+  }
+  ASSERT_TRUE(crashed.deserialize(&inc));
+  EXPECT_EQ(inc.val, 1500u);
+
+  unlink(fname.c_str());
+}
+
+TEST(SidecarIndex, BuildAndFilter) {
+  std::string fname = test_file("sidecar");
+  const unsigned NUM_MESSAGES = 1000;
+  const double BASE_TS = 1.7e9;
+  const size_t GARBAGE = 37;
+  size_t garbage_offset = 0;
+
+  // Two sessions without a footer, with garbage between them
+  for (unsigned part = 0; part < 2; part++) {
+    cbuf_ostream cos;
+    cos.set_write_index(false);
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    cbuf_ostream::type_options opts;
+    opts.batch_messages = 8;
+    opts.batch_window = 1.0;
+    cos.set_type_options<messages::complex_thing>(opts);
+    for (unsigned i = part * NUM_MESSAGES / 2; i < (part + 1) * NUM_MESSAGES / 2; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i * 0.01));
+      if (i % 4 == 0) {
+        messages::complex_thing thing;
+        thing.one_val = i;
+        thing.preamble.packet_timest = BASE_TS + i * 0.01;
+        ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+        char* ptr = thing.encode();
+        ASSERT_TRUE(cos.write_packet(ptr, thing.encode_size()));
+        thing.free_encode(ptr);
+      }
+    }
+    cos.close();
+    if (part == 0) {
+      garbage_offset = fs::file_size(fname);
+      FILE* f = fopen(fname.c_str(), "ab");
+      ASSERT_NE(f, nullptr);
+      std::vector<uint8_t> garbage(GARBAGE, 0x5A);
+      ASSERT_EQ(fwrite(garbage.data(), 1, garbage.size(), f), garbage.size());
+      fclose(f);
+    }
+  }
+
+  cbuf_istream plain;
+  ASSERT_TRUE(plain.open_file(fname.c_str()));
+  EXPECT_EQ(plain.get_index(), nullptr);
+  plain.close();
+
+  std::vector<std::string> errors;
+  ASSERT_TRUE(CBufIndex::build_sidecars({fname}, 2, errors));
+  EXPECT_TRUE(errors.empty());
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  const CBufIndex* index = cis.get_index();
+  ASSERT_NE(index, nullptr);
+  EXPECT_EQ(index->file_size(), fs::file_size(fname));
+  const auto* inc_info = index->find_type(messages::inctype::TYPE_HASH);
+  ASSERT_NE(inc_info, nullptr);
+  EXPECT_EQ(inc_info->count, NUM_MESSAGES);
+  EXPECT_EQ(inc_info->name, "messages::inctype");
+  const auto* thing_info = index->find_type(messages::complex_thing::TYPE_HASH);
+  ASSERT_NE(thing_info, nullptr);
+  EXPECT_EQ(thing_info->count, NUM_MESSAGES / 4);
+  ASSERT_EQ(index->corruptions().size(), 1u);
+  EXPECT_EQ(index->corruptions()[0].start, garbage_offset);
+  EXPECT_EQ(index->corruptions()[0].end, garbage_offset + GARBAGE);
+
+  // Only the filtered type is visited, jumping over the garbage too
+  ASSERT_TRUE(cis.set_type_filter({"messages::complex_thing"}));
+  unsigned things = 0;
+  while (!cis.empty_no_internal()) {
+    ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::complex_thing::TYPE_HASH));
+    messages::complex_thing thing;
+    ASSERT_TRUE(cis.deserialize(&thing));
+    EXPECT_EQ(thing.one_val, things * 4);
+    things++;
+  }
+  EXPECT_EQ(things, NUM_MESSAGES / 4);
+
+  // Seeks start from the sidecar samples
+  cis.clear_type_filter();
+  ASSERT_TRUE(cis.seek_to_time(BASE_TS + 700 * 0.01));
+  while (cis.get_next_hash() != messages::inctype::TYPE_HASH) {
+    ASSERT_TRUE(cis.skip_message());
+  }
+  EXPECT_GT(cis.get_current_offset(), garbage_offset);
+  messages::inctype inc;
+  ASSERT_TRUE(cis.deserialize(&inc));
+  EXPECT_EQ(inc.val, 700u);
+  cis.close();
+
+  // Once the file changes the sidecar no longer applies
+  {
+    FILE* f = fopen(fname.c_str(), "ab");
+    ASSERT_NE(f, nullptr);
+    fputc(0, f);
+    fclose(f);
+  }
+  cbuf_istream changed;
+  ASSERT_TRUE(changed.open_file(fname.c_str()));
+  EXPECT_EQ(changed.get_index(), nullptr);
+  changed.close();
+
+  unlink(fname.c_str());
+  unlink(CBufIndex::sidecar_path(fname).c_str());
+}
+
+TEST(Fsck, ReportsAndRepairs) {
+  std::string fname = test_file("fsck");
+  std::string repair_dir = (fs::temp_directory_path() / ("repaired." + std::to_string(getpid()))).string();
+  const double BASE_TS = 1.7e9;
+  const size_t GARBAGE = 100;
+
+  // A session with a footer, garbage, and a session with invalid messages
+  {
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned i = 0; i < 10; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i));
+    }
+    cos.close();
+  }
+  size_t garbage_offset = fs::file_size(fname);
+  {
+    FILE* f = fopen(fname.c_str(), "ab");
+    ASSERT_NE(f, nullptr);
+    std::vector<uint8_t> garbage(GARBAGE, 0x5A);
+    ASSERT_EQ(fwrite(garbage.data(), 1, garbage.size(), f), garbage.size());
+    fclose(f);
+  }
+  size_t bad_thing_offset, unknown_offset, truncated_offset;
+  {
+    cbuf_ostream cos;
+    cos.set_write_index(false);
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    messages::complex_thing thing;
+    thing.one_val = 1;
+    thing.dynamic_array.push_back(2);
+    thing.preamble.packet_timest = BASE_TS + 10;
+    ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+    char* ptr = thing.encode();
+    std::vector<char> encoded(ptr, ptr + thing.encode_size());
+    thing.free_encode(ptr);
+    ASSERT_TRUE(cos.write_packet(encoded.data(), encoded.size()));
+    // A dynamic array larger than the message
+    bad_thing_offset = cos.stream_offset();
+    uint32_t huge = 0x10000000;
+    memcpy(encoded.data() + sizeof(cbuf_preamble) + 2 * sizeof(int32_t), &huge, sizeof(huge));
+    ASSERT_TRUE(cos.write_packet(encoded.data(), encoded.size()));
+
+    unknown_offset = cos.stream_offset();
+    messages::inctype unknown;
+    unknown.preamble.hash = 0x1234;
+    unknown.preamble.packet_timest = BASE_TS + 10;
+    ASSERT_TRUE(cos.write_packet(&unknown, sizeof(unknown)));
+    for (unsigned i = 10; i < 15; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i));
+    }
+    truncated_offset = cos.stream_offset();
+    ASSERT_TRUE(write_inctype(cos, 15, BASE_TS + 15));
+    cos.close();
+  }
+  fs::resize_file(fname, fs::file_size(fname) - 5);
+
+  fs::create_directories(repair_dir);
+  std::vector<CBufFsck::Report> reports;
+  CBufFsck::check_files({fname}, 2, repair_dir, reports);
+  ASSERT_EQ(reports.size(), 1u);
+  const auto& report = reports[0];
+  EXPECT_TRUE(report.error.empty());
+  EXPECT_EQ(report.messages, 16u);
+  ASSERT_EQ(report.issues.size(), 4u);
+  EXPECT_EQ(report.issues[0].problem, CBufFsck::Problem::BAD_PREAMBLE);
+  EXPECT_EQ(report.issues[0].start, garbage_offset);
+  EXPECT_EQ(report.issues[0].end, garbage_offset + GARBAGE);
+  EXPECT_EQ(report.issues[1].problem, CBufFsck::Problem::DECODE_FAILED);
+  EXPECT_EQ(report.issues[1].start, bad_thing_offset);
+  EXPECT_EQ(report.issues[1].hash, uint64_t(messages::complex_thing::TYPE_HASH));
+  EXPECT_EQ(report.issues[2].problem, CBufFsck::Problem::NO_METADATA);
+  EXPECT_EQ(report.issues[2].start, unknown_offset);
+  EXPECT_EQ(report.issues[2].hash, 0x1234u);
+  EXPECT_EQ(report.issues[3].problem, CBufFsck::Problem::TRUNCATED);
+  EXPECT_EQ(report.issues[3].start, truncated_offset);
+  EXPECT_EQ(report.issues[3].end, fs::file_size(fname));
+  EXPECT_NE(CBufFsck::to_json(report).find("\"problem\":\"decode_failed\""), std::string::npos);
+
+  // The repaired copy is valid, without the footer of the first session
+  ASSERT_FALSE(report.repaired_path.empty());
+  CBufFsck::Report repaired;
+  ASSERT_TRUE(CBufFsck::check_file(report.repaired_path, repaired));
+  EXPECT_TRUE(repaired.ok());
+  EXPECT_EQ(repaired.messages, 16u);
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(report.repaired_path.c_str()));
+  EXPECT_EQ(cis.get_index(), nullptr);
+  unsigned inctypes = 0, things = 0;
+  while (!cis.empty_no_internal()) {
+    if (cis.get_next_hash() == messages::inctype::TYPE_HASH) {
+      messages::inctype inc;
+      ASSERT_TRUE(cis.deserialize(&inc));
+      EXPECT_EQ(inc.val, inctypes);
+      inctypes++;
+    } else {
+      ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::complex_thing::TYPE_HASH));
+      messages::complex_thing thing;
+      ASSERT_TRUE(cis.deserialize(&thing));
+      EXPECT_EQ(thing.dynamic_array.size(), 1u);
+      things++;
+    }
+  }
+  EXPECT_EQ(inctypes, 15u);
+  EXPECT_EQ(things, 1u);
+  cis.close();
+
+  unlink(fname.c_str());
+  fs::remove_all(repair_dir);
+}
+
+TEST(Fsck, RepairKeepsReferences) {
+  std::string fname = test_file("fsck_refs");
+  std::string repaired_fname = fname + ".repaired";
+  const unsigned NUM_MESSAGES = 30;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.delta_keyframe_interval = 10;
+  cos.set_type_options<messages::image>(opts);
+  messages::image img;
+  ASSERT_EQ(cos.serialize_metadata(img.cbuf_string, img.hash(), img.TYPE_STRING), 0);
+  std::vector<messages::image> written;
+  std::vector<size_t> offsets;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    img.rows = i;
+    img.pixels[i * 7] = uint8_t(i + 1);
+    img.preamble.packet_timest = 100.0 + i;
+    offsets.push_back(cos.stream_offset());
+    ASSERT_TRUE(cos.serialize(&img));
+    written.push_back(img);
+  }
+  cos.close();
+
+  // A delta between its keyframe and the next deltas, and a keyframe
+  corrupt_hash(fname, offsets[12]);
+  corrupt_hash(fname, offsets[20]);
+  CBufFsck::Report report;
+  ASSERT_TRUE(CBufFsck::check_file(fname, report, repaired_fname));
+  EXPECT_FALSE(report.ok());
+
+  // Deltas past the one dropped still find their keyframe, the ones of the keyframe dropped go
+  CBufFsck::Report repaired;
+  ASSERT_TRUE(CBufFsck::check_file(repaired_fname, repaired));
+  EXPECT_TRUE(repaired.ok());
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(repaired_fname.c_str()));
+  std::vector<uint32_t> rows;
+  while (!cis.empty_no_internal()) {
+    ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::image::TYPE_HASH));
+    messages::image msg;
+    ASSERT_TRUE(cis.deserialize(&msg));
+    ASSERT_LT(msg.rows, NUM_MESSAGES);
+    EXPECT_EQ(memcmp(&msg, &written[msg.rows], sizeof(msg)), 0);
+    rows.push_back(msg.rows);
+  }
+  std::vector<uint32_t> expected;
+  for (unsigned i = 0; i < 20; i++) {
+    if (i != 12) expected.push_back(i);
+  }
+  EXPECT_EQ(rows, expected);
+  cis.close();
+
+  unlink(fname.c_str());
+  unlink(repaired_fname.c_str());
+}
+
+TEST(Fsck, ValidatesBatchedMessages) {
+  std::string fname = test_file("fsck_batch");
+  cbuf_ostream cos;
+  cos.set_write_index(false);
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 4;
+  opts.batch_window = 1.0;
+  cos.set_type_options<messages::complex_thing>(opts);
+  messages::complex_thing thing;
+  thing.dynamic_array.push_back(2);
+  ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+  char* ptr = thing.encode();
+  std::vector<char> encoded(ptr, ptr + thing.encode_size());
+  thing.free_encode(ptr);
+  for (unsigned i = 0; i < 4; i++) {
+    ASSERT_TRUE(cos.write_packet(encoded.data(), encoded.size()));
+  }
+  // A batch with a dynamic array larger than its message
+  size_t bad_batch_offset = cos.stream_offset();
+  uint32_t huge = 0x10000000;
+  for (unsigned i = 0; i < 4; i++) {
+    std::vector<char> bad = encoded;
+    if (i == 2) memcpy(bad.data() + sizeof(cbuf_preamble) + 2 * sizeof(int32_t), &huge, sizeof(huge));
+    ASSERT_TRUE(cos.write_packet(bad.data(), bad.size()));
+  }
+  cos.close();
+
+  CBufFsck::Report report;
+  ASSERT_TRUE(CBufFsck::check_file(fname, report));
+  EXPECT_EQ(report.messages, 4u);
+  ASSERT_EQ(report.issues.size(), 1u);
+  EXPECT_EQ(report.issues[0].problem, CBufFsck::Problem::DECODE_FAILED);
+  EXPECT_EQ(report.issues[0].start, bad_batch_offset);
+  EXPECT_EQ(report.issues[0].end, fs::file_size(fname));
+  unlink(fname.c_str());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
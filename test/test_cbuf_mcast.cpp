@@ -0,0 +1,107 @@
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "cbuf_mcast.h"
+#include "cbuf_reader.h"
+#include "gtest/gtest.h"
+#include "image.h"
+#include "inctype.h"
+
+static const char* GROUP = "239.255.42.99";
+static const char* LOOPBACK = "127.0.0.1";
+
+// Separate ports so tests running at once do not hear each other
+static int test_port(int offset) { return 20000 + (getpid() % 20000) + offset; }
+
+static cbuf_mcast_publisher::options loopback_options() {
+  cbuf_mcast_publisher::options opts;
+  opts.interface = LOOPBACK;
+  // Small datagrams, so images take several fragments
+  opts.max_datagram = 512;
+  return opts;
+}
+
+TEST(Multicast, FragmentsAndLateJoiners) {
+  int port = test_port(0);
+  cbuf_mcast_subscriber early;
+  ASSERT_TRUE(early.open(GROUP, port, LOOPBACK));
+  cbuf_mcast_publisher pub;
+  cbuf_mcast_publisher::options opts = loopback_options();
+  opts.metadata_period = 1e9;
+  ASSERT_TRUE(pub.open(GROUP, port, opts));
+
+  const unsigned NUM_IMAGES = 20;
+  for (unsigned i = 0; i < NUM_IMAGES; i++) {
+    messages::image img;
+    img.rows = i;
+    img.pixels[sizeof(img.pixels) - 1] = uint8_t(i);
+    ASSERT_TRUE(pub.serialize(&img));
+  }
+  for (unsigned i = 0; i < NUM_IMAGES; i++) {
+    cbuf_decoder::message msg;
+    ASSERT_TRUE(early.next(msg, 1000));
+    ASSERT_EQ(msg.hash(), uint64_t(messages::image::TYPE_HASH));
+    messages::image img;
+    ASSERT_TRUE(early.decode(msg, &img));
+    EXPECT_EQ(img.rows, i);
+    EXPECT_EQ(img.pixels[sizeof(img.pixels) - 1], uint8_t(i));
+  }
+  EXPECT_EQ(early.lost(), 0u);
+  EXPECT_EQ(early.get_string_for_hash(messages::image::TYPE_HASH), "messages::image");
+
+  // Joining late, the metadata is only known once announced again
+  cbuf_mcast_subscriber late;
+  ASSERT_TRUE(late.open(GROUP, port, LOOPBACK));
+  messages::image img;
+  ASSERT_TRUE(pub.serialize(&img));
+  cbuf_decoder::message msg;
+  ASSERT_TRUE(late.next(msg, 1000));
+  EXPECT_EQ(late.get_string_for_hash(messages::image::TYPE_HASH), "");
+  ASSERT_TRUE(pub.announce_metadata());
+  ASSERT_TRUE(pub.serialize(&img));
+  ASSERT_TRUE(late.next(msg, 1000));
+  EXPECT_EQ(msg.hash(), uint64_t(messages::image::TYPE_HASH));
+  EXPECT_EQ(late.get_string_for_hash(messages::image::TYPE_HASH), "messages::image");
+  EXPECT_EQ(late.lost(), 0u);
+}
+
+TEST(Multicast, ReaderHandlers) {
+  int port = test_port(1);
+  CBufReaderBase::Options options;
+  options.socket_timeout_ms = 100;
+  CBufReader reader(options);
+  std::vector<uint32_t> vals;
+  unsigned images = 0;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  reader.addHandler<messages::image>([&](messages::image*) { images++; });
+  ASSERT_TRUE(reader.openMulticast(GROUP, port, LOOPBACK));
+
+  cbuf_mcast_publisher pub;
+  ASSERT_TRUE(pub.open(GROUP, port, loopback_options()));
+  const unsigned NUM_MESSAGES = 200;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    messages::inctype msg;
+    msg.val = i;
+    ASSERT_TRUE(pub.serialize(&msg));
+    if (i % 10 == 0) {
+      messages::image img;
+      ASSERT_TRUE(pub.serialize(&img));
+    }
+  }
+
+  for (int tries = 0; tries < 1000 && vals.size() < NUM_MESSAGES; tries++) {
+    reader.processMessage();
+  }
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  EXPECT_EQ(images, NUM_MESSAGES / 10);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,631 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cbuf_reader.h"
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+#include "image.h"
+#include "inctype.h"
+#include "test_stream_utils.h"
+
+namespace fs = std::filesystem;
+
+TEST(ReaderMerge, ManyFilesInTimeOrder) {
+  fs::path dir = fs::temp_directory_path() / ("merge." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_FILES = 40;
+  const unsigned PER_FILE = 50;
+
+  // Messages interleaved across the files, one of them with garbage in the middle
+  for (unsigned f = 0; f < NUM_FILES; f++) {
+    std::string fname = (dir / ("part" + std::to_string(f) + ".cb")).string();
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned j = 0; j < PER_FILE; j++) {
+      unsigned val = j * NUM_FILES + f;
+      ASSERT_TRUE(write_inctype(cos, val, BASE_TS + val * 0.01));
+      if (f == 7 && j == PER_FILE / 2) {
+        std::vector<uint8_t> garbage(64, 0x5A);
+        ASSERT_TRUE(cos.write_packet(garbage.data(), garbage.size()));
+      }
+    }
+    cos.close();
+  }
+
+  CBufReaderBase::Options options;
+  options.try_recovery = true;
+  CBufReader reader(dir.string(), options);
+  std::vector<uint32_t> vals;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  ASSERT_TRUE(reader.openUlog());
+  while (reader.processMessage()) {
+  }
+  EXPECT_GT(reader.num_corruptions, 0);
+  ASSERT_EQ(vals.size(), NUM_FILES * PER_FILE);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    ASSERT_EQ(vals[i], i);
+  }
+
+  // Seeking moves every stream, the merge starts over from there
+  vals.clear();
+  ASSERT_TRUE(reader.seekToTime(BASE_TS + 1000 * 0.01));
+  for (unsigned i = 0; i < 100; i++) {
+    ASSERT_TRUE(reader.processMessage());
+  }
+  ASSERT_EQ(vals.size(), 100u);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    EXPECT_EQ(vals[i], 1000 + i);
+  }
+  reader.close();
+  fs::remove_all(dir);
+}
+
+static size_t open_fds() {
+  size_t fds = 0;
+  for (const auto& entry : fs::directory_iterator("/proc/self/fd")) {
+    (void)entry;
+    fds++;
+  }
+  return fds;
+}
+
+TEST(ReaderMerge, FilesMappedWithinBudget) {
+  fs::path dir = fs::temp_directory_path() / ("budget." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_FILES = 20;
+  const unsigned PER_FILE = 50;
+  const unsigned MAX_OPEN = 3;
+
+  // Messages interleaved across the files, batched on half of them
+  for (unsigned f = 0; f < NUM_FILES; f++) {
+    std::string fname = (dir / ("part" + std::to_string(f) + ".cb")).string();
+    cbuf_ostream cos;
+    if (f % 2 == 1) {
+      cbuf_ostream::type_options opts;
+      opts.batch_messages = 8;
+      opts.batch_window = 1.0;
+      cos.set_type_options<messages::inctype>(opts);
+    }
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned j = 0; j < PER_FILE; j++) {
+      unsigned val = j * NUM_FILES + f;
+      ASSERT_TRUE(write_inctype(cos, val, BASE_TS + val * 0.01));
+    }
+    cos.close();
+  }
+
+  CBufReaderBase::Options options;
+  options.max_open_files = MAX_OPEN;
+  CBufReader reader(dir.string(), options);
+  std::vector<uint32_t> vals;
+  size_t max_fds = 0;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) {
+    vals.push_back(msg->val);
+    max_fds = std::max(max_fds, open_fds());
+  });
+  size_t base_fds = open_fds();
+  ASSERT_TRUE(reader.openUlog());
+  // Nothing is mapped until read
+  EXPECT_EQ(open_fds(), base_fds);
+  EXPECT_EQ(reader.getConsumedCbSize(), 0u);
+  EXPECT_GT(reader.getTotalCbSize(), 0u);
+  while (reader.processMessage()) {
+  }
+  ASSERT_EQ(vals.size(), NUM_FILES * PER_FILE);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    ASSERT_EQ(vals[i], i);
+  }
+  EXPECT_GT(max_fds, base_fds);
+  EXPECT_LE(max_fds, base_fds + MAX_OPEN);
+  // Files read to the end are unmapped
+  EXPECT_EQ(open_fds(), base_fds);
+  EXPECT_EQ(reader.getConsumedCbSize(), reader.getTotalCbSize());
+
+  // Seeking back maps them again
+  vals.clear();
+  ASSERT_TRUE(reader.seekToTime(BASE_TS + 500 * 0.01));
+  while (reader.processMessage()) {
+  }
+  ASSERT_EQ(vals.size(), NUM_FILES * PER_FILE - 500);
+  for (unsigned i = 0; i < vals.size(); i++) {
+    ASSERT_EQ(vals[i], 500 + i);
+  }
+  EXPECT_LE(max_fds, base_fds + MAX_OPEN);
+  reader.close();
+  fs::remove_all(dir);
+}
+
+TEST(ReaderMerge, TypeIdsFromHashes) {
+  std::string fname = test_file("typeids");
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  messages::image img;
+  ASSERT_TRUE(cos.serialize(&img));
+  ASSERT_TRUE(write_inctype(cos, 1, 1.7e9));
+  cos.close();
+
+  CBufTypeIds ids;
+  EXPECT_EQ(ids.add(messages::inctype::TYPE_STRING), 0u);
+  EXPECT_EQ(ids.add(messages::inctype::TYPE_STRING), 0u);
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  EXPECT_EQ(ids.of(&cis, messages::inctype::TYPE_HASH), CBufTypeIds::NONE);
+  while (!cis.empty_no_internal()) {
+    ASSERT_TRUE(cis.skip_message());
+  }
+  EXPECT_EQ(cis.get_string_view_for_hash(messages::image::TYPE_HASH), messages::image::TYPE_STRING);
+  EXPECT_EQ(ids.of(&cis, messages::inctype::TYPE_HASH), 0u);
+  EXPECT_EQ(ids.of(&cis, messages::image::TYPE_HASH), 1u);
+  EXPECT_EQ(ids.name(1), messages::image::TYPE_STRING);
+  EXPECT_EQ(ids.size(), 2u);
+  cis.close();
+  unlink(fname.c_str());
+}
+
+TEST(ReaderMerge, UnhandledTypesSkippedOnRequest) {
+  fs::path dir = fs::temp_directory_path() / ("unhandled." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_MESSAGES = 100;
+
+  cbuf_ostream cos;
+  cos.set_write_index(true);
+  ASSERT_TRUE(cos.open_file((dir / "mixed.cb").string().c_str()));
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i * 0.01));
+    messages::image img;
+    ASSERT_TRUE(cos.serialize(&img));
+  }
+  cos.close();
+
+  for (bool skip : {false, true}) {
+    CBufReaderBase::Options options;
+    options.skip_unhandled_types = skip;
+    CBufReader reader(dir.string(), options);
+    unsigned incs = 0;
+    reader.addHandler<messages::inctype>([&](messages::inctype*) { incs++; });
+    ASSERT_TRUE(reader.openUlog());
+    std::string error;
+    auto counts = reader.getMessageCounts(error);
+    EXPECT_EQ(counts[messages::inctype::TYPE_STRING], NUM_MESSAGES);
+    EXPECT_EQ(counts[messages::image::TYPE_STRING], NUM_MESSAGES);
+
+    // Images are processed without handlers unless asked to skip them
+    unsigned processed = 0;
+    while (reader.processMessage()) {
+      processed++;
+    }
+    EXPECT_EQ(incs, NUM_MESSAGES);
+    EXPECT_EQ(processed, skip ? NUM_MESSAGES : 2 * NUM_MESSAGES);
+
+    reader.close();
+
+    // A stream callback sees every message anyway
+    CBufReader with_callback(dir.string(), options);
+    with_callback.addHandler<messages::inctype>([&](messages::inctype*) {});
+    unsigned images = 0;
+    with_callback.addCbufIStreamCallback([&](cbuf_istream* cis) {
+      if (cis->get_next_hash() == messages::image::TYPE_HASH) images++;
+    });
+    ASSERT_TRUE(with_callback.openUlog());
+    while (with_callback.processMessage()) {
+    }
+    EXPECT_EQ(images, NUM_MESSAGES);
+    with_callback.close();
+  }
+  fs::remove_all(dir);
+}
+
+TEST(ReaderMerge, HandlersShareDecodedMessage) {
+  fs::path dir = fs::temp_directory_path() / ("shared." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const unsigned NUM_MESSAGES = 20;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file((dir / "shared.cb").string().c_str()));
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    ASSERT_TRUE(write_inctype(cos, i, 1.7e9 + i));
+  }
+  cos.close();
+
+  for (unsigned read_ahead : {0u, 4u}) {
+    CBufReaderBase::Options options;
+    options.read_ahead = read_ahead;
+    CBufReader reader(dir.string(), options);
+    std::vector<messages::inctype*> first_ptrs, last_ptrs;
+    std::vector<uint32_t> last_vals;
+    unsigned copies = 0;
+    reader.addHandler<messages::inctype>([&](messages::inctype* msg) { first_ptrs.push_back(msg); });
+    // Modifies the message, on a copy of its own
+    auto modifier = std::make_shared<CBufHandlerLambda<messages::inctype>>([&](messages::inctype* msg) {
+      if (msg != first_ptrs.back()) copies++;
+      msg->val = 1000;
+    });
+    modifier->set_copy_message(true);
+    reader.addHandler(messages::inctype::TYPE_STRING, modifier);
+    reader.addHandler<messages::inctype>([&](messages::inctype* msg) {
+      last_ptrs.push_back(msg);
+      last_vals.push_back(msg->val);
+    });
+    ASSERT_TRUE(reader.openUlog());
+    while (reader.processMessage()) {
+    }
+    ASSERT_EQ(last_vals.size(), NUM_MESSAGES);
+    EXPECT_EQ(copies, NUM_MESSAGES);
+    EXPECT_EQ(first_ptrs, last_ptrs);
+    for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+      EXPECT_EQ(last_vals[i], i);
+    }
+  }
+  fs::remove_all(dir);
+}
+
+TEST(ReaderMerge, ViewHandlersWithoutCopies) {
+  fs::path dir = fs::temp_directory_path() / ("views." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const unsigned NUM_MESSAGES = 50;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file((dir / "views.cb").string().c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 16;
+  opts.batch_window = 1.0;
+  cos.set_type_options<messages::inctype>(opts);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    messages::image img;
+    img.rows = i;
+    ASSERT_TRUE(cos.serialize(&img));
+    messages::inctype msg;
+    msg.val = i;
+    ASSERT_TRUE(cos.serialize(&msg));
+  }
+  cos.close();
+
+  CBufReader reader(dir.string());
+  std::set<const messages::image*> addresses;
+  std::vector<uint32_t> rows, vals;
+  reader.addViewHandler<messages::image>([&](const messages::image& img) {
+    addresses.insert(&img);
+    rows.push_back(img.rows);
+  });
+  // Batched messages are handed out from the record they were unpacked from
+  reader.addViewHandler<messages::inctype>([&](const messages::inctype& msg) { vals.push_back(msg.val); });
+  ASSERT_TRUE(reader.openUlog());
+  while (reader.processMessage()) {
+  }
+  ASSERT_EQ(rows.size(), NUM_MESSAGES);
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  // Every image is read in place on the file, not copied into the same message
+  EXPECT_EQ(addresses.size(), NUM_MESSAGES);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    EXPECT_EQ(rows[i], i);
+    EXPECT_EQ(vals[i], i);
+  }
+  fs::remove_all(dir);
+}
+
+TEST(ReaderMerge, ViewsOfUnalignedRecords) {
+  fs::path dir = fs::temp_directory_path() / ("unaligned." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const unsigned NUM_MESSAGES = 10;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file((dir / "unaligned.cb").string().c_str()));
+  messages::image img;
+  messages::complex_thing thing;
+  ASSERT_EQ(cos.serialize_metadata(img.cbuf_string, img.hash(), img.TYPE_STRING), 0);
+  ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+  // Every image at an odd offset, moved there by the size of a string
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    thing.name = "";
+    if ((cos.stream_offset() + thing.encode_size()) % 2 == 0) thing.name = "x";
+    char* ptr = thing.encode();
+    ASSERT_TRUE(cos.write_packet(ptr, thing.encode_size()));
+    thing.free_encode(ptr);
+    ASSERT_EQ(cos.stream_offset() % 2, 1u);
+    img.rows = i;
+    ASSERT_TRUE(cos.serialize(&img));
+  }
+  cos.close();
+
+  // Views are only handed out aligned for their type, which generated structs always are
+  static_assert(alignof(messages::image) == 1);
+  auto aligned = [](const messages::image& msg) {
+    return reinterpret_cast<uintptr_t>(&msg) % alignof(messages::image) == 0;
+  };
+  alignas(double) char buf[2 * sizeof(double)];
+  EXPECT_TRUE(cbuf_aligned_view<messages::image>(buf + 1));
+  EXPECT_TRUE(cbuf_aligned_view<double>(buf));
+  EXPECT_FALSE(cbuf_aligned_view<double>(buf + 1));
+
+  CBufReader reader(dir.string());
+  std::vector<uint32_t> rows;
+  std::set<const messages::image*> addresses;
+  reader.addViewHandler<messages::image>([&](const messages::image& msg) {
+    EXPECT_TRUE(aligned(msg));
+    addresses.insert(&msg);
+    rows.push_back(msg.rows);
+  });
+  ASSERT_TRUE(reader.openUlog());
+  while (reader.processMessage()) {
+  }
+  ASSERT_EQ(rows.size(), NUM_MESSAGES);
+  EXPECT_EQ(addresses.size(), NUM_MESSAGES);
+
+  CBufReader puller(dir.string());
+  ASSERT_TRUE(puller.openUlog());
+  std::vector<uint32_t> pulled;
+  for (const auto& msg : puller.messages<messages::image>()) {
+    EXPECT_TRUE(aligned(msg));
+    pulled.push_back(msg.rows);
+  }
+  EXPECT_EQ(pulled, rows);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    EXPECT_EQ(rows[i], i);
+  }
+  fs::remove_all(dir);
+}
+
+TEST(ReaderMerge, ReadAheadMatchesSequential) {
+  fs::path dir = fs::temp_directory_path() / ("readahead." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_FILES = 8;
+  const unsigned PER_FILE = 200;
+  const unsigned NUM_BATCHED = 300;
+
+  for (unsigned f = 0; f < NUM_FILES; f++) {
+    std::string fname = (dir / ("part" + std::to_string(f) + ".cb")).string();
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned j = 0; j < PER_FILE; j++) {
+      unsigned val = j * NUM_FILES + f;
+      ASSERT_TRUE(write_inctype(cos, val, BASE_TS + val * 0.01));
+    }
+    cos.close();
+  }
+  // Batches written now, after the rest, so reading stops in the middle of one below
+  cbuf_ostream batched;
+  ASSERT_TRUE(batched.open_file((dir / "batched.cb").string().c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 64;
+  opts.batch_window = 1.0;
+  batched.set_type_options<messages::inctype>(opts);
+  for (unsigned i = 0; i < NUM_BATCHED; i++) {
+    messages::inctype msg;
+    msg.val = 100000 + i;
+    ASSERT_TRUE(batched.serialize(&msg));
+  }
+  batched.close();
+
+  // Where messages were decoded, the same few places when reading ahead
+  std::set<const void*> decoded_at;
+  auto read_all = [&](unsigned read_ahead, unsigned stop_after) {
+    CBufReaderBase::Options options;
+    options.read_ahead = read_ahead;
+    CBufReader reader(dir.string(), options);
+    std::vector<std::string> seen;
+    decoded_at.clear();
+    reader.addHandler<messages::inctype>([&](messages::inctype* msg, const std::string& box_name) {
+      seen.push_back(box_name + ":" + std::to_string(msg->val));
+      decoded_at.insert(msg);
+    });
+    EXPECT_TRUE(reader.openUlog());
+    unsigned count = 0;
+    while (reader.processMessage()) {
+      if (++count == stop_after) {
+        // Messages decoded ahead are read again after changing what to read
+        reader.setTypeFilter({messages::inctype::TYPE_STRING});
+        EXPECT_LT(reader.getConsumedCbSize(), reader.getTotalCbSize());
+      }
+    }
+    EXPECT_EQ(reader.getConsumedCbSize(), reader.getTotalCbSize());
+    return seen;
+  };
+
+  auto sequential = read_all(0, 0);
+  ASSERT_EQ(sequential.size(), NUM_FILES * PER_FILE + NUM_BATCHED);
+  EXPECT_EQ(sequential.front(), "part0.cb:0");
+  EXPECT_EQ(sequential.back(), "batched.cb:" + std::to_string(100000 + NUM_BATCHED - 1));
+  EXPECT_EQ(read_all(4, 0), sequential);
+  EXPECT_LE(decoded_at.size(), (NUM_FILES + 1) * (4 + 1));
+  EXPECT_EQ(read_all(1, 500), sequential);
+  EXPECT_EQ(read_all(16, NUM_FILES * PER_FILE + 100), sequential);
+  fs::remove_all(dir);
+}
+
+TEST(ReaderMerge, HandlerThreadsKeepOrder) {
+  fs::path dir = fs::temp_directory_path() / ("executor." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_FILES = 4;
+  const unsigned PER_FILE = 250;
+  const unsigned TOTAL = NUM_FILES * PER_FILE;
+  for (unsigned f = 0; f < NUM_FILES; f++) {
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file((dir / ("part" + std::to_string(f) + ".cb")).string().c_str()));
+    for (unsigned j = 0; j < PER_FILE; j++) {
+      unsigned val = j * NUM_FILES + f;
+      ASSERT_TRUE(write_inctype(cos, val, BASE_TS + val * 0.01));
+    }
+    cos.close();
+  }
+
+  for (unsigned read_ahead : {0u, 8u}) {
+    CBufReaderBase::Options options;
+    options.read_ahead = read_ahead;
+    options.handler_threads = 3;
+    options.handler_queue = 4;
+    CBufReader reader(dir.string(), options);
+    const unsigned NUM_HANDLERS = 3;
+    std::vector<std::vector<uint32_t>> vals(NUM_HANDLERS);
+    std::atomic<unsigned> on_main_thread{0};
+    auto main_id = std::this_thread::get_id();
+    for (unsigned h = 0; h < NUM_HANDLERS; h++) {
+      reader.addHandler<messages::inctype>([&, h](messages::inctype* msg) {
+        if (std::this_thread::get_id() == main_id) on_main_thread++;
+        vals[h].push_back(msg->val);
+      });
+    }
+    ASSERT_TRUE(reader.openUlog());
+
+    // Every message up to the time point is handled when processUntil returns
+    ASSERT_TRUE(reader.processUntil(BASE_TS + 99 * 0.01));
+    for (unsigned h = 0; h < NUM_HANDLERS; h++) {
+      ASSERT_EQ(vals[h].size(), 100u);
+    }
+    EXPECT_FALSE(reader.processUntil(BASE_TS + TOTAL));
+    EXPECT_EQ(on_main_thread.load(), 0u);
+    for (unsigned h = 0; h < NUM_HANDLERS; h++) {
+      ASSERT_EQ(vals[h].size(), TOTAL);
+      for (unsigned i = 0; i < TOTAL; i++) {
+        ASSERT_EQ(vals[h][i], i);
+      }
+    }
+  }
+  fs::remove_all(dir);
+}
+
+TEST(PullMessages, TypedAndMixed) {
+  fs::path dir = fs::temp_directory_path() / ("pull." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const unsigned NUM_MESSAGES = 40;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file((dir / "pull.cb").string().c_str()));
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    messages::complex_thing thing;
+    thing.one_val = i;
+    thing.name = std::string(i % 5, 'x');
+    ASSERT_TRUE(cos.serialize(&thing));
+    messages::image img;
+    img.rows = i;
+    ASSERT_TRUE(cos.serialize(&img));
+    messages::inctype inc;
+    inc.val = i;
+    ASSERT_TRUE(cos.serialize(&inc));
+  }
+  cos.close();
+
+  {
+    CBufReader reader(dir.string());
+    unsigned handled = 0;
+    reader.addHandler<messages::inctype>([&](messages::inctype*) { handled++; });
+    ASSERT_TRUE(reader.openUlog());
+    std::vector<uint32_t> vals;
+    for (const auto& inc : reader.messages<messages::inctype>()) {
+      vals.push_back(inc.val);
+    }
+    ASSERT_EQ(vals.size(), NUM_MESSAGES);
+    for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+      EXPECT_EQ(vals[i], i);
+    }
+    // Handlers are not called for the messages pulled
+    EXPECT_EQ(handled, 0u);
+  }
+
+  {
+    CBufReader reader(dir.string());
+    ASSERT_TRUE(reader.openUlog());
+    std::vector<size_t> order;
+    std::vector<int32_t> things;
+    std::vector<uint32_t> rows;
+    std::set<const void*> thing_addresses, image_addresses;
+    for (const auto& msg : reader.messages<messages::complex_thing, messages::image>()) {
+      order.push_back(msg.index());
+      if (const auto* thing = msg.get<messages::complex_thing>()) {
+        things.push_back(thing->one_val);
+        EXPECT_EQ(thing->name, std::string(thing->one_val % 5, 'x'));
+        thing_addresses.insert(thing);
+      }
+      msg.visit([&](const auto& m) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(m)>, messages::image>) {
+          rows.push_back(m.rows);
+          image_addresses.insert(&m);
+        }
+      });
+    }
+    ASSERT_EQ(order.size(), 2 * NUM_MESSAGES);
+    for (unsigned i = 0; i < order.size(); i++) {
+      EXPECT_EQ(order[i], i % 2);
+    }
+    ASSERT_EQ(things.size(), NUM_MESSAGES);
+    ASSERT_EQ(rows.size(), NUM_MESSAGES);
+    for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+      EXPECT_EQ(things[i], int32_t(i));
+      EXPECT_EQ(rows[i], i);
+    }
+    // Decoded into the same message every time, or read in place on the file
+    EXPECT_EQ(thing_addresses.size(), 1u);
+    EXPECT_EQ(image_addresses.size(), NUM_MESSAGES);
+  }
+
+  {
+    // Stopping early leaves the rest for the handlers
+    CBufReader reader(dir.string());
+    std::vector<uint32_t> vals;
+    reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+    ASSERT_TRUE(reader.openUlog());
+    unsigned pulled = 0;
+    for (const auto& inc : reader.messages<messages::inctype>()) {
+      EXPECT_EQ(inc.val, pulled);
+      if (++pulled == 10) break;
+    }
+    while (reader.processMessage()) {
+    }
+    ASSERT_EQ(vals.size(), NUM_MESSAGES - 10);
+    EXPECT_EQ(vals.front(), 10u);
+    EXPECT_EQ(vals.back(), NUM_MESSAGES - 1);
+  }
+  fs::remove_all(dir);
+}
+
+TEST(PullMessages, ReaderClosedBeforeTheRange) {
+  fs::path dir = fs::temp_directory_path() / ("pull_close." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const unsigned NUM_MESSAGES = 20;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file((dir / "pull.cb").string().c_str()));
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    ASSERT_TRUE(write_inctype(cos, i, 1.7e9 + i * 0.01));
+  }
+  cos.close();
+
+  CBufReader reader(dir.string());
+  std::vector<uint32_t> vals;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  ASSERT_TRUE(reader.openUlog());
+  {
+    auto range = reader.messages<messages::inctype>();
+    auto it = range.begin();
+    ASSERT_TRUE(it != range.end());
+    EXPECT_EQ(it->val, 0u);
+    // The stream of the message pulled is gone, and the range leaves the new one alone
+    reader.close();
+    ASSERT_TRUE(reader.openUlog());
+  }
+  while (reader.processMessage()) {
+  }
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  EXPECT_EQ(vals.front(), 0u);
+  fs::remove_all(dir);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
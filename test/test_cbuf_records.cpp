@@ -0,0 +1,699 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cbuf_reader.h"
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+#include "image.h"
+#include "inctype.h"
+#include "test_stream_utils.h"
+
+namespace fs = std::filesystem;
+
+TEST(Batching, FixedSizeRoundTrip) {
+  std::string plain_fname = test_file("plain");
+  std::string batch_fname = test_file("batch");
+  const unsigned NUM_MESSAGES = 1000;
+
+  cbuf_ostream plain, batched;
+  ASSERT_TRUE(plain.open_file(plain_fname.c_str()));
+  ASSERT_TRUE(batched.open_file(batch_fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 64;
+  opts.batch_window = 1.0;
+  batched.set_type_options<messages::inctype>(opts);
+
+  std::vector<double> timestamps;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    messages::inctype msg;
+    msg.val = i;
+    ASSERT_TRUE(plain.serialize(&msg));
+    ASSERT_TRUE(batched.serialize(&msg));
+    timestamps.push_back(msg.preamble.packet_timest);
+  }
+  plain.close();
+  batched.close();
+  EXPECT_LT(fs::file_size(batch_fname), fs::file_size(plain_fname));
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(batch_fname.c_str()));
+  unsigned count = 0;
+  while (!cis.empty_no_internal()) {
+    ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::inctype::TYPE_HASH));
+    messages::inctype msg;
+    ASSERT_TRUE(cis.deserialize(&msg));
+    ASSERT_LT(count, NUM_MESSAGES);
+    EXPECT_EQ(msg.val, count);
+    EXPECT_EQ(msg.preamble.packet_timest, timestamps[count]);
+    count++;
+  }
+  EXPECT_EQ(count, NUM_MESSAGES);
+  cis.close();
+
+  unlink(plain_fname.c_str());
+  unlink(batch_fname.c_str());
+}
+
+TEST(Batching, VariableSizeMixedTypes) {
+  std::string fname = test_file("batch_mixed");
+  const unsigned NUM_MESSAGES = 100;
+
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 16;
+  opts.batch_window = 1.0;
+  cos.set_type_options<messages::complex_thing>(opts);
+
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    messages::complex_thing thing;
+    thing.one_val = i;
+    thing.dynamic_array.resize(i % 7);
+    thing.name = std::string(i % 5, 'x');
+    ASSERT_TRUE(cos.serialize(&thing));
+    // Unbatched messages go straight to the stream, in between batches
+    messages::inctype inc;
+    inc.val = i;
+    ASSERT_TRUE(cos.serialize(&inc));
+  }
+  cos.close();
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  unsigned things = 0, incs = 0;
+  while (!cis.empty_no_internal()) {
+    if (cis.get_next_hash() == messages::complex_thing::TYPE_HASH) {
+      messages::complex_thing thing;
+      ASSERT_TRUE(cis.deserialize(&thing));
+      EXPECT_EQ(thing.one_val, int(things));
+      EXPECT_EQ(thing.dynamic_array.size(), things % 7);
+      EXPECT_EQ(thing.name.size(), things % 5);
+      EXPECT_NE(cis.get_meta_cstring_for_hash(messages::complex_thing::TYPE_HASH), nullptr);
+      things++;
+    } else {
+      messages::inctype inc;
+      ASSERT_TRUE(cis.deserialize(&inc));
+      EXPECT_EQ(inc.val, incs);
+      incs++;
+    }
+  }
+  EXPECT_EQ(things, NUM_MESSAGES);
+  EXPECT_EQ(incs, NUM_MESSAGES);
+  cis.close();
+
+  unlink(fname.c_str());
+}
+
+TEST(Batching, WindowWithinResyncBackstep) {
+  std::string fname = test_file("batch_window");
+  const double BASE_TS = 1.7e9;
+  const double MAX_BACKSTEP = cbuf_istream::resync_options().max_backstep;
+  const unsigned NUM_MESSAGES = 20;
+
+  cbuf_ostream cos;
+  cos.set_write_index(false);
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.batch_messages = 1000;
+  opts.batch_window = 3600;
+  cos.set_type_options<messages::inctype>(opts);
+
+  messages::complex_thing thing;
+  ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i));
+    // Unbatched, written as they come
+    thing.one_val = i;
+    thing.preamble.packet_timest = BASE_TS + i + 0.5;
+    char* ptr = thing.encode();
+    ASSERT_TRUE(cos.write_packet(ptr, thing.encode_size()));
+    thing.free_encode(ptr);
+  }
+  cos.close();
+
+  // Records go back in time by the clamped window at most
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  double latest = 0;
+  unsigned count = 0;
+  while (!cis.empty_no_internal()) {
+    double ts = cis.get_next_timestamp();
+    EXPECT_GE(ts, latest - MAX_BACKSTEP);
+    latest = std::max(latest, ts);
+    cis.skip_message();
+    count++;
+  }
+  EXPECT_EQ(count, 2 * NUM_MESSAGES);
+  cis.close();
+
+  unlink(fname.c_str());
+}
+
+TEST(LargeRecords, StreamedInChunks) {
+  std::string fname = test_file("large");
+  // With a variant, the preamble only holds sizes up to 128MB
+  const uint32_t NUM_ELEMS = 33;
+  const uint8_t VARIANT = 3;
+
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  messages::inctype before;
+  before.val = 1;
+  ASSERT_TRUE(cos.serialize(&before));
+
+  // Encode getslarge by hand, one element at a time, to never hold it all in memory
+  messages::getslarge large;
+  large.preamble.setVariant(VARIANT);
+  size_t total_size = sizeof(cbuf_preamble) + sizeof(uint32_t) + NUM_ELEMS * sizeof(messages::fourmegs);
+  ASSERT_GT(total_size, size_t(large.preamble.maxSize()));
+  ASSERT_TRUE(cos.begin_packet(&large, total_size));
+  ASSERT_TRUE(cos.write_chunk(&NUM_ELEMS, sizeof(NUM_ELEMS)));
+  auto elem = std::make_unique<messages::fourmegs>();
+  for (uint32_t i = 0; i < NUM_ELEMS; i++) {
+    elem->data[0] = i;
+    elem->data[1024 * 1024 - 1] = i * 2;
+    ASSERT_TRUE(cos.write_chunk(elem.get(), sizeof(*elem)));
+  }
+  ASSERT_TRUE(cos.end_packet());
+
+  messages::inctype after;
+  after.val = 2;
+  ASSERT_TRUE(cos.serialize(&after));
+  cos.close();
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  messages::inctype inc;
+  ASSERT_TRUE(cis.deserialize(&inc));
+  EXPECT_EQ(inc.val, 1u);
+
+  ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::getslarge::TYPE_HASH));
+  EXPECT_EQ(cis.get_next_size(), total_size);
+  EXPECT_EQ(cis.get_next_variant(), VARIANT);
+  messages::getslarge loaded;
+  ASSERT_TRUE(cis.deserialize(&loaded));
+  ASSERT_EQ(loaded.vec.size(), NUM_ELEMS);
+  for (uint32_t i = 0; i < NUM_ELEMS; i++) {
+    EXPECT_EQ(loaded.vec[i].data[0], i);
+    EXPECT_EQ(loaded.vec[i].data[1024 * 1024 - 1], i * 2);
+  }
+
+  ASSERT_TRUE(cis.deserialize(&inc));
+  EXPECT_EQ(inc.val, 2u);
+  EXPECT_TRUE(cis.empty_no_internal());
+  cis.close();
+
+  unlink(fname.c_str());
+}
+
+static std::vector<messages::inctype> read_inctypes(const std::string& fname, bool expand) {
+  std::vector<messages::inctype> msgs;
+  cbuf_istream cis;
+  cis.set_expand_repeats(expand);
+  if (!cis.open_file(fname.c_str())) return msgs;
+  while (!cis.empty_no_internal()) {
+    messages::inctype msg;
+    if (!cis.deserialize(&msg)) break;
+    msgs.push_back(msg);
+  }
+  return msgs;
+}
+
+TEST(RepeatSuppression, ExpandRepeats) {
+  std::string fname = test_file("repeats");
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.suppress_repeats = true;
+  opts.keepalive_period = 1.0;
+  cos.set_type_options<messages::inctype>(opts);
+
+  // 3 seconds without changes at 10Hz, then a change and a few more repeats
+  std::vector<uint32_t> values;
+  std::vector<double> timestamps;
+  for (unsigned i = 0; i <= 30; i++) {
+    values.push_back(7);
+    timestamps.push_back(100.0 + i * 0.1);
+  }
+  for (unsigned i = 1; i <= 5; i++) {
+    values.push_back(8);
+    timestamps.push_back(103.0 + i * 0.1);
+  }
+  for (size_t i = 0; i < values.size(); i++) {
+    ASSERT_TRUE(write_inctype(cos, values[i], timestamps[i]));
+  }
+  cos.close();
+  EXPECT_LT(fs::file_size(fname), values.size() * sizeof(messages::inctype));
+
+  auto changes = read_inctypes(fname, false);
+  ASSERT_EQ(changes.size(), 2u);
+  EXPECT_EQ(changes[0].val, 7u);
+  EXPECT_EQ(changes[0].preamble.packet_timest, timestamps[0]);
+  EXPECT_EQ(changes[1].val, 8u);
+  EXPECT_EQ(changes[1].preamble.packet_timest, timestamps[31]);
+
+  auto expanded = read_inctypes(fname, true);
+  ASSERT_EQ(expanded.size(), values.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(expanded[i].val, values[i]);
+    EXPECT_NEAR(expanded[i].preamble.packet_timest, timestamps[i], 1e-6);
+  }
+  EXPECT_EQ(expanded.back().preamble.packet_timest, timestamps.back());
+
+  unlink(fname.c_str());
+}
+
+TEST(DeltaEncoding, RebuildImages) {
+  std::string plain_fname = test_file("delta_plain");
+  std::string delta_fname = test_file("delta");
+  const unsigned NUM_MESSAGES = 50;
+
+  cbuf_ostream plain, delta;
+  ASSERT_TRUE(plain.open_file(plain_fname.c_str()));
+  ASSERT_TRUE(delta.open_file(delta_fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.delta_keyframe_interval = 10;
+  delta.set_type_options<messages::image>(opts);
+
+  std::vector<messages::image> written;
+  messages::image img;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    // Only a few bytes change from one image to the next
+    img.rows = i;
+    img.pixels[i * 13] = uint8_t(i + 1);
+    img.timestamp = i * 0.5;
+    ASSERT_TRUE(plain.serialize(&img));
+    ASSERT_TRUE(delta.serialize(&img));
+    written.push_back(img);
+  }
+  plain.close();
+  delta.close();
+  EXPECT_LT(fs::file_size(delta_fname) * 3, fs::file_size(plain_fname));
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(delta_fname.c_str()));
+  unsigned count = 0;
+  while (!cis.empty_no_internal()) {
+    messages::image loaded;
+    ASSERT_TRUE(cis.deserialize(&loaded));
+    ASSERT_LT(count, NUM_MESSAGES);
+    EXPECT_EQ(memcmp(&loaded, &written[count], sizeof(loaded)), 0);
+    count++;
+  }
+  EXPECT_EQ(count, NUM_MESSAGES);
+  cis.close();
+
+  unlink(plain_fname.c_str());
+  unlink(delta_fname.c_str());
+}
+
+TEST(RepeatSuppression, MissingMessage) {
+  std::string fname = test_file("repeats_missing");
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.suppress_repeats = true;
+  opts.keepalive_period = 1.0;
+  cos.set_type_options<messages::inctype>(opts);
+  messages::inctype inc;
+  ASSERT_EQ(cos.serialize_metadata(inc.cbuf_string, inc.hash(), inc.TYPE_STRING), 0);
+  size_t first_offset = cos.stream_offset();
+  // Always the same message, so the bytes short_string does not set are repeated as well
+  for (unsigned i = 0; i < 20; i++) {
+    inc.val = i < 10 ? 7 : 8;
+    inc.preamble.packet_timest = 100.0 + i * 0.1;
+    ASSERT_TRUE(cos.write_packet(&inc, sizeof(inc)));
+  }
+  cos.close();
+
+  // The first message repeated is lost, its repeats with it
+  corrupt_hash(fname, first_offset);
+  cbuf_istream cis;
+  cis.set_expand_repeats(true);
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  std::vector<uint32_t> vals;
+  read_skipping_corruptions<messages::inctype>(cis,
+                                              [&](const messages::inctype& msg) { vals.push_back(msg.val); });
+  EXPECT_EQ(vals, std::vector<uint32_t>(10, 8));
+  unlink(fname.c_str());
+}
+
+TEST(DeltaEncoding, MissingKeyframes) {
+  std::string fname = test_file("delta_missing");
+  const unsigned NUM_MESSAGES = 30;
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  cbuf_ostream::type_options opts;
+  opts.delta_keyframe_interval = 10;
+  cos.set_type_options<messages::image>(opts);
+  messages::image img;
+  ASSERT_EQ(cos.serialize_metadata(img.cbuf_string, img.hash(), img.TYPE_STRING), 0);
+  std::vector<messages::image> written;
+  std::vector<size_t> offsets;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    img.rows = i;
+    img.pixels[i * 7] = uint8_t(i + 1);
+    offsets.push_back(cos.stream_offset());
+    ASSERT_TRUE(cos.serialize(&img));
+    written.push_back(img);
+  }
+  cos.close();
+
+  auto read_rows = [&](cbuf_istream& cis) {
+    std::vector<uint32_t> rows;
+    read_skipping_corruptions<messages::image>(cis, [&](const messages::image& msg) {
+      EXPECT_EQ(memcmp(&msg, &written[msg.rows], sizeof(msg)), 0);
+      rows.push_back(msg.rows);
+    });
+    return rows;
+  };
+  auto range = [](unsigned first, unsigned last) {
+    std::vector<uint32_t> rows;
+    for (unsigned i = first; i < last; i++) rows.push_back(i);
+    return rows;
+  };
+
+  // Jumping past a keyframe finds it on the file
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  ASSERT_TRUE(cis.jump_to_offset(offsets[15]));
+  EXPECT_EQ(read_rows(cis), range(15, NUM_MESSAGES));
+  cis.close();
+
+  // Deltas of a keyframe corrupted are skipped until the next one
+  corrupt_hash(fname, offsets[10]);
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  auto expected = range(0, 10);
+  for (auto row : range(20, NUM_MESSAGES)) expected.push_back(row);
+  EXPECT_EQ(read_rows(cis), expected);
+  cis.close();
+  unlink(fname.c_str());
+}
+
+TEST(Resync, MagicSearch) {
+  const uint32_t magic = CBUF_MAGIC;
+  std::vector<unsigned char> buf(300, 'T');
+  EXPECT_EQ(cbuf_istream::find_magic(buf.data(), buf.size()), buf.size() - 3);
+  EXPECT_EQ(cbuf_istream::find_magic(buf.data(), 2), 0u);
+  // Every alignment, on both the vector loop and the tail
+  for (size_t at = 0; at + sizeof(magic) <= buf.size(); at++) {
+    std::fill(buf.begin(), buf.end(), 'T');
+    memcpy(buf.data() + at, &magic, sizeof(magic));
+    ASSERT_EQ(cbuf_istream::find_magic(buf.data(), buf.size()), at);
+  }
+}
+
+TEST(Resync, SkipsFakePreambles) {
+  std::string fname = test_file("resync");
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_MESSAGES = 20;
+  size_t garbage_offset = 0;
+
+  for (unsigned part = 0; part < 2; part++) {
+    cbuf_ostream cos;
+    cos.set_write_index(false);
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned i = part * NUM_MESSAGES / 2; i < (part + 1) * NUM_MESSAGES / 2; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i));
+    }
+    cos.close();
+    if (part == 1) break;
+
+    // Garbage with magics that do not start real messages: too large, of an unknown type
+    // and from a time long before the file
+    std::vector<unsigned char> garbage(4096, 0x5A);
+    cbuf_preamble fake;
+    fake.magic = CBUF_MAGIC;
+    fake.setSize(0x7000000);
+    fake.hash = messages::inctype::TYPE_HASH;
+    fake.packet_timest = BASE_TS;
+    memcpy(garbage.data() + 100, &fake, sizeof(fake));
+    fake.setSize(64);
+    fake.hash = 0x1234;
+    memcpy(garbage.data() + 1000, &fake, sizeof(fake));
+    fake.hash = messages::inctype::TYPE_HASH;
+    fake.packet_timest = 1.0;
+    memcpy(garbage.data() + 2000, &fake, sizeof(fake));
+    garbage_offset = fs::file_size(fname);
+    FILE* f = fopen(fname.c_str(), "ab");
+    ASSERT_NE(f, nullptr);
+    ASSERT_EQ(fwrite(garbage.data(), 1, garbage.size(), f), garbage.size());
+    fclose(f);
+  }
+
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  std::vector<uint32_t> vals;
+  while (!cis.empty_no_internal()) {
+    if (!cis.check_next_preamble() || cis.get_next_size() == 0) {
+      ASSERT_TRUE(cis.skip_corrupted());
+      continue;
+    }
+    ASSERT_EQ(cis.get_next_hash(), uint64_t(messages::inctype::TYPE_HASH));
+    messages::inctype msg;
+    ASSERT_TRUE(cis.deserialize(&msg));
+    vals.push_back(msg.val);
+  }
+  ASSERT_EQ(vals.size(), NUM_MESSAGES);
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    EXPECT_EQ(vals[i], i);
+  }
+  EXPECT_GT(cis.get_current_offset(), garbage_offset);
+  cis.close();
+
+  unlink(fname.c_str());
+}
+
+TEST(Resync, TimestampLimits) {
+  std::string fname = test_file("resync_limits");
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_MESSAGES = 10;
+  {
+    cbuf_ostream cos;
+    cos.set_write_index(false);
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned i = 0; i < NUM_MESSAGES / 2; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i));
+    }
+    cos.close();
+  }
+  // Garbage with a message of a known type an hour later, plausible by default
+  std::vector<unsigned char> garbage(1024, 0x5A);
+  cbuf_preamble fake;
+  fake.magic = CBUF_MAGIC;
+  fake.setSize(sizeof(messages::inctype));
+  fake.hash = messages::inctype::TYPE_HASH;
+  fake.packet_timest = BASE_TS + 3600;
+  memcpy(garbage.data() + 100, &fake, sizeof(fake));
+  {
+    FILE* f = fopen(fname.c_str(), "ab");
+    ASSERT_NE(f, nullptr);
+    ASSERT_EQ(fwrite(garbage.data(), 1, garbage.size(), f), garbage.size());
+    fclose(f);
+  }
+  {
+    cbuf_ostream cos;
+    cos.set_write_index(false);
+    ASSERT_TRUE(cos.open_file(fname.c_str()));
+    for (unsigned i = NUM_MESSAGES / 2; i < NUM_MESSAGES; i++) {
+      ASSERT_TRUE(write_inctype(cos, i, BASE_TS + i));
+    }
+    cos.close();
+  }
+
+  auto read_vals = [&](const cbuf_istream::resync_options& options) {
+    cbuf_istream cis;
+    cis.set_resync_options(options);
+    EXPECT_TRUE(cis.open_file(fname.c_str()));
+    std::vector<uint32_t> vals;
+    auto add_val = [&](const messages::inctype& msg) { vals.push_back(msg.val); };
+    read_skipping_corruptions<messages::inctype>(cis, add_val);
+    return vals;
+  };
+  std::vector<uint32_t> expected;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) expected.push_back(i);
+
+  auto vals = read_vals({});
+  ASSERT_EQ(vals.size(), NUM_MESSAGES + 1);
+  EXPECT_EQ(vals[NUM_MESSAGES / 2], 0x5A5A5A5Au);
+  cbuf_istream::resync_options tight;
+  tight.max_jump = 60;
+  EXPECT_EQ(read_vals(tight), expected);
+  unlink(fname.c_str());
+}
+
+TEST(Resync, SeekWithoutIndex) {
+  fs::path dir = fs::temp_directory_path() / ("seek." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  std::string fname = (dir / "seek.cb").string();
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_MESSAGES = 20000;
+
+  // Timestamps going back a bit now and then, a type showing up late and garbage
+  cbuf_ostream cos;
+  cos.set_write_index(false);
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    double ts = BASE_TS + i * 0.01 - (i % 100 == 0 ? 2.0 : 0.0);
+    ASSERT_TRUE(write_inctype(cos, i, ts));
+    if (i >= 15000 && i % 10 == 0) {
+      messages::complex_thing thing;
+      thing.one_val = i;
+      thing.preamble.packet_timest = ts;
+      ASSERT_EQ(cos.serialize_metadata(thing.cbuf_string, thing.hash(), thing.TYPE_STRING), 0);
+      char* ptr = thing.encode();
+      ASSERT_TRUE(cos.write_packet(ptr, thing.encode_size()));
+      thing.free_encode(ptr);
+    }
+    if (i == 8000) {
+      std::vector<uint8_t> garbage(64, 0x5A);
+      ASSERT_TRUE(cos.write_packet(garbage.data(), garbage.size()));
+    }
+  }
+  cos.close();
+
+  struct Entry {
+    uint64_t hash;
+    double ts;
+  };
+  std::vector<Entry> all;
+  cbuf_istream cis;
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  ASSERT_EQ(cis.get_index(), nullptr);
+  while (!cis.empty_no_internal()) {
+    if (!cis.check_next_preamble() || cis.get_next_size() == 0) {
+      ASSERT_TRUE(cis.skip_corrupted());
+      continue;
+    }
+    all.push_back({cis.get_next_hash(), cis.get_next_timestamp()});
+    ASSERT_TRUE(cis.skip_message());
+  }
+  cis.close();
+
+  // The same messages as scanning from the start, with the metadata of the late type
+  for (double at : {0.0, 1.0, 79.995, 80.0, 100.0, 150.0, 150.005, 175.5, 199.99, 300.0}) {
+    double t = BASE_TS + at;
+    size_t first = 0;
+    while (first < all.size() && all[first].ts < t) first++;
+    cbuf_istream seeker;
+    ASSERT_TRUE(seeker.open_file(fname.c_str()));
+    ASSERT_TRUE(seeker.seek_to_time(t));
+    for (size_t i = first; i < std::min(all.size(), first + 50); i++) {
+      ASSERT_FALSE(seeker.empty_no_internal());
+      ASSERT_EQ(seeker.get_next_hash(), all[i].hash) << "seeking to " << at;
+      ASSERT_EQ(seeker.get_next_timestamp(), all[i].ts);
+      EXPECT_FALSE(seeker.get_string_for_hash(all[i].hash).empty());
+      ASSERT_TRUE(seeker.skip_message());
+    }
+    if (first == all.size()) {
+      EXPECT_TRUE(seeker.empty_no_internal());
+    }
+  }
+
+  // Readers seek files without an index to a time only when asked to
+  CBufReader reader(dir.string());
+  std::vector<uint32_t> vals;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  const double START_TS = BASE_TS + 120.005;
+  std::vector<uint32_t> expected;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    if (BASE_TS + i * 0.01 - (i % 100 == 0 ? 2.0 : 0.0) >= START_TS) expected.push_back(i);
+  }
+  reader.setStartTime(START_TS);
+  ASSERT_TRUE(reader.openUlog());
+  ASSERT_TRUE(reader.seekToTime(START_TS));
+  while (reader.processMessage()) {
+  }
+  EXPECT_EQ(vals, expected);
+  reader.close();
+  fs::remove_all(dir);
+}
+
+TEST(Resync, StartTimeWithoutIndex) {
+  fs::path dir = fs::temp_directory_path() / ("starttime." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  std::string fname = (dir / "starttime.cb").string();
+  const double BASE_TS = 1.7e9;
+  const unsigned NUM_MESSAGES = 20000;
+  const unsigned AHEAD = 100;
+
+  // One message far ahead of its neighbours, before the start time in the file
+  cbuf_ostream cos;
+  cos.set_write_index(false);
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  auto ts_of = [&](unsigned i) { return BASE_TS + (i == AHEAD ? 150.0 : i * 0.01); };
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    ASSERT_TRUE(write_inctype(cos, i, ts_of(i)));
+  }
+  cos.close();
+
+  // Without an index the reader does not seek, so the start time filter keeps it
+  const double START_TS = BASE_TS + 120.005;
+  std::vector<uint32_t> expected;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    if (ts_of(i) >= START_TS) expected.push_back(i);
+  }
+  ASSERT_EQ(expected.front(), AHEAD);
+  CBufReader reader(dir.string());
+  std::vector<uint32_t> vals;
+  reader.addHandler<messages::inctype>([&](messages::inctype* msg) { vals.push_back(msg->val); });
+  reader.setStartTime(START_TS);
+  ASSERT_TRUE(reader.openUlog());
+  while (reader.processMessage()) {
+  }
+  EXPECT_EQ(vals, expected);
+  reader.close();
+  fs::remove_all(dir);
+}
+
+TEST(StreamingMap, ReadWithSmallWindow) {
+  std::string fname = test_file("streaming");
+  const unsigned NUM_MESSAGES = 2000;
+
+  cbuf_ostream cos;
+  ASSERT_TRUE(cos.open_file(fname.c_str()));
+  messages::image img;
+  for (unsigned i = 0; i < NUM_MESSAGES; i++) {
+    img.rows = i;
+    img.pixels[i % sizeof(img.pixels)] = uint8_t(i);
+    ASSERT_TRUE(cos.serialize(&img));
+  }
+  cos.close();
+
+  // Windows much smaller than the file, pages behind are released while reading
+  cbuf_istream cis;
+  cbuf_istream::map_options opts;
+  opts.mode = cbuf_istream::MapMode::STREAMING;
+  opts.readahead = 64 * 1024;
+  opts.keep_behind = 16 * 1024;
+  cis.set_map_options(opts);
+  ASSERT_TRUE(cis.open_file(fname.c_str()));
+  for (unsigned pass = 0; pass < 2; pass++) {
+    unsigned count = 0;
+    while (!cis.empty_no_internal()) {
+      messages::image loaded;
+      ASSERT_TRUE(cis.deserialize(&loaded));
+      EXPECT_EQ(loaded.rows, count);
+      EXPECT_EQ(loaded.pixels[count % sizeof(loaded.pixels)], uint8_t(count));
+      count++;
+    }
+    EXPECT_EQ(count, NUM_MESSAGES);
+    // Released pages come back from the file when reading again
+    cis.reset_ptr();
+  }
+  cis.close();
+
+  unlink(fname.c_str());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
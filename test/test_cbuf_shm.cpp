@@ -0,0 +1,162 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "cbuf_shm.h"
+#include "gtest/gtest.h"
+#include "image.h"
+#include "inctype.h"
+
+TEST(SharedMemory, ViewsAndCopies) {
+  cbuf_shm_publisher pub;
+  cbuf_shm_publisher::options opts;
+  opts.capacity = 64 * 1024;
+  ASSERT_TRUE(pub.create("test_views", opts));
+  cbuf_shm_subscriber sub;
+  ASSERT_TRUE(sub.open(pub.fd()));
+  EXPECT_EQ(pub.subscriber_count(), 1u);
+
+  cbuf_shm_subscriber::message msg;
+  EXPECT_FALSE(sub.next(msg));
+
+  // Enough images to wrap around the ring several times
+  for (unsigned i = 0; i < 100; i++) {
+    messages::image img;
+    img.rows = i;
+    img.pixels[i] = uint8_t(i);
+    ASSERT_TRUE(pub.publish(&img));
+    messages::complex_thing thing;
+    thing.one_val = int32_t(i);
+    thing.dynamic_array.push_back(int32_t(i * 2));
+    ASSERT_TRUE(pub.publish(&thing));
+
+    ASSERT_TRUE(sub.next(msg));
+    ASSERT_EQ(msg.hash(), uint64_t(messages::image::TYPE_HASH));
+    messages::image storage;
+    const messages::image* view = sub.decode(msg, &storage);
+    ASSERT_NE(view, nullptr);
+    // Simple structs are not copied
+    EXPECT_EQ((const void*)view, (const void*)msg.preamble);
+    EXPECT_EQ(view->rows, i);
+    EXPECT_EQ(view->pixels[i], uint8_t(i));
+    EXPECT_EQ(sub.decode(msg, (messages::complex_thing*)&thing), nullptr);
+
+    ASSERT_TRUE(sub.next(msg));
+    messages::complex_thing copy;
+    const messages::complex_thing* decoded = sub.decode(msg, &copy);
+    ASSERT_EQ(decoded, &copy);
+    EXPECT_EQ(copy.one_val, int32_t(i));
+    ASSERT_EQ(copy.dynamic_array.size(), 1u);
+    EXPECT_EQ(copy.dynamic_array[0], int32_t(i * 2));
+  }
+  EXPECT_FALSE(sub.next(msg));
+  EXPECT_EQ(sub.get_string_for_hash(messages::image::TYPE_HASH), "messages::image");
+  EXPECT_FALSE(sub.get_meta_string_for_hash(messages::complex_thing::TYPE_HASH).empty());
+
+  pub.close();
+  EXPECT_TRUE(sub.publisher_closed());
+  EXPECT_FALSE(sub.next(msg, 1000));
+}
+
+TEST(SharedMemory, SubscriberProcesses) {
+  cbuf_shm_publisher pub;
+  cbuf_shm_publisher::options opts;
+  // Much smaller than what is published, so the publisher waits for the subscribers
+  opts.capacity = 16 * 1024;
+  opts.timeout_ms = 10000;
+  ASSERT_TRUE(pub.create("test_processes", opts));
+  const unsigned NUM_SUBSCRIBERS = 3;
+  const uint32_t NUM_MESSAGES = 20000;
+
+  std::vector<pid_t> children;
+  for (unsigned i = 0; i < NUM_SUBSCRIBERS; i++) {
+    pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+      // Subscribe by path, as an unrelated process would
+      cbuf_shm_subscriber sub;
+      if (!sub.open(pub.path().c_str())) _exit(1);
+      uint32_t expected = 0;
+      cbuf_shm_subscriber::message msg;
+      while (expected < NUM_MESSAGES && sub.next(msg, 5000)) {
+        messages::inctype storage;
+        const messages::inctype* inc = sub.decode(msg, &storage);
+        if (inc == nullptr || inc->val != expected) _exit(2);
+        expected++;
+      }
+      _exit(expected == NUM_MESSAGES && sub.evictions() == 0 ? 0 : 3);
+    }
+    children.push_back(pid);
+  }
+
+  for (int wait = 0; wait < 500 && pub.subscriber_count() < NUM_SUBSCRIBERS; wait++) {
+    usleep(10000);
+  }
+  ASSERT_EQ(pub.subscriber_count(), NUM_SUBSCRIBERS);
+  for (uint32_t i = 0; i < NUM_MESSAGES; i++) {
+    messages::inctype msg;
+    msg.val = i;
+    ASSERT_TRUE(pub.publish(&msg));
+  }
+  EXPECT_EQ(pub.dropped(), 0u);
+
+  for (pid_t pid : children) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+  }
+}
+
+TEST(SharedMemory, SlowSubscriberPolicies) {
+  cbuf_shm_publisher::options opts;
+  opts.capacity = 4096;
+  opts.timeout_ms = 0;
+
+  opts.slow_policy = cbuf_shm_publisher::SlowPolicy::DROP;
+  cbuf_shm_publisher dropping;
+  ASSERT_TRUE(dropping.create("test_drop", opts));
+  cbuf_shm_subscriber idle;
+  ASSERT_TRUE(idle.open(dropping.fd()));
+  unsigned published = 0;
+  for (uint32_t i = 0; i < 1000; i++) {
+    messages::inctype msg;
+    msg.val = i;
+    if (dropping.publish(&msg)) published++;
+  }
+  EXPECT_GT(published, 0u);
+  EXPECT_EQ(dropping.dropped(), 1000u - published);
+  // The subscriber still gets the oldest messages
+  cbuf_shm_subscriber::message msg;
+  ASSERT_TRUE(idle.next(msg));
+  messages::inctype storage;
+  EXPECT_EQ(idle.decode(msg, &storage)->val, 0u);
+
+  opts.slow_policy = cbuf_shm_publisher::SlowPolicy::EVICT;
+  cbuf_shm_publisher evicting;
+  ASSERT_TRUE(evicting.create("test_evict", opts));
+  cbuf_shm_subscriber slow;
+  ASSERT_TRUE(slow.open(evicting.fd()));
+  for (uint32_t i = 0; i < 1000; i++) {
+    messages::inctype inc;
+    inc.val = i;
+    ASSERT_TRUE(evicting.publish(&inc));
+  }
+  EXPECT_GT(evicting.evicted(), 0u);
+  EXPECT_EQ(evicting.dropped(), 0u);
+  // Evicted, it continues with what comes next
+  EXPECT_FALSE(slow.next(msg));
+  EXPECT_GT(slow.evictions(), 0u);
+  messages::inctype last;
+  last.val = 1000;
+  ASSERT_TRUE(evicting.publish(&last));
+  ASSERT_TRUE(slow.next(msg));
+  EXPECT_EQ(slow.decode(msg, &storage)->val, 1000u);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -156,6 +156,72 @@ TEST(CParsing, Complex) {
   */
 }
 
+TEST(CParsing, ConversionPlan) {
+  messages::complex_thing th1;
+  set_data(th1, 43);
+  std::vector<char> v;
+  v.resize(th1.encode_net_size());
+  ASSERT_TRUE(th1.encode_net(v.data(), v.size()));
+
+  // Same metadata on both sides, as if only the hash had changed
+  auto plan = CBufConversion::get(1, messages::complex_thing::cbuf_string, messages::complex_thing::TYPE_HASH,
+                                  messages::complex_thing::cbuf_string, messages::complex_thing::TYPE_STRING);
+  ASSERT_NE(plan, nullptr);
+  messages::complex_thing th2;
+  EXPECT_EQ(plan->Convert((unsigned char*)v.data(), v.size(), (unsigned char*)&th2, sizeof(th2)), v.size());
+  ASSERT_TRUE(compare(th1, th2));
+
+  // Plans are built once per pair of hashes
+  auto again = CBufConversion::get(1, "", messages::complex_thing::TYPE_HASH, "",
+                                   messages::complex_thing::TYPE_STRING);
+  EXPECT_EQ(again, plan);
+}
+
+#pragma pack(push, 1)
+struct old_inctype {
+  cbuf_preamble preamble;
+  uint16_t val;
+  double extra;
+  char sensor_name[16];
+  uint32_t dropped[3];
+};
+#pragma pack(pop)
+
+TEST(CParsing, ConversionPlanOldVersion) {
+  const char* old_metadata = R"(
+namespace messages {
+  struct inctype {
+    u16 val;
+    f64 extra;
+    short_string sensor_name;
+    u32 dropped[3];
+  }
+}
+)";
+  const uint64_t OLD_HASH = 0x1234;
+  auto plan = CBufConversion::get(OLD_HASH, old_metadata, messages::inctype::TYPE_HASH,
+                                  messages::inctype::cbuf_string, messages::inctype::TYPE_STRING);
+  ASSERT_NE(plan, nullptr);
+
+  // Fields change type, move around or go away
+  old_inctype old = {};
+  old.preamble.hash = OLD_HASH;
+  old.val = 1234;
+  old.extra = 2.5;
+  strcpy(old.sensor_name, "old");
+  messages::inctype inc;
+  inc.Init();
+  EXPECT_EQ(plan->Convert((unsigned char*)&old, sizeof(old), (unsigned char*)&inc, sizeof(inc)), sizeof(old));
+  EXPECT_EQ(inc.val, 1234u);
+  EXPECT_TRUE(inc.sensor_name == "old");
+
+  // Arrays cannot become single values
+  const char* array_metadata = "namespace messages { struct inctype { u32 val[2]; } }\n";
+  EXPECT_EQ(CBufConversion::get(OLD_HASH + 1, array_metadata, messages::inctype::TYPE_HASH,
+                                messages::inctype::cbuf_string, messages::inctype::TYPE_STRING),
+            nullptr);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,47 @@
+#include "test_stream_utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <filesystem>
+
+#include "inctype.h"
+
+namespace fs = std::filesystem;
+
+std::string test_file(const char* name) {
+  return (fs::temp_directory_path() / (std::string(name) + "." + std::to_string(getpid()) + ".cb")).string();
+}
+
+std::vector<uint8_t> read_whole_file(const std::string& fname) {
+  std::vector<uint8_t> data(fs::file_size(fname));
+  FILE* f = fopen(fname.c_str(), "rb");
+  if (f == nullptr) return {};
+  size_t got = fread(data.data(), 1, data.size(), f);
+  fclose(f);
+  data.resize(got);
+  return data;
+}
+
+bool write_inctype(cbuf_ostream& cos, uint32_t val, double ts) {
+  messages::inctype msg;
+  msg.val = val;
+  msg.preamble.packet_timest = ts;
+  if (cos.serialize_metadata(msg.cbuf_string, msg.hash(), msg.TYPE_STRING) != 0) return false;
+  return cos.write_packet(&msg, sizeof(msg));
+}
+
+void corrupt_hash(const std::string& fname, size_t offset) {
+  int fd = open(fname.c_str(), O_WRONLY);
+  ASSERT_NE(fd, -1);
+  unsigned char garbage = 0x5A;
+  ASSERT_EQ(pwrite(fd, &garbage, 1, offset + offsetof(cbuf_preamble, hash)), 1);
+  close(fd);
+}
+
+uint64_t corrupted_hash(uint64_t hash) { return (hash & ~uint64_t(0xFF)) | 0x5A; }
+
+double elapsed_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
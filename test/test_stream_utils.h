@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "cbuf_stream.h"
+#include "gtest/gtest.h"
+
+// Path of a temporary cb file, unique to the test process
+std::string test_file(const char* name);
+std::vector<uint8_t> read_whole_file(const std::string& fname);
+// Write an inctype with the given value and timestamp, as ULogger would
+bool write_inctype(cbuf_ostream& cos, uint32_t val, double ts);
+// Change the hash of the record at offset, which no longer looks like the message it was
+void corrupt_hash(const std::string& fname, size_t offset);
+uint64_t corrupted_hash(uint64_t hash);
+double elapsed_since(std::chrono::steady_clock::time_point start);
+
+// Messages of type CBufMsg on a stream, skipping corruptions and the record corrupted by
+// corrupt_hash. Records packing other messages never show up
+template <typename CBufMsg, typename Fn>
+void read_skipping_corruptions(cbuf_istream& cis, Fn fn) {
+  while (!cis.empty_no_internal()) {
+    if (!cis.check_next_preamble() || cis.get_next_size() == 0) {
+      ASSERT_TRUE(cis.skip_corrupted());
+      continue;
+    }
+    if (cis.get_next_hash() == corrupted_hash(CBufMsg::TYPE_HASH)) {
+      ASSERT_TRUE(cis.skip_message());
+      continue;
+    }
+    ASSERT_EQ(cis.get_next_hash(), uint64_t(CBufMsg::TYPE_HASH));
+    CBufMsg msg;
+    ASSERT_TRUE(cis.deserialize(&msg));
+    fn(msg);
+  }
+}
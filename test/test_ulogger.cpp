@@ -4,6 +4,8 @@
 #include <filesystem>
 #include <thread>
 
+#include "cbuf_catalog.h"
+#include "cbuf_reader.h"
 #include "cbuf_stream.h"
 #include "gtest/gtest.h"
 #include "image.h"
@@ -84,6 +86,61 @@ TEST(RecordManyMessages, ULogger) {
   unlink(filename.c_str());
 }
 
+TEST(CatalogPrunesFiles, ULogger) {
+  fs::path dir = fs::temp_directory_path() / ("ulog_catalog." + std::to_string(getpid()));
+  fs::remove_all(dir);
+  ULogger::getULogger()->setLogPath(dir.string());
+
+  messages::image img;
+  for (unsigned i = 0; i < 3; i++) {
+    set_data(img, i);
+    ULogger::getULogger()->serialize(img);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::string filename = ULogger::getULogger()->getCurrentUlogPath();
+  ULogger::endLogging();
+
+  // The file was added to the catalog on close
+  CBufCatalog catalog;
+  ASSERT_TRUE(catalog.load(dir.string()));
+  ASSERT_EQ(catalog.files().size(), 1u);
+  const auto* info = catalog.find(fs::path(filename).filename().string());
+  ASSERT_NE(info, nullptr);
+  EXPECT_EQ(info->file_size, fs::file_size(filename));
+  ASSERT_EQ(info->type_names.size(), 1u);
+  EXPECT_EQ(info->type_names[0], "messages::image");
+  EXPECT_EQ(info->type_hashes[0], uint64_t(messages::image::TYPE_HASH));
+  EXPECT_LE(info->start_time, info->end_time);
+
+  // A later file missing from the catalog is always opened
+  std::string later = (dir / "later.cb").string();
+  {
+    cbuf_ostream cos;
+    ASSERT_TRUE(cos.open_file(later.c_str()));
+    messages::inctype inc;
+    inc.val = 1;
+    ASSERT_TRUE(cos.serialize(&inc));
+    cos.close();
+  }
+  size_t later_size = fs::file_size(later);
+
+  CBufReader all(dir.string());
+  ASSERT_TRUE(all.openUlog());
+  EXPECT_EQ(all.getTotalCbSize(), later_size + info->file_size);
+
+  CBufReader by_time(dir.string());
+  by_time.setStartTime(info->end_time + 1);
+  ASSERT_TRUE(by_time.openUlog());
+  EXPECT_EQ(by_time.getTotalCbSize(), later_size);
+
+  CBufReader by_type(dir.string());
+  by_type.setTypeFilter({"messages::inctype"});
+  ASSERT_TRUE(by_type.openUlog());
+  EXPECT_EQ(by_type.getTotalCbSize(), later_size);
+
+  fs::remove_all(dir);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
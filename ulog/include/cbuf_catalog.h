@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Catalog of the files on a ulog folder, so readers can tell which files hold the times
+// and types they are after without opening every one of them.
+//
+// ULogger appends an entry as it finishes each file. Files without an entry, like the one
+// being written or those from older loggers, and files whose size no longer matches their
+// entry, have to be opened to know what they hold.
+class CBufCatalog {
+public:
+  struct FileInfo {
+    // Name of the file, without the folder
+    std::string file_name;
+    uint64_t file_size = 0;
+    double start_time = 0;
+    double end_time = 0;
+    std::vector<uint64_t> type_hashes;
+    std::vector<std::string> type_names;
+
+    // Whether the file has messages between start and end times, and of any of the types.
+    // Non positive times and empty types do not filter
+    bool overlaps(double start, double end, const std::vector<std::string>& types) const;
+  };
+
+  static constexpr const char* FILENAME = "catalog.cbcat";
+
+  static std::string catalog_path(const std::string& ulog_dir);
+  // Append the entry of a file on ulog_dir, written as a single record
+  static bool append(const std::string& ulog_dir, const FileInfo& info);
+
+  // Load the catalog of a folder, false if it has none. Entries cut short are ignored
+  bool load(const std::string& ulog_dir);
+
+  // Entry for a file name, null if the catalog does not have it
+  const FileInfo* find(const std::string& file_name) const;
+  const std::vector<FileInfo>& files() const { return files_; }
+
+private:
+  std::vector<FileInfo> files_;
+  std::unordered_map<std::string, size_t> file_pos_;
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cbuf_stream.h"
+
+// Follows files still being written, as by ULogger, with one inotify descriptor for all of
+// them. follow opens a stream on the file with cbuf_istream::open_growing_file, then wait maps
+// what is appended to it, and reads it to the end once its writer closes it.
+//
+// A folder can be watched as well, for the files created on it later. The streams stay owned
+// by the caller, which stops following them or closes the follower before deleting them.
+class cbuf_follower {
+public:
+  cbuf_follower() {}
+  ~cbuf_follower() { close(); }
+
+  // Watch a folder for files created, growing or closed on it. Call it before listing the
+  // folder, so no file created meanwhile is missed
+  bool watch_folder(const std::string& path);
+  // Open the file on cis as growing, and map what is appended to it from then on
+  bool follow(cbuf_istream* cis, const std::string& path);
+  // The file is not written anymore, cis reads it to the end
+  void stop(cbuf_istream* cis);
+  bool is_following(const cbuf_istream* cis) const;
+  bool is_open() const { return fd_ != -1; }
+  void close();
+
+  // Wait up to timeout_ms for changes and apply them: the files grown are mapped further, the
+  // ones closed read to the end. Files created on the folder watched go to new_file, which can
+  // follow them. False if nothing changed
+  bool wait(int timeout_ms, const std::function<void(const std::string&)>& new_file = nullptr);
+
+private:
+  struct followed {
+    cbuf_istream* cis;
+    // Watch of the file, or of the folder watched when in it
+    int wd;
+  };
+
+  int fd_ = -1;
+  int folder_wd_ = -1;
+  std::string folder_;
+  std::vector<followed> followed_;
+
+  bool init();
+  void changed(const followed& f, bool closed);
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Integrity check of cbuf files, see the cbuf_fsck tool. Every record is walked from the
+// start of the file: preambles need the magic and a size that fits, messages need the
+// metadata of their type earlier on the file and have to decode with CBufParser to exactly
+// their size, and internal records have to decode and point to records that exist.
+//
+// Problems are reported as ranges of bytes. A repaired copy of a file is the file without
+// those ranges, which also drops a message cut short at the end of the file.
+class CBufFsck {
+public:
+  enum class Problem {
+    // Bytes without a valid preamble, up to the next one
+    BAD_PREAMBLE,
+    // Internal record that does not decode, or whose references are wrong
+    BAD_RECORD,
+    // Message of a type without metadata before it
+    NO_METADATA,
+    // Message that does not decode with the metadata of its type
+    DECODE_FAILED,
+    // Message cut short at the end of the file
+    TRUNCATED,
+  };
+
+  // Range of bytes, [start, end), with a problem. hash is the type of the message, if known
+  struct Issue {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    Problem problem = Problem::BAD_PREAMBLE;
+    uint64_t hash = 0;
+  };
+
+  struct Report {
+    std::string path;
+    uint64_t file_size = 0;
+    // Valid records, and the messages they hold
+    uint64_t records = 0;
+    uint64_t messages = 0;
+    std::vector<Issue> issues;
+    // Set when the file could not be checked at all
+    std::string error;
+    // Path of the repaired copy, if one was written
+    std::string repaired_path;
+
+    bool ok() const { return error.empty() && issues.empty(); }
+    uint64_t bad_bytes() const;
+  };
+
+  static const char* problem_name(Problem problem);
+
+  // Check a file in memory
+  static void check(const unsigned char* data, size_t size, Report& report);
+  // Check a file, and if repaired_path is not empty and there are problems, write a copy
+  // without them there
+  static bool check_file(const std::string& path, Report& report, const std::string& repaired_path = "");
+  // Check several files in parallel, one file per thread with up to max_threads of them (0
+  // to use every core). Repaired copies go to repair_dir, with the same file name, when set.
+  // Reports are in the order of the paths
+  static void check_files(const std::vector<std::string>& paths, unsigned max_threads,
+                          const std::string& repair_dir, std::vector<Report>& reports);
+
+  // Write the file without the ranges with problems. The footer index is dropped as well
+  // when anything else is, its offsets would not match anymore. Repeats and deltas referring
+  // across the bytes dropped are encoded again, and dropped with the message they refer to
+  static bool write_repaired(const unsigned char* data, size_t size, const Report& report,
+                             const std::string& repaired_path);
+
+  // Report as a single line of JSON
+  static std::string to_json(const Report& report);
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Index of the records on a cbuf file, to answer counts and time seeks without walking
+// every preamble. It holds, per message type, the counts, bytes and offsets of the records
+// holding it, and sparse samples mapping time to the offset where reading has to start.
+//
+// cbuf_ostream writes it as a footer when closing a file (see cbuf_ostream::set_write_index):
+// an index record followed by a trailer record, the last bytes of the file, pointing back
+// to it. Readers skip both records as internal.
+//
+// Files without a footer can be indexed offline (see the ulog_index tool), scanning every
+// record. That index is stored on a sidecar file next to the cbuf file, and readers load it
+// when the file has no footer.
+class CBufIndex {
+public:
+  struct TypeInfo {
+    uint64_t hash = 0;
+    std::string name;
+    // Messages of the type, as seen by a reader that does not expand repeats
+    uint64_t count = 0;
+    // Messages suppressed as repeats, seen only when expanding them
+    uint64_t repeats = 0;
+    // Bytes on the file of the records holding messages of the type
+    uint64_t bytes = 0;
+    // Offsets of the records holding messages of the type, in file order
+    std::vector<uint64_t> offsets;
+  };
+
+  // Range of bytes, [start, end), that does not hold valid records
+  struct Corruption {
+    uint64_t start = 0;
+    uint64_t end = 0;
+  };
+
+  // Records written between two time samples
+  static constexpr unsigned SAMPLE_INTERVAL = 256;
+
+  void clear();
+
+  // Build the index as records are written
+  void add_metadata(uint64_t offset, uint64_t hash, const std::string& name);
+  void add_record(uint64_t hash, uint64_t offset, uint64_t size, double min_ts, double max_ts,
+                  uint32_t messages, uint32_t repeats = 0);
+  void add_corruption(uint64_t start, uint64_t end);
+
+  // Build the index scanning a whole file in memory, resyncing on corruptions
+  void build(const unsigned char* data, size_t size);
+
+  // Serialize the index record for a file where it starts at index_offset, and the trailer
+  bool encode_footer(uint64_t index_offset, std::vector<uint8_t>& out) const;
+  // Load the footer from a file in memory, false if the file does not end with one
+  bool load_footer(const unsigned char* data, size_t size);
+
+  // Path of the sidecar index for a cbuf file
+  static std::string sidecar_path(const std::string& cb_path);
+  // Load the sidecar of a cbuf file, false if there is none or the file changed since
+  bool load_sidecar(const std::string& cb_path);
+  // Scan a cbuf file and write its sidecar
+  static bool build_sidecar(const std::string& cb_path, std::string& error);
+  // Build the sidecars of several files in parallel, one file per thread with up to
+  // max_threads of them (0 to use every core). Errors are appended, one per file failing
+  static bool build_sidecars(const std::vector<std::string>& cb_paths, unsigned max_threads,
+                             std::vector<std::string>& errors);
+
+  // Offset where to start reading to get every message with timestamp t or later. Messages
+  // earlier than t can still follow, when timestamps are not monotonic
+  uint64_t offset_for_time(double t) const;
+
+  const std::vector<TypeInfo>& types() const { return types_; }
+  const TypeInfo* find_type(uint64_t hash) const;
+  // Offsets of the metadata records, needed to decode messages after a seek
+  const std::vector<uint64_t>& metadata_offsets() const { return metadata_offsets_; }
+  const std::vector<Corruption>& corruptions() const { return corruptions_; }
+  // Size of the file indexed
+  uint64_t file_size() const { return file_size_; }
+
+  double start_time() const { return start_time_; }
+  double end_time() const { return end_time_; }
+  bool empty() const { return types_.empty(); }
+
+private:
+  TypeInfo& get_type(uint64_t hash);
+  bool encode_index(std::vector<uint8_t>& out) const;
+  bool decode_index(const unsigned char* data, size_t size);
+  // Index the record at offset, returning its size, or 0 if it is not a valid record
+  size_t scan_record(const unsigned char* data, size_t size, size_t offset);
+  bool save_sidecar(const std::string& cb_path, uint64_t cb_size, int64_t cb_mtime_ns) const;
+
+  std::vector<TypeInfo> types_;
+  std::unordered_map<uint64_t, size_t> type_pos_;
+  std::unordered_map<uint64_t, std::string> names_;
+  std::vector<uint64_t> metadata_offsets_;
+  std::vector<Corruption> corruptions_;
+  // Each sample holds the largest timestamp of all the records before its offset
+  std::vector<double> sample_times_;
+  std::vector<uint64_t> sample_offsets_;
+  double max_ts_ = -1e300;
+  unsigned since_sample_ = 0;
+  double start_time_ = 0;
+  double end_time_ = 0;
+  uint64_t file_size_ = 0;
+};
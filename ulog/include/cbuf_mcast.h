@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cbuf_stream.h"
+
+// UDP multicast of cbuf messages, for fanning out telemetry to any number of local consumers
+// with a single send. Messages are encoded through a cbuf_cstream and sent as datagrams,
+// split in fragments when they do not fit on one. Every message carries a sequence number,
+// so subscribers notice losses, and the metadata of every type is sent again periodically
+// so subscribers joining late can decode. IPv4 only.
+//
+// Subscribers reassemble the fragments and decode the messages with a cbuf_decoder. To
+// dispatch them to handlers, open the group with CBufReaderBase::openMulticast instead.
+class cbuf_mcast_publisher {
+public:
+  struct options {
+    options() {}
+    // Largest datagram payload sent, headers included. Larger messages are fragmented
+    size_t max_datagram = 1472;
+    // Seconds between announcements of the metadata already sent
+    double metadata_period = 1.0;
+    int ttl = 1;
+    // Address of the interface to send from, the default route when empty
+    std::string interface;
+  };
+
+  cbuf_mcast_publisher() {}
+  ~cbuf_mcast_publisher() { close(); }
+
+  bool open(const char* group, int port, const options& opts = options());
+  void close();
+  bool is_open() const { return fd_ != -1; }
+
+  template <class cbuf_struct>
+  bool serialize(cbuf_struct* member) {
+    if (fd_ == -1) return false;
+    announce_metadata(false);
+    send_ok_ = true;
+    cstream_.serialize(member);
+    return send_ok_;
+  }
+
+  // Send the metadata of every type sent so far, if the period passed or when forced
+  bool announce_metadata(bool force = true);
+
+  // Messages sent, metadata announcements included
+  uint64_t messages_sent() const { return next_seq_; }
+
+private:
+  cbuf_cstream cstream_;
+  int fd_ = -1;
+  std::vector<unsigned char> dest_;
+  options opts_;
+  // Picked at random on open, so subscribers tell publisher restarts apart
+  uint32_t session_ = 0;
+  uint64_t next_seq_ = 0;
+  // Message being encoded by cstream_, and the datagram being sent
+  std::vector<unsigned char> packet_;
+  std::vector<unsigned char> datagram_;
+  std::vector<std::vector<unsigned char>> metadata_records_;
+  double last_announce_ = 0;
+  bool send_ok_ = true;
+
+  static unsigned char* alloc_packet(size_t size, void* ctx);
+  static void packet_complete(unsigned char* data, size_t size, void* ctx);
+  // Send a whole record, in as many fragments as it needs
+  bool send_record(const unsigned char* data, size_t size);
+};
+
+class cbuf_mcast_subscriber {
+public:
+  cbuf_mcast_subscriber() {}
+  ~cbuf_mcast_subscriber() { close(); }
+
+  // Join the group on the interface with the given address, any of them by default
+  bool open(const char* group, int port, const char* interface = "0.0.0.0");
+  void close();
+  bool is_open() const { return fd_ != -1; }
+
+  // Get the next complete message, waiting up to timeout_ms for it. Valid until the next call
+  bool next(cbuf_decoder::message& msg, int timeout_ms = 0);
+
+  template <class cbuf_struct>
+  bool decode(const cbuf_decoder::message& msg, cbuf_struct* member) const {
+    return decoder_.decode(msg, member);
+  }
+
+  std::string get_string_for_hash(uint64_t hash) const { return decoder_.get_string_for_hash(hash); }
+  std::string get_meta_string_for_hash(uint64_t hash) const { return decoder_.get_meta_string_for_hash(hash); }
+
+  void set_expand_repeats(bool expand) { decoder_.set_expand_repeats(expand); }
+  // Hand out metadata records as well, see cbuf_decoder::set_include_metadata
+  void set_include_metadata(bool include) { decoder_.set_include_metadata(include); }
+
+  // Messages lost, seen as gaps on the sequence numbers, or left incomplete
+  uint64_t lost() const { return lost_; }
+  uint64_t received() const { return received_; }
+
+private:
+  // Fragments received of a message
+  struct partial_message {
+    std::vector<unsigned char> data;
+    std::vector<bool> have;
+    uint32_t missing = 0;
+  };
+
+  int fd_ = -1;
+  cbuf_decoder decoder_;
+  std::vector<unsigned char> datagram_;
+  std::map<uint64_t, partial_message> partials_;
+  // Last message completed, fed to the decoder
+  std::vector<unsigned char> complete_;
+  uint32_t session_ = 0;
+  bool has_session_ = false;
+  uint64_t next_seq_ = 0;
+  uint64_t lost_ = 0;
+  uint64_t received_ = 0;
+
+  // Process a datagram, returns true if it completed a message, fed to the decoder
+  bool handle_datagram(size_t size);
+  // Account for a message completed, for the losses
+  void complete_sequence(uint64_t seq);
+};
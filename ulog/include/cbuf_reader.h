@@ -1,20 +1,39 @@
 #pragma once
 
+#include <atomic>
 #include <filesystem>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include "CBufParser.h"
 #include "cbuf_readerbase.h"
 
 namespace fs = std::filesystem;
 
+// Message decoded apart from calling its handler, see CBufHandlerBase::decodeMessage
+class CBufDecodedBase {
+public:
+  virtual ~CBufDecodedBase() {}
+};
+
 class CBufHandlerBase {
   std::string msg_name_;
   // set this to true to process this message even when out of start,end time
   bool process_always_ = false;
+  bool copy_message_ = false;
 
 public:
   CBufHandlerBase(const std::string& msg_name, bool process)
@@ -22,192 +41,210 @@ public:
       , process_always_(process) {}
   const std::string& name() const { return msg_name_; }
   bool process_always() const { return process_always_; }
+  // Handlers of the same version of a type share the message decoded for the first of them.
+  // Set this on a handler that modifies it, to get a copy of its own
+  void set_copy_message(bool copy) { copy_message_ = copy; }
+  bool copy_message() const { return copy_message_; }
   virtual ~CBufHandlerBase() {}
   // returns true if the message was consumed, 0 otherwise
   virtual bool processMessage(cbuf_istream& cis) = 0;
+
+  // Decoding apart from calling the handler, for CBufReader to decode messages once for every
+  // handler of a type, and ahead on other threads (see Options::read_ahead). decodedHash is the
+  // hash of the version of the type decoded, 0 if the handler only decodes for itself.
+  // decodeMessage can be called from several threads at once, decodeReused decodes into the
+  // same storage every time, and both return nullptr if the message could not be decoded.
+  // decodeInto decodes into decoded, made by the handler when null, and can be called from
+  // several threads at once. dispatchDecoded calls the handler on the thread processing messages
+  virtual bool canDecodeAhead() const { return false; }
+  virtual uint64_t decodedHash() const { return 0; }
+  virtual std::unique_ptr<CBufDecodedBase> decodeMessage(cbuf_istream&) { return nullptr; }
+  virtual CBufDecodedBase* decodeReused(cbuf_istream&) { return nullptr; }
+  virtual bool decodeInto(cbuf_istream&, std::unique_ptr<CBufDecodedBase>& /*decoded*/) { return false; }
+  virtual void dispatchDecoded(CBufDecodedBase*, const std::string& /*filename*/) {}
 };
 
-// Handler callback function pointer.
-template <typename TApp, typename CBufMsg>
-using CBufMessageHandler = void (TApp::*)(CBufMsg* msg);
+template <typename CBufMsg>
+class CBufDecoded : public CBufDecodedBase {
+public:
+  CBufMsg msg;
+};
 
-template <typename TApp, typename CBufMsg>
-class CBufHandler : public CBufHandlerBase {
-  TApp* caller = nullptr;
-  CBufMessageHandler<TApp, CBufMsg> handler = nullptr;
-  CBufMsg* msg = nullptr;
-  CBufParser* parser = nullptr;
-  CBufParser* parserCurrent = nullptr;
+// Decodes the next message of a stream as a CBufMsg, converting it when it was written with
+// another version of the type. Conversion plans are shared by every decoder, see
+// CBufConversion. decode can be used from several threads at once
+template <typename CBufMsg>
+class CBufMsgDecoder {
   bool allow_conversion = true;
   bool warned_conversion = false;
-
-public:
-  CBufHandler(TApp* owner, CBufMessageHandler<TApp, CBufMsg> h, bool allow_conv = true,
-              bool process_always = false)
-      : CBufHandlerBase(CBufMsg::TYPE_STRING, process_always)
-      , caller(owner)
-      , handler(h)
-      , allow_conversion(allow_conv) {}
-
-  ~CBufHandler() override {
-    if (msg) {
-      delete msg;
-      msg = nullptr;
+  std::mutex conversion_mutex;
+  // Plan for the last hash converted, files can hold different versions
+  std::shared_ptr<const CBufConversion> conversion_;
+  uint64_t conversion_hash_ = 0;
+  // Storage of decode_reused, and of the copies handed out by message
+  std::unique_ptr<CBufDecoded<CBufMsg>> reused_;
+  std::unique_ptr<CBufMsg> copy_;
+
+  // Convert a message written with another version of the type
+  bool convert(uint64_t hash, std::string_view meta, const unsigned char* data, size_t size, double timestamp,
+               CBufMsg* msg) {
+    std::shared_ptr<const CBufConversion> conversion;
+    {
+      std::lock_guard<std::mutex> lock(conversion_mutex);
+      if (!allow_conversion) {
+        if (!warned_conversion) {
+          // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
+          // cbuf version mismatch for message `CBufMsg::TYPE_STRING` and conversion is not allowed
+          warned_conversion = true;
+        }
+        return false;
+      }
+      // the hash did not match but has the same name, try to do conversion
+      if (conversion_hash_ != hash) {
+        conversion_ = CBufConversion::get(hash, std::string(meta), CBufMsg::TYPE_HASH, CBufMsg::cbuf_string,
+                                          CBufMsg::TYPE_STRING);
+        conversion_hash_ = hash;
+      }
+      conversion = conversion_;
     }
+    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
+    // Metadata could not be parsed for message `CBufMsg::TYPE_STRING`
+    if (conversion == nullptr) return false;
+
+    // Initialize the fields on the cbuf in order to ensure when backwards compat
+    // does not fill in fields (that are not there) still have sane values
+    msg->Init();
+    auto fillret = conversion->Convert(data, size, (unsigned char*)msg, sizeof(CBufMsg));
+    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
+    if (fillret == 0) return false;
+    msg->preamble.packet_timest = timestamp;
+    return true;
   }
 
-  bool processMessage(cbuf_istream& cis) override {
-    if (cis.empty()) return true;
-    if (msg == nullptr) {
-      msg = new CBufMsg();
-    }
+public:
+  explicit CBufMsgDecoder(bool allow_conv)
+      : allow_conversion(allow_conv) {}
+
+  bool decode(cbuf_istream& cis, CBufMsg* msg) {
     auto hash = cis.get_next_hash();
 
     if (hash == CBufMsg::TYPE_HASH) {
-      bool ret = cis.deserialize(msg);
-      if (!ret) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // Could not deserialize message of type `CBufMsg::TYPE_STRING`
-        return false;
-      }
-      (caller->*handler)(msg);
-      return true;
+      // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
+      // Could not deserialize message of type `CBufMsg::TYPE_STRING`
+      return cis.deserialize(msg);
+    }
+    if (cis.get_string_view_for_hash(hash) != CBufMsg::TYPE_STRING) {
+      // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
+      return false;
     }
-    auto msg_type = cis.get_string_for_hash(hash);
-    if (msg_type == CBufMsg::TYPE_STRING) {
-      if (allow_conversion) {
-        // the hash did not match but has the same name, try to do conversion
-        if (parser == nullptr) {
-          parser = new CBufParser();
-          if (!parser->ParseMetadata(cis.get_meta_string_for_hash(hash), CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
 
-        if (parserCurrent == nullptr) {
-          parserCurrent = new CBufParser();
-          if (!parserCurrent->ParseMetadata(CBufMsg::cbuf_string, CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for current message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
+    return convert(hash, cis.get_meta_string_view_for_hash(hash), cis.get_current_ptr(), cis.get_next_size(),
+                   cis.get_next_timestamp(), msg);
+  }
 
-        // Initialize the fields on the cbuf in order to ensure when backwards compat
-        // does not fill in fields (that are not there) still have sane values
-        msg->Init();
-        auto fillret = parser->FastConversion(CBufMsg::TYPE_STRING, cis.get_current_ptr(),
-                                              cis.get_next_size(), *parserCurrent, CBufMsg::TYPE_STRING,
-                                              (unsigned char*)msg, sizeof(CBufMsg));
-        if (fillret == 0) return false;
-        msg->preamble.packet_timest = cis.get_next_timestamp();
+  // Decode into decoded, made when null
+  bool decode_into(cbuf_istream& cis, std::unique_ptr<CBufDecodedBase>& decoded) {
+    if (decoded == nullptr) decoded = std::make_unique<CBufDecoded<CBufMsg>>();
+    return decode(cis, &static_cast<CBufDecoded<CBufMsg>*>(decoded.get())->msg);
+  }
 
-        (caller->*handler)(msg);
-        return true;
-      }
-      if (!warned_conversion) {
-        // cbuf version mismatch for message `CBufMsg::TYPE_STRING` and conversion is not allowed
-        warned_conversion = true;
-      }
-    }
-    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-    return false;
+  // Decode into a new message, nullptr if it could not be decoded
+  std::unique_ptr<CBufDecodedBase> decode(cbuf_istream& cis) {
+    auto decoded = std::make_unique<CBufDecoded<CBufMsg>>();
+    if (!decode(cis, &decoded->msg)) return nullptr;
+    return decoded;
+  }
+
+  // Decode into the same message every time, nullptr if it could not be decoded
+  CBufDecoded<CBufMsg>* decode_reused(cbuf_istream& cis) {
+    if (reused_ == nullptr) reused_ = std::make_unique<CBufDecoded<CBufMsg>>();
+    if (!decode(cis, &reused_->msg)) return nullptr;
+    return reused_.get();
+  }
+
+  // Message decoded by any decoder of CBufMsg, or a copy of it to modify
+  CBufMsg* message(CBufDecodedBase* decoded, bool copy) {
+    CBufMsg* msg = &static_cast<CBufDecoded<CBufMsg>*>(decoded)->msg;
+    if (!copy) return msg;
+    if (copy_ == nullptr) copy_ = std::make_unique<CBufMsg>();
+    *copy_ = *msg;
+    return copy_.get();
   }
 };
 
-template <typename TApp, typename CBufMsg>
-using CBufBoxMessageHandler = void (TApp::*)(CBufMsg* msg, const std::string& box_name);
+// Handlers of a CBufMsg, which only differ on how they are called
+template <typename CBufMsg>
+class CBufMsgHandlerBase : public CBufHandlerBase {
+  CBufMsgDecoder<CBufMsg> decoder;
 
-template <typename TApp, typename CBufMsg>
-class CBufBoxHandler : public CBufHandlerBase {
-  TApp* caller = nullptr;
-  CBufBoxMessageHandler<TApp, CBufMsg> handler = nullptr;
-  CBufMsg* msg = nullptr;
-  CBufParser* parser = nullptr;
-  CBufParser* parserCurrent = nullptr;
-  bool allow_conversion = true;
-  bool warned_conversion = false;
+protected:
+  // filename is the one of the stream the message comes from
+  virtual void call(CBufMsg* msg, const std::string& filename) = 0;
 
 public:
-  CBufBoxHandler(TApp* owner, CBufBoxMessageHandler<TApp, CBufMsg> h, bool allow_conv = true,
-                 bool process_always = false)
+  CBufMsgHandlerBase(bool allow_conv, bool process_always)
       : CBufHandlerBase(CBufMsg::TYPE_STRING, process_always)
-      , caller(owner)
-      , handler(h)
-      , allow_conversion(allow_conv) {}
-
-  ~CBufBoxHandler() override {
-    if (msg) {
-      delete msg;
-      msg = nullptr;
-    }
-  }
+      , decoder(allow_conv) {}
 
   bool processMessage(cbuf_istream& cis) override {
     if (cis.empty()) return true;
-    if (msg == nullptr) {
-      msg = new CBufMsg();
-    }
-    auto hash = cis.get_next_hash();
+    auto decoded = decoder.decode_reused(cis);
+    if (decoded == nullptr) return false;
+    call(&decoded->msg, cis.filename());
+    return true;
+  }
 
-    if (hash == CBufMsg::TYPE_HASH) {
-      bool ret = cis.deserialize(msg);
-      if (!ret) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // Could not deserialize message of type `CBufMsg::TYPE_STRING`
-        return false;
-      }
+  bool canDecodeAhead() const override { return true; }
+  uint64_t decodedHash() const override { return CBufMsg::TYPE_HASH; }
+  std::unique_ptr<CBufDecodedBase> decodeMessage(cbuf_istream& cis) override { return decoder.decode(cis); }
+  CBufDecodedBase* decodeReused(cbuf_istream& cis) override { return decoder.decode_reused(cis); }
+  bool decodeInto(cbuf_istream& cis, std::unique_ptr<CBufDecodedBase>& decoded) override {
+    return decoder.decode_into(cis, decoded);
+  }
+  void dispatchDecoded(CBufDecodedBase* decoded, const std::string& filename) override {
+    call(decoder.message(decoded, copy_message()), filename);
+  }
+};
 
-      // Assuming the istream has been instantiated
-      (caller->*handler)(msg, fs::path(cis.filename()).filename());
-      return true;
-    }
-    auto msg_type = cis.get_string_for_hash(hash);
-    if (msg_type == CBufMsg::TYPE_STRING) {
-      if (allow_conversion) {
-        // the hash did not match but has the same name, try to do conversion
-        if (parser == nullptr) {
-          parser = new CBufParser();
-          if (!parser->ParseMetadata(cis.get_meta_string_for_hash(hash), CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
+// Handler callback function pointer.
+template <typename TApp, typename CBufMsg>
+using CBufMessageHandler = void (TApp::*)(CBufMsg* msg);
 
-        if (parserCurrent == nullptr) {
-          parserCurrent = new CBufParser();
-          if (!parserCurrent->ParseMetadata(CBufMsg::cbuf_string, CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for current message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
+template <typename TApp, typename CBufMsg>
+class CBufHandler : public CBufMsgHandlerBase<CBufMsg> {
+  TApp* caller = nullptr;
+  CBufMessageHandler<TApp, CBufMsg> handler = nullptr;
 
-        // Initialize the fields on the cbuf in order to ensure when backwards compat
-        // does not fill in fields (that are not there) still have sane values
-        msg->Init();
-        auto fillret = parser->FastConversion(CBufMsg::TYPE_STRING, cis.get_current_ptr(),
-                                              cis.get_next_size(), *parserCurrent, CBufMsg::TYPE_STRING,
-                                              (unsigned char*)msg, sizeof(CBufMsg));
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        if (fillret == 0) return false;
-        msg->preamble.packet_timest = cis.get_next_timestamp();
-
-        (caller->*handler)(msg, fs::path(cis.filename()).filename());
-        return true;
-      }
-      if (!warned_conversion) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // cbuf version mismatch for message `CBufMsg::TYPE_STRING` and conversion is not allowed
-        warned_conversion = true;
-      }
-    }
-    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-    return false;
+protected:
+  void call(CBufMsg* msg, const std::string&) override { (caller->*handler)(msg); }
+
+public:
+  CBufHandler(TApp* owner, CBufMessageHandler<TApp, CBufMsg> h, bool allow_conv = true,
+              bool process_always = false)
+      : CBufMsgHandlerBase<CBufMsg>(allow_conv, process_always)
+      , caller(owner)
+      , handler(h) {}
+};
+
+template <typename TApp, typename CBufMsg>
+using CBufBoxMessageHandler = void (TApp::*)(CBufMsg* msg, const std::string& box_name);
+
+template <typename TApp, typename CBufMsg>
+class CBufBoxHandler : public CBufMsgHandlerBase<CBufMsg> {
+  TApp* caller = nullptr;
+  CBufBoxMessageHandler<TApp, CBufMsg> handler = nullptr;
+
+protected:
+  void call(CBufMsg* msg, const std::string& filename) override {
+    (caller->*handler)(msg, fs::path(filename).filename());
   }
+
+public:
+  CBufBoxHandler(TApp* owner, CBufBoxMessageHandler<TApp, CBufMsg> h, bool allow_conv = true,
+                 bool process_always = false)
+      : CBufMsgHandlerBase<CBufMsg>(allow_conv, process_always)
+      , caller(owner)
+      , handler(h) {}
 };
 
 template <typename CBufMsg>
@@ -217,195 +254,315 @@ template <typename CBufMsg>
 using CBufBoxHandlerLambdaFn = std::function<void(CBufMsg*, const std::string& box_name)>;
 
 template <typename CBufMsg>
-class CBufHandlerLambda : public CBufHandlerBase {
+class CBufHandlerLambda : public CBufMsgHandlerBase<CBufMsg> {
   CBufHandlerLambdaFn<CBufMsg> handler = nullptr;
-  CBufMsg* msg = nullptr;
-  CBufParser* parser = nullptr;
-  CBufParser* parserCurrent = nullptr;
-  bool allow_conversion = true;
-  bool warned_conversion = false;
+
+protected:
+  void call(CBufMsg* msg, const std::string&) override { handler(msg); }
 
 public:
   CBufHandlerLambda(void (*h)(CBufMsg*), bool allow_conv = true, bool process_always = false)
-      : CBufHandlerBase(CBufMsg::TYPE_STRING, process_always)
-      , handler(h)
-      , allow_conversion(allow_conv) {}
+      : CBufMsgHandlerBase<CBufMsg>(allow_conv, process_always)
+      , handler(h) {}
 
   CBufHandlerLambda(std::function<void(CBufMsg*)> h, bool allow_conv = true, bool process_always = false)
-      : CBufHandlerBase(CBufMsg::TYPE_STRING, process_always)
-      , handler(h)
-      , allow_conversion(allow_conv) {}
-
-  ~CBufHandlerLambda() override {
-    if (msg) {
-      delete msg;
-      msg = nullptr;
-    }
-  }
-
-  bool processMessage(cbuf_istream& cis) override {
-    if (cis.empty()) return true;
-    if (msg == nullptr) {
-      msg = new CBufMsg();
-    }
-    auto hash = cis.get_next_hash();
-    if (hash == CBufMsg::TYPE_HASH) {
-      bool ret = cis.deserialize(msg);
-      if (!ret) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // Could not deserialize message of type `CBufMsg::TYPE_STRING`
-        return false;
-      }
-      handler(msg);
-      return true;
-    }
-    auto msg_type = cis.get_string_for_hash(hash);
-    if (msg_type == CBufMsg::TYPE_STRING) {
-      if (allow_conversion) {
-        // the hash did not match but has the same name, try to do conversion
-        if (parser == nullptr) {
-          parser = new CBufParser();
-          if (!parser->ParseMetadata(cis.get_meta_string_for_hash(hash), CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
-
-        if (parserCurrent == nullptr) {
-          parserCurrent = new CBufParser();
-          if (!parserCurrent->ParseMetadata(CBufMsg::cbuf_string, CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for current message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
-
-        // Initialize the fields on the cbuf in order to ensure when backwards compat
-        // does not fill in fields (that are not there) still have sane values
-        msg->Init();
-        auto fillret = parser->FastConversion(CBufMsg::TYPE_STRING, cis.get_current_ptr(),
-                                              cis.get_next_size(), *parserCurrent, CBufMsg::TYPE_STRING,
-                                              (unsigned char*)msg, sizeof(CBufMsg));
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        if (fillret == 0) return false;
-
-        handler(msg);
-        return true;
-      }
-      if (!warned_conversion) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // cbuf version mismatch for message `CBufMsg::TYPE_STRING` and conversion is not allowed
-        warned_conversion = true;
-      }
-    }
-    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-    return false;
-  }
+      : CBufMsgHandlerBase<CBufMsg>(allow_conv, process_always)
+      , handler(h) {}
 };
 
 // Partial specialisation of the template
 template <typename CBufMsg>
-class CBufBoxHandlerLambda : public CBufHandlerBase {
+class CBufBoxHandlerLambda : public CBufMsgHandlerBase<CBufMsg> {
   CBufBoxHandlerLambdaFn<CBufMsg> handler = nullptr;
-  CBufMsg* msg = nullptr;
-  CBufParser* parser = nullptr;
-  CBufParser* parserCurrent = nullptr;
-  bool allow_conversion = true;
-  bool warned_conversion = false;
+
+protected:
+  // assuming the istream has been instantiated
+  void call(CBufMsg* msg, const std::string& filename) override {
+    handler(msg, fs::path(filename).filename());
+  }
 
 public:
   CBufBoxHandlerLambda(void (*h)(CBufMsg*, std::string), bool allow_conversion = true,
                        bool process_always = false)
-      : CBufHandlerBase(CBufMsg::TYPE_STRING, process_always)
-      , handler(h)
-      , allow_conversion(allow_conversion) {}
+      : CBufMsgHandlerBase<CBufMsg>(allow_conversion, process_always)
+      , handler(h) {}
 
   CBufBoxHandlerLambda(std::function<void(CBufMsg*, std::string)> h, bool allow_conv = true,
                        bool process_always = false)
-      : CBufHandlerBase(CBufMsg::TYPE_STRING, process_always)
-      , handler(h)
-      , allow_conversion(allow_conv) {}
+      : CBufMsgHandlerBase<CBufMsg>(allow_conv, process_always)
+      , handler(h) {}
+};
 
-  ~CBufBoxHandlerLambda() override {
-    if (msg) {
-      delete msg;
-      msg = nullptr;
-    }
-  }
+template <typename CBufMsg>
+using CBufViewHandlerFn = std::function<void(const CBufMsg&)>;
+
+// Whether a message of a simple type can be used in place at ptr. Records are not aligned on
+// the files: generated structs are packed and can be used anywhere, any other type is copied
+// when not aligned for it
+template <typename CBufMsg>
+inline bool cbuf_aligned_view(const void* ptr) {
+  return reinterpret_cast<uintptr_t>(ptr) % alignof(CBufMsg) == 0;
+}
+
+// Handler taking messages by const reference, only valid during the call. Messages of simple
+// types written with the same version are handed out in place, straight from the mapped file
+// (or the record they were unpacked from) without copying them, when aligned for the type.
+// Anything else is decoded or converted first, as for the other handlers
+template <typename CBufMsg>
+class CBufViewHandler : public CBufMsgHandlerBase<CBufMsg> {
+  CBufViewHandlerFn<CBufMsg> handler = nullptr;
+
+protected:
+  void call(CBufMsg* msg, const std::string&) override { handler(*msg); }
+
+public:
+  CBufViewHandler(CBufViewHandlerFn<CBufMsg> h, bool allow_conv = true, bool process_always = false)
+      : CBufMsgHandlerBase<CBufMsg>(allow_conv, process_always)
+      , handler(h) {}
 
   bool processMessage(cbuf_istream& cis) override {
-    if (cis.empty()) return true;
-    if (msg == nullptr) {
-      msg = new CBufMsg();
-    }
-    auto hash = cis.get_next_hash();
-    if (hash == CBufMsg::TYPE_HASH) {
-      bool ret = cis.deserialize(msg);
-      if (!ret) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // Could not deserialize message of type `CBufMsg::TYPE_STRING`
-        return false;
+    if constexpr (CBufMsg::is_simple() && !CBufMsg::supports_compact()) {
+      if (!cis.empty() && cis.get_next_hash() == CBufMsg::TYPE_HASH &&
+          cbuf_aligned_view<CBufMsg>(cis.get_current_ptr())) {
+        CBufMsg* view = nullptr;
+        if (!CBufMsg::decode((char*)cis.get_current_ptr(), cis.get_next_size(), &view)) return false;
+        handler(*view);
+        return true;
       }
-      // assuming the istream has been instantiated
-      (handler)(msg, fs::path(cis.filename()).filename());
-      return true;
     }
-    auto msg_type = cis.get_string_for_hash(hash);
-    if (msg_type == CBufMsg::TYPE_STRING) {
-      if (allow_conversion) {
-        // the hash did not match but has the same name, try to do conversion
-        if (parser == nullptr) {
-          parser = new CBufParser();
-          if (!parser->ParseMetadata(cis.get_meta_string_for_hash(hash), CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
+    return CBufMsgHandlerBase<CBufMsg>::processMessage(cis);
+  }
 
-        if (parserCurrent == nullptr) {
-          parserCurrent = new CBufParser();
-          if (!parserCurrent->ParseMetadata(CBufMsg::cbuf_string, CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for current message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
+  // Not sharing decoded messages with other handlers, views need no decoding
+  uint64_t decodedHash() const override { return 0; }
+};
 
-        // Initialize the fields on the cbuf in order to ensure when backwards compat
-        // does not fill in fields (that are not there) still have sane values
-        msg->Init();
-        auto fillret = parser->FastConversion(CBufMsg::TYPE_STRING, cis.get_current_ptr(),
-                                              cis.get_next_size(), *parserCurrent, CBufMsg::TYPE_STRING,
-                                              (unsigned char*)msg, sizeof(CBufMsg));
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        if (fillret == 0) return false;
-
-        // assuming the istream has been instantiated
-        (handler)(msg, fs::path(cis.filename()).filename());
-        return true;
-      }
-      if (!warned_conversion) {
-        // cbuf version mismatch for message `CBufMsg::TYPE_STRING` and conversion is not allowed
-        warned_conversion = true;
-      }
+// Messages decoded ahead for a handler, see Options::read_ahead. Entries go back to the pool
+// once every handler they were given to is done with them, to decode other messages into
+class CBufDecodedPool {
+public:
+  struct Entry {
+    std::unique_ptr<CBufDecodedBase> decoded;
+    // Handlers still to be done with the message
+    std::atomic<unsigned> users = 0;
+    CBufDecodedPool* pool = nullptr;
+    // Done by a handler, back to the pool after the last one
+    void release() {
+      if (users.fetch_sub(1, std::memory_order_acq_rel) == 1) pool->give(this);
     }
-    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-    return false;
+  };
+
+  // A free entry, new if every one is in use
+  Entry* take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+      entries_.push_back(std::make_unique<Entry>());
+      entries_.back()->pool = this;
+      return entries_.back().get();
+    }
+    Entry* entry = free_.back();
+    free_.pop_back();
+    return entry;
+  }
+  void give(Entry* entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(entry);
   }
+
+private:
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Entry>> entries_;
+  std::vector<Entry*> free_;
+};
+
+// Runs handlers on a pool of threads, see Options::handler_threads. Every handler is given
+// one of the threads the first time it gets a message, so it gets all of them in order. Each
+// thread has a bounded queue, submitting waits while it is full
+class CBufHandlerExecutor {
+  struct Task {
+    CBufHandlerBase* handler = nullptr;
+    std::shared_ptr<CBufDecodedBase> decoded;
+    // Decoded ahead instead, released once handled
+    CBufDecodedPool::Entry* pooled = nullptr;
+    // Of the stream the message comes from, which outlives the task
+    const std::string* filename = nullptr;
+  };
+
+  struct Lane {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Task> tasks;
+    bool busy = false;
+    bool quit = false;
+  };
+
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  std::unordered_map<const CBufHandlerBase*, Lane*> handler_lanes_;
+  size_t queue_size_;
+
+  void run(Lane* lane);
+  void push(Task task);
+
+public:
+  CBufHandlerExecutor(unsigned threads, size_t queue_size);
+  ~CBufHandlerExecutor();
+
+  void submit(CBufHandlerBase* handler, std::shared_ptr<CBufDecodedBase> decoded,
+              const std::string* filename);
+  void submit(CBufHandlerBase* handler, CBufDecodedPool::Entry* pooled, const std::string* filename);
+  // Wait until every message submitted was handled
+  void sync();
 };
 
+// Handlers of every message type, indexed by its id on CBufTypeIds
+using CBufHandlerTable = std::vector<std::vector<std::shared_ptr<CBufHandlerBase>>>;
+
+template <typename... CBufMsgs>
+class CBufMessageRange;
+
 class CBufReader : public CBufReaderBase {
-  std::unordered_map<std::string, std::vector<std::shared_ptr<CBufHandlerBase>>> msg_map;
+  CBufHandlerTable handlers_;
   std::function<void(cbuf_istream*)> cis_callback_;
   bool use_cis_callback_ = false;
+  // Open count of the streams filtered by the handler types, see applyHandlerTypes
+  unsigned handler_types_applied_ = 0;
+  bool handlers_changed_ = true;
+  // Whether every handler can decode messages ahead, see Options::read_ahead
+  bool handlers_decode_ahead_ = true;
+
+  // A stream read ahead. Its worker thread owns the stream while reading ahead: it walks it,
+  // faulting its pages in, and decodes the messages for their handlers in place. The thread
+  // processing messages only merges the streams and calls the handlers
+  struct ReadAhead {
+    struct Item {
+      double packet_time = 0;
+      // Handlers to call, and the message decoded for each, shared by handlers of the same
+      // version and null if it could not be decoded
+      std::vector<CBufHandlerBase*> handlers;
+      std::vector<CBufDecodedPool::Entry*> decoded;
+      // Where the stream is after the message
+      cbuf_istream::position next;
+      size_t next_offset = 0;
+      // Corruptions skipped before the message
+      int corruptions = 0;
+      // Corruption without try_recovery, reading halts here
+      bool halt = false;
+    };
+
+    StreamInfo* si = nullptr;
+    std::string filename;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Items decoded by the worker, up to Options::read_ahead of them. The front one is the next
+    // to process, and only the thread processing messages pops them
+    std::deque<Item> items;
+    bool stop = false;
+    // No more items, with the corruptions after the last one
+    bool ended = false;
+    int end_corruptions = 0;
+    // Items processed, kept for their storage
+    std::vector<Item> spare;
+    // Front item, once there is one, for the thread processing messages to merge without locking
+    Item* head = nullptr;
+    // Storage of the messages decoded per handler, and type ids of the hashes on the stream.
+    // Only used by the worker
+    std::unordered_map<const CBufHandlerBase*, std::unique_ptr<CBufDecodedPool>> pools;
+    std::unordered_map<uint64_t, uint32_t> types;
+    // Where the stream is left if reading ahead stops
+    cbuf_istream::position processed;
+  };
+  std::vector<std::unique_ptr<ReadAhead>> read_ahead_;
+  // Min heap of read_ahead_ positions by the time of their head, like the one of computeNextSi
+  std::vector<size_t> read_ahead_heap_;
+  // Workers resolve the types of the hashes they find on type_ids_
+  std::mutex type_ids_mutex_;
+
+  bool canReadAhead() const {
+    return options_.read_ahead > 0 && options_.max_open_files == 0 && handlers_decode_ahead_ &&
+           !use_cis_callback_ && !has_live_streams_;
+  }
+  bool startReadAhead();
+  void readAheadWorker(ReadAhead* ra);
+  // Read and decode the next message of a stream on its worker. False when the stream has no
+  // more messages, last when none is read after this one
+  bool readAheadItem(ReadAhead* ra, ReadAhead::Item& item, bool& last);
+  // Handlers of a hash on the stream of a worker, null for none
+  const std::vector<std::shared_ptr<CBufHandlerBase>>* readAheadHandlers(ReadAhead* ra, uint64_t hash);
+  // Wait for the worker of a stream to decode its next message, or to end
+  void waitReadAheadHead(ReadAhead* ra);
+  double readAheadTime(size_t i) const {
+    const ReadAhead::Item* head = read_ahead_[i]->head;
+    return head == nullptr ? VERY_LARGE_TIMESTAMP : head->packet_time;
+  }
+  // Order of read_ahead_heap_, earliest head on top and ties going to the first stream
+  bool readAheadLater(size_t a, size_t b) const {
+    double ta = readAheadTime(a);
+    double tb = readAheadTime(b);
+    return ta > tb || (ta == tb && a > b);
+  }
+  bool processReadAhead();
+
+  // Versions of the type of the message being dispatched, and what was decoded for each
+  std::vector<std::pair<uint64_t, CBufDecodedBase*>> shared_decodes_;
+  std::vector<std::pair<uint64_t, std::shared_ptr<CBufDecodedBase>>> executor_decodes_;
+  // Runs the handlers, with Options::handler_threads
+  std::unique_ptr<CBufHandlerExecutor> executor_;
+  // Call the handlers of the next message on a stream, decoding it once per version of its type
+  void dispatchMessage(cbuf_istream* cis, const std::vector<std::shared_ptr<CBufHandlerBase>>& handlers);
+  void stopBackgroundWork() override;
+
+  // Only the types with handlers are read when asked to, unless a stream callback wants every
+  // message. See Options::skip_unhandled_types
+  void updateHandlerTypes() {
+    handler_types_.clear();
+    if (use_cis_callback_ || !options_.skip_unhandled_types) return;
+    for (uint32_t type = 0; type < handlers_.size(); type++) {
+      if (!handlers_[type].empty()) handler_types_.push_back(type_ids_.name(type));
+    }
+  }
+
+  // Files with an index jump over the types not read, unless a type filter was given
+  void applyHandlerTypes() {
+    updateHandlerTypes();
+    applyStreamTypes();
+  }
+  // Filter the streams mapped by handler_types_, the rest are filtered once mapped
+  void applyStreamTypes() {
+    stopBackgroundWork();
+    handlers_changed_ = false;
+    handler_types_applied_ = open_count_;
+    if (!type_filter_.empty()) return;
+    streams_moved_ = true;
+    for (auto si : input_streams) {
+      if (!si->mapped) continue;
+      if (handler_types_.empty()) {
+        si->cis->clear_type_filter();
+      } else {
+        si->cis->set_type_filter(handler_types_);
+      }
+    }
+  }
+
+  // Only read the types pulled by a CBufMessageRange, until messages are processed again
+  template <typename... CBufMsgs>
+  friend class CBufMessageRange;
+  void pullTypes(const std::vector<std::string>& types) {
+    handler_types_ = types;
+    applyStreamTypes();
+    handlers_changed_ = true;
+  }
 
 public:
   CBufReader(const std::string& ulog_path, const Options& options = Options())
       : CBufReaderBase(ulog_path, options) {}
   CBufReader(const Options& options = Options())
       : CBufReaderBase(options) {}
+  ~CBufReader() override {
+    stopBackgroundWork();
+    executor_.reset();
+  }
 
   [[deprecated]] void setRoleFilter(const std::string& filter) {
     error_string_ =
@@ -415,7 +572,15 @@ public:
   }
 
   bool addHandler(const std::string& msg_type, std::shared_ptr<CBufHandlerBase> handler) {
-    msg_map[msg_type].push_back(handler);
+    // Workers reading ahead look the handlers up
+    stopBackgroundWork();
+    uint32_t type = type_ids_.add(msg_type);
+    if (type >= handlers_.size()) handlers_.resize(type + 1);
+    handlers_[type].push_back(handler);
+    needs_early_messages_ |= handler->process_always();
+    handlers_decode_ahead_ &= handler->canDecodeAhead();
+    handlers_changed_ = true;
+    updateHandlerTypes();
     return true;
   }
 
@@ -464,20 +629,48 @@ public:
     return addHandler(CBufMsg::TYPE_STRING, ptr);
   }
 
+  // Handler taking messages by const reference, only valid during the call. Messages of simple
+  // types are not copied, see CBufViewHandler
+  template <typename CBufMsg>
+  bool addViewHandler(CBufViewHandlerFn<CBufMsg> h, bool allow_conversion = true,
+                      bool process_always = false) {
+    std::shared_ptr<CBufHandlerBase> ptr(new CBufViewHandler<CBufMsg>(h, allow_conversion, process_always));
+    return addHandler(CBufMsg::TYPE_STRING, ptr);
+  }
+
+  // Pull the messages of the given types in time order, instead of having handlers called:
+  //   for (const auto& img : reader.messages<messages::image>()) { ... }
+  // With several types, each message pulled tells which one it is, see CBufAnyMessage. See
+  // CBufMessageRange for how long messages are valid and how to stop early
+  template <typename... CBufMsgs>
+  CBufMessageRange<CBufMsgs...> messages(bool allow_conversion = true) {
+    return CBufMessageRange<CBufMsgs...>(this, allow_conversion);
+  }
+
   // CBufIStream Callback can be used to process a message directly using a cbuf_istream instead of
   // CBufReader doing the message decoding
   void addCbufIStreamCallback(std::function<void(cbuf_istream*)> h) {
+    stopBackgroundWork();
     cis_callback_ = h;
     use_cis_callback_ = true;
+    handlers_changed_ = true;
+    updateHandlerTypes();
   }
 
+  // Process the next message in time order, calling its handlers. With Options::read_ahead,
+  // messages are decoded ahead on a thread per file while the handlers are called here. With
+  // Options::handler_threads, handlers are called on those threads, see sync
   bool processMessage() {
+    if (handlers_changed_ || handler_types_applied_ != open_count_) applyHandlerTypes();
+    if (start_seek_pending_) seekToStartTime();
+    if (options_.handler_threads > 0 && executor_ == nullptr) {
+      executor_ = std::make_unique<CBufHandlerExecutor>(options_.handler_threads, options_.handler_queue);
+    }
+    if (canReadAhead()) return processReadAhead();
     if (!computeNextSi()) return false;
 
     auto nhash = next_si->cis->get_next_hash();
     cbuf_istream* next_cis = next_si->cis;
-    auto str = next_cis->get_string_for_hash(nhash);
-    // check if the topic name for this message has a namespace
 
     auto msize = next_cis->get_next_size();
     if (msize == 0 || !next_cis->check_next_preamble()) {
@@ -489,16 +682,221 @@ public:
       cis_callback_(next_cis);
     }
 
-    if (msg_map.count(str) > 0) {
-      for (auto& handler : msg_map[str]) {
-        if (handler->process_always() || is_valid_early(next_cis->get_next_timestamp())) {
-          handler->processMessage(*next_cis);
-        }
+    uint32_t type = type_ids_.of(next_cis, nhash);
+    if (type < handlers_.size()) dispatchMessage(next_cis, handlers_[type]);
+
+    if (!next_cis->skip_message()) return false;
+
+    return true;
+  }
+
+  double getNextTimestamp() override;
+
+  // Wait for the handlers running on Options::handler_threads to handle every message processed
+  void sync() {
+    if (executor_) executor_->sync();
+  }
+  // Process the messages up to time t, and wait for their handlers. A barrier for handlers
+  // running apart. Returns false once there is nothing more to process
+  bool processUntil(double t) {
+    bool more = true;
+    for (;;) {
+      double next = getNextTimestamp();
+      if (next < 0) {
+        more = false;
+        break;
       }
+      if (next > t || !processMessage()) break;
     }
+    sync();
+    return more;
+  }
+};
 
-    if (!next_cis->skip_message()) return false;
+// Message pulled from a CBufMessageRange of several types, along with which of them it is
+template <typename... CBufMsgs>
+class CBufAnyMessage {
+  template <typename... Types>
+  friend class CBufMessageRange;
+  const void* msg_ = nullptr;
+  size_t index_ = 0;
+  const std::string* filename_ = nullptr;
+
+public:
+  // Position of a type on CBufMsgs, sizeof...(CBufMsgs) if it is not there
+  template <typename CBufMsg>
+  static constexpr size_t index_of() {
+    constexpr bool same[] = {std::is_same_v<CBufMsg, CBufMsgs>...};
+    for (size_t i = 0; i < sizeof...(CBufMsgs); i++) {
+      if (same[i]) return i;
+    }
+    return sizeof...(CBufMsgs);
+  }
+
+  // Position of the type of the message on CBufMsgs
+  size_t index() const { return index_; }
+  template <typename CBufMsg>
+  bool is() const {
+    return index_ == index_of<CBufMsg>();
+  }
+  // The message if it is a CBufMsg, nullptr otherwise
+  template <typename CBufMsg>
+  const CBufMsg* get() const {
+    static_assert(index_of<CBufMsg>() < sizeof...(CBufMsgs), "Not one of the types pulled");
+    return is<CBufMsg>() ? static_cast<const CBufMsg*>(msg_) : nullptr;
+  }
+  // Call fn with the message as its own type
+  template <typename Fn>
+  void visit(Fn&& fn) const {
+    size_t i = 0;
+    ((i++ == index_ ? (void)fn(*static_cast<const CBufMsgs*>(msg_)) : (void)0), ...);
+  }
+  // File the message comes from
+  const std::string& filename() const { return *filename_; }
+};
+
+// Messages of some types pulled from a CBufReader in time order, see CBufReader::messages.
+// Pulling one message is a step of the merge of the streams, without handlers in between.
+// Simple types written with the same version are read in place, as by CBufViewHandler, the
+// rest are decoded or converted into the same storage every time. Either way, messages are
+// only valid until the next one is pulled, and pulling allocates nothing once warmed up.
+// Leaving the loop early leaves the reader after the last message pulled, for another range
+// or processMessage to go on from there. On live streams, the range ends when nothing arrives
+// within Options::socket_timeout_ms, pulling again later goes on with what arrived
+template <typename... CBufMsgs>
+class CBufMessageRange {
+  static_assert(sizeof...(CBufMsgs) > 0, "Pull at least one type");
+  using Types = std::tuple<CBufMsgs...>;
+  static constexpr bool SINGLE = sizeof...(CBufMsgs) == 1;
+
+public:
+  // A single type is pulled as itself, several as a CBufAnyMessage
+  using value_type = std::conditional_t<SINGLE, std::tuple_element_t<0, Types>, CBufAnyMessage<CBufMsgs...>>;
+
+  class iterator {
+    CBufMessageRange* range_ = nullptr;
+
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = CBufMessageRange::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    iterator() {}
+    explicit iterator(CBufMessageRange* range)
+        : range_(range) {}
+    reference operator*() const { return range_->current(); }
+    pointer operator->() const { return &range_->current(); }
+    iterator& operator++() {
+      range_->next();
+      return *this;
+    }
+    void operator++(int) { range_->next(); }
+    bool operator==(std::default_sentinel_t) const { return range_->done_; }
+  };
+
+  CBufMessageRange(CBufReader* reader, bool allow_conversion)
+      : reader_(reader)
+      , decoders_(std::make_unique<CBufMsgDecoder<CBufMsgs>>(allow_conversion)...)
+      , types_{std::string(CBufMsgs::TYPE_STRING)...} {}
+  CBufMessageRange(const CBufMessageRange&) = delete;
+  CBufMessageRange& operator=(const CBufMessageRange&) = delete;
+  // The last message pulled is consumed, also when leaving early
+  ~CBufMessageRange() { consume_current(); }
+
+  iterator begin() {
+    if (!started_) {
+      started_ = true;
+      start();
+      next();
+    }
+    return iterator(this);
+  }
+  std::default_sentinel_t end() const { return {}; }
+
+private:
+  CBufReader* reader_;
+  std::tuple<std::unique_ptr<CBufMsgDecoder<CBufMsgs>>...> decoders_;
+  std::vector<std::string> types_;
+  // Position on CBufMsgs of every type id, -1 for the types not pulled
+  std::vector<int> slots_;
+  CBufAnyMessage<CBufMsgs...> current_;
+  // Stream of the message pulled, which moves past it when the next one is pulled. Only while
+  // the reader has the streams of current_open_count_, closing or opening it deletes them
+  cbuf_istream* current_cis_ = nullptr;
+  unsigned current_open_count_ = 0;
+  bool started_ = false;
+  bool done_ = false;
+
+  const value_type& current() const {
+    if constexpr (SINGLE) {
+      return *static_cast<const value_type*>(current_.msg_);
+    } else {
+      return current_;
+    }
+  }
+
+  void start() {
+    reader_->pullTypes(types_);
+    for (size_t i = 0; i < types_.size(); i++) {
+      uint32_t type = reader_->type_ids_.add(types_[i]);
+      if (type >= slots_.size()) slots_.resize(type + 1, -1);
+      slots_[type] = int(i);
+    }
+    if (reader_->start_seek_pending_) reader_->seekToStartTime();
+  }
+
+  void consume_current() {
+    if (current_cis_ != nullptr && current_open_count_ == reader_->open_count_) current_cis_->skip_message();
+    current_cis_ = nullptr;
+  }
+
+  void next() {
+    consume_current();
+    while (!done_) {
+      // New streams opened meanwhile, as on a folder followed
+      if (reader_->handler_types_applied_ != reader_->open_count_) reader_->pullTypes(types_);
+      if (!reader_->computeNextSi()) {
+        done_ = true;
+        break;
+      }
+      cbuf_istream* cis = reader_->next_si->cis;
+      uint32_t type = reader_->type_ids_.of(cis, cis->get_next_hash());
+      int slot = type < slots_.size() ? slots_[type] : -1;
+      if (slot >= 0 && reader_->is_valid_early(cis->get_next_timestamp()) &&
+          decode(slot, cis, std::index_sequence_for<CBufMsgs...>())) {
+        current_cis_ = cis;
+        current_open_count_ = reader_->open_count_;
+        current_.index_ = size_t(slot);
+        current_.filename_ = &reader_->next_si->filename;
+        return;
+      }
+      if (!cis->skip_message()) done_ = true;
+    }
+  }
+
+  template <size_t... I>
+  bool decode(int slot, cbuf_istream* cis, std::index_sequence<I...>) {
+    bool decoded = false;
+    ((slot == int(I) ? (decoded = decode_as<I>(cis), true) : false) || ...);
+    return decoded;
+  }
 
+  template <size_t I>
+  bool decode_as(cbuf_istream* cis) {
+    using CBufMsg = std::tuple_element_t<I, Types>;
+    if constexpr (CBufMsg::is_simple() && !CBufMsg::supports_compact()) {
+      if (cis->get_next_hash() == CBufMsg::TYPE_HASH && cbuf_aligned_view<CBufMsg>(cis->get_current_ptr())) {
+        CBufMsg* view = nullptr;
+        if (!CBufMsg::decode((char*)cis->get_current_ptr(), cis->get_next_size(), &view)) return false;
+        current_.msg_ = view;
+        return true;
+      }
+    }
+    auto decoded = std::get<I>(decoders_)->decode_reused(*cis);
+    if (decoded == nullptr) return false;
+    current_.msg_ = &decoded->msg;
     return true;
   }
 };
@@ -526,10 +924,7 @@ class CBufInfoGetter : public CBufInfoGetterBase {
   CBufOffsetGetter<TApp, CBufMsg> offsetGetter_ = nullptr;
   CBufTimestampGetter<TApp, CBufMsg> timestampGetter_ = nullptr;
   CBufMsg* msg = nullptr;
-  CBufParser* parser = nullptr;
-  CBufParser* parserCurrent = nullptr;
-  bool allow_conversion = true;
-  bool warned_conversion = false;
+  CBufMsgDecoder<CBufMsg> decoder_;
   bool process_always_;
 
 public:
@@ -540,7 +935,7 @@ public:
       , caller(owner)
       , offsetGetter_(offsetGetter)
       , timestampGetter_(timestampGetter)
-      , allow_conversion(allow_conv)
+      , decoder_(allow_conv)
       , process_always_(process_always) {}
 
   ~CBufInfoGetter() override {
@@ -551,7 +946,7 @@ public:
   }
 
   bool isMessageOfType(cbuf_istream& cis, std::string_view type) {
-    return cis.get_string_for_hash(cis.get_next_hash()) == type;
+    return cis.get_string_view_for_hash(cis.get_next_hash()) == type;
   }
 
   bool processMessage(cbuf_istream& cis) override {
@@ -559,59 +954,7 @@ public:
     if (msg == nullptr) {
       msg = new CBufMsg();
     }
-    auto hash = cis.get_next_hash();
-
-    if (hash == CBufMsg::TYPE_HASH) {
-      bool ret = cis.deserialize(msg);
-      if (!ret) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // Could not deserialize message of type `CBufMsg::TYPE_STRING`
-        return false;
-      }
-      return true;
-    }
-    auto msg_type = cis.get_string_for_hash(hash);
-    if (msg_type == CBufMsg::TYPE_STRING) {
-      if (allow_conversion) {
-        // the hash did not match but has the same name, try to do conversion
-        if (parser == nullptr) {
-          parser = new CBufParser();
-          if (!parser->ParseMetadata(cis.get_meta_string_for_hash(hash), CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
-
-        if (parserCurrent == nullptr) {
-          parserCurrent = new CBufParser();
-          if (!parserCurrent->ParseMetadata(CBufMsg::cbuf_string, CBufMsg::TYPE_STRING)) {
-            // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-            // Metadata could not be parsed for current message `CBufMsg::TYPE_STRING`
-            return false;
-          }
-        }
-
-        // Initialize the fields on the cbuf in order to ensure when backwards compat
-        // does not fill in fields (that are not there) still have sane values
-        msg->Init();
-        auto fillret = parser->FastConversion(CBufMsg::TYPE_STRING, cis.get_current_ptr(),
-                                              cis.get_next_size(), *parserCurrent, CBufMsg::TYPE_STRING,
-                                              (unsigned char*)msg, sizeof(CBufMsg));
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        if (fillret == 0) return false;
-        msg->preamble.packet_timest = cis.get_next_timestamp();
-
-        return true;
-      }
-      if (!warned_conversion) {
-        // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-        // cbuf version mismatch for message `CBufMsg::TYPE_STRING` and conversion is not allowed
-        warned_conversion = true;
-      }
-    }
-    // TODO(https://github.com/Verdant-Robotics/cbuf/issues/9): Better error handling
-    return false;
+    return decoder_.decode(cis, msg);
   }
 
   std::optional<uint32_t> getCurrentOffset() override {
@@ -637,12 +980,13 @@ class CBufReaderWindow : public CBufReaderBase {
   std::map<double, uint32_t> timestampMap_;
   std::map<uint32_t, std::vector<size_t>> stateMap_;
   std::string box_name_;
-  std::unordered_map<std::string, std::vector<std::shared_ptr<CBufHandlerBase>>> msg_map;
-  std::unordered_map<std::string, std::shared_ptr<CBufInfoGetterBase>> info_getters_map;
+  // Handlers and info getters of every message type, indexed by its id on CBufTypeIds
+  CBufHandlerTable handlers_;
+  std::vector<std::shared_ptr<CBufInfoGetterBase>> info_getters_;
   std::vector<size_t> lowest_loaded_state_;
   std::vector<size_t> highest_loaded_state_;
   bool is_external_ = false;
-  std::string last_msg_type_;
+  uint32_t last_msg_type_ = CBufTypeIds::NONE;
 
 public:
   CBufReaderWindow(const std::string& ulog_path, const Options& options = Options())
@@ -651,7 +995,12 @@ public:
       : CBufReaderBase(options) {}
 
   bool addHandler(const std::string& msg_type, std::shared_ptr<CBufHandlerBase> handler) {
-    msg_map[msg_type].push_back(handler);
+    // Workers reading ahead look the handlers up
+    stopBackgroundWork();
+    uint32_t type = type_ids_.add(msg_type);
+    if (type >= handlers_.size()) handlers_.resize(type + 1);
+    handlers_[type].push_back(handler);
+    needs_early_messages_ |= handler->process_always();
     return true;
   }
 
@@ -664,7 +1013,9 @@ public:
   }
 
   bool addInfoGetter(const std::string& msg_type, std::shared_ptr<CBufInfoGetterBase> getter) {
-    info_getters_map[msg_type] = getter;
+    uint32_t type = type_ids_.add(msg_type);
+    if (type >= info_getters_.size()) info_getters_.resize(type + 1);
+    info_getters_[type] = getter;
     return true;
   }
 
@@ -693,12 +1044,16 @@ private:
   bool processSilently();
   bool processGetters();
 
-  void removeHandlers() { msg_map.clear(); }
+  void removeHandlers() { handlers_.clear(); }
 
   bool jumpToOffset(const uint32_t);
 
   bool isCorrectBox() const { return next_si->cis->filename().find(box_name_) != std::string::npos; }
   std::string getMessageType() { return next_si->cis->get_string_for_hash(next_si->cis->get_next_hash()); }
+  // Info getter of the last message type read, nullptr if it has none
+  CBufInfoGetterBase* lastInfoGetter() const {
+    return last_msg_type_ < info_getters_.size() ? info_getters_[last_msg_type_].get() : nullptr;
+  }
 
   std::optional<uint32_t> getCurrentOffset();
   std::optional<double> getCurrentTimestamp();
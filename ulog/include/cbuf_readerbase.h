@@ -1,14 +1,71 @@
 #pragma once
 
+#include <map>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
+#include "cbuf_catalog.h"
+#include "cbuf_follow.h"
 #include "cbuf_stream.h"
 
+// Dense ids for the names of message types, to dispatch messages through tables indexed by
+// them. The hash on a preamble is resolved to an id the first time it is seen with its
+// metadata, from then on it is a lookup by integer without copying or hashing names
+class CBufTypeIds {
+  std::map<std::string, uint32_t, std::less<>> ids_;
+  std::vector<std::string> names_;
+  std::unordered_map<uint64_t, uint32_t> hash_ids_;
+
+public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  // Id of a type, given one if it has none yet
+  uint32_t add(std::string_view name);
+  // Id of the type of a message hash on a stream, NONE while the stream has no metadata for it
+  uint32_t of(const cbuf_istream* cis, uint64_t hash) {
+    auto it = hash_ids_.find(hash);
+    if (it != hash_ids_.end()) return it->second;
+    return resolve(cis, hash);
+  }
+  const std::string& name(uint32_t id) const { return names_[id]; }
+  size_t size() const { return names_.size(); }
+
+private:
+  uint32_t resolve(const cbuf_istream* cis, uint64_t hash);
+};
+
 class CBufReaderBase {
 public:
   struct Options {
     Options() {}
     bool try_recovery = false;  // whether to try to continue past corruptions.
+    bool expand_repeats = false;  // whether to bring back messages suppressed as repeats.
+    cbuf_istream::map_options map_options;  // how to map the files, see cbuf_istream::MapMode.
+    cbuf_istream::resync_options resync_options;  // how to tell real preambles when recovering.
+    int socket_timeout_ms = 1000;  // how long to wait for messages on live streams when empty.
+    // Messages CBufReader reads and decodes ahead per file, on a thread per file that walks it,
+    // 0 to decode them when processed. Handlers are still called in time order on the thread
+    // processing messages, which only merges the files
+    unsigned read_ahead = 0;
+    // Threads running the handlers of CBufReader, 0 to run them on the thread processing
+    // messages. Every handler runs on one of them, and gets its messages in time order
+    unsigned handler_threads = 0;
+    // Messages waiting per handler thread before processing more blocks
+    unsigned handler_queue = 256;
+    // Files mapped at once, 0 for no limit. Files are mapped when first read and unmapped
+    // once read to the end. Past the limit, the file read least recently is unmapped to map
+    // another, and mapped again where it was when read again. Reading ahead needs no limit
+    unsigned max_open_files = 0;
+    // Keep reading the ulog as it is written: openUlog follows the files not closed yet, see
+    // cbuf_follower, and the ones created later. Files the catalog shows as closed
+    // are read as usual. Reading waits up to socket_timeout_ms for more, as on live streams
+    bool follow = false;
+    // CBufReader only reads the types it has handlers for: files with an index jump over the
+    // records of other types, which getNextTimestamp does not see either. Messages are still
+    // counted by getMessageCounts. Ignored with a stream callback
+    bool skip_unhandled_types = false;
   };
 
   int num_corruptions = 0;  // counter of corruptions found.
@@ -20,25 +77,100 @@ protected:
   // Store what substring to discrimnate on input files when reading
   std::vector<std::string> source_filters_;
   Options options_;
+  // Message types to read, all of them when empty
+  std::vector<std::string> type_filter_;
+  // Message types the subclass reads, all of them when empty. Used when there is no type filter
+  std::vector<std::string> handler_types_;
+  // Whether messages before the start time are processed anyway, as by process_always handlers
+  bool needs_early_messages_ = false;
+  // Ids of the message types read, for subclasses to dispatch by them
+  CBufTypeIds type_ids_;
 
   struct StreamInfo {
     cbuf_istream* cis = nullptr;
     double packet_time;
     std::string filename;
+    // Offset after the messages processed, while the stream is read ahead of them
+    size_t processed_offset = 0;
+    // Files are mapped only while read, see Options::max_open_files. Path is empty for
+    // streams always mapped. While unmapped, packet_time is no later than the next message,
+    // and reading continues from position, or from the first message at seek_time if set
+    // (only when the file has an index if seek_needs_index)
+    std::string path;
+    bool mapped = true;
+    bool exhausted = false;
+    cbuf_istream::position position;
+    double seek_time = -1;
+    bool seek_needs_index = false;
+    // Time of the first message, from the catalog or the start of the file
+    double start_time = 0;
+    size_t file_size = 0;
+    uint64_t last_use = 0;
   };
 
   std::vector<StreamInfo*> input_streams;
   StreamInfo* next_si = nullptr;
+  // Min heap of input_streams positions by packet_time, to merge them in time order. Only
+  // next_si moves between calls to computeNextSi, anything else moving streams has to set
+  // streams_moved_ so the heap is built again
+  std::vector<size_t> stream_heap_;
+  bool streams_moved_ = true;
+  // Whether any stream is live, never finished while waiting for more
+  bool has_live_streams_ = false;
+  // Files of the ulog folder followed, and the folder itself for the files created on it
+  cbuf_follower follower_;
+  // Files mapped, and a counter of reads to find the least recently read one
+  unsigned mapped_files_ = 0;
+  uint64_t use_count_ = 0;
+  // Whether a subclass reads the streams ahead of the messages processed, see stopBackgroundWork
+  bool reading_ahead_ = false;
   bool finish_reading = false;
   bool is_opened = false;
+  // Incremented on every openUlog and close, to notice the streams changed
+  unsigned open_count_ = 0;
   double startTime = -1;
   double endTime = -1;
+  // Streams are moved to the start time before reading them, see seekToStartTime
+  bool start_seek_pending_ = false;
 
   // returns true if time t is within our range
   bool is_valid_early(double t) const noexcept;
   // returns true if time t is within our range
   bool is_valid_late(double t) const noexcept;
   bool computeNextSi();
+  // Update the streams and pick the one with the earliest message as next_si
+  bool mergeStreams();
+  // Skip corruptions on a stream and update its packet_time, false to halt on a corruption.
+  // Corruptions found are added to the counter
+  bool updateStream(StreamInfo* si, int& corruptions);
+  // Subclasses working on other threads finish: reading ahead stops and leaves the streams
+  // after the messages processed, handlers running apart are waited for. Called before
+  // anything else moves or changes the streams
+  virtual void stopBackgroundWork() {}
+  bool addLiveStream(cbuf_istream* cis);
+  // Follow a file of the ulog folder, unless it is a stream already
+  bool followFile(const std::string& path);
+  // Wait up to timeout_ms for changes on the folder followed and apply them: new files are
+  // followed, the ones grown are read further, the ones closed read to the end. False if
+  // nothing changed
+  bool waitFollowed(int timeout_ms);
+  // Whether a file name passes the source filters
+  bool matchesSourceFilters(const std::string& filename) const;
+  // Map the file of a stream to read it, unmapping the one read least recently when at
+  // Options::max_open_files. False if the file cannot be opened again
+  bool mapStream(StreamInfo* si);
+  // Unmap the file of a stream, remembering where it was
+  void unmapStream(StreamInfo* si);
+  // Offset of a stream, whether mapped or not
+  size_t streamOffset(const StreamInfo* si) const;
+  // Move a stream to an offset, 0 to rewind it, without mapping it. False past its end
+  bool jumpStream(StreamInfo* si, size_t offset);
+  // Move the streams not read yet to their first message at the start time, once after
+  // opening them or setting it, instead of skipping the earlier messages one by one. Not
+  // when messages before the start time are processed anyway
+  void seekToStartTime();
+  // Whether a file described on the catalog can hold messages to read, by time and type filter
+  bool wantsFile(const CBufCatalog::FileInfo& info) const;
 
 public:
   CBufReaderBase(const std::string& ulog_path, const Options& options = Options())
@@ -46,6 +178,7 @@ public:
       , options_(options) {}
   CBufReaderBase(const Options& options = Options())
       : options_(options) {}
+  virtual ~CBufReaderBase() {}
 
   void setOptions(const Options& options) { options_ = options; }
   void setULogPath(const std::string& ulog_path) { ulog_path_ = ulog_path; }
@@ -53,24 +186,47 @@ public:
   const std::string& getULogPath() const { return ulog_path_; }
   const std::vector<std::string>& getSourceFilters() const { return source_filters_; }
 
-  // Main function to open the ulog and build the data structures to being processing
+  // Main function to open the ulog and build the data structures to being processing.
+  // Files the folder catalog shows out of the time range or types to read are not opened
   bool openUlog(bool error_ok = false);
+  // Read a live stream sent by a cbuf_ostream, listening on a TCP port or a Unix socket path,
+  // along with any files opened. Reading waits up to socket_timeout_ms for messages when the
+  // stream is empty, then returns with nothing to process and can be resumed later
+  bool openSocket(const char* ip, int port);
+  bool openUnixSocket(const char* path);
+  // Same for the messages multicast to a group, see cbuf_mcast.h
+  bool openMulticast(const char* group, int port, const char* interface = "0.0.0.0");
   void close();
   bool isOpened() const { return is_opened; }
   // Errors are accumulated on error_string, get this string to provide the user with info
   const std::string& getErrorMessage() const { return error_string_; }
 
-  void setStartTime(double t) { startTime = t; }
+  // Files with an index are moved to the start time before reading them, unless handlers need
+  // earlier messages. Files without one are read from the start and filtered, call seekToTime
+  // to move them with a binary search on their timestamps instead
+  void setStartTime(double t) {
+    startTime = t;
+    start_seek_pending_ = true;
+  }
   void setEndTime(double t) { endTime = t; }
 
-  double getNextTimestamp() {
+  // Only read messages of these types. Files with an index (footer or sidecar) jump over
+  // the records of other types, the rest are still scanned. Empty to read every type
+  void setTypeFilter(const std::vector<std::string>& types);
+  const std::vector<std::string>& getTypeFilter() const { return type_filter_; }
+
+  // Position every file on its first message at time t or later, using their index when present
+  // and a binary search on the timestamps otherwise. See cbuf_istream::seek_to_time
+  bool seekToTime(double t);
+
+  virtual double getNextTimestamp() {
     if (!computeNextSi()) return -1;
 
     return next_si->cis->get_next_timestamp();
   }
 
   // This function will reset the reading to the start of the log, count all messages and
-  // leave the log in the beginning state
+  // leave the log in the beginning state. Files with an index are not scanned
   std::unordered_map<std::string, unsigned int> getMessageCounts(std::string& error_string);
 
   // Get the total size on disk of all the files in the log
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include "cbuf_preamble.h"
+
+struct cbuf_shm_header;
+
+void add_metadata_cbuf_shm(const char* msg_meta, uint64_t hash, const char* msg_name, void* ctx);
+
+// Shared memory transport for cbuf messages between processes, one publisher and several
+// subscribers on the same machine. The publisher creates a ring on a memfd and encodes
+// messages straight into it, framed by their cbuf_preamble as on a file. Metadata records
+// live on their own area so subscribers joining late can decode every type.
+//
+// Subscribers open the memfd, passed on by fd or by path (see cbuf_shm_publisher::path), and
+// read messages in place: simple structs are handed out as const views into the ring, with
+// no copy at all, and the rest are decoded into the caller's struct. Waiting on both sides
+// sleeps on futexes on the shared memory.
+//
+//   cbuf_shm_publisher pub;                  cbuf_shm_subscriber sub;
+//   pub.create("camera");                    sub.open(path);
+//   pub.publish(&img);                       cbuf_shm_subscriber::message msg;
+//                                            while (sub.next(msg, 100)) {
+//                                              messages::image storage;
+//                                              auto* img = sub.decode(msg, &storage);
+//                                            }
+class cbuf_shm_publisher {
+public:
+  // What to do when a message does not fit because a subscriber is behind
+  enum class SlowPolicy {
+    // Wait for the subscribers to read, dropping the message after timeout_ms
+    BLOCK,
+    // Drop the message right away
+    DROP,
+    // Wait up to timeout_ms, then evict the subscribers behind. They notice on their next
+    // read and continue from the newest message, see cbuf_shm_subscriber::evictions
+    EVICT,
+  };
+
+  struct options {
+    options() {}
+    // Bytes of messages the ring holds
+    size_t capacity = 64 * 1024 * 1024;
+    // Bytes for the metadata records of every type published
+    size_t metadata_capacity = 1024 * 1024;
+    SlowPolicy slow_policy = SlowPolicy::BLOCK;
+    int timeout_ms = 1000;
+  };
+
+  cbuf_shm_publisher() {}
+  ~cbuf_shm_publisher() { close(); }
+
+  bool create(const char* name, const options& opts = options());
+  void close();
+  bool is_open() const { return hdr_ != nullptr; }
+
+  // The memfd holding the ring, to hand to subscribers, and a path other processes can open it by
+  int fd() const { return fd_; }
+  std::string path() const;
+
+  template <class cbuf_struct>
+  bool publish(cbuf_struct* member) {
+    if (!dictionary.count(member->hash())) {
+      member->handle_metadata(add_metadata_cbuf_shm, this);
+    }
+    member->preamble.packet_timest = now();
+    size_t size = member->supports_compact() ? member->encode_net_size() : member->encode_size();
+    member->preamble.setSize(uint32_t(size));
+    char* dst = (char*)reserve(size);
+    if (dst == nullptr) return false;
+    bool ret = member->supports_compact() ? member->encode_net(dst, size) : member->encode(dst, size);
+    if (!ret) mark_skipped(dst, size);
+    commit();
+    return ret;
+  }
+
+  // Publish a packet already encoded, preamble included
+  bool publish_packet(const void* data, size_t size);
+  // Add the metadata of a type, done by publish on the first message of each type
+  bool add_metadata(const char* msg_meta, uint64_t hash, const char* msg_name);
+
+  unsigned subscriber_count() const;
+  // Messages not published because of slow subscribers, and subscribers evicted
+  uint64_t dropped() const { return dropped_; }
+  uint64_t evicted() const { return evicted_; }
+
+private:
+  cbuf_shm_header* hdr_ = nullptr;
+  unsigned char* data_ = nullptr;
+  size_t map_size_ = 0;
+  int fd_ = -1;
+  options opts_;
+  std::map<uint64_t, std::string> dictionary;
+  uint64_t dropped_ = 0;
+  uint64_t evicted_ = 0;
+  // Bytes taken by the record reserved, padding included
+  size_t reserved_ = 0;
+
+  double now() const;
+  // Space on the ring for a record of size bytes, nullptr if it cannot be made
+  unsigned char* reserve(size_t size);
+  // Hand the record reserved to the subscribers
+  void commit();
+  // A record reserved but not filled, skipped by subscribers
+  static void mark_skipped(void* dst, size_t size);
+  // Bytes from write_pos on that a record of size bytes takes, padding to the ring start included
+  size_t record_footprint(uint64_t write_pos, size_t size) const;
+
+  friend void add_metadata_cbuf_shm(const char* msg_meta, uint64_t hash, const char* msg_name, void* ctx);
+};
+
+class cbuf_shm_subscriber {
+public:
+  struct message {
+    // The message in place on the ring, preamble included. Valid until the next call to next
+    const cbuf_preamble* preamble = nullptr;
+    size_t size = 0;
+
+    uint64_t hash() const { return preamble->hash; }
+    double timestamp() const { return preamble->packet_timest; }
+    uint8_t variant() const { return preamble->variant(); }
+  };
+
+  cbuf_shm_subscriber() {}
+  ~cbuf_shm_subscriber() { close(); }
+
+  // Subscribe to the ring on a publisher memfd, or on a path to it. Only messages published
+  // afterwards are read
+  bool open(int fd);
+  bool open(const char* path);
+  void close();
+  bool is_open() const { return hdr_ != nullptr; }
+
+  // Get the next message, waiting up to timeout_ms for it. Releases the previous one, whose
+  // views are not valid anymore. False on timeout or when the publisher closed the ring
+  bool next(message& msg, int timeout_ms = 0);
+
+  // Simple structs are viewed in place on the ring, returning a pointer into it; the rest are
+  // decoded into storage, which is returned. Null if the message is not of the type
+  template <class cbuf_struct>
+  const cbuf_struct* decode(const message& msg, cbuf_struct* storage) const {
+    unsigned int size = (unsigned int)std::min<size_t>(msg.size, UINT_MAX);
+    if constexpr (cbuf_struct::is_simple()) {
+      cbuf_struct* view = nullptr;
+      if (!cbuf_struct::decode((char*)msg.preamble, size, &view)) return nullptr;
+      return view;
+    } else {
+      bool ret = storage->supports_compact() ? storage->decode_net((char*)msg.preamble, size)
+                                             : storage->decode((char*)msg.preamble, size);
+      return ret ? storage : nullptr;
+    }
+  }
+
+  std::string get_string_for_hash(uint64_t hash) const {
+    const auto it = dictionary.find(hash);
+    return it != dictionary.end() ? it->second : std::string();
+  }
+
+  std::string get_meta_string_for_hash(uint64_t hash) const {
+    const auto it = metadictionary.find(hash);
+    return it != metadictionary.end() ? it->second : std::string();
+  }
+
+  // Times the publisher evicted this subscriber for being too slow. Messages published
+  // while evicted are lost
+  uint64_t evictions() const { return evictions_; }
+  bool publisher_closed() const;
+
+private:
+  cbuf_shm_header* hdr_ = nullptr;
+  unsigned char* data_ = nullptr;
+  size_t map_size_ = 0;
+  int slot_ = -1;
+  uint64_t read_pos_ = 0;
+  // Bytes of the message handed out, released on the next call
+  size_t pending_ = 0;
+  size_t metadata_loaded_ = 0;
+  uint64_t evictions_ = 0;
+  std::map<uint64_t, std::string> dictionary;
+  std::map<uint64_t, std::string> metadictionary;
+
+  void load_metadata();
+  // Move past bytes read, letting the publisher reuse them
+  void advance(size_t size);
+  // Continue from the newest message after being evicted
+  void rejoin();
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "cbuf_stream.h"
+
+// Receiving end of the stream a cbuf_ostream sends over a socket, see
+// cbuf_ostream::open_socket. Listens on a TCP port or a Unix socket path and takes one
+// sender at a time, every connection starting a new stream with its own metadata.
+//
+// Messages are decoded with a cbuf_decoder. To dispatch them to handlers, open the socket
+// with CBufReaderBase::openSocket instead.
+class cbuf_socket_receiver {
+public:
+  // Senders can suppress repeats and send deltas, see cbuf_ostream::type_options
+  cbuf_socket_receiver() { decoder_.set_keep_references(true); }
+  ~cbuf_socket_receiver() { close(); }
+
+  // Listen on a TCP port, 0 picks a free one (see local_port)
+  bool open(const char* ip, int port);
+  // Listen on a Unix socket path, replacing a stale socket left there
+  bool open_unix(const char* path);
+  void close();
+  bool is_open() const { return listen_fd_ != -1; }
+  bool is_connected() const { return conn_fd_ != -1; }
+  int local_port() const { return local_port_; }
+
+  // Get the next complete message, waiting up to timeout_ms for it. Valid until the next call
+  bool next(cbuf_decoder::message& msg, int timeout_ms = 0);
+
+  template <class cbuf_struct>
+  bool decode(const cbuf_decoder::message& msg, cbuf_struct* member) const {
+    return decoder_.decode(msg, member);
+  }
+
+  void set_expand_repeats(bool expand) { decoder_.set_expand_repeats(expand); }
+  // Hand out metadata records as well, see cbuf_decoder::set_include_metadata
+  void set_include_metadata(bool include) { decoder_.set_include_metadata(include); }
+
+private:
+  int listen_fd_ = -1;
+  int conn_fd_ = -1;
+  int local_port_ = 0;
+  std::string unix_path_;
+  cbuf_decoder decoder_;
+  std::vector<unsigned char> recv_buf_;
+
+  bool start_listening(int fd);
+};
+
+// Connect to a cbuf_socket_receiver, on a TCP host and port or on a Unix socket path with
+// port 0. The socket descriptor, -1 on failure
+int cbuf_socket_connect(const std::string& address, int port);
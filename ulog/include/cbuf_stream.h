@@ -1,16 +1,24 @@
 #pragma once
 #include <assert.h>
+#include <limits.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "cbuf_index.h"
 #include "cbuf_preamble.h"
 
 class ULogger;
 class cbuf_istream;
+class cbuf_mcast_subscriber;
+class cbuf_socket_receiver;
 
 void serialize_metadata_cbuf_ostream(const char* msg_meta, uint64_t hash, const char* msg_name, void* ctx);
 void serialize_metadata_cbuf_cstream(const char* msg_meta, uint64_t hash, const char* msg_name, void* ctx);
@@ -26,6 +34,59 @@ using pre_file_write_callback_t = std::function<void(FileWriteType)>;
 
 // Note: these classes will compact whenever possible, to work with ulogger
 class cbuf_ostream {
+public:
+  // Options to control how the messages of a given type are written
+  struct type_options {
+    // Pack up to this many messages of the type (and variant) on a single batch record,
+    // 0 or 1 disables batching. Meant for small messages logged at a high rate
+    unsigned batch_messages = 0;
+    // Maximum time, in seconds, a message can wait on a batch before it is written. Records
+    // written meanwhile go first, so the file steps back in time by up to this much. Clamped
+    // to the default cbuf_istream::resync_options::max_backstep, which resyncing relies on
+    double batch_window = 0.01;
+    // Skip messages identical to the previous one of the type (and variant), ignoring the
+    // timestamp, and write a repeat record instead. Takes precedence over batching
+    bool suppress_repeats = false;
+    // Maximum time, in seconds, between repeat records while the content does not change
+    double keepalive_period = 1.0;
+    // Write messages as a delta against the last keyframe, a full message written every
+    // this many messages. Meant for simple structs, where few bytes change between messages.
+    // 0 disables it. Takes precedence over batching
+    unsigned delta_keyframe_interval = 0;
+  };
+
+private:
+  // Messages waiting to be written as a batch record
+  struct pending_batch {
+    double first_ts = 0;
+    double window = 0;
+    // Size of all the messages, 0 if they differ and sizes is used
+    uint32_t msg_size = 0;
+    std::vector<uint32_t> sizes;
+    std::vector<float> ts_deltas;
+    std::vector<uint8_t> data;
+  };
+
+  // Last message written of a type and variant with repeat suppression
+  struct repeat_state {
+    uint64_t payload_hash = 0;
+    size_t msg_size = 0;
+    size_t msg_offset = 0;
+    double written_ts = 0;
+    double keepalive = 0;
+    // Repeats not written yet
+    uint32_t count = 0;
+    double first_ts = 0;
+    double last_ts = 0;
+  };
+
+  // Last keyframe written of a type and variant with delta encoding
+  struct delta_state {
+    std::vector<uint8_t> keyframe;
+    size_t key_offset = 0;
+    unsigned since_keyframe = 0;
+  };
+
   // This is a dictionary which maps the message type hash to message type string
   std::map<uint64_t, std::string> dictionary;
   // This is a dictionary which maps the topic type hash to its list of sorted topics with same type
@@ -38,9 +99,70 @@ class cbuf_ostream {
 
   std::string fname_;
   int stream = -1;
+  // Offset on the stream of the next byte to write
+  size_t offset_ = 0;
+
+  // Batches are flushed before growing past this size
+  static constexpr size_t MAX_BATCH_BYTES = 1024 * 1024;
+  std::unordered_map<uint64_t, type_options> type_options_;
+  std::map<std::pair<uint64_t, uint8_t>, pending_batch> pending_batches_;
+  // No batch is due before this time, packets earlier than it do not walk pending_batches_
+  double next_batch_deadline_ = 1e15;
+  std::map<std::pair<uint64_t, uint8_t>, repeat_state> repeat_states_;
+  std::map<std::pair<uint64_t, uint8_t>, delta_state> delta_states_;
+  std::vector<uint8_t> delta_scratch_;
+
+  // Index of the records written, for the footer
+  bool write_index_ = false;
+  bool indexing_ = false;
+  CBufIndex index_;
+  // Bytes still to be written for the packet started with begin_packet
+  size_t chunk_remaining_ = 0;
+  bool in_chunked_packet_ = false;
+
+  // Socket the stream is sent to, reconnected when the connection drops. Writes are
+  // buffered and sent in batches without blocking for long
+  static constexpr size_t SOCKET_BATCH_BYTES = 256 * 1024;
+  // Bytes kept buffered while the receiver is slow, beyond them the connection is dropped
+  static constexpr size_t MAX_SOCKET_BUFFER = 64 * 1024 * 1024;
+  bool is_socket_ = false;
+  std::string socket_address_;
+  int socket_port_ = 0;
+  double reconnect_period_ = 1.0;
+  double next_reconnect_ = 0;
+  double max_send_delay_ = 0.01;
+  double first_buffered_ts_ = 0;
+  std::vector<uint8_t> send_buffer_;
+  size_t send_pos_ = 0;
 
   double now() const;
 
+  // Write bytes to the stream, retrying on partial writes
+  bool write_bytes(const void* data, size_t size);
+  bool batch_packet(const cbuf_preamble* pre, size_t size, const type_options& opts);
+  bool write_batch(const std::pair<uint64_t, uint8_t>& key, pending_batch& batch);
+  bool suppress_packet(const cbuf_preamble* pre, size_t size, const type_options& opts);
+  bool write_repeat(const std::pair<uint64_t, uint8_t>& key, repeat_state& rep);
+  bool delta_packet(const cbuf_preamble* pre, size_t size, const type_options& opts);
+  // Add the record written since offset to the index
+  void index_record(uint64_t hash, size_t offset, double min_ts, double max_ts, uint32_t messages,
+                    uint32_t repeats = 0);
+  bool write_index();
+  // Write a full record, preceded by a large header if its preamble cannot hold the size
+  bool write_record(const void* data, size_t size);
+  // Write the large header for a packet of the given size, and clear the size on its preamble
+  bool write_large_header(cbuf_preamble& pre, size_t size);
+  // Buffer bytes for the socket, sending them once enough are waiting
+  bool buffer_socket_bytes(const void* data, size_t size);
+  // Send as much of the buffer as the socket takes, waiting up to timeout_ms for it
+  bool send_buffered(int timeout_ms);
+  // Drop the connection, and reconnect later, forgetting what was written on it
+  void drop_connection();
+  bool connect_socket();
+  void check_connection() {
+    if (is_socket_ && stream == -1) connect_socket();
+  }
+
   friend class ULogger;
 
   friend void serialize_metadata_cbuf_ostream(const char* msg_meta, uint64_t hash, const char* msg_name,
@@ -69,19 +191,68 @@ public:
   void attach_handle(int handle) {
     assert(stream == -1);
     stream = handle;
+    offset_ = 0;
   }
 
   void close();
 
-  bool is_open() const { return stream != -1; }
+  // Sockets stay open while reconnecting
+  bool is_open() const { return stream != -1 || is_socket_; }
 
   bool open_file(const char* fname);
 
+  // Send the stream to a cbuf_istream listening on a TCP port, or on a Unix socket path.
+  // Metadata is sent again on every connection. When the connection drops, writes fail
+  // until it reconnects, tried every reconnect period
   bool open_socket(const char* ip, int port);
+  bool open_unix_socket(const char* path);
+  bool is_connected() const { return stream != -1; }
+  void set_reconnect_period(double seconds) { reconnect_period_ = seconds; }
+  // Socket writes are sent once a batch of them is buffered, or max_send_delay seconds
+  // after the first of them on the next write. flush sends them right away
+  void set_max_send_delay(double seconds) { max_send_delay_ = seconds; }
+  bool flush();
 
   const std::string& filename() const { return fname_; }
 
   ssize_t file_offset() const;
+  // Same as file_offset, but tracked as we write instead of asking the OS
+  size_t stream_offset() const { return offset_; }
+
+  void set_type_options(uint64_t hash, const type_options& opts);
+  template <class cbuf_struct>
+  void set_type_options(const type_options& opts) {
+    set_type_options(cbuf_struct::TYPE_HASH, opts);
+  }
+
+  // Write the batches that have been waiting since before time - batch_window,
+  // or all of them by default
+  bool flush_batches(double time = 1e15);
+  // Write the suppressed repeats last written before time - keepalive_period,
+  // or all of them by default
+  bool flush_repeats(double time = 1e15);
+
+  // Write a packet already encoded, preamble included, applying the options for its type
+  bool write_packet(const void* data, size_t size);
+
+  // Write a packet in chunks, for payloads too large to be encoded in memory at once.
+  // begin_packet writes the preamble, then write_chunk has to be called with the rest of the
+  // encoded packet, total_size bytes including the preamble, before calling end_packet.
+  // Sizes are not limited by the preamble, large ones are written with an extended header.
+  bool begin_packet(const cbuf_preamble& pre, size_t total_size);
+  bool write_chunk(const void* data, size_t size);
+  bool end_packet();
+
+  template <class cbuf_struct>
+  bool begin_packet(cbuf_struct* member, size_t total_size) {
+    if (!dictionary.count(member->hash())) {
+      member->handle_metadata(serialize_metadata_cbuf_ostream, this);
+    }
+    member->preamble.magic = CBUF_MAGIC;
+    member->preamble.hash = member->hash();
+    member->preamble.packet_timest = now();
+    return begin_packet(member->preamble, total_size);
+  }
 
   void setFileWriteCallback(file_write_callback_t cb, void* user_ptr) {
     file_write_callback_ = cb;
@@ -90,8 +261,14 @@ public:
 
   void setPreFileWriteCallback(pre_file_write_callback_t cb) { pre_file_write_callback_ = cb; }
 
+  // Write an index of the file as a footer when closing it, see cbuf_index.h. Applies to
+  // files opened afterwards, and only when they start empty
+  void set_write_index(bool enable) { write_index_ = enable; }
+
   template <class cbuf_struct>
   bool serialize(cbuf_struct* member) {
+    // A new connection needs the metadata again
+    check_connection();
     // check if we have serialized this type before or not.
     if (!dictionary.count(member->hash())) {
       // If not, serialize its metadata
@@ -104,21 +281,20 @@ public:
       pre_file_write_callback_(FileWriteType::DATA);
     }
     // Serialize the data of the member itself
+    bool ret;
     if (member->supports_compact()) {
       auto ns = member->encode_net_size();
       char* ptr = (char*)malloc(ns);
       member->encode_net(ptr, ns);
-      auto n = write(stream, ptr, ns);
-      (void)n;
+      ret = write_packet(ptr, ns);
       free(ptr);
     } else {
       auto* ptr = member->encode();
-      auto n = write(stream, ptr, member->encode_size());
-      (void)n;
+      ret = write_packet(ptr, member->encode_size());
       member->free_encode(ptr);
     }
 
-    return true;
+    return ret;
   }
 
   // serialize_metadata:
@@ -204,7 +380,144 @@ public:
   }
 };
 
+// Decoder for a cbuf stream arriving in chunks of any size, as read from stdin, pipes,
+// sockets or files still being written. Messages are handed out as soon as they are
+// complete: in place on the chunk fed when they lie whole on it, otherwise from internal
+// buffers, reused across messages, where partial messages are assembled and records like
+// batches unpacked. Metadata and other internal records are consumed as cbuf_istream does.
+//
+//   cbuf_decoder dec;
+//   while ((n = read(fd, buf, sizeof(buf))) > 0) {
+//     dec.feed(buf, n);
+//     cbuf_decoder::message msg;
+//     while (dec.next(msg)) {
+//       ...
+//     }
+//   }
+class cbuf_decoder {
+public:
+  struct message {
+    // The message, preamble included. Valid until the next call to feed or next
+    const cbuf_preamble* preamble = nullptr;
+    // Sizes can go past 4GB for messages written with a large header
+    size_t size = 0;
+
+    uint64_t hash() const { return preamble->hash; }
+    double timestamp() const { return preamble->packet_timest; }
+    uint8_t variant() const { return preamble->variant(); }
+  };
+
+  // Add the next bytes of the stream. They are only read in place until the next call to
+  // feed, or until next returns false, so the caller can reuse its buffer after either
+  void feed(const void* data, size_t size);
+
+  // Get the next complete message, false if more bytes are needed first
+  bool next(message& msg);
+
+  template <class cbuf_struct>
+  bool decode(const message& msg, cbuf_struct* member) const {
+    unsigned int size = (unsigned int)std::min<size_t>(msg.size, UINT_MAX);
+    if (member->supports_compact()) {
+      return member->decode_net((char*)msg.preamble, size);
+    }
+    return member->decode((char*)msg.preamble, size);
+  }
+
+  std::string get_string_for_hash(uint64_t hash) const {
+    const auto it = dictionary.find(hash);
+    return it != dictionary.end() ? it->second : std::string();
+  }
+
+  std::string get_meta_string_for_hash(uint64_t hash) const {
+    const auto it = metadictionary.find(hash);
+    return it != metadictionary.end() ? it->second : std::string();
+  }
+
+  // As on cbuf_istream, repeat records are skipped unless expanding them
+  void set_expand_repeats(bool expand) { expand_repeats_ = expand; }
+  // Delta records and repeats are rebuilt from a copy of the full message they refer to. Copies
+  // are kept for the types seen on such records, so the first ones of a type are dropped. Keep
+  // them for every type instead on streams written by a cbuf_ostream that can send them
+  void set_keep_references(bool keep) { keep_references_ = keep; }
+  // Hand out metadata records as well, after adding them to the dictionaries
+  void set_include_metadata(bool include) { include_metadata_ = include; }
+
+  // Bytes waiting for the rest of their message
+  size_t buffered_size() const { return buffer_.size() - buf_start_ + chunk_rem_; }
+  // Bytes skipped as they did not hold valid messages
+  size_t corrupted_bytes() const { return corrupted_bytes_; }
+
+  // Forget everything decoded so far, as when the stream starts over
+  void reset();
+
+private:
+  std::map<uint64_t, std::string> dictionary;
+  std::map<uint64_t, std::string> metadictionary;
+
+  // Chunk being fed, walked in place
+  const unsigned char* chunk_ptr_ = nullptr;
+  size_t chunk_rem_ = 0;
+  // Bytes of the stream copied out of chunks, from buf_start_ on
+  std::vector<unsigned char> buffer_;
+  size_t buf_start_ = 0;
+  // Message handed out in place, consumed on the next call
+  size_t yielded_size_ = 0;
+  bool yielded_from_buffer_ = false;
+  // Messages unpacked from the last record, walked from unpacked_pos_ on
+  std::vector<unsigned char> unpacked_;
+  size_t unpacked_pos_ = 0;
+  // Offset on the stream of the next record, as the distances on repeats and deltas count
+  size_t stream_offset_ = 0;
+  // Last full message of the types on repeats and deltas, and its offset on the stream
+  struct reference {
+    size_t offset = 0;
+    std::vector<unsigned char> data;
+  };
+  std::map<std::pair<uint64_t, uint8_t>, reference> references_;
+  // Size and hash of the message following the last large header
+  size_t large_size_ = 0;
+  uint64_t large_hash_ = 0;
+  bool expand_repeats_ = false;
+  bool keep_references_ = false;
+  bool include_metadata_ = false;
+  size_t corrupted_bytes_ = 0;
+
+  // Size of the record starting with the preamble given, 0 if it is not a valid one
+  size_t record_size(const cbuf_preamble* pre) const;
+  // Move bytes from the chunk to the buffer
+  void take_from_chunk(size_t size);
+  void consume(size_t size, bool from_buffer);
+  // Message of the type distance bytes before the record being handled, null if it was not
+  // the last one kept, as when it was corrupted or lost
+  const cbuf_preamble* find_reference(uint64_t hash, uint8_t variant, size_t distance);
+  // Process a whole record. Returns true if it is a message to hand out, set on msg
+  bool handle_record(const unsigned char* rec, size_t size, message& msg);
+};
+
 class cbuf_istream {
+public:
+  // How open_file maps files. POPULATE faults the whole file in when opening it. STREAMING
+  // maps it lazily, reading ahead of the position and releasing the pages left behind, so
+  // opening is instant and the resident memory stays bounded
+  enum class MapMode {
+    POPULATE,
+    STREAMING,
+  };
+  struct map_options {
+    MapMode mode = MapMode::POPULATE;
+    // Bytes to read ahead of the position, and to keep resident behind it, in STREAMING mode
+    size_t readahead = 16 * 1024 * 1024;
+    size_t keep_behind = 4 * 1024 * 1024;
+  };
+  // How far timestamps can go from the last message consumed, for a preamble found when
+  // resyncing to look real. Timestamps go back a bit, as with batches, and jump ahead over
+  // gaps in the recording. Seeking files without an index relies on max_backstep as well
+  struct resync_options {
+    double max_backstep = 10.0;
+    double max_jump = 24 * 3600.0;
+  };
+
+private:
   friend class cbuf_ostream;
   std::map<uint64_t, std::string> dictionary;
   std::map<uint64_t, std::string> metadictionary;
@@ -217,16 +530,70 @@ class cbuf_istream {
   bool consume_on_deserialize = true;
   std::string fname_ = "";
 
+  // Messages unpacked from a record that holds several of them, like a batch.
+  // While unpacking, ptr and rem_size walk this buffer instead of the file
+  std::vector<unsigned char> unpacked_;
+  bool unpacking_ = false;
+  // Where to continue on the file once the unpacked messages are consumed
+  const unsigned char* resume_ptr_ = nullptr;
+  size_t resume_rem_size_ = 0;
+  // Offset on the file of the record being unpacked
+  size_t record_offset_ = 0;
+  // Expand repeat records into copies of the message they repeat
+  bool expand_repeats_ = false;
+  // Copy of the last full message, and its offset, of the types delta and repeat records
+  // refer to. Records are rebuilt from it even once that message is no longer mapped
+  struct reference {
+    size_t offset = 0;
+    std::vector<unsigned char> data;
+  };
+  std::map<std::pair<uint64_t, uint8_t>, reference> references_;
+  // Message following the last large header consumed, and its size
+  const unsigned char* large_ptr_ = nullptr;
+  size_t large_size_ = 0;
+  // Index of the file, loaded on first use
+  std::unique_ptr<CBufIndex> index_;
+  bool index_checked_ = false;
+  // With a type filter, offsets of the records to visit, sorted
+  std::vector<uint64_t> filter_offsets_;
+  bool filtering_ = false;
+  // Mapping of files, and in STREAMING mode the position where to advise the window next
+  // and the start of the pages not released yet
+  map_options map_options_;
+  const unsigned char* advise_ptr_ = nullptr;
+  size_t released_offset_ = 0;
+  resync_options resync_options_;
+  // Timestamp of the last message consumed, to tell real preambles from noise when resyncing
+  double last_good_ts_ = 0;
+  // Bytes of the file not searched for metadata, [start, end), left behind when seeking
+  // without an index. Searched when a message of an unknown type shows up
+  size_t metadata_gap_start_ = 0;
+  size_t metadata_gap_end_ = 0;
+  // Live stream received from cbuf_ostream senders, see cbuf_socket.h, or from a multicast
+  // group, see cbuf_mcast.h. Complete messages are appended to live_, where the position
+  // walks as on a file
+  cbuf_socket_receiver* socket_ = nullptr;
+  cbuf_mcast_subscriber* mcast_ = nullptr;
+  std::vector<unsigned char> live_;
+  // Bytes mapped of the file. While the file is still being written, filesize only covers
+  // its whole records, and the mapping grows with it, see open_growing_file
+  size_t mapped_size_ = 0;
+  bool growing_ = false;
+
   uint64_t __get_next_hash() const {
     const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
     return pre->hash;
   }
 
-  uint32_t __get_next_size() const {
+  size_t __get_next_size() const {
+    if (ptr == large_ptr_) return large_size_;
     const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
     return pre->size();
   }
 
+  // Generated decoders take 32 bit sizes
+  unsigned int decode_size() const { return (unsigned int)std::min<size_t>(rem_size, UINT_MAX); }
+
   uint8_t __get_next_variant() const {
     const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
     return pre->variant();
@@ -249,20 +616,92 @@ class cbuf_istream {
     }
     ptr += nsize;
     rem_size -= nsize;
+    if (unpacking_ && rem_size == 0) finish_unpacking();
+    if (advise_ptr_ != nullptr && !unpacking_ && ptr >= advise_ptr_) advise_window();
+  }
+
+  // Read ahead of the position and release the pages far behind it, in STREAMING mode
+  void advise_window();
+
+  void finish_unpacking() {
+    ptr = resume_ptr_;
+    rem_size = resume_rem_size_;
+    unpacking_ = false;
   }
 
   /// Try to consume metadata packets, not exposed to clients
   /// Return true if a packet was consumed, false otherwise
   bool consume_internal();
 
+  /// Unpack the record at the current position if it packs other messages.
+  /// Return true if the record was consumed, false otherwise
+  bool unpack_record();
+  bool unpack_batch();
+  bool unpack_repeat();
+  bool unpack_delta();
+  // Walk the messages on unpacked_, then continue after the current record of nsize bytes
+  void start_unpacking(size_t nsize);
+  // Keep a copy of the message at the current position if records refer to its type
+  void keep_reference();
+  // Message a delta or repeat record at the current position refers to, distance bytes before
+  // it, from the copy kept or else the file. Null if it is neither, or not the one expected
+  const cbuf_preamble* find_reference(uint64_t hash, uint8_t variant, size_t distance);
+
+  /// Consume the large header at the current position, the message it describes is next
+  bool consume_large_header();
+
+  void reset_internal_state();
+  // Jump to the next record passing the type filter, if not there already
+  void skip_filtered();
+  // Add the metadata record at offset to the dictionaries
+  bool load_metadata_at(size_t offset);
+  // How likely the preamble at p is a real one when resyncing: 0 not at all, 1 if only its
+  // size is plausible, 2 if another preamble follows it or its hash and timestamp are plausible
+  int resync_quality(const unsigned char* p, size_t remaining) const;
+  // Size of the record at offset if it looks real, as when followed by another preamble or
+  // by the end of the file. 0 otherwise
+  size_t chained_record_size(size_t offset) const;
+  // First record starting on [offset, limit) that looks real and is timestamped, as messages
+  // and the records packing them are. False if there is none
+  bool find_timed_record(size_t offset, size_t limit, size_t& found, double& ts) const;
+  // Walk the metadata gap until the metadata of hash is found, true if it was
+  bool search_metadata_gap(uint64_t hash);
+  // Start a live stream, with the transport open already
+  void start_live();
+  // Append a message handed out by the transport to the live buffer
+  void append_live(const cbuf_decoder::message& msg);
+  // Append what arrived on the transport, waiting up to timeout_ms when there is nothing
+  void receive_live(int timeout_ms);
+  // Map size bytes of the file, moving the pointers along if the mapping moves
+  bool remap(size_t size);
+
 public:
   cbuf_istream() {}
   ~cbuf_istream() { close(); }
 
   void disable_consume_on_deserialize() { consume_on_deserialize = false; }
+  // By default repeat records are skipped, which only shows the messages that changed.
+  // Expanding them brings back the suppressed copies, with interpolated timestamps
+  void set_expand_repeats(bool expand) { expand_repeats_ = expand; }
+  // Applies to the files opened afterwards
+  void set_map_options(const map_options& options) { map_options_ = options; }
+  void set_resync_options(const resync_options& options) { resync_options_ = options; }
   void close();
 
   bool open_file(const char* fname);
+  // Open a file still being written, as by ULogger. Only its whole records are read, one
+  // written halfway is waited for instead of taken as a corruption. Nothing is read until
+  // map_appended, see cbuf_follower to call it as the file grows
+  bool open_growing_file(const char* fname);
+  bool is_growing() const { return growing_; }
+  // Map what was appended to the file since, only its whole records while it is growing
+  void map_appended();
+  // The file is not written anymore, read the rest of it as any file, a truncated message included
+  void done_growing();
+  // Timestamp of the first record on a file that is not metadata, reading only the start of
+  // it. Metadata records are timestamped when written, not with the times of the messages.
+  // ts is 0 when none is found there, false if the file cannot be read
+  static bool peek_start_time(const char* fname, double& ts);
 
   const std::string& filename() const { return fname_; }
   // Mainly used in memory open case
@@ -270,7 +709,20 @@ public:
 
   bool open_memory(const unsigned char* data, size_t length);
 
+  // Listen for a cbuf_ostream sending its stream, on a TCP port (0 picks a free one, see
+  // local_port) or on a Unix socket path. Messages show up as they are received, the stream
+  // stays empty until then
   bool open_socket(const char* ip, int port);
+  bool open_unix_socket(const char* path);
+  // Receive the messages multicast to a group by a cbuf_mcast_publisher
+  bool open_multicast(const char* group, int port, const char* interface = "0.0.0.0");
+  bool is_live() const { return socket_ != nullptr || mcast_ != nullptr; }
+  bool is_connected() const;
+  int local_port() const;
+  // Wait up to timeout_ms for messages and append every complete one received, dropping the
+  // ones already consumed. When a sender disconnects the next one is accepted. On a file
+  // followed, waits for whole records appended to it. Returns true if there are messages to read
+  bool receive(int timeout_ms);
 
   template <class cbuf_struct>
   bool deserialize(cbuf_struct* member) {
@@ -283,12 +735,15 @@ public:
 
     auto nsize = get_next_size();
     if (member->supports_compact()) {
-      ret = member->decode_net((char*)ptr, rem_size);
+      ret = member->decode_net((char*)ptr, decode_size());
     } else {
-      ret = member->decode((char*)ptr, rem_size);
+      ret = member->decode((char*)ptr, decode_size());
     }
     if (!ret) return false;
-    if (consume_on_deserialize) updatePtrAndSize(nsize);
+    if (consume_on_deserialize) {
+      last_good_ts_ = __get_next_timestamp();
+      updatePtrAndSize(nsize);
+    }
     return true;
   }
 
@@ -300,6 +755,12 @@ public:
     return std::string();
   }
 
+  // Same without copying the name, the view is valid while the stream is open
+  std::string_view get_string_view_for_hash(uint64_t hash) const {
+    const auto it = dictionary.find(hash);
+    return it != dictionary.end() ? std::string_view(it->second) : std::string_view();
+  }
+
   const char* get_cstring_for_hash(uint64_t hash) {
     const auto it = dictionary.find(hash);
     if (it != dictionary.end()) {
@@ -316,6 +777,11 @@ public:
     return std::string();
   }
 
+  std::string_view get_meta_string_view_for_hash(uint64_t hash) const {
+    const auto it = metadictionary.find(hash);
+    return it != metadictionary.end() ? std::string_view(it->second) : std::string_view();
+  }
+
   const char* get_meta_cstring_for_hash(uint64_t hash) {
     const auto it = metadictionary.find(hash);
     if (it != metadictionary.end()) {
@@ -328,20 +794,38 @@ public:
   // have not seen this yet (could happen on replayer)
   const char* get_or_search_string_for_hash(uint64_t hash);
 
+  // Index of the file, from its footer or else its sidecar. Null if there is none, as on
+  // files not closed cleanly and never indexed offline
+  const CBufIndex* get_index();
+
+  // Only visit the messages of the given types, jumping over the other records. Needs an
+  // index, returns false without one and every message is still visited
+  bool set_type_filter(const std::vector<std::string>& msg_names);
+  void clear_type_filter();
+
+  // Position the stream on the first message at time t or later. Uses the index when
+  // present, otherwise a binary search on the timestamps of the records, which tolerates
+  // timestamps going back a few seconds. The metadata skipped over is searched for later,
+  // when a message needs it
+  bool seek_to_time(double t);
+
   uint64_t get_next_hash() {
     if (consume_internal()) {
       return get_next_hash();
     }
     const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
+    if (metadata_gap_start_ < metadata_gap_end_ && dictionary.count(pre->hash) == 0) {
+      search_metadata_gap(pre->hash);
+    }
     return pre->hash;
   }
 
-  uint32_t get_next_size() {
+  // Sizes can go past 4GB for messages written with a large header
+  size_t get_next_size() {
     if (consume_internal()) {
       return get_next_size();
     }
-    const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
-    return pre->size();
+    return __get_next_size();
   }
 
   double get_next_timestamp() {
@@ -372,7 +856,8 @@ public:
   bool empty() const { return rem_size <= 0; }
   // Return if there is any data after internal consumption
   bool empty_no_internal() {
-    consume_internal();
+    while (consume_internal()) {
+    }
     return empty();
   }
 
@@ -387,27 +872,24 @@ public:
     auto nsize = get_next_size();
     // corrupt cbuf
     if (nsize == 0) return false;
+    last_good_ts_ = __get_next_timestamp();
     updatePtrAndSize(nsize);
     return true;
   }
 
-  bool skip_corrupted() {
-    if (empty()) return true;
-    if (__check_next_preamble() && (__get_next_size() > 0)) return true;
+  // Move to the next valid preamble, or to the end. Candidates are found with a vectorized
+  // search for the magic, and preferred when their hash is known and their timestamp follows
+  // the last message read
+  bool skip_corrupted();
 
-    while (rem_size >= sizeof(cbuf_preamble)) {
-      ptr += 1;
-      rem_size -= 1;
-      if (__check_next_preamble() && (__get_next_size() > 0)) return true;
-    }
-    ptr += rem_size;
-    rem_size = 0;
-    return true;
-  }
+  // Offset of the first CBUF_MAGIC on data, or of where one could still start on bytes not
+  // seen yet (the last 3 bytes) when there is none
+  static size_t find_magic(const unsigned char* data, size_t size);
 
   const unsigned char* get_current_ptr() const { return ptr; }
   size_t get_filesize() const { return filesize; }
-  size_t get_current_offset() const { return filesize - rem_size; }
+  // While unpacking a record, this is the offset of the record itself
+  size_t get_current_offset() const { return unpacking_ ? record_offset_ : filesize - rem_size; }
   unsigned int get_next_magic() const {
     cbuf_preamble* pre = (cbuf_preamble*)ptr;
     return pre->magic;
@@ -416,15 +898,32 @@ public:
   void reset_ptr() {
     ptr = start_ptr;
     rem_size = filesize;
+    unpacking_ = false;
+    last_good_ts_ = 0;
+    if (advise_ptr_ != nullptr) advise_window();
   }
 
   bool jump_to_offset(size_t offset) {
     if (offset <= filesize) {
       ptr = start_ptr + offset;
       rem_size = filesize - offset;
+      unpacking_ = false;
+      if (advise_ptr_ != nullptr) advise_window();
 
       return true;
     }
     return false;
   }
+
+  // Where the next message is, also in the middle of a record holding several of them
+  struct position {
+    size_t offset = 0;
+    // Bytes already read of the messages unpacked from the record at offset
+    size_t unpacked = 0;
+  };
+  position get_position() const {
+    return {get_current_offset(), unpacking_ ? unpacked_.size() - rem_size : 0};
+  }
+  // Go back to a position taken on this stream, with the same type filter
+  bool restore_position(const position& pos);
 };
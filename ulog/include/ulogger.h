@@ -8,7 +8,9 @@
 #include <queue>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
+#include "cbuf_catalog.h"
 #include "cbuf_preamble.h"
 #include "cbuf_stream.h"
 #include "ringbuffer.h"
@@ -40,11 +42,21 @@ class ULogger {
   std::string ulogfilename;
 
   uint64_t current_file_size = 0;
+  // What the current file holds, for its catalog entry
+  CBufCatalog::FileInfo current_file_info_;
+
+  // Per type options set by clients, applied to cos on the logger thread
+  std::mutex type_options_mutex_;
+  std::unordered_map<uint64_t, cbuf_ostream::type_options> type_options_;
+  std::atomic<bool> type_options_dirty_{false};
 
   void initialize();
+  void applyTypeOptions();
   cbuf_ostream cos;
   bool quit_thread;
   bool logging_enabled = true;
+  bool write_index_ = true;
+  bool write_catalog_ = true;
 
   void processPacket(void* data, int size, const char* metadata, const char* type_name,
                      const uint64_t topic_name_hash);
@@ -73,6 +85,10 @@ public:
 
   bool getLoggingEnabled() const { return logging_enabled; }
   void setLoggingEnabled(bool enable) { logging_enabled = enable; }
+  // Write an index at the end of every log file, see cbuf_index.h. Enabled by default
+  void setWriteIndex(bool enable) { write_index_ = enable; }
+  // Keep a catalog of the log folder as files are closed, see cbuf_catalog.h. Enabled by default
+  void setWriteCatalog(bool enable) { write_catalog_ = enable; }
   void setFileCloseCallback(std::function<void(const std::string&)> cb) { file_close_callback_ = cb; }
   // Set the write callback but return the current (if existent) ulog filename
   void setFileWriteCallback(std::function<void(const void*, size_t)> cb, std::string& file_path,
@@ -82,6 +98,34 @@ public:
   void resetFileCallbacks();
   void setErrorCallback(std::function<void(const std::string&)> cb) { error_callback_ = cb; }
 
+  /// Pack up to max_messages of the given type on a single batch record, waiting at most
+  /// max_window seconds before writing them. Saves the per message preamble for small, high
+  /// rate messages. Readers unpack batches transparently. max_messages <= 1 disables it
+  void setBatching(uint64_t type_hash, unsigned max_messages, double max_window = 0.01);
+  template <class cbuf_struct>
+  void setBatching(unsigned max_messages, double max_window = 0.01) {
+    setBatching(cbuf_struct::TYPE_HASH, max_messages, max_window);
+  }
+
+  /// Skip messages of the given type identical to the previous one, timestamp aside, writing
+  /// instead how many times they repeated. While the content does not change, that count is
+  /// written at least every keepalive_period seconds. Readers can expand the repeats back
+  void setRepeatSuppression(uint64_t type_hash, bool enable, double keepalive_period = 1.0);
+  template <class cbuf_struct>
+  void setRepeatSuppression(bool enable, double keepalive_period = 1.0) {
+    setRepeatSuppression(cbuf_struct::TYPE_HASH, enable, keepalive_period);
+  }
+
+  /// Write messages of the given type as the difference with a full message, a keyframe,
+  /// written every keyframe_interval messages. Meant for simple structs where few bytes
+  /// change from one message to the next. Readers rebuild the messages transparently.
+  /// keyframe_interval 0 disables it
+  void setDeltaEncoding(uint64_t type_hash, unsigned keyframe_interval);
+  template <class cbuf_struct>
+  void setDeltaEncoding(unsigned keyframe_interval) {
+    setDeltaEncoding(cbuf_struct::TYPE_HASH, keyframe_interval);
+  }
+
   // gets a topic variant if it exists or adds one and then gets the variant if it does not exist
   int getOrMakeTopicVariant(const uint64_t& message_hash, const uint64_t& topic_name_hash);
 
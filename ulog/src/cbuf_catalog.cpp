@@ -0,0 +1,99 @@
+#include "cbuf_catalog.h"
+
+#include <cbuf_preamble.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <records.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+bool CBufCatalog::FileInfo::overlaps(double start, double end, const std::vector<std::string>& types) const {
+  if (start > 0 && end_time < start) return false;
+  if (end > 0 && start_time > end) return false;
+  if (types.empty()) return true;
+  for (const auto& name : type_names) {
+    if (std::find(types.begin(), types.end(), name) != types.end()) return true;
+  }
+  return false;
+}
+
+std::string CBufCatalog::catalog_path(const std::string& ulog_dir) { return ulog_dir + "/" + FILENAME; }
+
+bool CBufCatalog::append(const std::string& ulog_dir, const FileInfo& info) {
+  cbufmsg::catalog_entry entry;
+  entry.preamble.packet_timest = info.end_time;
+  entry.file_name = info.file_name;
+  entry.file_size = info.file_size;
+  entry.start_time = info.start_time;
+  entry.end_time = info.end_time;
+  entry.type_hashes = info.type_hashes;
+  entry.type_names = info.type_names;
+
+  size_t size = entry.encode_size();
+  char* ptr = entry.encode();
+  if (ptr == nullptr) return false;
+  // A single append, so several loggers can share the folder
+  int fd = open(catalog_path(ulog_dir).c_str(), O_WRONLY | O_APPEND | O_CREAT,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  bool ok = fd != -1 && write(fd, ptr, size) == ssize_t(size);
+  if (fd != -1) close(fd);
+  entry.free_encode(ptr);
+  return ok;
+}
+
+bool CBufCatalog::load(const std::string& ulog_dir) {
+  files_.clear();
+  file_pos_.clear();
+
+  std::string path = catalog_path(ulog_dir);
+  std::error_code ec;
+  size_t size = fs::file_size(path, ec);
+  if (ec) return false;
+  std::vector<unsigned char> data(size);
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) return false;
+  bool ok = fread(data.data(), 1, size, f) == size;
+  fclose(f);
+  if (!ok) return false;
+
+  size_t offset = 0;
+  while (offset + sizeof(cbuf_preamble) <= size) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)(data.data() + offset);
+    size_t nsize = pre->size();
+    if (pre->magic != CBUF_MAGIC || nsize < sizeof(cbuf_preamble) || nsize > size - offset) break;
+    cbufmsg::catalog_entry entry;
+    if (pre->hash == cbufmsg::catalog_entry::TYPE_HASH &&
+        entry.decode((char*)pre, (unsigned int)std::min<size_t>(nsize, UINT_MAX)) &&
+        entry.type_hashes.size() == entry.type_names.size()) {
+      FileInfo info;
+      info.file_name = entry.file_name;
+      info.file_size = entry.file_size;
+      info.start_time = entry.start_time;
+      info.end_time = entry.end_time;
+      info.type_hashes.swap(entry.type_hashes);
+      info.type_names.swap(entry.type_names);
+
+      auto it = file_pos_.find(info.file_name);
+      if (it != file_pos_.end()) {
+        files_[it->second] = std::move(info);
+      } else {
+        file_pos_[info.file_name] = files_.size();
+        files_.push_back(std::move(info));
+      }
+    }
+    offset += nsize;
+  }
+  return true;
+}
+
+const CBufCatalog::FileInfo* CBufCatalog::find(const std::string& file_name) const {
+  auto it = file_pos_.find(file_name);
+  if (it == file_pos_.end()) return nullptr;
+  return &files_[it->second];
+}
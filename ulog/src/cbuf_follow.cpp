@@ -0,0 +1,108 @@
+#include "cbuf_follow.h"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+bool cbuf_follower::init() {
+  if (fd_ == -1) fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  return fd_ != -1;
+}
+
+bool cbuf_follower::watch_folder(const std::string& path) {
+  if (!init()) return false;
+  folder_wd_ = inotify_add_watch(fd_, path.c_str(), IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE);
+  if (folder_wd_ == -1) return false;
+  folder_ = fs::absolute(path).string();
+  return true;
+}
+
+bool cbuf_follower::follow(cbuf_istream* cis, const std::string& path) {
+  if (!init() || !cis->open_growing_file(path.c_str())) return false;
+  int wd = folder_wd_;
+  fs::path parent = fs::absolute(path).parent_path().lexically_normal();
+  if (folder_wd_ == -1 || parent != fs::path(folder_).lexically_normal()) {
+    wd = inotify_add_watch(fd_, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+    if (wd == -1) {
+      cis->close();
+      return false;
+    }
+  }
+  followed_.push_back({cis, wd});
+  // Appended before watching
+  cis->map_appended();
+  return true;
+}
+
+void cbuf_follower::stop(cbuf_istream* cis) {
+  auto it = std::find_if(followed_.begin(), followed_.end(),
+                         [&](const followed& f) { return f.cis == cis; });
+  if (it == followed_.end()) return;
+  int wd = it->wd;
+  followed_.erase(it);
+  cis->done_growing();
+  // The same file followed twice shares its watch
+  bool shared =
+      std::any_of(followed_.begin(), followed_.end(), [&](const followed& f) { return f.wd == wd; });
+  if (wd != folder_wd_ && !shared) inotify_rm_watch(fd_, wd);
+}
+
+bool cbuf_follower::is_following(const cbuf_istream* cis) const {
+  return std::any_of(followed_.begin(), followed_.end(),
+                     [&](const followed& f) { return f.cis == cis; });
+}
+
+void cbuf_follower::close() {
+  followed_.clear();
+  if (fd_ != -1) ::close(fd_);
+  fd_ = -1;
+  folder_wd_ = -1;
+  folder_.clear();
+}
+
+void cbuf_follower::changed(const followed& f, bool closed) {
+  if (closed) {
+    stop(f.cis);
+  } else {
+    f.cis->map_appended();
+  }
+}
+
+bool cbuf_follower::wait(int timeout_ms, const std::function<void(const std::string&)>& new_file) {
+  if (fd_ == -1) return false;
+  struct pollfd pfd = {fd_, POLLIN, 0};
+  if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+  alignas(struct inotify_event) char events[16 * 1024];
+  ssize_t n;
+  while ((n = read(fd_, events, sizeof(events))) > 0) {
+    for (ssize_t pos = 0; pos < n;) {
+      const struct inotify_event* ev = (const struct inotify_event*)(events + pos);
+      pos += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_IGNORED) continue;
+      bool closed = (ev->mask & IN_CLOSE_WRITE) != 0;
+      if (ev->wd != folder_wd_) {
+        // A file watched on its own, stop can remove it from followed_
+        for (size_t i = followed_.size(); i-- > 0;) {
+          if (followed_[i].wd == ev->wd) changed(followed_[i], closed);
+        }
+        continue;
+      }
+      if (ev->len == 0) continue;
+      std::string file = (fs::path(folder_) / ev->name).string();
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (new_file) new_file(file);
+        continue;
+      }
+      for (size_t i = followed_.size(); i-- > 0;) {
+        if (followed_[i].cis->filename() == file) changed(followed_[i], closed);
+      }
+    }
+  }
+  return true;
+}
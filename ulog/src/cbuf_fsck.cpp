@@ -0,0 +1,515 @@
+#include "cbuf_fsck.h"
+
+#include <CBufParser.h>
+#include <cbuf_preamble.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <metadata.h>
+#include <records.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+
+#include "cbuf_stream.h"
+
+namespace fs = std::filesystem;
+
+// Walks the records of a file, keeping a parser for every type with metadata so far
+class FsckWalker {
+public:
+  FsckWalker(const unsigned char* data, size_t size, CBufFsck::Report& report)
+      : data_(data), size_(size), report_(report) {}
+
+  void run();
+
+private:
+  const unsigned char* data_;
+  size_t size_;
+  CBufFsck::Report& report_;
+  std::unordered_map<uint64_t, std::unique_ptr<CBufParser>> parsers_;
+  std::unordered_map<uint64_t, std::string> names_;
+  // Message of a batch being validated, with a blank preamble
+  std::vector<unsigned char> batch_msg_;
+
+  void add_issue(uint64_t start, uint64_t end, CBufFsck::Problem problem, uint64_t hash = 0);
+  // Offset of the next preamble that could be valid after offset, or the end of the file
+  size_t resync(size_t offset) const;
+  // Whether a record of the type is at offset - distance, for references back
+  bool has_record_back(size_t offset, uint64_t distance, uint64_t hash) const;
+  // Check the record at offset, of size nsize, which can grow for large messages
+  std::optional<CBufFsck::Problem> check_record(size_t offset, size_t& nsize, uint64_t& hash,
+                                                uint32_t& messages);
+  std::optional<CBufFsck::Problem> check_message(const unsigned char* ptr, size_t nsize, uint64_t hash);
+};
+
+void FsckWalker::add_issue(uint64_t start, uint64_t end, CBufFsck::Problem problem, uint64_t hash) {
+  auto& issues = report_.issues;
+  if (!issues.empty() && issues.back().end == start && issues.back().problem == problem &&
+      issues.back().hash == hash) {
+    issues.back().end = end;
+    return;
+  }
+  issues.push_back({start, end, problem, hash});
+}
+
+size_t FsckWalker::resync(size_t offset) const {
+  size_t pos = offset + 1;
+  while (pos + sizeof(cbuf_preamble) <= size_) {
+    pos += cbuf_istream::find_magic(data_ + pos, size_ - pos);
+    if (pos + sizeof(cbuf_preamble) > size_) break;
+    if (((const cbuf_preamble*)(data_ + pos))->size() >= sizeof(cbuf_preamble)) return pos;
+    pos++;
+  }
+  return size_;
+}
+
+bool FsckWalker::has_record_back(size_t offset, uint64_t distance, uint64_t hash) const {
+  if (distance == 0 || distance > offset) return false;
+  const cbuf_preamble* pre = (const cbuf_preamble*)(data_ + offset - distance);
+  return pre->magic == CBUF_MAGIC && pre->hash == hash;
+}
+
+std::optional<CBufFsck::Problem> FsckWalker::check_message(const unsigned char* ptr, size_t nsize,
+                                                           uint64_t hash) {
+  auto it = parsers_.find(hash);
+  if (it == parsers_.end()) return CBufFsck::Problem::NO_METADATA;
+  // Metadata that CBufParser could not parse does not tell whether the message is valid
+  if (it->second == nullptr) return std::nullopt;
+  if (it->second->Validate(names_[hash].c_str(), ptr, nsize) != nsize) return CBufFsck::Problem::DECODE_FAILED;
+  return std::nullopt;
+}
+
+std::optional<CBufFsck::Problem> FsckWalker::check_record(size_t offset, size_t& nsize, uint64_t& hash,
+                                                          uint32_t& messages) {
+  const unsigned char* ptr = data_ + offset;
+  const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
+  char* rec_ptr = (char*)ptr;
+  unsigned int rec_size = (unsigned int)std::min<size_t>(nsize, UINT_MAX);
+  hash = pre->hash;
+  messages = 0;
+
+  if (pre->hash == cbufmsg::metadata::TYPE_HASH) {
+    cbufmsg::metadata mdata;
+    if (!mdata.decode(rec_ptr, rec_size)) return CBufFsck::Problem::BAD_RECORD;
+    hash = mdata.msg_hash;
+    if (parsers_.count(mdata.msg_hash) > 0) return std::nullopt;
+    auto parser = std::make_unique<CBufParser>();
+    // Parse errors are printed by CBufParser, the messages of the type are not validated then
+    if (!parser->ParseMetadata(mdata.msg_meta, mdata.msg_name)) parser.reset();
+    parsers_[mdata.msg_hash] = std::move(parser);
+    names_[mdata.msg_hash] = mdata.msg_name;
+    return std::nullopt;
+  }
+  if (pre->hash == cbufmsg::file_index::TYPE_HASH) {
+    cbufmsg::file_index idx;
+    if (!idx.decode(rec_ptr, rec_size)) return CBufFsck::Problem::BAD_RECORD;
+    return std::nullopt;
+  }
+  if (pre->hash == cbufmsg::index_trailer::TYPE_HASH) {
+    cbufmsg::index_trailer trailer;
+    if (nsize != trailer.encode_size() || !trailer.decode(rec_ptr, rec_size)) return CBufFsck::Problem::BAD_RECORD;
+    if (trailer.index_offset >= offset ||
+        !has_record_back(offset, offset - trailer.index_offset, cbufmsg::file_index::TYPE_HASH)) {
+      return CBufFsck::Problem::BAD_RECORD;
+    }
+    return std::nullopt;
+  }
+  if (pre->hash == cbufmsg::large_header::TYPE_HASH) {
+    cbufmsg::large_header hdr;
+    if (!hdr.decode(rec_ptr, rec_size) || hdr.msg_size < sizeof(cbuf_preamble)) {
+      return CBufFsck::Problem::BAD_RECORD;
+    }
+    hash = hdr.msg_hash;
+    size_t rem = size_ - offset - nsize;
+    const cbuf_preamble* msg = (const cbuf_preamble*)(ptr + nsize);
+    if (rem >= sizeof(cbuf_preamble) && (msg->magic != CBUF_MAGIC || msg->hash != hdr.msg_hash)) {
+      return CBufFsck::Problem::BAD_RECORD;
+    }
+    if (hdr.msg_size > rem) {
+      nsize = size_ - offset;
+      return CBufFsck::Problem::TRUNCATED;
+    }
+    nsize += hdr.msg_size;
+    messages = 1;
+    return check_message(ptr + nsize - hdr.msg_size, hdr.msg_size, hdr.msg_hash);
+  }
+  if (pre->hash == cbufmsg::batch::TYPE_HASH) {
+    cbufmsg::batch rec;
+    if (!rec.decode(rec_ptr, rec_size) || rec.ts_deltas.empty()) return CBufFsck::Problem::BAD_RECORD;
+    hash = rec.msg_hash;
+    // Messages are packed without their preamble
+    size_t count = rec.ts_deltas.size();
+    size_t payload = 0;
+    if (rec.msg_size > 0) {
+      if (rec.msg_size < sizeof(cbuf_preamble)) return CBufFsck::Problem::BAD_RECORD;
+      payload = count * (rec.msg_size - sizeof(cbuf_preamble));
+    } else {
+      if (rec.sizes.size() != count) return CBufFsck::Problem::BAD_RECORD;
+      for (auto s : rec.sizes) {
+        if (s < sizeof(cbuf_preamble)) return CBufFsck::Problem::BAD_RECORD;
+        payload += s - sizeof(cbuf_preamble);
+      }
+    }
+    if (payload != rec.data.size()) return CBufFsck::Problem::BAD_RECORD;
+    if (parsers_.count(rec.msg_hash) == 0) return CBufFsck::Problem::NO_METADATA;
+    // Validated after a blank preamble, which CBufParser skips
+    const uint8_t* src = rec.data.data();
+    for (size_t i = 0; i < count; i++) {
+      size_t body_size = (rec.msg_size > 0 ? rec.msg_size : rec.sizes[i]) - sizeof(cbuf_preamble);
+      batch_msg_.assign(sizeof(cbuf_preamble), 0);
+      batch_msg_.insert(batch_msg_.end(), src, src + body_size);
+      auto problem = check_message(batch_msg_.data(), batch_msg_.size(), rec.msg_hash);
+      if (problem) return problem;
+      src += body_size;
+    }
+    messages = uint32_t(count);
+    return std::nullopt;
+  }
+  if (pre->hash == cbufmsg::repeat::TYPE_HASH) {
+    cbufmsg::repeat rec;
+    if (!rec.decode(rec_ptr, rec_size)) return CBufFsck::Problem::BAD_RECORD;
+    hash = rec.msg_hash;
+    if (!has_record_back(offset, rec.msg_distance, rec.msg_hash)) return CBufFsck::Problem::BAD_RECORD;
+    if (parsers_.count(rec.msg_hash) == 0) return CBufFsck::Problem::NO_METADATA;
+    return std::nullopt;
+  }
+  if (pre->hash == cbufmsg::delta::TYPE_HASH) {
+    cbufmsg::delta rec;
+    if (!rec.decode(rec_ptr, rec_size)) return CBufFsck::Problem::BAD_RECORD;
+    hash = rec.msg_hash;
+    if (!has_record_back(offset, rec.key_distance, rec.msg_hash)) return CBufFsck::Problem::BAD_RECORD;
+    if (parsers_.count(rec.msg_hash) == 0) return CBufFsck::Problem::NO_METADATA;
+    messages = 1;
+    return std::nullopt;
+  }
+
+  messages = 1;
+  return check_message(ptr, nsize, pre->hash);
+}
+
+void FsckWalker::run() {
+  size_t offset = 0;
+  while (offset < size_) {
+    size_t rem = size_ - offset;
+    if (rem < sizeof(cbuf_preamble)) {
+      add_issue(offset, size_, CBufFsck::Problem::TRUNCATED);
+      break;
+    }
+    const cbuf_preamble* pre = (const cbuf_preamble*)(data_ + offset);
+    size_t nsize = pre->size();
+    bool valid_magic = pre->magic == CBUF_MAGIC;
+    if (valid_magic && nsize > rem && resync(offset) == size_) {
+      // Nothing valid after it, the file was cut while writing the message
+      add_issue(offset, size_, CBufFsck::Problem::TRUNCATED, pre->hash);
+      break;
+    }
+    // Large messages are checked along with their header
+    if (!valid_magic || nsize < sizeof(cbuf_preamble) || nsize > rem) {
+      size_t next = resync(offset);
+      add_issue(offset, next, CBufFsck::Problem::BAD_PREAMBLE);
+      offset = next;
+      continue;
+    }
+
+    uint64_t hash;
+    uint32_t messages;
+    auto problem = check_record(offset, nsize, hash, messages);
+    if (problem) {
+      add_issue(offset, offset + nsize, *problem, hash);
+    } else {
+      report_.records++;
+      report_.messages += messages;
+    }
+    offset += nsize;
+  }
+}
+
+uint64_t CBufFsck::Report::bad_bytes() const {
+  uint64_t bytes = 0;
+  for (const auto& issue : issues) {
+    bytes += issue.end - issue.start;
+  }
+  return bytes;
+}
+
+const char* CBufFsck::problem_name(Problem problem) {
+  switch (problem) {
+    case Problem::BAD_PREAMBLE:
+      return "bad_preamble";
+    case Problem::BAD_RECORD:
+      return "bad_record";
+    case Problem::NO_METADATA:
+      return "no_metadata";
+    case Problem::DECODE_FAILED:
+      return "decode_failed";
+    case Problem::TRUNCATED:
+      return "truncated";
+  }
+  return "unknown";
+}
+
+void CBufFsck::check(const unsigned char* data, size_t size, Report& report) {
+  report.file_size = size;
+  report.records = 0;
+  report.messages = 0;
+  report.issues.clear();
+  FsckWalker walker(data, size, report);
+  walker.run();
+}
+
+// Distance back to the message a repeat or delta record refers to, 0 for other records
+static uint64_t reference_distance(const cbuf_preamble* pre, size_t nsize) {
+  if (pre->hash == cbufmsg::repeat::TYPE_HASH) {
+    cbufmsg::repeat rec;
+    return rec.decode((char*)pre, (unsigned int)nsize) ? rec.msg_distance : 0;
+  }
+  if (pre->hash == cbufmsg::delta::TYPE_HASH) {
+    cbufmsg::delta rec;
+    return rec.decode((char*)pre, (unsigned int)nsize) ? rec.key_distance : 0;
+  }
+  return 0;
+}
+
+// Encode the repeat or delta record again with another distance back, empty if it does not
+// take the same bytes anymore
+static std::vector<unsigned char> with_reference_distance(const cbuf_preamble* pre, size_t nsize,
+                                                          uint64_t distance) {
+  std::vector<unsigned char> out;
+  auto reencode = [&](auto& rec) {
+    if (rec.encode_size() != nsize) return;
+    auto ptr = rec.encode();
+    out.assign(ptr, ptr + nsize);
+    rec.free_encode(ptr);
+  };
+  if (pre->hash == cbufmsg::repeat::TYPE_HASH) {
+    cbufmsg::repeat rec;
+    rec.decode((char*)pre, (unsigned int)nsize);
+    rec.msg_distance = distance;
+    reencode(rec);
+  } else {
+    cbufmsg::delta rec;
+    rec.decode((char*)pre, (unsigned int)nsize);
+    rec.key_distance = distance;
+    reencode(rec);
+  }
+  return out;
+}
+
+bool CBufFsck::write_repaired(const unsigned char* data, size_t size, const Report& report,
+                              const std::string& repaired_path) {
+  // Ranges without problems hold whole records, walked here. Large messages go with their header
+  auto walk_records = [&](size_t start, size_t end, auto fn) {
+    for (size_t pos = start; pos + sizeof(cbuf_preamble) <= end;) {
+      const cbuf_preamble* pre = (const cbuf_preamble*)(data + pos);
+      size_t nsize = pre->size();
+      if (nsize < sizeof(cbuf_preamble) || nsize > end - pos) break;
+      if (pre->hash == cbufmsg::large_header::TYPE_HASH) {
+        cbufmsg::large_header hdr;
+        if (!hdr.decode((char*)pre, (unsigned int)nsize) || hdr.msg_size > end - pos - nsize) break;
+        nsize += hdr.msg_size;
+      }
+      fn(pos, nsize, pre);
+      pos += nsize;
+    }
+  };
+
+  auto is_footer = [](const cbuf_preamble* pre) {
+    return pre->hash == cbufmsg::file_index::TYPE_HASH || pre->hash == cbufmsg::index_trailer::TYPE_HASH;
+  };
+  // Bytes left out: the ranges with problems and, when there are some, the footer records, whose
+  // offsets would not match anymore
+  std::vector<std::pair<size_t, size_t>> kept, dropped;
+  size_t offset = 0;
+  for (const auto& issue : report.issues) {
+    if (issue.start > offset) kept.emplace_back(offset, issue.start);
+    dropped.emplace_back(issue.start, issue.end);
+    offset = std::max<size_t>(offset, issue.end);
+  }
+  if (offset < size) kept.emplace_back(offset, size);
+  if (!report.issues.empty()) {
+    for (const auto& [start, end] : kept) {
+      walk_records(start, end, [&](size_t pos, size_t nsize, const cbuf_preamble* pre) {
+        if (is_footer(pre)) dropped.emplace_back(pos, pos + nsize);
+      });
+    }
+  }
+  std::sort(dropped.begin(), dropped.end());
+  auto in_dropped = [&](size_t off) {
+    auto it = std::upper_bound(dropped.begin(), dropped.end(), std::make_pair(off, SIZE_MAX));
+    return it != dropped.begin() && off < std::prev(it)->second;
+  };
+  // Repeats and deltas of a message left out go too. They only refer to plain messages, so
+  // leaving them out does not break other references
+  std::vector<std::pair<size_t, size_t>> orphans;
+  for (const auto& [start, end] : kept) {
+    walk_records(start, end, [&](size_t pos, size_t nsize, const cbuf_preamble* pre) {
+      uint64_t distance = reference_distance(pre, nsize);
+      if (distance > 0 && distance <= pos && in_dropped(pos - distance)) {
+        orphans.emplace_back(pos, pos + nsize);
+      }
+    });
+  }
+  dropped.insert(dropped.end(), orphans.begin(), orphans.end());
+  std::sort(dropped.begin(), dropped.end());
+  // Offset on the copy of a byte that is kept
+  std::vector<size_t> dropped_before(dropped.size() + 1, 0);
+  for (size_t i = 0; i < dropped.size(); i++) {
+    dropped_before[i + 1] = dropped_before[i] + dropped[i].second - dropped[i].first;
+  }
+  auto copy_offset = [&](size_t off) {
+    auto it = std::upper_bound(dropped.begin(), dropped.end(), std::make_pair(off, SIZE_MAX));
+    return off - dropped_before[it - dropped.begin()];
+  };
+
+  // Write it whole under a temporary name, as the sidecar indexes are
+  std::string tmp_path = repaired_path + ".tmp";
+  FILE* f = fopen(tmp_path.c_str(), "wb");
+  if (f == nullptr) return false;
+  bool ok = true;
+  auto write_bytes = [&](const void* ptr, size_t len) {
+    if (len > 0) ok = ok && fwrite(ptr, 1, len, f) == len;
+  };
+  for (const auto& [start, end] : kept) {
+    size_t copy_from = start;
+    walk_records(start, end, [&](size_t pos, size_t nsize, const cbuf_preamble* pre) {
+      std::vector<unsigned char> reencoded;
+      if (!in_dropped(pos)) {
+        // References across the bytes left out get shorter
+        uint64_t distance = reference_distance(pre, nsize);
+        if (distance == 0 || distance > pos) return;
+        uint64_t copy_distance = copy_offset(pos) - copy_offset(pos - distance);
+        if (copy_distance == distance) return;
+        reencoded = with_reference_distance(pre, nsize, copy_distance);
+      }
+      write_bytes(data + copy_from, pos - copy_from);
+      write_bytes(reencoded.data(), reencoded.size());
+      copy_from = pos + nsize;
+    });
+    write_bytes(data + copy_from, end - copy_from);
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_path.c_str(), repaired_path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CBufFsck::check_file(const std::string& path, Report& report, const std::string& repaired_path) {
+  report = Report();
+  report.path = path;
+  std::error_code ec;
+  uint64_t size = fs::file_size(path, ec);
+  if (ec) {
+    report.error = "Could not stat " + path;
+    return false;
+  }
+  if (size == 0) return true;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    report.error = "Could not open " + path + ": " + strerror(errno);
+    return false;
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    report.error = "Could not map " + path + ": " + strerror(errno);
+    return false;
+  }
+#if defined(__linux__)
+  madvise(data, size, MADV_SEQUENTIAL);
+#endif
+  check((const unsigned char*)data, size, report);
+  bool ok = true;
+  if (!repaired_path.empty() && !report.issues.empty()) {
+    if (write_repaired((const unsigned char*)data, size, report, repaired_path)) {
+      report.repaired_path = repaired_path;
+    } else {
+      report.error = "Could not write the repaired copy " + repaired_path;
+      ok = false;
+    }
+  }
+  munmap(data, size);
+  return ok;
+}
+
+void CBufFsck::check_files(const std::vector<std::string>& paths, unsigned max_threads,
+                           const std::string& repair_dir, std::vector<Report>& reports) {
+  if (max_threads == 0) max_threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t num_threads = std::min<size_t>(max_threads, paths.size());
+  reports.clear();
+  reports.resize(paths.size());
+
+  std::atomic<size_t> next_file(0);
+  auto worker = [&]() {
+    for (size_t i = next_file++; i < paths.size(); i = next_file++) {
+      std::string repaired_path;
+      if (!repair_dir.empty()) repaired_path = (fs::path(repair_dir) / fs::path(paths[i]).filename()).string();
+      check_file(paths[i], reports[i], repaired_path);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+static void append_json_string(std::string& out, const std::string& str) {
+  out += '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+std::string CBufFsck::to_json(const Report& report) {
+  char buf[256];
+  std::string out = "{\"path\":";
+  append_json_string(out, report.path);
+  snprintf(buf, sizeof(buf),
+           ",\"ok\":%s,\"file_size\":%" PRIu64 ",\"records\":%" PRIu64 ",\"messages\":%" PRIu64
+           ",\"bad_bytes\":%" PRIu64,
+           report.ok() ? "true" : "false", report.file_size, report.records, report.messages, report.bad_bytes());
+  out += buf;
+  if (!report.error.empty()) {
+    out += ",\"error\":";
+    append_json_string(out, report.error);
+  }
+  if (!report.repaired_path.empty()) {
+    out += ",\"repaired\":";
+    append_json_string(out, report.repaired_path);
+  }
+  out += ",\"issues\":[";
+  for (size_t i = 0; i < report.issues.size(); i++) {
+    const auto& issue = report.issues[i];
+    snprintf(buf, sizeof(buf), "%s{\"start\":%" PRIu64 ",\"end\":%" PRIu64 ",\"problem\":\"%s\",\"hash\":\"%016" PRIX64 "\"}",
+             i > 0 ? "," : "", issue.start, issue.end, problem_name(issue.problem), issue.hash);
+    out += buf;
+  }
+  out += "]}";
+  return out;
+}
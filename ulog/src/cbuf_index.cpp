@@ -0,0 +1,405 @@
+#include "cbuf_index.h"
+
+#include <cbuf_preamble.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <metadata.h>
+#include <records.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#include "cbuf_stream.h"
+
+namespace fs = std::filesystem;
+
+void CBufIndex::clear() {
+  types_.clear();
+  type_pos_.clear();
+  names_.clear();
+  metadata_offsets_.clear();
+  corruptions_.clear();
+  sample_times_.clear();
+  sample_offsets_.clear();
+  max_ts_ = -1e300;
+  since_sample_ = 0;
+  start_time_ = 0;
+  end_time_ = 0;
+  file_size_ = 0;
+}
+
+CBufIndex::TypeInfo& CBufIndex::get_type(uint64_t hash) {
+  auto it = type_pos_.find(hash);
+  if (it != type_pos_.end()) return types_[it->second];
+  type_pos_[hash] = types_.size();
+  types_.emplace_back();
+  auto& info = types_.back();
+  info.hash = hash;
+  auto name_it = names_.find(hash);
+  if (name_it != names_.end()) info.name = name_it->second;
+  return info;
+}
+
+const CBufIndex::TypeInfo* CBufIndex::find_type(uint64_t hash) const {
+  auto it = type_pos_.find(hash);
+  if (it == type_pos_.end()) return nullptr;
+  return &types_[it->second];
+}
+
+void CBufIndex::add_metadata(uint64_t offset, uint64_t hash, const std::string& name) {
+  metadata_offsets_.push_back(offset);
+  names_[hash] = name;
+  auto it = type_pos_.find(hash);
+  if (it != type_pos_.end()) types_[it->second].name = name;
+}
+
+void CBufIndex::add_record(uint64_t hash, uint64_t offset, uint64_t size, double min_ts, double max_ts,
+                           uint32_t messages, uint32_t repeats) {
+  if (sample_offsets_.empty()) {
+    start_time_ = min_ts;
+    end_time_ = max_ts;
+  }
+  if (since_sample_ == 0) {
+    sample_times_.push_back(max_ts_);
+    sample_offsets_.push_back(offset);
+  }
+  if (++since_sample_ >= SAMPLE_INTERVAL) since_sample_ = 0;
+
+  start_time_ = std::min(start_time_, min_ts);
+  end_time_ = std::max(end_time_, max_ts);
+  max_ts_ = std::max(max_ts_, max_ts);
+
+  auto& info = get_type(hash);
+  info.count += messages;
+  info.repeats += repeats;
+  info.bytes += size;
+  info.offsets.push_back(offset);
+}
+
+void CBufIndex::add_corruption(uint64_t start, uint64_t end) {
+  if (!corruptions_.empty() && corruptions_.back().end == start) {
+    corruptions_.back().end = end;
+    return;
+  }
+  corruptions_.push_back({start, end});
+}
+
+bool CBufIndex::encode_index(std::vector<uint8_t>& out) const {
+  cbufmsg::file_index idx;
+  idx.preamble.packet_timest = end_time_;
+  idx.start_time = start_time_;
+  idx.end_time = end_time_;
+  for (const auto& info : types_) {
+    idx.type_hashes.push_back(info.hash);
+    idx.type_names.push_back(info.name);
+    idx.type_counts.push_back(info.count);
+    idx.type_repeats.push_back(info.repeats);
+    idx.type_bytes.push_back(info.bytes);
+    idx.type_num_offsets.push_back(info.offsets.size());
+    idx.type_offsets.insert(idx.type_offsets.end(), info.offsets.begin(), info.offsets.end());
+  }
+  idx.metadata_offsets = metadata_offsets_;
+  idx.sample_times = sample_times_;
+  idx.sample_offsets = sample_offsets_;
+  for (const auto& c : corruptions_) {
+    idx.corrupt_starts.push_back(c.start);
+    idx.corrupt_ends.push_back(c.end);
+  }
+
+  size_t idx_size = idx.encode_size();
+  if (idx_size >= idx.preamble.maxSize()) return false;
+  size_t start = out.size();
+  out.resize(start + idx_size);
+  return idx.encode((char*)out.data() + start, idx_size);
+}
+
+bool CBufIndex::encode_footer(uint64_t index_offset, std::vector<uint8_t>& out) const {
+  out.clear();
+  if (!encode_index(out)) return false;
+
+  cbufmsg::index_trailer trailer;
+  trailer.preamble.packet_timest = end_time_;
+  trailer.index_offset = index_offset;
+  const char* trailer_ptr = trailer.encode();
+  out.insert(out.end(), trailer_ptr, trailer_ptr + trailer.encode_size());
+  return true;
+}
+
+bool CBufIndex::decode_index(const unsigned char* data, size_t size) {
+  cbufmsg::file_index idx;
+  if (size < sizeof(cbuf_preamble)) return false;
+  if (!idx.decode((char*)data, (unsigned int)std::min<size_t>(size, UINT_MAX))) return false;
+
+  size_t num_types = idx.type_hashes.size();
+  if (idx.type_names.size() != num_types || idx.type_counts.size() != num_types ||
+      idx.type_repeats.size() != num_types || idx.type_bytes.size() != num_types ||
+      idx.type_num_offsets.size() != num_types || idx.sample_times.size() != idx.sample_offsets.size() ||
+      idx.corrupt_starts.size() != idx.corrupt_ends.size()) {
+    return false;
+  }
+  uint64_t total_offsets = 0;
+  for (auto n : idx.type_num_offsets) total_offsets += n;
+  if (total_offsets != idx.type_offsets.size()) return false;
+
+  clear();
+  start_time_ = idx.start_time;
+  end_time_ = idx.end_time;
+  auto offset_it = idx.type_offsets.begin();
+  for (size_t i = 0; i < num_types; i++) {
+    names_[idx.type_hashes[i]] = idx.type_names[i];
+    auto& info = get_type(idx.type_hashes[i]);
+    info.count = idx.type_counts[i];
+    info.repeats = idx.type_repeats[i];
+    info.bytes = idx.type_bytes[i];
+    info.offsets.assign(offset_it, offset_it + idx.type_num_offsets[i]);
+    offset_it += idx.type_num_offsets[i];
+  }
+  metadata_offsets_.swap(idx.metadata_offsets);
+  sample_times_.swap(idx.sample_times);
+  sample_offsets_.swap(idx.sample_offsets);
+  for (size_t i = 0; i < idx.corrupt_starts.size(); i++) {
+    corruptions_.push_back({idx.corrupt_starts[i], idx.corrupt_ends[i]});
+  }
+  return true;
+}
+
+bool CBufIndex::load_footer(const unsigned char* data, size_t size) {
+  cbufmsg::index_trailer trailer;
+  if (data == nullptr || size < trailer.encode_size()) return false;
+
+  const unsigned char* tail = data + size - trailer.encode_size();
+  const cbuf_preamble* pre = (const cbuf_preamble*)tail;
+  if (pre->magic != CBUF_MAGIC || pre->hash != cbufmsg::index_trailer::TYPE_HASH ||
+      pre->size() != trailer.encode_size()) {
+    return false;
+  }
+  if (!trailer.decode((char*)tail, trailer.encode_size())) return false;
+  if (trailer.index_offset >= size - trailer.encode_size()) return false;
+
+  const unsigned char* idx_ptr = data + trailer.index_offset;
+  pre = (const cbuf_preamble*)idx_ptr;
+  size_t idx_space = size - trailer.encode_size() - trailer.index_offset;
+  if (pre->magic != CBUF_MAGIC || pre->hash != cbufmsg::file_index::TYPE_HASH || pre->size() != idx_space) {
+    return false;
+  }
+  if (!decode_index(idx_ptr, idx_space)) return false;
+  file_size_ = size;
+  return true;
+}
+
+uint64_t CBufIndex::offset_for_time(double t) const {
+  // Last sample where all the records before it are earlier than t
+  auto it = std::lower_bound(sample_times_.begin(), sample_times_.end(), t);
+  if (it == sample_times_.begin()) return 0;
+  return sample_offsets_[it - sample_times_.begin() - 1];
+}
+
+size_t CBufIndex::scan_record(const unsigned char* data, size_t size, size_t offset) {
+  const cbuf_preamble* pre = (const cbuf_preamble*)(data + offset);
+  size_t rem = size - offset;
+  size_t nsize = pre->size();
+  if (pre->magic != CBUF_MAGIC || nsize < sizeof(cbuf_preamble) || nsize > rem) return 0;
+
+  char* rec_ptr = (char*)pre;
+  unsigned int rec_size = (unsigned int)std::min<size_t>(nsize, UINT_MAX);
+  double ts = pre->packet_timest;
+  // Records are indexed as cbuf_ostream does when writing them
+  if (pre->hash == cbufmsg::metadata::TYPE_HASH) {
+    cbufmsg::metadata mdata;
+    if (!mdata.decode(rec_ptr, rec_size)) return 0;
+    add_metadata(offset, mdata.msg_hash, mdata.msg_name);
+  } else if (pre->hash == cbufmsg::file_index::TYPE_HASH || pre->hash == cbufmsg::index_trailer::TYPE_HASH) {
+    // The footer of the file, not a message
+  } else if (pre->hash == cbufmsg::large_header::TYPE_HASH) {
+    cbufmsg::large_header hdr;
+    if (!hdr.decode(rec_ptr, rec_size)) return 0;
+    if (hdr.msg_size < sizeof(cbuf_preamble) || hdr.msg_size > rem - nsize) return 0;
+    const cbuf_preamble* msg = (const cbuf_preamble*)(data + offset + nsize);
+    if (msg->magic != CBUF_MAGIC || msg->hash != hdr.msg_hash) return 0;
+    nsize += hdr.msg_size;
+    add_record(hdr.msg_hash, offset, nsize, ts, ts, 1);
+  } else if (pre->hash == cbufmsg::batch::TYPE_HASH) {
+    cbufmsg::batch rec;
+    if (!rec.decode(rec_ptr, rec_size) || rec.ts_deltas.empty()) return 0;
+    float max_delta = *std::max_element(rec.ts_deltas.begin(), rec.ts_deltas.end());
+    add_record(rec.msg_hash, offset, nsize, ts, ts + max_delta, uint32_t(rec.ts_deltas.size()));
+  } else if (pre->hash == cbufmsg::repeat::TYPE_HASH) {
+    cbufmsg::repeat rec;
+    if (!rec.decode(rec_ptr, rec_size)) return 0;
+    add_record(rec.msg_hash, offset, nsize, ts, rec.last_ts, 0, rec.count);
+  } else if (pre->hash == cbufmsg::delta::TYPE_HASH) {
+    cbufmsg::delta rec;
+    if (!rec.decode(rec_ptr, rec_size)) return 0;
+    add_record(rec.msg_hash, offset, nsize, ts, ts, 1);
+  } else {
+    add_record(pre->hash, offset, nsize, ts, ts, 1);
+  }
+  return nsize;
+}
+
+void CBufIndex::build(const unsigned char* data, size_t size) {
+  clear();
+  size_t offset = 0;
+  size_t corrupt_start = 0;
+  bool corrupted = false;
+  while (offset + sizeof(cbuf_preamble) <= size) {
+    size_t nsize = scan_record(data, size, offset);
+    if (nsize == 0) {
+      // Resync on the next valid preamble, as cbuf_istream::skip_corrupted does
+      if (!corrupted) corrupt_start = offset;
+      corrupted = true;
+      offset += 1 + cbuf_istream::find_magic(data + offset + 1, size - offset - 1);
+      continue;
+    }
+    if (corrupted) add_corruption(corrupt_start, offset);
+    corrupted = false;
+    offset += nsize;
+  }
+  if (offset < size) add_corruption(corrupted ? corrupt_start : offset, size);
+  file_size_ = size;
+}
+
+std::string CBufIndex::sidecar_path(const std::string& cb_path) { return cb_path + ".idx"; }
+
+static bool file_stamp(const std::string& path, uint64_t& size, int64_t& mtime_ns) {
+  std::error_code ec;
+  size = fs::file_size(path, ec);
+  if (ec) return false;
+  auto mtime = fs::last_write_time(path, ec);
+  if (ec) return false;
+  mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(mtime.time_since_epoch()).count();
+  return true;
+}
+
+bool CBufIndex::save_sidecar(const std::string& cb_path, uint64_t cb_size, int64_t cb_mtime_ns) const {
+  cbufmsg::sidecar_info info;
+  info.preamble.packet_timest = end_time_;
+  info.cb_size = cb_size;
+  info.cb_mtime_ns = cb_mtime_ns;
+  const char* info_ptr = info.encode();
+  std::vector<uint8_t> out(info_ptr, info_ptr + info.encode_size());
+  if (!encode_index(out)) return false;
+
+  // Write it whole under a temporary name, readers never see a partial sidecar
+  std::string path = sidecar_path(cb_path);
+  std::string tmp_path = path + ".tmp";
+  FILE* f = fopen(tmp_path.c_str(), "wb");
+  if (f == nullptr) return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CBufIndex::load_sidecar(const std::string& cb_path) {
+  uint64_t cb_size;
+  int64_t cb_mtime_ns;
+  if (!file_stamp(cb_path, cb_size, cb_mtime_ns)) return false;
+
+  std::string path = sidecar_path(cb_path);
+  std::error_code ec;
+  uint64_t size = fs::file_size(path, ec);
+  cbufmsg::sidecar_info info;
+  if (ec || size < info.encode_size()) return false;
+
+  std::vector<uint8_t> data(size);
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) return false;
+  bool ok = fread(data.data(), 1, size, f) == size;
+  fclose(f);
+  if (!ok) return false;
+
+  const cbuf_preamble* pre = (const cbuf_preamble*)data.data();
+  if (pre->magic != CBUF_MAGIC || pre->hash != cbufmsg::sidecar_info::TYPE_HASH ||
+      pre->size() != info.encode_size() || !info.decode((char*)data.data(), info.encode_size())) {
+    return false;
+  }
+  if (info.cb_size != cb_size || info.cb_mtime_ns != cb_mtime_ns) return false;
+
+  const unsigned char* idx_ptr = data.data() + info.encode_size();
+  size_t idx_space = size - info.encode_size();
+  pre = (const cbuf_preamble*)idx_ptr;
+  if (idx_space < sizeof(cbuf_preamble) || pre->magic != CBUF_MAGIC ||
+      pre->hash != cbufmsg::file_index::TYPE_HASH || pre->size() != idx_space) {
+    return false;
+  }
+  if (!decode_index(idx_ptr, idx_space)) return false;
+  file_size_ = cb_size;
+  return true;
+}
+
+bool CBufIndex::build_sidecar(const std::string& cb_path, std::string& error) {
+  // Stamp the file before reading it, a file changing meanwhile gets a stale sidecar
+  uint64_t cb_size;
+  int64_t cb_mtime_ns;
+  if (!file_stamp(cb_path, cb_size, cb_mtime_ns)) {
+    error = "Could not stat " + cb_path;
+    return false;
+  }
+
+  CBufIndex index;
+  if (cb_size > 0) {
+    int fd = open(cb_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      error = "Could not open " + cb_path + ": " + strerror(errno);
+      return false;
+    }
+    void* data = mmap(nullptr, cb_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      error = "Could not map " + cb_path + ": " + strerror(errno);
+      return false;
+    }
+#if defined(__linux__)
+    madvise(data, cb_size, MADV_SEQUENTIAL);
+#endif
+    index.build((const unsigned char*)data, cb_size);
+    munmap(data, cb_size);
+  }
+
+  if (!index.save_sidecar(cb_path, cb_size, cb_mtime_ns)) {
+    error = "Could not write the sidecar index " + sidecar_path(cb_path);
+    return false;
+  }
+  return true;
+}
+
+bool CBufIndex::build_sidecars(const std::vector<std::string>& cb_paths, unsigned max_threads,
+                               std::vector<std::string>& errors) {
+  if (max_threads == 0) max_threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t num_threads = std::min<size_t>(max_threads, cb_paths.size());
+
+  std::atomic<size_t> next_file(0);
+  std::mutex errors_mutex;
+  bool ok = true;
+  auto worker = [&]() {
+    for (size_t i = next_file++; i < cb_paths.size(); i = next_file++) {
+      std::string error;
+      if (!build_sidecar(cb_paths[i], error)) {
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        errors.push_back(error);
+        ok = false;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  return ok;
+}
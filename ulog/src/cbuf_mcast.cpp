@@ -0,0 +1,260 @@
+#include "cbuf_mcast.h"
+
+#include <arpa/inet.h>
+#include <metadata.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <random>
+
+static constexpr uint32_t MCAST_MAGIC = 0x4D434243;  // "CBCM"
+// Messages behind the newest one still waiting for fragments
+static constexpr uint64_t REASSEMBLY_WINDOW = 64;
+
+// Start of every datagram, followed by the bytes of the message from frag_offset on
+struct mcast_header {
+  uint32_t magic;
+  uint32_t session;
+  uint64_t seq;
+  uint32_t msg_size;
+  uint32_t frag_offset;
+  uint16_t frag_index;
+  uint16_t frag_count;
+  uint32_t reserved;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+static bool parse_address(const char* ip, int port, struct sockaddr_in& addr) {
+  addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(uint16_t(port));
+  return inet_pton(AF_INET, ip, &addr.sin_addr) == 1;
+}
+
+bool cbuf_mcast_publisher::open(const char* group, int port, const options& opts) {
+  close();
+  struct sockaddr_in dest;
+  if (!parse_address(group, port, dest) || !IN_MULTICAST(ntohl(dest.sin_addr.s_addr))) {
+    fprintf(stderr, "%s is not an IPv4 multicast group\n", group);
+    return false;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) return false;
+  unsigned char ttl = (unsigned char)opts.ttl;
+  unsigned char loop = 1;
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+  if (!opts.interface.empty()) {
+    struct in_addr iface;
+    if (inet_pton(AF_INET, opts.interface.c_str(), &iface) != 1 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) != 0) {
+      fprintf(stderr, "Could not send multicast from interface %s\n", opts.interface.c_str());
+      ::close(fd);
+      return false;
+    }
+  }
+
+  fd_ = fd;
+  opts_ = opts;
+  if (opts_.max_datagram < sizeof(mcast_header) + sizeof(cbuf_preamble)) {
+    opts_.max_datagram = sizeof(mcast_header) + sizeof(cbuf_preamble);
+  }
+  dest_.assign((const unsigned char*)&dest, (const unsigned char*)(&dest + 1));
+  session_ = std::random_device()();
+  next_seq_ = 0;
+  metadata_records_.clear();
+  last_announce_ = now();
+  // A new cstream, to send the metadata of every type again
+  cstream_ = cbuf_cstream();
+  cstream_.setCallbacks(alloc_packet, packet_complete, this);
+  return true;
+}
+
+void cbuf_mcast_publisher::close() {
+  if (fd_ != -1) ::close(fd_);
+  fd_ = -1;
+}
+
+unsigned char* cbuf_mcast_publisher::alloc_packet(size_t size, void* ctx) {
+  cbuf_mcast_publisher* pub = static_cast<cbuf_mcast_publisher*>(ctx);
+  pub->packet_.resize(size);
+  return pub->packet_.data();
+}
+
+void cbuf_mcast_publisher::packet_complete(unsigned char* data, size_t size, void* ctx) {
+  cbuf_mcast_publisher* pub = static_cast<cbuf_mcast_publisher*>(ctx);
+  const cbuf_preamble* pre = (const cbuf_preamble*)data;
+  if (pre->hash == cbufmsg::metadata::TYPE_HASH) {
+    pub->metadata_records_.emplace_back(data, data + size);
+  }
+  if (!pub->send_record(data, size)) pub->send_ok_ = false;
+}
+
+bool cbuf_mcast_publisher::send_record(const unsigned char* data, size_t size) {
+  size_t frag_payload = opts_.max_datagram - sizeof(mcast_header);
+  size_t frag_count = (size + frag_payload - 1) / frag_payload;
+  if (frag_count > UINT16_MAX || size > UINT32_MAX) {
+    fprintf(stderr, "Message of %zu bytes is too large to multicast\n", size);
+    return false;
+  }
+
+  mcast_header hdr = {};
+  hdr.magic = MCAST_MAGIC;
+  hdr.session = session_;
+  hdr.seq = next_seq_++;
+  hdr.msg_size = uint32_t(size);
+  hdr.frag_count = uint16_t(frag_count);
+  bool ok = true;
+  for (size_t i = 0; i < frag_count; i++) {
+    size_t offset = i * frag_payload;
+    size_t len = std::min(frag_payload, size - offset);
+    hdr.frag_index = uint16_t(i);
+    hdr.frag_offset = uint32_t(offset);
+    datagram_.resize(sizeof(hdr) + len);
+    memcpy(datagram_.data(), &hdr, sizeof(hdr));
+    memcpy(datagram_.data() + sizeof(hdr), data + offset, len);
+    ssize_t sent = sendto(fd_, datagram_.data(), datagram_.size(), 0, (const struct sockaddr*)dest_.data(),
+                          socklen_t(dest_.size()));
+    // A fragment lost here is a message lost for the subscribers, as on the network
+    if (sent != ssize_t(datagram_.size())) ok = false;
+  }
+  return ok;
+}
+
+bool cbuf_mcast_publisher::announce_metadata(bool force) {
+  double t = now();
+  if (!force && t - last_announce_ < opts_.metadata_period) return true;
+  last_announce_ = t;
+  bool ok = true;
+  for (const auto& record : metadata_records_) {
+    if (!send_record(record.data(), record.size())) ok = false;
+  }
+  return ok;
+}
+
+bool cbuf_mcast_subscriber::open(const char* group, int port, const char* interface) {
+  close();
+  struct sockaddr_in addr;
+  struct ip_mreq mreq = {};
+  if (!parse_address(group, port, addr) || !IN_MULTICAST(ntohl(addr.sin_addr.s_addr)) ||
+      inet_pton(AF_INET, interface, &mreq.imr_interface) != 1) {
+    fprintf(stderr, "Could not join multicast group %s on interface %s\n", group, interface);
+    return false;
+  }
+  mreq.imr_multiaddr = addr.sin_addr;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) return false;
+  // Every subscriber on the machine binds the same port
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  int rcvbuf = 4 * 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+    perror("Could not join the multicast group");
+    ::close(fd);
+    return false;
+  }
+
+  fd_ = fd;
+  datagram_.resize(64 * 1024);
+  partials_.clear();
+  decoder_.reset();
+  has_session_ = false;
+  lost_ = 0;
+  received_ = 0;
+  return true;
+}
+
+void cbuf_mcast_subscriber::close() {
+  if (fd_ != -1) ::close(fd_);
+  fd_ = -1;
+}
+
+void cbuf_mcast_subscriber::complete_sequence(uint64_t seq) {
+  received_++;
+  if (seq >= next_seq_) {
+    lost_ += seq - next_seq_;
+    next_seq_ = seq + 1;
+  } else if (lost_ > 0) {
+    // Counted as lost when a later one completed first
+    lost_--;
+  }
+  // Messages too far behind will not be completed anymore
+  while (!partials_.empty() && partials_.begin()->first + REASSEMBLY_WINDOW < next_seq_) {
+    partials_.erase(partials_.begin());
+  }
+}
+
+bool cbuf_mcast_subscriber::handle_datagram(size_t size) {
+  if (size < sizeof(mcast_header)) return false;
+  mcast_header hdr;
+  memcpy(&hdr, datagram_.data(), sizeof(hdr));
+  size_t len = size - sizeof(hdr);
+  if (hdr.magic != MCAST_MAGIC || hdr.frag_count == 0 || hdr.frag_index >= hdr.frag_count ||
+      size_t(hdr.frag_offset) + len > hdr.msg_size) {
+    return false;
+  }
+  if (!has_session_ || hdr.session != session_) {
+    // A new publisher, its metadata comes again
+    has_session_ = true;
+    session_ = hdr.session;
+    next_seq_ = hdr.seq;
+    partials_.clear();
+    decoder_.reset();
+  }
+  const unsigned char* payload = datagram_.data() + sizeof(hdr);
+
+  if (hdr.frag_count == 1) {
+    if (len != hdr.msg_size) return false;
+    complete_sequence(hdr.seq);
+    decoder_.feed(payload, len);
+    return true;
+  }
+
+  if (hdr.seq + REASSEMBLY_WINDOW < next_seq_) return false;
+  auto& part = partials_[hdr.seq];
+  if (part.have.empty()) {
+    part.data.resize(hdr.msg_size);
+    part.have.assign(hdr.frag_count, false);
+    part.missing = hdr.frag_count;
+  }
+  if (part.have.size() != hdr.frag_count || part.data.size() != hdr.msg_size || part.have[hdr.frag_index]) {
+    return false;
+  }
+  memcpy(part.data.data() + hdr.frag_offset, payload, len);
+  part.have[hdr.frag_index] = true;
+  if (--part.missing > 0) return false;
+
+  complete_.swap(part.data);
+  partials_.erase(hdr.seq);
+  complete_sequence(hdr.seq);
+  decoder_.feed(complete_.data(), complete_.size());
+  return true;
+}
+
+bool cbuf_mcast_subscriber::next(cbuf_decoder::message& msg, int timeout_ms) {
+  if (fd_ == -1) return false;
+  double deadline = now() + timeout_ms / 1000.0;
+  while (true) {
+    if (decoder_.next(msg)) return true;
+
+    int wait_ms = std::max(0, int((deadline - now()) * 1000.0 + 0.5));
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    if (poll(&pfd, 1, wait_ms) <= 0) return false;
+    ssize_t n = recv(fd_, datagram_.data(), datagram_.size(), MSG_DONTWAIT);
+    if (n > 0) handle_datagram(size_t(n));
+  }
+}
@@ -1,5 +1,353 @@
 #include "cbuf_reader.h"
 
+#include <algorithm>
+
+CBufHandlerExecutor::CBufHandlerExecutor(unsigned threads, size_t queue_size)
+    : queue_size_(std::max<size_t>(queue_size, 1)) {
+  for (unsigned i = 0; i < std::max(threads, 1u); i++) {
+    lanes_.push_back(std::make_unique<Lane>());
+  }
+  for (auto& lane : lanes_) {
+    lane->thread = std::thread(&CBufHandlerExecutor::run, this, lane.get());
+  }
+}
+
+CBufHandlerExecutor::~CBufHandlerExecutor() {
+  for (auto& lane : lanes_) {
+    std::lock_guard<std::mutex> lock(lane->mutex);
+    lane->quit = true;
+    lane->cond.notify_all();
+  }
+  for (auto& lane : lanes_) {
+    lane->thread.join();
+  }
+}
+
+void CBufHandlerExecutor::run(Lane* lane) {
+  std::unique_lock<std::mutex> lock(lane->mutex);
+  for (;;) {
+    lane->cond.wait(lock, [lane] { return lane->quit || !lane->tasks.empty(); });
+    if (lane->tasks.empty()) return;
+    Task task = std::move(lane->tasks.front());
+    lane->tasks.pop_front();
+    lane->busy = true;
+    lane->cond.notify_all();
+    lock.unlock();
+    CBufDecodedBase* decoded = task.pooled ? task.pooled->decoded.get() : task.decoded.get();
+    task.handler->dispatchDecoded(decoded, *task.filename);
+    task.decoded.reset();
+    if (task.pooled) task.pooled->release();
+    lock.lock();
+    lane->busy = false;
+    lane->cond.notify_all();
+  }
+}
+
+void CBufHandlerExecutor::submit(CBufHandlerBase* handler, std::shared_ptr<CBufDecodedBase> decoded,
+                                 const std::string* filename) {
+  push({handler, std::move(decoded), nullptr, filename});
+}
+
+void CBufHandlerExecutor::submit(CBufHandlerBase* handler, CBufDecodedPool::Entry* pooled,
+                                 const std::string* filename) {
+  push({handler, nullptr, pooled, filename});
+}
+
+void CBufHandlerExecutor::push(Task task) {
+  CBufHandlerBase* handler = task.handler;
+  auto it = handler_lanes_.find(handler);
+  if (it == handler_lanes_.end()) {
+    // Handlers spread over the threads in the order they get messages
+    it = handler_lanes_.emplace(handler, lanes_[handler_lanes_.size() % lanes_.size()].get()).first;
+  }
+  Lane* lane = it->second;
+  std::unique_lock<std::mutex> lock(lane->mutex);
+  lane->cond.wait(lock, [&] { return lane->tasks.size() < queue_size_; });
+  lane->tasks.push_back(std::move(task));
+  lane->cond.notify_all();
+}
+
+void CBufHandlerExecutor::sync() {
+  for (auto& lane : lanes_) {
+    std::unique_lock<std::mutex> lock(lane->mutex);
+    lane->cond.wait(lock, [&] { return lane->tasks.empty() && !lane->busy; });
+  }
+}
+
+bool CBufReader::startReadAhead() {
+  if (input_streams.empty()) return false;
+  for (auto si : input_streams) {
+    if (!mapStream(si)) return false;
+  }
+  for (auto si : input_streams) {
+    auto ra = std::make_unique<ReadAhead>();
+    ra->si = si;
+    ra->filename = si->cis->filename();
+    ra->processed = si->cis->get_position();
+    si->processed_offset = si->cis->get_current_offset();
+    read_ahead_.push_back(std::move(ra));
+  }
+  reading_ahead_ = true;
+  for (auto& ra : read_ahead_) {
+    ra->thread = std::thread(&CBufReader::readAheadWorker, this, ra.get());
+  }
+
+  auto later = [this](size_t a, size_t b) { return readAheadLater(a, b); };
+  read_ahead_heap_.resize(read_ahead_.size());
+  for (size_t i = 0; i < read_ahead_heap_.size(); i++) {
+    read_ahead_heap_[i] = i;
+    waitReadAheadHead(read_ahead_[i].get());
+  }
+  std::make_heap(read_ahead_heap_.begin(), read_ahead_heap_.end(), later);
+  return true;
+}
+
+void CBufReader::readAheadWorker(ReadAhead* ra) {
+  std::unique_lock<std::mutex> lock(ra->mutex);
+  for (;;) {
+    ra->cond.wait(lock, [&] { return ra->stop || (!ra->ended && ra->items.size() < options_.read_ahead); });
+    if (ra->stop) return;
+    ReadAhead::Item item;
+    if (!ra->spare.empty()) {
+      item = std::move(ra->spare.back());
+      ra->spare.pop_back();
+    }
+    lock.unlock();
+    bool last = false;
+    bool read = readAheadItem(ra, item, last);
+    lock.lock();
+    if (read) {
+      ra->items.push_back(std::move(item));
+    } else {
+      ra->end_corruptions = item.corruptions;
+      ra->spare.push_back(std::move(item));
+    }
+    ra->ended = !read || last;
+    ra->cond.notify_all();
+  }
+}
+
+const std::vector<std::shared_ptr<CBufHandlerBase>>* CBufReader::readAheadHandlers(ReadAhead* ra,
+                                                                                    uint64_t hash) {
+  auto it = ra->types.find(hash);
+  if (it == ra->types.end()) {
+    uint32_t type;
+    {
+      std::lock_guard<std::mutex> lock(type_ids_mutex_);
+      type = type_ids_.of(ra->si->cis, hash);
+    }
+    // Not kept until the stream has the metadata of the hash
+    if (type == CBufTypeIds::NONE) return nullptr;
+    it = ra->types.emplace(hash, type).first;
+  }
+  return it->second < handlers_.size() ? &handlers_[it->second] : nullptr;
+}
+
+bool CBufReader::readAheadItem(ReadAhead* ra, ReadAhead::Item& item, bool& last) {
+  item.handlers.clear();
+  item.decoded.clear();
+  item.halt = false;
+  last = false;
+  cbuf_istream* cis = ra->si->cis;
+  int corruptions = 0;
+  if (!updateStream(ra->si, corruptions)) {
+    // Halts as soon as it is the next item, as computeNextSi halts when it reaches the stream
+    item.halt = true;
+    item.packet_time = -VERY_LARGE_TIMESTAMP;
+    last = true;
+  } else if (cis->empty()) {
+    item.corruptions = corruptions;
+    return false;
+  } else {
+    item.packet_time = ra->si->packet_time;
+    if (!is_valid_late(item.packet_time)) {
+      // Reading finishes when this is the next message of all
+      last = true;
+    } else {
+      bool valid_early = is_valid_early(item.packet_time);
+      const auto* handlers = readAheadHandlers(ra, cis->get_next_hash());
+      if (handlers != nullptr) {
+        for (auto& handler : *handlers) {
+          if (handler->process_always() || valid_early) item.handlers.push_back(handler.get());
+        }
+      }
+      for (size_t i = 0; i < item.handlers.size(); i++) {
+        CBufHandlerBase* handler = item.handlers[i];
+        // Decoded once for the handlers of the same version of the type
+        CBufDecodedPool::Entry* entry = nullptr;
+        for (size_t j = 0; j < i && entry == nullptr; j++) {
+          if (handler->decodedHash() != 0 && item.handlers[j]->decodedHash() == handler->decodedHash()) {
+            entry = item.decoded[j];
+          }
+        }
+        if (entry == nullptr) {
+          auto& pool = ra->pools[handler];
+          if (pool == nullptr) pool = std::make_unique<CBufDecodedPool>();
+          entry = pool->take();
+          if (!handler->decodeInto(*cis, entry->decoded)) {
+            pool->give(entry);
+            entry = nullptr;
+          }
+        }
+        if (entry != nullptr) entry->users++;
+        item.decoded.push_back(entry);
+      }
+      if (!cis->skip_message()) {
+        for (auto entry : item.decoded) {
+          if (entry != nullptr) entry->release();
+        }
+        item.handlers.clear();
+        item.decoded.clear();
+        item.halt = true;
+        item.packet_time = -VERY_LARGE_TIMESTAMP;
+        last = true;
+      }
+    }
+  }
+  item.corruptions = corruptions;
+  item.next = cis->get_position();
+  item.next_offset = cis->get_current_offset();
+  return true;
+}
+
+void CBufReader::waitReadAheadHead(ReadAhead* ra) {
+  std::unique_lock<std::mutex> lock(ra->mutex);
+  ra->cond.wait(lock, [ra] { return ra->ended || !ra->items.empty(); });
+  if (!ra->items.empty()) {
+    ra->head = &ra->items.front();
+    return;
+  }
+  ra->head = nullptr;
+  num_corruptions += ra->end_corruptions;
+  ra->end_corruptions = 0;
+}
+
+bool CBufReader::processReadAhead() {
+  if (finish_reading) return false;
+  if (read_ahead_.empty() && !startReadAhead()) return false;
+
+  ReadAhead* ra = read_ahead_[read_ahead_heap_.front()].get();
+  if (ra->head == nullptr) {
+    // Every stream is done
+    finish_reading = true;
+    return false;
+  }
+  // Left alone by the worker, which only appends items
+  ReadAhead::Item& item = *ra->head;
+  num_corruptions += item.corruptions;
+  item.corruptions = 0;
+  if (item.halt) return false;
+  if (!is_valid_late(item.packet_time)) {
+    finish_reading = true;
+    return false;
+  }
+
+  for (size_t i = 0; i < item.handlers.size(); i++) {
+    CBufDecodedPool::Entry* entry = item.decoded[i];
+    if (entry == nullptr) continue;
+    if (executor_) {
+      executor_->submit(item.handlers[i], entry, &ra->filename);
+    } else {
+      item.handlers[i]->dispatchDecoded(entry->decoded.get(), ra->filename);
+      entry->release();
+    }
+  }
+  ra->processed = item.next;
+  ra->si->processed_offset = item.next_offset;
+  {
+    std::lock_guard<std::mutex> lock(ra->mutex);
+    ra->spare.push_back(std::move(item));
+    ra->items.pop_front();
+    ra->cond.notify_all();
+  }
+
+  // Only the stream on top has a new head
+  auto later = [this](size_t a, size_t b) { return readAheadLater(a, b); };
+  waitReadAheadHead(ra);
+  std::pop_heap(read_ahead_heap_.begin(), read_ahead_heap_.end(), later);
+  std::push_heap(read_ahead_heap_.begin(), read_ahead_heap_.end(), later);
+  return true;
+}
+
+void CBufReader::stopBackgroundWork() {
+  // Handlers may still use messages of the streams
+  if (executor_) executor_->sync();
+  if (read_ahead_.empty()) return;
+  for (auto& ra : read_ahead_) {
+    std::lock_guard<std::mutex> lock(ra->mutex);
+    ra->stop = true;
+    ra->cond.notify_all();
+  }
+  for (auto& ra : read_ahead_) {
+    ra->thread.join();
+    // Messages decoded but not processed are read again
+    if (!ra->si->cis->restore_position(ra->processed)) {
+      error_string_ = "Could not go back to the last message processed on " + ra->si->filename;
+    }
+  }
+  read_ahead_.clear();
+  read_ahead_heap_.clear();
+  reading_ahead_ = false;
+  streams_moved_ = true;
+}
+
+void CBufReader::dispatchMessage(cbuf_istream* cis,
+                                 const std::vector<std::shared_ptr<CBufHandlerBase>>& handlers) {
+  bool valid_early = is_valid_early(cis->get_next_timestamp());
+  if (executor_) {
+    // Messages outlive the stream position, decoded into new ones shared by the handlers of
+    // the same version of the type
+    executor_decodes_.clear();
+    for (auto& handler : handlers) {
+      if (!handler->process_always() && !valid_early) continue;
+      if (!handler->canDecodeAhead()) {
+        handler->processMessage(*cis);
+        continue;
+      }
+      uint64_t version = handler->decodedHash();
+      auto it = std::find_if(executor_decodes_.begin(), executor_decodes_.end(),
+                             [version](const auto& entry) { return version != 0 && entry.first == version; });
+      if (it == executor_decodes_.end()) {
+        executor_decodes_.emplace_back(version, handler->decodeMessage(*cis));
+        it = executor_decodes_.end() - 1;
+      }
+      if (it->second != nullptr) executor_->submit(handler.get(), it->second, &cis->filename());
+    }
+    return;
+  }
+
+  // A single handler decodes into its own message
+  if (handlers.size() == 1) {
+    if (handlers[0]->process_always() || valid_early) handlers[0]->processMessage(*cis);
+    return;
+  }
+
+  shared_decodes_.clear();
+  for (auto& handler : handlers) {
+    if (!handler->process_always() && !valid_early) continue;
+    uint64_t version = handler->decodedHash();
+    if (version == 0) {
+      handler->processMessage(*cis);
+      continue;
+    }
+    auto it = std::find_if(shared_decodes_.begin(), shared_decodes_.end(),
+                           [version](const auto& entry) { return entry.first == version; });
+    if (it == shared_decodes_.end()) {
+      shared_decodes_.emplace_back(version, handler->decodeReused(*cis));
+      it = shared_decodes_.end() - 1;
+    }
+    if (it->second != nullptr) handler->dispatchDecoded(it->second, cis->filename());
+  }
+}
+
+double CBufReader::getNextTimestamp() {
+  if (read_ahead_.empty()) return CBufReaderBase::getNextTimestamp();
+  if (finish_reading) return -1;
+  const ReadAhead::Item* head = read_ahead_[read_ahead_heap_.front()]->head;
+  if (head == nullptr || head->halt || !is_valid_late(head->packet_time)) return -1;
+  return head->packet_time;
+}
+
 bool CBufReaderWindow::initialize() {
   // Find the mapping between offsets and states
   max_offset_ = 0;
@@ -35,15 +383,17 @@ bool CBufReaderWindow::initialize() {
   finish_reading = false;
 
   for (auto si : input_streams) {
-    si->cis->reset_ptr();
+    jumpStream(si, 0);
   }
+  streams_moved_ = true;
 
   while (processMessage()) {
   }
 
   for (auto si : input_streams) {
-    si->cis->reset_ptr();
+    jumpStream(si, 0);
   }
+  streams_moved_ = true;
 
   removeHandlers();
 
@@ -139,9 +489,7 @@ bool CBufReaderWindow::processGetters() {
 
   auto nhash = next_si->cis->get_next_hash();
   cbuf_istream* next_cis = next_si->cis;
-  auto str = next_cis->get_string_for_hash(nhash);
-  last_msg_type_ = str;
-  // check if the topic name for this message has a namespace
+  last_msg_type_ = type_ids_.of(next_cis, nhash);
 
   auto msize = next_cis->get_next_size();
   if (msize == 0 || !next_cis->check_next_preamble()) {
@@ -149,9 +497,8 @@ bool CBufReaderWindow::processGetters() {
     return false;
   }
 
-  if ((is_external_ || isCorrectBox()) && info_getters_map.count(str) > 0) {
-    auto& handler = info_getters_map[str];
-    handler->processMessage(*next_cis);
+  if ((is_external_ || isCorrectBox()) && lastInfoGetter() != nullptr) {
+    lastInfoGetter()->processMessage(*next_cis);
   }
 
   if (!next_cis->skip_message()) return false;
@@ -164,9 +511,7 @@ bool CBufReaderWindow::processMessage() {
 
   auto nhash = next_si->cis->get_next_hash();
   cbuf_istream* next_cis = next_si->cis;
-  auto str = next_cis->get_string_for_hash(nhash);
-  last_msg_type_ = str;
-  // check if the topic name for this message has a namespace
+  last_msg_type_ = type_ids_.of(next_cis, nhash);
 
   auto msize = next_cis->get_next_size();
   if (msize == 0 || !next_cis->check_next_preamble()) {
@@ -174,17 +519,16 @@ bool CBufReaderWindow::processMessage() {
     return false;
   }
 
-  if ((is_external_ || isCorrectBox()) && msg_map.count(str) > 0) {
-    for (auto& handler : msg_map[str]) {
+  if ((is_external_ || isCorrectBox()) && last_msg_type_ < handlers_.size()) {
+    for (auto& handler : handlers_[last_msg_type_]) {
       if (handler->process_always() || is_valid_early(next_cis->get_next_timestamp())) {
         handler->processMessage(*next_cis);
       }
     }
   }
 
-  if ((is_external_ || isCorrectBox()) && info_getters_map.count(str) > 0) {
-    auto& handler = info_getters_map[str];
-    handler->processMessage(*next_cis);
+  if ((is_external_ || isCorrectBox()) && lastInfoGetter() != nullptr) {
+    lastInfoGetter()->processMessage(*next_cis);
   }
 
   if (!next_cis->skip_message()) return false;
@@ -197,9 +541,7 @@ bool CBufReaderWindow::processSilently() {
 
   auto nhash = next_si->cis->get_next_hash();
   cbuf_istream* next_cis = next_si->cis;
-  auto str = next_cis->get_string_for_hash(nhash);
-  last_msg_type_ = str;
-  // check if the topic name for this message has a namespace
+  last_msg_type_ = type_ids_.of(next_cis, nhash);
 
   auto msize = next_cis->get_next_size();
   if (msize == 0 || !next_cis->check_next_preamble()) {
@@ -207,9 +549,8 @@ bool CBufReaderWindow::processSilently() {
     return false;
   }
 
-  if ((is_external_ || isCorrectBox()) && info_getters_map.count(str) > 0) {
-    auto& handler = info_getters_map[str];
-    handler->processMessage(*next_cis);
+  if ((is_external_ || isCorrectBox()) && lastInfoGetter() != nullptr) {
+    lastInfoGetter()->processMessage(*next_cis);
   }
 
   if (!next_cis->skip_message()) return false;
@@ -221,7 +562,7 @@ std::vector<size_t> CBufReaderWindow::getState() const {
   std::vector<size_t> state;
 
   for (auto si : input_streams) {
-    state.push_back(si->cis->get_current_offset());
+    state.push_back(streamOffset(si));
   }
 
   return state;
@@ -234,8 +575,9 @@ bool CBufReaderWindow::jumpToOffset(const uint32_t seq_offset) {
     auto si = input_streams[i];
     size_t jump_offset = state[i];
 
-    if (!(si->cis->jump_to_offset(jump_offset))) return false;
+    if (!jumpStream(si, jump_offset)) return false;
   }
+  streams_moved_ = true;
 
   if (!computeNextSi()) return false;
 
@@ -245,8 +587,8 @@ bool CBufReaderWindow::jumpToOffset(const uint32_t seq_offset) {
 std::optional<uint32_t> CBufReaderWindow::getCurrentOffset() {
   if (!is_external_ && !isCorrectBox()) return {};
 
-  if (auto it = info_getters_map.find(last_msg_type_); it != info_getters_map.end()) {
-    return it->second->getCurrentOffset();
+  if (auto getter = lastInfoGetter()) {
+    return getter->getCurrentOffset();
   }
 
   return {};
@@ -255,8 +597,8 @@ std::optional<uint32_t> CBufReaderWindow::getCurrentOffset() {
 std::optional<double> CBufReaderWindow::getCurrentTimestamp() {
   if (!is_external_ && !isCorrectBox()) return {};
 
-  if (auto it = info_getters_map.find(last_msg_type_); it != info_getters_map.end()) {
-    return it->second->getCurrentTimestamp();
+  if (auto getter = lastInfoGetter()) {
+    return getter->getCurrentTimestamp();
   }
 
   return {};
@@ -1,11 +1,29 @@
 #include "cbuf_readerbase.h"
 
+#include <chrono>
 #include <filesystem>
 
 #include "ulogger.h"
 
 namespace fs = std::filesystem;
 
+uint32_t CBufTypeIds::add(std::string_view name) {
+  auto it = ids_.find(name);
+  if (it != ids_.end()) return it->second;
+  uint32_t id = uint32_t(names_.size());
+  names_.emplace_back(name);
+  ids_.emplace(names_.back(), id);
+  return id;
+}
+
+uint32_t CBufTypeIds::resolve(const cbuf_istream* cis, uint64_t hash) {
+  std::string_view name = cis->get_string_view_for_hash(hash);
+  if (name.empty()) return NONE;
+  uint32_t id = add(name);
+  hash_ids_.emplace(hash, id);
+  return id;
+}
+
 // returns true if time t is within our range
 bool CBufReaderBase::is_valid_early(double t) const noexcept {
   if (startTime > 0) {
@@ -26,67 +44,86 @@ bool CBufReaderBase::is_valid_late(double t) const noexcept {
   return true;
 }
 
-bool CBufReaderBase::computeNextSi() {
-  // nothing else to do
-  if (finish_reading) return false;
-
-  if (input_streams.empty()) return false;
+bool CBufReaderBase::updateStream(StreamInfo* si, int& corruptions) {
+  if (!si->mapped) {
+    if (si->exhausted) si->packet_time = VERY_LARGE_TIMESTAMP;
+    return true;
+  }
+  // Files followed are read further once the folder shows them growing, see waitFollowed
+  if (si->cis->is_live() && si->cis->empty_no_internal()) {
+    si->cis->receive(options_.socket_timeout_ms);
+  }
+  if (si->cis->empty_no_internal()) {
+    si->packet_time = VERY_LARGE_TIMESTAMP;
+    return true;
+  }
+  bool corrupted = !si->cis->check_next_preamble() || (si->cis->get_next_size() == 0);
+  if (!options_.try_recovery && corrupted) {
+    fprintf(stderr, "** Failed to process corrupted cbuf file %s; halting\n", si->filename.c_str());
+    corruptions++;
+    return false;
+  }
 
-  // Compute the correct packet time and ensure we skip corruption
-  for (auto si : input_streams) {
-    if (si->cis->empty_no_internal()) {
-      si->packet_time = VERY_LARGE_TIMESTAMP;
-      continue;
+  while (corrupted && !si->cis->empty()) {
+    corruptions++;
+    auto msize = si->cis->get_next_size();
+    auto nhash = si->cis->get_next_hash();
+    fprintf(stderr,
+            " ** Reading a cbuf message on %s with invalid preamble (size: %zu, hash: %" PRIX64
+            ") [FileSize %zu, Offset %zu], this indicates a corrupted ulog. Trying to recover...\n",
+            si->filename.c_str(), msize, nhash, si->cis->get_filesize(), si->cis->get_current_offset());
+    auto off = si->cis->get_current_offset();
+    if (si->cis->skip_corrupted()) {
+      fprintf(stderr, "  => Recovered from corruption, skipped %zu bytes\n",
+              si->cis->get_current_offset() - off);
     }
-    bool corrupted = !si->cis->check_next_preamble() || (si->cis->get_next_size() == 0);
-    if (!options_.try_recovery && corrupted) {
-      fprintf(stderr, "** Failed to process corrupted cbuf file %s; halting\n", si->filename.c_str());
-      num_corruptions++;
-      return false;
+    if (si->cis->empty()) {
+      corrupted = false;
+      break;
     }
-
-    while (corrupted && !si->cis->empty()) {
-      num_corruptions++;
-      auto msize = si->cis->get_next_size();
-      auto nhash = si->cis->get_next_hash();
-      fprintf(stderr,
-              " ** Reading a cbuf message on %s with invalid preamble (size: %u, hash: %" PRIX64
-              ") [FileSize %zu, Offset %zu], this indicates a corrupted ulog. Trying to recover...\n",
-              si->filename.c_str(), msize, nhash, si->cis->get_filesize(), si->cis->get_current_offset());
-      auto off = si->cis->get_current_offset();
-      if (si->cis->skip_corrupted()) {
-        fprintf(stderr, "  => Recovered from corruption, skipped %zu bytes\n",
-                si->cis->get_current_offset() - off);
-      }
-      if (si->cis->empty()) {
-        corrupted = false;
-        break;
-      }
-      corrupted = !si->cis->check_next_preamble() || (si->cis->get_next_size() == 0);
-    }
-    if (corrupted || si->cis->empty()) {
+    corrupted = !si->cis->check_next_preamble() || (si->cis->get_next_size() == 0);
+  }
+  if (corrupted || si->cis->empty()) {
+    si->packet_time = VERY_LARGE_TIMESTAMP;
+  } else {
+    // One more case that can happen here, we have one last packet that is not complete
+    // The answer is to skip it
+    if (si->cis->get_next_size() > si->cis->get_remaining_size()) {
+      si->cis->skip_message();
       si->packet_time = VERY_LARGE_TIMESTAMP;
     } else {
-      // One more case that can happen here, we have one last packet that is not complete
-      // The answer is to skip it
-      if (si->cis->get_next_size() > si->cis->get_remaining_size()) {
-        si->cis->skip_message();
-        si->packet_time = VERY_LARGE_TIMESTAMP;
-      } else {
-        // This is the good case, we found the right timestamp of a valid packet
-        si->packet_time = si->cis->get_next_timestamp();
-      }
+      // This is the good case, we found the right timestamp of a valid packet
+      si->packet_time = si->cis->get_next_timestamp();
     }
   }
+  return true;
+}
 
-  // Find earliest packet
-  next_si = input_streams[0];
-  for (auto si : input_streams) {
-    if (si->packet_time < next_si->packet_time) {
-      next_si = si;
+bool CBufReaderBase::computeNextSi() {
+  // nothing else to do
+  if (finish_reading) return false;
+
+  // A folder followed can get its first files later
+  if (input_streams.empty() && follower_.is_open()) waitFollowed(options_.socket_timeout_ms);
+  if (input_streams.empty()) return false;
+
+  if (!mergeStreams()) return false;
+  if (next_si->cis->empty() && follower_.is_open()) {
+    // Nothing to read, wait for the files followed to grow or for new ones
+    using clock = std::chrono::steady_clock;
+    auto deadline = clock::now() + std::chrono::milliseconds(options_.socket_timeout_ms);
+    while (next_si->cis->empty()) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now());
+      if (wait.count() <= 0 || !waitFollowed(int(wait.count()))) break;
+      streams_moved_ = true;
+      if (!mergeStreams()) return false;
     }
   }
 
+  if (next_si->cis->empty() && has_live_streams_) {
+    // Nothing received yet, more can arrive later
+    return false;
+  }
   if (next_si->cis->empty() || !is_valid_late(next_si->packet_time)) {
     finish_reading = true;
     // nothing more to do here
@@ -96,42 +133,124 @@ bool CBufReaderBase::computeNextSi() {
   return true;
 }
 
+bool CBufReaderBase::mergeStreams() {
+  // Earliest packet on top, ties going to the first stream
+  auto later = [this](size_t a, size_t b) {
+    double ta = input_streams[a]->packet_time;
+    double tb = input_streams[b]->packet_time;
+    return ta > tb || (ta == tb && a > b);
+  };
+
+  // Compute the correct packet time and ensure we skip corruption. Live streams can get
+  // messages any time, so they are all checked again
+  // Files read to the end are unmapped
+  auto update = [this](StreamInfo* si) {
+    if (!updateStream(si, num_corruptions)) return false;
+    if (si->mapped && !si->path.empty() && si->packet_time == VERY_LARGE_TIMESTAMP) {
+      unmapStream(si);
+      si->exhausted = true;
+    }
+    return true;
+  };
+  if (streams_moved_ || has_live_streams_ || stream_heap_.size() != input_streams.size()) {
+    for (auto si : input_streams) {
+      if (!update(si)) return false;
+    }
+    stream_heap_.resize(input_streams.size());
+    for (size_t i = 0; i < stream_heap_.size(); i++) {
+      stream_heap_[i] = i;
+    }
+    std::make_heap(stream_heap_.begin(), stream_heap_.end(), later);
+    streams_moved_ = false;
+  } else {
+    // Only the stream on top was read from
+    if (!update(input_streams[stream_heap_.front()])) return false;
+    std::pop_heap(stream_heap_.begin(), stream_heap_.end(), later);
+    std::push_heap(stream_heap_.begin(), stream_heap_.end(), later);
+  }
+  // A stream not mapped is on the heap by a time no later than its next message, it is only
+  // mapped once on top
+  while (!input_streams[stream_heap_.front()]->mapped &&
+         input_streams[stream_heap_.front()]->packet_time < VERY_LARGE_TIMESTAMP) {
+    StreamInfo* si = input_streams[stream_heap_.front()];
+    if (!mapStream(si)) {
+      if (!options_.try_recovery) return false;
+      si->exhausted = true;
+    }
+    if (!update(si)) return false;
+    std::pop_heap(stream_heap_.begin(), stream_heap_.end(), later);
+    std::push_heap(stream_heap_.begin(), stream_heap_.end(), later);
+  }
+  next_si = input_streams[stream_heap_.front()];
+  return true;
+}
+
+bool CBufReaderBase::wantsFile(const CBufCatalog::FileInfo& info) const {
+  double start = needs_early_messages_ ? -1 : startTime;
+  // Files without the types handled are still opened, getMessageCounts counts every type
+  return info.overlaps(start, endTime, type_filter_);
+}
+
 bool CBufReaderBase::openUlog(bool error_ok) {
   if (!fs::exists(ulog_path_)) {
     error_string_ = "Could not find ulog path " + ulog_path_;
     return false;
   }
+  stopBackgroundWork();
+  if (options_.follow && !follower_.is_open()) {
+    // Watched before listing the folder, so no file created meanwhile is missed
+    if (!follower_.watch_folder(ulog_path_)) {
+      error_string_ = "Could not watch the ulog path " + ulog_path_;
+      follower_.close();
+      return false;
+    }
+  }
+  CBufCatalog catalog;
+  catalog.load(ulog_path_);
   for (const auto& f : fs::directory_iterator(ulog_path_)) {
     if (f.path().extension().string() == ".cb") {
-      if (!source_filters_.empty()) {
-        bool filter_match = false;
-        std::string filename = f.path().filename();
-        for (auto& str : source_filters_) {
-          // Find the source_filter in filename only.
-          if (std::string::npos != filename.find(str, 0)) {
-            filter_match = true;
-            break;
-          }
-        }
-        if (!filter_match) {
-          // skip cbufs that do not contain the source name we want to filter on
-          continue;
-        }
+      // skip cbufs that do not contain the source name we want to filter on
+      if (!matchesSourceFilters(f.path().filename())) continue;
+
+      // The catalog entry only holds while the file is unchanged. Files in it are closed
+      std::error_code ec;
+      auto file_size = fs::file_size(f, ec);
+      const auto* info = catalog.find(f.path().filename().string());
+      bool cataloged = info != nullptr && info->file_size == file_size;
+      if (follower_.is_open() && !cataloged) {
+        if (!followFile(fs::absolute(f).string()) && !options_.try_recovery) return false;
+        continue;
       }
-      
+
       // Check the file is not empty
-      std::error_code ec;
-      if (fs::file_size(f, ec) == 0) {
+      if (file_size == 0) {
+        continue;
+      }
+      if (cataloged && !wantsFile(*info)) {
         continue;
       }
-      
-      // this is a cb file, open it
+
+      // this is a cb file, it is mapped once read. Only its start time is needed until then
       StreamInfo* si = new StreamInfo;
       si->cis = new cbuf_istream();
       si->filename = f.path().string();
       std::string fname = fs::absolute(f).string();
-      if (si->cis->open_file(fname.c_str())) {
+      si->path = fname;
+      si->mapped = false;
+      si->file_size = file_size;
+      bool readable = true;
+      if (cataloged) {
+        si->start_time = info->start_time;
+      } else {
+        readable = cbuf_istream::peek_start_time(fname.c_str(), si->start_time);
+      }
+      si->packet_time = si->start_time;
+      si->cis->set_filename(fname.c_str());
+      si->cis->set_map_options(options_.map_options);
+      si->cis->set_resync_options(options_.resync_options);
+      if (readable) {
         si->cis->disable_consume_on_deserialize();
+        si->cis->set_expand_repeats(options_.expand_repeats);
         input_streams.push_back(si);
       } else {
         error_string_ = "Could not open file " + fname + " for reading.";
@@ -144,20 +263,210 @@ bool CBufReaderBase::openUlog(bool error_ok) {
       }
     }
   }
-  if (input_streams.size() == 0) {
+  // Files show up later on a folder followed
+  if (follower_.is_open()) has_live_streams_ = true;
+  if (input_streams.size() == 0 && !follower_.is_open()) {
     if (!error_ok) {
       error_string_ = "Could not find any 'cb' file on the ulog file " + ulog_path_;
       return false;
     }
   }
   is_opened = true;
+  open_count_++;
+  streams_moved_ = true;
+  start_seek_pending_ = true;
+  return true;
+}
+
+bool CBufReaderBase::addLiveStream(cbuf_istream* cis) {
+  stopBackgroundWork();
+  StreamInfo* si = new StreamInfo;
+  si->cis = cis;
+  si->filename = cis->filename();
+  cis->disable_consume_on_deserialize();
+  cis->set_expand_repeats(options_.expand_repeats);
+  input_streams.push_back(si);
+  has_live_streams_ = true;
+  is_opened = true;
+  open_count_++;
+  streams_moved_ = true;
+  return true;
+}
+
+bool CBufReaderBase::followFile(const std::string& path) {
+  for (auto si : input_streams) {
+    if (si->cis->filename() == path) return true;
+  }
+  cbuf_istream* cis = new cbuf_istream();
+  if (!follower_.follow(cis, path)) {
+    error_string_ = "Could not open file " + path + " for reading.";
+    delete cis;
+    return false;
+  }
+  return addLiveStream(cis);
+}
+
+bool CBufReaderBase::waitFollowed(int timeout_ms) {
+  return follower_.wait(timeout_ms, [this](const std::string& path) {
+    fs::path file(path);
+    if (file.extension().string() != ".cb" || !matchesSourceFilters(file.filename())) return;
+    followFile(path);
+  });
+}
+
+bool CBufReaderBase::matchesSourceFilters(const std::string& filename) const {
+  if (source_filters_.empty()) return true;
+  for (auto& str : source_filters_) {
+    // Find the source_filter in filename only.
+    if (std::string::npos != filename.find(str, 0)) return true;
+  }
+  return false;
+}
+
+bool CBufReaderBase::openSocket(const char* ip, int port) {
+  cbuf_istream* cis = new cbuf_istream();
+  if (!cis->open_socket(ip, port)) {
+    error_string_ = "Could not listen on " + std::string(ip) + ":" + std::to_string(port);
+    delete cis;
+    return false;
+  }
+  return addLiveStream(cis);
+}
+
+bool CBufReaderBase::openUnixSocket(const char* path) {
+  cbuf_istream* cis = new cbuf_istream();
+  if (!cis->open_unix_socket(path)) {
+    error_string_ = "Could not listen on " + std::string(path);
+    delete cis;
+    return false;
+  }
+  return addLiveStream(cis);
+}
+
+bool CBufReaderBase::openMulticast(const char* group, int port, const char* interface) {
+  cbuf_istream* cis = new cbuf_istream();
+  if (!cis->open_multicast(group, port, interface)) {
+    error_string_ = "Could not join " + std::string(group) + ":" + std::to_string(port);
+    delete cis;
+    return false;
+  }
+  return addLiveStream(cis);
+}
+
+void CBufReaderBase::setTypeFilter(const std::vector<std::string>& types) {
+  stopBackgroundWork();
+  type_filter_ = types;
+  streams_moved_ = true;
+  for (auto si : input_streams) {
+    // Streams not mapped get the filter when mapped
+    if (!si->mapped) continue;
+    if (type_filter_.empty()) {
+      si->cis->clear_type_filter();
+    } else {
+      si->cis->set_type_filter(type_filter_);
+    }
+  }
+}
+
+bool CBufReaderBase::seekToTime(double t) {
+  stopBackgroundWork();
+  bool ret = true;
+  for (auto si : input_streams) {
+    if (si->mapped) {
+      if (!si->cis->seek_to_time(t)) ret = false;
+    } else {
+      si->seek_time = t;
+      si->seek_needs_index = false;
+      si->exhausted = false;
+      si->packet_time = si->start_time;
+    }
+  }
+  finish_reading = false;
+  streams_moved_ = true;
+  start_seek_pending_ = false;
+  return ret;
+}
+
+void CBufReaderBase::seekToStartTime() {
+  start_seek_pending_ = false;
+  if (startTime <= 0 || needs_early_messages_ || has_live_streams_) return;
+  stopBackgroundWork();
+  // Without an index seeking relies on how far timestamps go back, the filter on the
+  // start time does not
+  for (auto si : input_streams) {
+    if (streamOffset(si) != 0) continue;
+    if (si->mapped) {
+      if (si->cis->get_index() != nullptr) si->cis->seek_to_time(startTime);
+    } else if (!si->exhausted) {
+      si->seek_time = startTime;
+      si->seek_needs_index = true;
+    }
+  }
+  streams_moved_ = true;
+}
+
+bool CBufReaderBase::mapStream(StreamInfo* si) {
+  si->last_use = ++use_count_;
+  if (si->mapped) return true;
+  if (options_.max_open_files > 0 && mapped_files_ >= options_.max_open_files) {
+    StreamInfo* lru = nullptr;
+    for (auto other : input_streams) {
+      if (!other->mapped || other->path.empty()) continue;
+      if (lru == nullptr || other->last_use < lru->last_use) lru = other;
+    }
+    if (lru != nullptr) unmapStream(lru);
+  }
+  if (!si->cis->open_file(si->path.c_str())) {
+    error_string_ = "Could not open file " + si->path + " for reading.";
+    return false;
+  }
+  si->mapped = true;
+  mapped_files_++;
+  // Types the subclass reads, unless a type filter was given
+  const auto& types = type_filter_.empty() ? handler_types_ : type_filter_;
+  if (!types.empty()) si->cis->set_type_filter(types);
+  bool seek = si->seek_time > 0 && (!si->seek_needs_index || si->cis->get_index() != nullptr);
+  double seek_time = si->seek_time;
+  si->seek_time = -1;
+  if (seek) {
+    si->cis->seek_to_time(seek_time);
+  } else if (!si->cis->restore_position(si->position)) {
+    si->cis->jump_to_offset(si->position.offset);
+  }
+  return true;
+}
+
+void CBufReaderBase::unmapStream(StreamInfo* si) {
+  if (!si->mapped || si->path.empty()) return;
+  si->position = si->cis->get_position();
+  si->cis->close();
+  si->mapped = false;
+  mapped_files_--;
+}
+
+size_t CBufReaderBase::streamOffset(const StreamInfo* si) const {
+  return si->mapped ? si->cis->get_current_offset() : si->position.offset;
+}
+
+bool CBufReaderBase::jumpStream(StreamInfo* si, size_t offset) {
+  if (si->mapped) {
+    if (offset != 0) return si->cis->jump_to_offset(offset);
+    si->cis->reset_ptr();
+    return true;
+  }
+  if (offset > si->file_size) return false;
+  si->position = cbuf_istream::position{offset, 0};
+  si->seek_time = -1;
+  si->seek_needs_index = false;
+  si->exhausted = false;
+  si->packet_time = si->start_time;
   return true;
 }
 
 size_t CBufReaderBase::getTotalCbSize() const {
   size_t total = 0;
   for (auto si : input_streams) {
-    total += si->cis->get_filesize();
+    total += si->mapped ? si->cis->get_filesize() : si->file_size;
   }
   return total;
 }
@@ -165,12 +474,14 @@ size_t CBufReaderBase::getTotalCbSize() const {
 size_t CBufReaderBase::getConsumedCbSize() const {
   size_t consumed = 0;
   for (auto si : input_streams) {
-    consumed += si->cis->get_current_offset();
+    consumed += reading_ahead_ ? si->processed_offset : streamOffset(si);
   }
   return consumed;
 }
 
 void CBufReaderBase::close() {
+  stopBackgroundWork();
+  follower_.close();
   for (auto& si : input_streams) {
     if (si != nullptr) {
       if (si->cis != nullptr) {
@@ -182,16 +493,37 @@ void CBufReaderBase::close() {
     }
   }
   input_streams.clear();
+  mapped_files_ = 0;
+  next_si = nullptr;
+  streams_moved_ = true;
+  has_live_streams_ = false;
   is_opened = false;
+  open_count_++;
 }
 
 std::unordered_map<std::string, unsigned int> CBufReaderBase::getMessageCounts(std::string& error_string) {
   std::unordered_map<std::string, unsigned int> msg_counts;
+  // Scanned messages are counted by type id, without looking up their names
+  std::vector<unsigned int> type_counts;
+  stopBackgroundWork();
   for (auto si : input_streams) {
-    si->cis->reset_ptr();
+    jumpStream(si, 0);
   }
 
   for (auto si : input_streams) {
+    if (!mapStream(si)) {
+      error_string = "Could not open file " + si->path + " for reading.";
+      continue;
+    }
+    // Files with an index do not need to be scanned
+    const CBufIndex* index = si->cis->get_index();
+    if (index != nullptr) {
+      for (const auto& info : index->types()) {
+        auto count = info.count + (options_.expand_repeats ? info.repeats : 0);
+        if (count > 0) msg_counts[info.name] += count;
+      }
+      continue;
+    }
     while (!si->cis->empty()) {
       auto msize = si->cis->get_next_size();
       auto nhash = si->cis->get_next_hash();
@@ -203,18 +535,20 @@ std::unordered_map<std::string, unsigned int> CBufReaderBase::getMessageCounts(s
         si->cis->skip_message();
         continue;
       }
-      auto msg_name = si->cis->get_string_for_hash(nhash);
-      if (msg_counts.find(msg_name) == msg_counts.end()) {
-        msg_counts[msg_name] = 1;
-      } else {
-        msg_counts[msg_name]++;
-      }
+      uint32_t type = type_ids_.of(si->cis, nhash);
+      if (type == CBufTypeIds::NONE) type = type_ids_.add("");
+      if (type >= type_counts.size()) type_counts.resize(type + 1);
+      type_counts[type]++;
       si->cis->skip_message();
     }
   }
+  for (uint32_t type = 0; type < type_counts.size(); type++) {
+    if (type_counts[type] > 0) msg_counts[type_ids_.name(type)] += type_counts[type];
+  }
   // Leave the streams at the start
   for (auto si : input_streams) {
-    si->cis->reset_ptr();
+    jumpStream(si, 0);
   }
+  streams_moved_ = true;
   return msg_counts;
 }
@@ -0,0 +1,418 @@
+#include "cbuf_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <metadata.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+static constexpr uint32_t SHM_MAGIC = 0x4D485343;  // "CSHM"
+static constexpr uint32_t SHM_VERSION = 1;
+static constexpr unsigned MAX_SUBSCRIBERS = 32;
+// Records start aligned, so simple structs can be viewed in place
+static constexpr size_t RECORD_ALIGN = 8;
+
+enum SlotState : uint32_t {
+  SLOT_FREE = 0,
+  // Taken by a subscriber still setting its position, ignored by the publisher
+  SLOT_CLAIMING,
+  SLOT_ACTIVE,
+  SLOT_EVICTED,
+};
+
+struct alignas(64) cbuf_shm_slot {
+  std::atomic<uint32_t> state;
+  // Position of the next byte the subscriber reads, the publisher cannot write past it a lap later
+  std::atomic<uint64_t> read_pos;
+};
+
+// Start of the shared memory, followed by the ring and then the metadata area. Positions
+// count bytes written since the ring was created; the offset on the ring is modulo capacity.
+// A record that does not fit before the end of the ring starts over at its beginning, after a
+// preamble with no hash or size, or no preamble at all if it does not fit either
+struct cbuf_shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t metadata_capacity;
+  uint64_t data_offset;
+  uint64_t metadata_offset;
+
+  alignas(64) std::atomic<uint64_t> write_pos;
+  // Futex words, bumped when messages are published and when subscribers release them
+  std::atomic<uint32_t> data_seq;
+  std::atomic<uint32_t> data_waiters;
+  std::atomic<uint32_t> closed;
+  alignas(64) std::atomic<uint32_t> space_seq;
+  std::atomic<uint32_t> space_waiters;
+  // Bytes of metadata records on the metadata area
+  std::atomic<uint64_t> metadata_size;
+
+  cbuf_shm_slot slots[MAX_SUBSCRIBERS];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs lock free atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex words have to be 32 bits");
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+static double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+static size_t align_up(size_t size, size_t alignment) { return (size + alignment - 1) / alignment * alignment; }
+
+// The words are shared between processes, so no FUTEX_PRIVATE_FLAG
+static void futex_wait(std::atomic<uint32_t>* word, uint32_t val, double seconds) {
+  struct timespec ts;
+  ts.tv_sec = time_t(seconds);
+  ts.tv_nsec = long((seconds - double(ts.tv_sec)) * 1e9);
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, val, &ts, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Bump a futex word and wake whoever sleeps on it
+static void notify(std::atomic<uint32_t>* seq, std::atomic<uint32_t>* waiters) {
+  seq->fetch_add(1);
+  if (waiters->load() > 0) futex_wake(seq);
+}
+
+void add_metadata_cbuf_shm(const char* msg_meta, uint64_t hash, const char* msg_name, void* ctx) {
+  cbuf_shm_publisher* pub = static_cast<cbuf_shm_publisher*>(ctx);
+  pub->add_metadata(msg_meta, hash, msg_name);
+}
+
+double cbuf_shm_publisher::now() const { return ::now(); }
+
+bool cbuf_shm_publisher::create(const char* name, const options& opts) {
+  close();
+  opts_ = opts;
+  size_t capacity = align_up(std::max<size_t>(opts.capacity, 4096), RECORD_ALIGN);
+  size_t data_offset = align_up(sizeof(cbuf_shm_header), 64);
+  size_t metadata_offset = data_offset + align_up(capacity, 64);
+  size_t map_size = metadata_offset + opts.metadata_capacity;
+
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd == -1) {
+    perror("Could not create the shared memory");
+    return false;
+  }
+  if (ftruncate(fd, map_size) != 0) {
+    perror("Could not size the shared memory");
+    ::close(fd);
+    return false;
+  }
+  void* base = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    perror("Could not map the shared memory");
+    ::close(fd);
+    return false;
+  }
+
+  hdr_ = new (base) cbuf_shm_header();
+  hdr_->capacity = capacity;
+  hdr_->metadata_capacity = opts.metadata_capacity;
+  hdr_->data_offset = data_offset;
+  hdr_->metadata_offset = metadata_offset;
+  hdr_->version = SHM_VERSION;
+  // Subscribers check the magic last, once everything else is set
+  std::atomic_thread_fence(std::memory_order_release);
+  hdr_->magic = SHM_MAGIC;
+  data_ = (unsigned char*)base + data_offset;
+  map_size_ = map_size;
+  fd_ = fd;
+  dictionary.clear();
+  return true;
+}
+
+void cbuf_shm_publisher::close() {
+  if (hdr_ == nullptr) return;
+  hdr_->closed.store(1);
+  notify(&hdr_->data_seq, &hdr_->data_waiters);
+  munmap(hdr_, map_size_);
+  ::close(fd_);
+  hdr_ = nullptr;
+  data_ = nullptr;
+  fd_ = -1;
+}
+
+std::string cbuf_shm_publisher::path() const {
+  return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd_);
+}
+
+unsigned cbuf_shm_publisher::subscriber_count() const {
+  if (hdr_ == nullptr) return 0;
+  unsigned count = 0;
+  for (const auto& slot : hdr_->slots) {
+    if (slot.state.load() == SLOT_ACTIVE) count++;
+  }
+  return count;
+}
+
+size_t cbuf_shm_publisher::record_footprint(uint64_t write_pos, size_t size) const {
+  size_t need = align_up(size, RECORD_ALIGN);
+  size_t offset = write_pos % hdr_->capacity;
+  if (offset + need <= hdr_->capacity) return need;
+  return hdr_->capacity - offset + need;
+}
+
+unsigned char* cbuf_shm_publisher::reserve(size_t size) {
+  if (hdr_ == nullptr) return nullptr;
+  size_t capacity = hdr_->capacity;
+  if (size < sizeof(cbuf_preamble) || align_up(size, RECORD_ALIGN) > capacity) {
+    fprintf(stderr, "Message of %zu bytes does not fit on a shared memory ring of %zu\n", size, capacity);
+    dropped_++;
+    return nullptr;
+  }
+
+  // Only the publisher moves write_pos
+  uint64_t write_pos = hdr_->write_pos.load(std::memory_order_relaxed);
+  size_t footprint = record_footprint(write_pos, size);
+  double deadline = monotonic_now() + opts_.timeout_ms / 1000.0;
+  auto has_room = [&]() {
+    for (auto& slot : hdr_->slots) {
+      if (slot.state.load() == SLOT_ACTIVE && write_pos + footprint - slot.read_pos.load() > capacity) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while (!has_room()) {
+    if (opts_.slow_policy == SlowPolicy::DROP) {
+      dropped_++;
+      return nullptr;
+    }
+    double remaining = deadline - monotonic_now();
+    if (remaining <= 0) {
+      if (opts_.slow_policy == SlowPolicy::BLOCK) {
+        dropped_++;
+        return nullptr;
+      }
+      // Evict whoever holds the space, they rejoin on their own
+      for (auto& slot : hdr_->slots) {
+        uint32_t active = SLOT_ACTIVE;
+        if (write_pos + footprint - slot.read_pos.load() > capacity &&
+            slot.state.compare_exchange_strong(active, SLOT_EVICTED)) {
+          evicted_++;
+        }
+      }
+      continue;
+    }
+
+    hdr_->space_waiters.fetch_add(1);
+    uint32_t seq = hdr_->space_seq.load();
+    if (!has_room()) futex_wait(&hdr_->space_seq, seq, remaining);
+    hdr_->space_waiters.fetch_sub(1);
+  }
+
+  size_t offset = write_pos % capacity;
+  reserved_ = footprint;
+  if (footprint == align_up(size, RECORD_ALIGN)) return data_ + offset;
+  // Starts over at the beginning of the ring, marking the end of this lap
+  if (capacity - offset >= sizeof(cbuf_preamble)) {
+    cbuf_preamble* end = (cbuf_preamble*)(data_ + offset);
+    *end = cbuf_preamble();
+    end->magic = CBUF_MAGIC;
+  }
+  return data_;
+}
+
+void cbuf_shm_publisher::commit() {
+  hdr_->write_pos.store(hdr_->write_pos.load(std::memory_order_relaxed) + reserved_);
+  reserved_ = 0;
+  notify(&hdr_->data_seq, &hdr_->data_waiters);
+}
+
+void cbuf_shm_publisher::mark_skipped(void* dst, size_t size) {
+  cbuf_preamble* pre = (cbuf_preamble*)dst;
+  *pre = cbuf_preamble();
+  pre->magic = CBUF_MAGIC;
+  pre->setSize(uint32_t(size));
+}
+
+bool cbuf_shm_publisher::publish_packet(const void* data, size_t size) {
+  unsigned char* dst = reserve(size);
+  if (dst == nullptr) return false;
+  memcpy(dst, data, size);
+  commit();
+  return true;
+}
+
+bool cbuf_shm_publisher::add_metadata(const char* msg_meta, uint64_t hash, const char* msg_name) {
+  if (hdr_ == nullptr) return false;
+  if (dictionary.count(hash) > 0) return true;
+
+  cbufmsg::metadata mdata;
+  mdata.preamble.packet_timest = now();
+  mdata.msg_meta = msg_meta;
+  mdata.msg_hash = hash;
+  mdata.msg_name = msg_name;
+  size_t size = mdata.encode_size();
+  mdata.preamble.setSize(uint32_t(size));
+  uint64_t used = hdr_->metadata_size.load(std::memory_order_relaxed);
+  if (used + align_up(size, RECORD_ALIGN) > hdr_->metadata_capacity) {
+    fprintf(stderr, "No room left for the metadata of %s on the shared memory\n", msg_name);
+    return false;
+  }
+  unsigned char* meta = (unsigned char*)hdr_ + hdr_->metadata_offset;
+  if (!mdata.encode((char*)meta + used, size)) return false;
+  // Published before any message of the type
+  hdr_->metadata_size.store(used + align_up(size, RECORD_ALIGN));
+  dictionary[hash] = msg_name;
+  return true;
+}
+
+bool cbuf_shm_subscriber::open(int fd) {
+  close();
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(cbuf_shm_header)) return false;
+  size_t map_size = st.st_size;
+  void* base = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    perror("Could not map the shared memory");
+    return false;
+  }
+  cbuf_shm_header* hdr = (cbuf_shm_header*)base;
+  if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION ||
+      hdr->metadata_offset + hdr->metadata_capacity > map_size) {
+    fprintf(stderr, "The shared memory does not hold a cbuf ring\n");
+    munmap(base, map_size);
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  for (unsigned i = 0; i < MAX_SUBSCRIBERS && slot_ == -1; i++) {
+    uint32_t expected = SLOT_FREE;
+    if (hdr->slots[i].state.compare_exchange_strong(expected, SLOT_CLAIMING)) slot_ = int(i);
+  }
+  if (slot_ == -1) {
+    fprintf(stderr, "The shared memory has no room for more than %u subscribers\n", MAX_SUBSCRIBERS);
+    munmap(base, map_size);
+    return false;
+  }
+  hdr_ = hdr;
+  data_ = (unsigned char*)base + hdr->data_offset;
+  map_size_ = map_size;
+  pending_ = 0;
+  metadata_loaded_ = 0;
+  evictions_ = 0;
+  dictionary.clear();
+  metadictionary.clear();
+  read_pos_ = hdr_->write_pos.load();
+  hdr_->slots[slot_].read_pos.store(read_pos_);
+  hdr_->slots[slot_].state.store(SLOT_ACTIVE);
+  load_metadata();
+  return true;
+}
+
+bool cbuf_shm_subscriber::open(const char* path) {
+  int fd = ::open(path, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open shared memory %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  // The mapping keeps the memory alive
+  bool ret = open(fd);
+  ::close(fd);
+  return ret;
+}
+
+void cbuf_shm_subscriber::close() {
+  if (hdr_ == nullptr) return;
+  hdr_->slots[slot_].state.store(SLOT_FREE);
+  notify(&hdr_->space_seq, &hdr_->space_waiters);
+  munmap(hdr_, map_size_);
+  hdr_ = nullptr;
+  data_ = nullptr;
+  slot_ = -1;
+}
+
+bool cbuf_shm_subscriber::publisher_closed() const { return hdr_ == nullptr || hdr_->closed.load() != 0; }
+
+void cbuf_shm_subscriber::load_metadata() {
+  const unsigned char* meta = (const unsigned char*)hdr_ + hdr_->metadata_offset;
+  size_t size = hdr_->metadata_size.load();
+  while (metadata_loaded_ + sizeof(cbuf_preamble) <= size) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)(meta + metadata_loaded_);
+    cbufmsg::metadata mdata;
+    if (pre->magic != CBUF_MAGIC || !mdata.decode((char*)pre, pre->size())) break;
+    dictionary[mdata.msg_hash] = mdata.msg_name;
+    metadictionary[mdata.msg_hash] = mdata.msg_meta;
+    metadata_loaded_ += align_up(pre->size(), RECORD_ALIGN);
+  }
+}
+
+void cbuf_shm_subscriber::advance(size_t size) {
+  read_pos_ += size;
+  hdr_->slots[slot_].read_pos.store(read_pos_);
+  notify(&hdr_->space_seq, &hdr_->space_waiters);
+}
+
+void cbuf_shm_subscriber::rejoin() {
+  evictions_++;
+  read_pos_ = hdr_->write_pos.load();
+  hdr_->slots[slot_].read_pos.store(read_pos_);
+  hdr_->slots[slot_].state.store(SLOT_ACTIVE);
+}
+
+bool cbuf_shm_subscriber::next(message& msg, int timeout_ms) {
+  if (hdr_ == nullptr) return false;
+  if (pending_ > 0) {
+    advance(pending_);
+    pending_ = 0;
+  }
+
+  size_t capacity = hdr_->capacity;
+  double deadline = monotonic_now() + timeout_ms / 1000.0;
+  while (true) {
+    if (hdr_->slots[slot_].state.load() == SLOT_EVICTED) rejoin();
+    uint64_t write_pos = hdr_->write_pos.load();
+    if (write_pos != read_pos_) {
+      size_t offset = read_pos_ % capacity;
+      const cbuf_preamble* pre = (const cbuf_preamble*)(data_ + offset);
+      if (capacity - offset < sizeof(cbuf_preamble) || (pre->hash == 0 && pre->size() == 0)) {
+        // End of the lap
+        advance(capacity - offset);
+        continue;
+      }
+      size_t size = pre->size();
+      if (pre->hash == 0) {
+        advance(align_up(size, RECORD_ALIGN));
+        continue;
+      }
+      if (hdr_->metadata_size.load() != metadata_loaded_) load_metadata();
+      msg.preamble = pre;
+      msg.size = size;
+      pending_ = align_up(size, RECORD_ALIGN);
+      return true;
+    }
+
+    if (hdr_->closed.load() != 0) return false;
+    double remaining = deadline - monotonic_now();
+    if (remaining <= 0) return false;
+    hdr_->data_waiters.fetch_add(1);
+    uint32_t seq = hdr_->data_seq.load();
+    if (hdr_->write_pos.load() == read_pos_ && hdr_->closed.load() == 0) {
+      futex_wait(&hdr_->data_seq, seq, remaining);
+    }
+    hdr_->data_waiters.fetch_sub(1);
+  }
+}
@@ -0,0 +1,169 @@
+#include "cbuf_socket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+static bool unix_address(const std::string& path, struct sockaddr_un& addr) {
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return true;
+}
+
+static int socket_listen_unix(const std::string& path) {
+  struct sockaddr_un addr;
+  if (!unix_address(path, addr)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return -1;
+  // A stale socket left by a previous receiver would make bind fail
+  unlink(path.c_str());
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int socket_listen_tcp(const std::string& address, int port, int& bound_port) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* res = nullptr;
+  const char* host = address.empty() ? nullptr : address.c_str();
+  if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &res) != 0) return -1;
+  int fd = -1;
+  for (auto* ai = res; ai != nullptr && fd == -1; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 4) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd == -1) return -1;
+
+  struct sockaddr_storage bound = {};
+  socklen_t len = sizeof(bound);
+  getsockname(fd, (struct sockaddr*)&bound, &len);
+  if (bound.ss_family == AF_INET6) {
+    bound_port = ntohs(((struct sockaddr_in6*)&bound)->sin6_port);
+  } else {
+    bound_port = ntohs(((struct sockaddr_in*)&bound)->sin_port);
+  }
+  return fd;
+}
+
+int cbuf_socket_connect(const std::string& address, int port) {
+  if (port == 0) {
+    struct sockaddr_un addr;
+    if (!unix_address(address, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) return -1;
+  int fd = -1;
+  for (auto* ai = res; ai != nullptr && fd == -1; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd != -1) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+bool cbuf_socket_receiver::start_listening(int fd) {
+  if (fd == -1) return false;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  listen_fd_ = fd;
+  recv_buf_.resize(1024 * 1024);
+  decoder_.reset();
+  return true;
+}
+
+bool cbuf_socket_receiver::open(const char* ip, int port) {
+  close();
+  return start_listening(socket_listen_tcp(ip, port, local_port_));
+}
+
+bool cbuf_socket_receiver::open_unix(const char* path) {
+  close();
+  if (!start_listening(socket_listen_unix(path))) return false;
+  unix_path_ = path;
+  return true;
+}
+
+void cbuf_socket_receiver::close() {
+  if (conn_fd_ != -1) ::close(conn_fd_);
+  conn_fd_ = -1;
+  if (listen_fd_ != -1) ::close(listen_fd_);
+  listen_fd_ = -1;
+  if (!unix_path_.empty()) unlink(unix_path_.c_str());
+  unix_path_.clear();
+  local_port_ = 0;
+}
+
+bool cbuf_socket_receiver::next(cbuf_decoder::message& msg, int timeout_ms) {
+  if (listen_fd_ == -1) return false;
+  double deadline = now() + timeout_ms / 1000.0;
+  while (true) {
+    if (decoder_.next(msg)) return true;
+
+    int wait_ms = std::max(0, int((deadline - now()) * 1000.0 + 0.5));
+    struct pollfd pfd = {conn_fd_ != -1 ? conn_fd_ : listen_fd_, POLLIN, 0};
+    if (poll(&pfd, 1, wait_ms) <= 0) return false;
+    if (conn_fd_ == -1) {
+      conn_fd_ = accept(listen_fd_, nullptr, nullptr);
+      if (conn_fd_ == -1) return false;
+      // Every connection starts a new stream, metadata included
+      decoder_.reset();
+      continue;
+    }
+    ssize_t n = recv(conn_fd_, recv_buf_.data(), recv_buf_.size(), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+    if (n <= 0) {
+      ::close(conn_fd_);
+      conn_fd_ = -1;
+      continue;
+    }
+    decoder_.feed(recv_buf_.data(), n);
+  }
+}
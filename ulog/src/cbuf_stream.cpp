@@ -4,11 +4,21 @@
 #include <cbuf_preamble.h>
 #include <fcntl.h>
 #include <metadata.h>
+#include <poll.h>
+#include <records.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <cmath>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "cbuf_mcast.h"
+#include "cbuf_socket.h"
 #include "ulogger.h"
 
 static double now() {
@@ -39,6 +49,33 @@ ssize_t cbuf_ostream::file_offset() const {
 #endif
 }
 
+bool cbuf_ostream::write_bytes(const void* data, size_t size) {
+  if (is_socket_) return buffer_socket_bytes(data, size);
+  const char* write_ptr = (const char*)data;
+  size_t bytes_to_write = size;
+  int error_count = 0;
+  while (bytes_to_write > 0) {
+    ssize_t result = write(stream, write_ptr, bytes_to_write);
+    if (result > 0) {
+      bytes_to_write -= result;
+      write_ptr += result;
+    } else {
+      if (errno != EAGAIN) {
+        perror("Cbuf writing error");
+      }
+      error_count++;
+      if (exit_early_on_write_failure || error_count > 10) {
+        return false;
+      }
+    }
+  }
+  if (file_write_callback_) {
+    file_write_callback_(data, size, write_callback_usr_ptr_);
+  }
+  offset_ += size;
+  return true;
+}
+
 int cbuf_ostream::serialize_metadata(const char* msg_meta, uint64_t hash, const char* msg_name) {
   if (dictionary.count(hash) > 0) return 0;
   assert(hash != 0);
@@ -49,44 +86,419 @@ int cbuf_ostream::serialize_metadata(const char* msg_meta, uint64_t hash, const
   mdata.msg_hash = hash;
   mdata.msg_name = msg_name;
   char* ptr = mdata.encode();
-  char* write_ptr = ptr;
-  int bytes_to_write = mdata.encode_size();
-  int total_bytes_to_write = bytes_to_write;
-  int error_count = 0;
   if (pre_file_write_callback_) {
     pre_file_write_callback_(FileWriteType::METADATA);
   }
-  do {
-    int result = write(stream, write_ptr, bytes_to_write);
-    if (result > 0) {
-      bytes_to_write -= result;
-      write_ptr += result;
-    } else {
-      if (errno != EAGAIN) {
-        perror("Cbuf serialize metadata writing error");
-      }
-      if (exit_early_on_write_failure) {
-        mdata.free_encode(ptr);
-        return errno;
-      }
-      error_count++;
-      if (error_count > 10) {
-        assert(false);
-      }
-    }
-  } while (bytes_to_write > 0);
-  if (file_write_callback_) {
-    file_write_callback_(ptr, total_bytes_to_write, write_callback_usr_ptr_);
+  size_t offset = offset_;
+  if (!write_bytes(ptr, mdata.encode_size())) {
+    int err = errno != 0 ? errno : EIO;
+    mdata.free_encode(ptr);
+    return err;
   }
   mdata.free_encode(ptr);
   dictionary[hash] = msg_name;
+  if (indexing_) index_.add_metadata(offset, hash, msg_name);
   return 0;
 }
 
+void cbuf_ostream::index_record(uint64_t hash, size_t offset, double min_ts, double max_ts, uint32_t messages,
+                                uint32_t repeats) {
+  if (indexing_) {
+    index_.add_record(hash, offset, offset_ - offset, min_ts, max_ts, messages, repeats);
+  }
+}
+
+bool cbuf_ostream::write_index() {
+  std::vector<uint8_t> footer;
+  if (!index_.encode_footer(offset_, footer)) {
+    fprintf(stderr, "Could not encode the index for %s\n", fname_.c_str());
+    return false;
+  }
+  return write_bytes(footer.data(), footer.size());
+}
+
+void cbuf_ostream::set_type_options(uint64_t hash, const type_options& opts) {
+  type_options& stored = type_options_[hash] = opts;
+  double max_window = cbuf_istream::resync_options().max_backstep;
+  if (stored.batch_window > max_window) {
+    fprintf(stderr, "Batch window of %f seconds is too long, using %f\n", stored.batch_window, max_window);
+    stored.batch_window = max_window;
+  }
+}
+
+bool cbuf_ostream::write_packet(const void* data, size_t size) {
+  const cbuf_preamble* pre = (const cbuf_preamble*)data;
+  check_connection();
+  if (in_chunked_packet_) {
+    fprintf(stderr, "Cannot write a packet while another one is written in chunks\n");
+    return false;
+  }
+  // Batches are written once too old, as seen by the packets going by
+  if (!pending_batches_.empty() && !flush_batches(pre->packet_timest)) {
+    return false;
+  }
+  if (!repeat_states_.empty() && !flush_repeats(pre->packet_timest)) {
+    return false;
+  }
+
+  auto it = type_options_.find(pre->hash);
+  if (it != type_options_.end()) {
+    const auto& opts = it->second;
+    if (opts.suppress_repeats && size < pre->maxSize()) {
+      return suppress_packet(pre, size, opts);
+    }
+    if (opts.delta_keyframe_interval > 0 && size < pre->maxSize()) {
+      return delta_packet(pre, size, opts);
+    }
+    if (opts.batch_messages > 1 && size < MAX_BATCH_BYTES) {
+      return batch_packet(pre, size, opts);
+    }
+  }
+  return write_record(data, size);
+}
+
+// FNV-1a over the packet, skipping the preamble
+static uint64_t hash_payload(const cbuf_preamble* pre, size_t size) {
+  const uint8_t* data = (const uint8_t*)pre + sizeof(cbuf_preamble);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size - sizeof(cbuf_preamble); i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool cbuf_ostream::suppress_packet(const cbuf_preamble* pre, size_t size, const type_options& opts) {
+  auto key = std::make_pair(pre->hash, pre->variant());
+  auto& rep = repeat_states_[key];
+  uint64_t payload_hash = hash_payload(pre, size);
+  double ts = pre->packet_timest;
+
+  if (rep.msg_size == size && rep.payload_hash == payload_hash) {
+    if (rep.count == 0) rep.first_ts = ts;
+    rep.count++;
+    rep.last_ts = ts;
+    rep.keepalive = opts.keepalive_period;
+    if (ts - rep.written_ts >= opts.keepalive_period) {
+      return write_repeat(key, rep);
+    }
+    return true;
+  }
+
+  // The content changed, account for the previous repeats before the new message
+  if (!write_repeat(key, rep)) return false;
+  rep.payload_hash = payload_hash;
+  rep.msg_size = size;
+  rep.msg_offset = offset_;
+  rep.written_ts = ts;
+  if (!write_bytes(pre, size)) return false;
+  index_record(pre->hash, rep.msg_offset, ts, ts, 1);
+  return true;
+}
+
+bool cbuf_ostream::write_repeat(const std::pair<uint64_t, uint8_t>& key, repeat_state& rep) {
+  if (rep.count == 0) return true;
+
+  cbufmsg::repeat rec;
+  rec.preamble.packet_timest = rep.first_ts;
+  rec.msg_hash = key.first;
+  rec.msg_variant = key.second;
+  rec.count = rep.count;
+  rec.last_ts = rep.last_ts;
+  rec.msg_distance = offset_ - rep.msg_offset;
+  size_t offset = offset_;
+  uint32_t count = rep.count;
+  rep.count = 0;
+  rep.written_ts = rep.last_ts;
+  if (!write_bytes(rec.encode(), rec.encode_size())) return false;
+  index_record(key.first, offset, rep.first_ts, rep.last_ts, 0, count);
+  return true;
+}
+
+static void put_varint(std::vector<uint8_t>& out, size_t value) {
+  while (value >= 0x80) {
+    out.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(uint8_t(value));
+}
+
+static bool get_varint(const uint8_t*& ptr, const uint8_t* end, size_t& value) {
+  value = 0;
+  for (unsigned shift = 0; ptr < end && shift < 64; shift += 7) {
+    uint8_t byte = *ptr++;
+    value |= size_t(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// Run length encode the XOR of a and b, see cbufmsg::delta
+static void rle_xor_encode(const uint8_t* a, const uint8_t* b, size_t n, std::vector<uint8_t>& out) {
+  // Shorter runs of equal bytes are cheaper to keep as literals
+  constexpr size_t MIN_ZERO_RUN = 3;
+  out.clear();
+  size_t i = 0;
+  while (i < n) {
+    size_t zeros = 0;
+    while (i + zeros < n && a[i + zeros] == b[i + zeros]) zeros++;
+    if (i + zeros == n) break;
+    i += zeros;
+
+    size_t start = i;
+    while (i < n) {
+      if (a[i] != b[i]) {
+        i++;
+        continue;
+      }
+      size_t run = 0;
+      while (i + run < n && a[i + run] == b[i + run] && run < MIN_ZERO_RUN) run++;
+      if (run >= MIN_ZERO_RUN || i + run == n) break;
+      i += run;
+    }
+    put_varint(out, zeros);
+    put_varint(out, i - start);
+    for (size_t k = start; k < i; k++) {
+      out.push_back(a[k] ^ b[k]);
+    }
+  }
+}
+
+static bool rle_xor_decode(const uint8_t* rle, size_t rle_size, uint8_t* data, size_t n) {
+  const uint8_t* end = rle + rle_size;
+  size_t pos = 0;
+  while (rle < end) {
+    size_t zeros, literals;
+    if (!get_varint(rle, end, zeros) || !get_varint(rle, end, literals)) return false;
+    if (zeros > n - pos || literals > n - pos - zeros || literals > size_t(end - rle)) return false;
+    pos += zeros;
+    for (size_t k = 0; k < literals; k++) {
+      data[pos++] ^= *rle++;
+    }
+  }
+  return true;
+}
+
+bool cbuf_ostream::delta_packet(const cbuf_preamble* pre, size_t size, const type_options& opts) {
+  auto key = std::make_pair(pre->hash, pre->variant());
+  auto& delta = delta_states_[key];
+  const uint8_t* data = (const uint8_t*)pre;
+  size_t body_size = size - sizeof(cbuf_preamble);
+
+  cbufmsg::delta rec;
+  bool keyframe = delta.keyframe.size() != size || delta.since_keyframe + 1 >= opts.delta_keyframe_interval;
+  if (!keyframe) {
+    rle_xor_encode(data + sizeof(cbuf_preamble), delta.keyframe.data() + sizeof(cbuf_preamble), body_size,
+                   delta_scratch_);
+    rec.rle.swap(delta_scratch_);
+    // Not worth it if the delta is as large as the message
+    keyframe = rec.encode_size() >= size;
+    rec.rle.swap(delta_scratch_);
+  }
+  if (keyframe) {
+    delta.keyframe.assign(data, data + size);
+    delta.key_offset = offset_;
+    delta.since_keyframe = 0;
+    if (!write_bytes(data, size)) return false;
+    index_record(key.first, delta.key_offset, pre->packet_timest, pre->packet_timest, 1);
+    return true;
+  }
+
+  rec.preamble.packet_timest = pre->packet_timest;
+  rec.msg_hash = key.first;
+  rec.msg_variant = key.second;
+  rec.key_distance = offset_ - delta.key_offset;
+  rec.rle.swap(delta_scratch_);
+  size_t offset = offset_;
+  char* ptr = rec.encode();
+  bool ret = write_bytes(ptr, rec.encode_size());
+  rec.free_encode(ptr);
+  rec.rle.swap(delta_scratch_);
+  delta.since_keyframe++;
+  if (ret) index_record(key.first, offset, pre->packet_timest, pre->packet_timest, 1);
+  return ret;
+}
+
+bool cbuf_ostream::flush_repeats(double time) {
+  bool ret = true;
+  for (auto& [key, rep] : repeat_states_) {
+    if (rep.count > 0 && (time - rep.written_ts >= rep.keepalive)) {
+      ret = write_repeat(key, rep) && ret;
+    }
+  }
+  return ret;
+}
+
+bool cbuf_ostream::write_large_header(cbuf_preamble& pre, size_t size) {
+  cbufmsg::large_header hdr;
+  hdr.preamble.packet_timest = pre.packet_timest;
+  hdr.msg_hash = pre.hash;
+  hdr.msg_size = size;
+  if (!write_bytes(hdr.encode(), hdr.encode_size())) return false;
+  pre.setSize(0);
+  return true;
+}
+
+bool cbuf_ostream::write_record(const void* data, size_t size) {
+  const cbuf_preamble* pre = (const cbuf_preamble*)data;
+  size_t offset = offset_;
+  if (size < pre->maxSize()) {
+    if (!write_bytes(data, size)) return false;
+  } else {
+    cbuf_preamble large_pre = *pre;
+    if (!write_large_header(large_pre, size)) return false;
+    if (!write_bytes(&large_pre, sizeof(large_pre))) return false;
+    if (!write_bytes((const char*)data + sizeof(large_pre), size - sizeof(large_pre))) return false;
+  }
+  index_record(pre->hash, offset, pre->packet_timest, pre->packet_timest, 1);
+  return true;
+}
+
+bool cbuf_ostream::begin_packet(const cbuf_preamble& pre, size_t total_size) {
+  if (in_chunked_packet_ || total_size < sizeof(cbuf_preamble)) return false;
+  // Keep the batches in order with this packet
+  if (!pending_batches_.empty() && !flush_batches(pre.packet_timest)) return false;
+
+  cbuf_preamble chunk_pre = pre;
+  size_t offset = offset_;
+  if (total_size < chunk_pre.maxSize()) {
+    chunk_pre.setSize(uint32_t(total_size));
+  } else if (!write_large_header(chunk_pre, total_size)) {
+    return false;
+  }
+  if (pre_file_write_callback_) {
+    pre_file_write_callback_(FileWriteType::DATA);
+  }
+  if (!write_bytes(&chunk_pre, sizeof(chunk_pre))) return false;
+  chunk_remaining_ = total_size - sizeof(chunk_pre);
+  in_chunked_packet_ = true;
+  // Indexed with its full size, the chunks are about to follow
+  if (indexing_) {
+    index_.add_record(pre.hash, offset, offset_ - offset + chunk_remaining_, pre.packet_timest,
+                      pre.packet_timest, 1);
+  }
+  return true;
+}
+
+bool cbuf_ostream::write_chunk(const void* data, size_t size) {
+  if (!in_chunked_packet_ || size > chunk_remaining_) return false;
+  if (!write_bytes(data, size)) return false;
+  chunk_remaining_ -= size;
+  return true;
+}
+
+bool cbuf_ostream::end_packet() {
+  if (!in_chunked_packet_) return false;
+  in_chunked_packet_ = false;
+  if (chunk_remaining_ != 0) {
+    fprintf(stderr, "Packet written in chunks is missing %zu bytes, the stream is corrupted\n",
+            chunk_remaining_);
+    chunk_remaining_ = 0;
+    return false;
+  }
+  return true;
+}
+
+bool cbuf_ostream::batch_packet(const cbuf_preamble* pre, size_t size, const type_options& opts) {
+  auto key = std::make_pair(pre->hash, pre->variant());
+  auto& batch = pending_batches_[key];
+  double ts = pre->packet_timest;
+
+  if (!batch.ts_deltas.empty()) {
+    // Timestamps are stored as float offsets, only add them to the batch if they are exact
+    float delta = float(ts - batch.first_ts);
+    if ((batch.first_ts + double(delta) != ts) || (batch.data.size() + size > MAX_BATCH_BYTES)) {
+      if (!write_batch(key, batch)) return false;
+    }
+  }
+
+  if (batch.ts_deltas.empty()) {
+    batch.first_ts = ts;
+    batch.window = opts.batch_window;
+    next_batch_deadline_ = std::min(next_batch_deadline_, ts + batch.window);
+    batch.msg_size = uint32_t(size);
+  } else if ((batch.msg_size != 0) && (batch.msg_size != size)) {
+    // Sizes differ, from now on store them all
+    batch.sizes.assign(batch.ts_deltas.size(), batch.msg_size);
+    batch.msg_size = 0;
+  }
+  if (batch.msg_size == 0) {
+    batch.sizes.push_back(uint32_t(size));
+  }
+  batch.ts_deltas.push_back(float(ts - batch.first_ts));
+  const uint8_t* body = (const uint8_t*)pre + sizeof(cbuf_preamble);
+  batch.data.insert(batch.data.end(), body, body + size - sizeof(cbuf_preamble));
+
+  if (batch.ts_deltas.size() >= opts.batch_messages) {
+    return write_batch(key, batch);
+  }
+  return true;
+}
+
+bool cbuf_ostream::write_batch(const std::pair<uint64_t, uint8_t>& key, pending_batch& batch) {
+  if (batch.ts_deltas.empty()) return true;
+
+  cbufmsg::batch rec;
+  rec.preamble.packet_timest = batch.first_ts;
+  rec.msg_hash = key.first;
+  rec.msg_variant = key.second;
+  rec.msg_size = batch.msg_size;
+  rec.sizes.swap(batch.sizes);
+  rec.ts_deltas.swap(batch.ts_deltas);
+  rec.data.swap(batch.data);
+
+  size_t offset = offset_;
+  char* ptr = rec.encode();
+  bool ret = write_bytes(ptr, rec.encode_size());
+  rec.free_encode(ptr);
+  if (ret) {
+    float max_delta = *std::max_element(rec.ts_deltas.begin(), rec.ts_deltas.end());
+    index_record(key.first, offset, batch.first_ts, batch.first_ts + max_delta, rec.ts_deltas.size());
+  }
+
+  // Give the buffers back to the batch to reuse their memory
+  rec.sizes.clear();
+  rec.ts_deltas.clear();
+  rec.data.clear();
+  batch.sizes.swap(rec.sizes);
+  batch.ts_deltas.swap(rec.ts_deltas);
+  batch.data.swap(rec.data);
+  return ret;
+}
+
+bool cbuf_ostream::flush_batches(double time) {
+  if (time < next_batch_deadline_) return true;
+  bool ret = true;
+  next_batch_deadline_ = 1e15;
+  for (auto& [key, batch] : pending_batches_) {
+    if (batch.ts_deltas.empty()) continue;
+    if (batch.first_ts + batch.window <= time) {
+      ret = write_batch(key, batch) && ret;
+    } else {
+      next_batch_deadline_ = std::min(next_batch_deadline_, batch.first_ts + batch.window);
+    }
+  }
+  return ret;
+}
+
 void cbuf_ostream::close() {
   if (stream != -1) {
+    flush_batches();
+    flush_repeats();
+    if (indexing_) write_index();
+    if (is_socket_) send_buffered(1000);
     ::close(stream);
   }
+  is_socket_ = false;
+  send_buffer_.clear();
+  send_pos_ = 0;
+  index_.clear();
+  indexing_ = false;
+  pending_batches_.clear();
+  next_batch_deadline_ = 1e15;
+  repeat_states_.clear();
+  delta_states_.clear();
+  in_chunked_packet_ = false;
+  chunk_remaining_ = 0;
   dictionary.clear();
   stream = -1;
 }
@@ -100,14 +512,124 @@ bool cbuf_ostream::open_file(const char* fname) {
     fname_.clear();
   } else {
     fname_ = fname;
+    offset_ = lseek(stream, 0, SEEK_END);
+    // Files appended to would only index the new part
+    index_.clear();
+    indexing_ = write_index_ && offset_ == 0;
+    // Records never refer to messages on another file, a new one starts with keyframes
+    repeat_states_.clear();
+    delta_states_.clear();
   }
   return stream != -1;
 }
 
 bool cbuf_ostream::open_socket(const char* ip, int port) {
-  (void)ip;
-  (void)port;
-  return false;
+  if (port <= 0) return false;
+  close();
+  is_socket_ = true;
+  socket_address_ = ip;
+  socket_port_ = port;
+  next_reconnect_ = 0;
+  fname_ = socket_address_ + ":" + std::to_string(port);
+  return connect_socket();
+}
+
+bool cbuf_ostream::open_unix_socket(const char* path) {
+  close();
+  is_socket_ = true;
+  socket_address_ = path;
+  socket_port_ = 0;
+  next_reconnect_ = 0;
+  fname_ = path;
+  return connect_socket();
+}
+
+bool cbuf_ostream::connect_socket() {
+  double t = now();
+  if (t < next_reconnect_) return false;
+  int fd = cbuf_socket_connect(socket_address_, socket_port_);
+  if (fd == -1) {
+    next_reconnect_ = t + reconnect_period_;
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  stream = fd;
+  // Everything sent so far went to another receiver, start over
+  dictionary.clear();
+  pending_batches_.clear();
+  next_batch_deadline_ = 1e15;
+  repeat_states_.clear();
+  delta_states_.clear();
+  send_buffer_.clear();
+  send_pos_ = 0;
+  return true;
+}
+
+void cbuf_ostream::drop_connection() {
+  if (stream != -1) ::close(stream);
+  stream = -1;
+  send_buffer_.clear();
+  send_pos_ = 0;
+  next_reconnect_ = now() + reconnect_period_;
+}
+
+bool cbuf_ostream::buffer_socket_bytes(const void* data, size_t size) {
+  if (stream == -1) return false;
+  if (send_pos_ == send_buffer_.size()) {
+    send_buffer_.clear();
+    send_pos_ = 0;
+    first_buffered_ts_ = now();
+  }
+  const uint8_t* bytes = (const uint8_t*)data;
+  send_buffer_.insert(send_buffer_.end(), bytes, bytes + size);
+  if (file_write_callback_) {
+    file_write_callback_(data, size, write_callback_usr_ptr_);
+  }
+  offset_ += size;
+
+  size_t pending = send_buffer_.size() - send_pos_;
+  if (pending >= SOCKET_BATCH_BYTES || now() - first_buffered_ts_ >= max_send_delay_) {
+    return send_buffered(0);
+  }
+  return true;
+}
+
+bool cbuf_ostream::send_buffered(int timeout_ms) {
+  while (stream != -1 && send_pos_ < send_buffer_.size()) {
+    ssize_t sent = send(stream, send_buffer_.data() + send_pos_, send_buffer_.size() - send_pos_,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent > 0) {
+      send_pos_ += sent;
+      continue;
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      struct pollfd pfd = {stream, POLLOUT, 0};
+      if (poll(&pfd, 1, timeout_ms) > 0) continue;
+      // The receiver is slow, keep the rest for later unless too much is waiting
+      if (send_buffer_.size() - send_pos_ > MAX_SOCKET_BUFFER) {
+        fprintf(stderr, "Dropping the connection to %s, the receiver is not keeping up\n", fname_.c_str());
+        drop_connection();
+        return false;
+      }
+      break;
+    }
+    drop_connection();
+    return false;
+  }
+  if (send_pos_ == send_buffer_.size()) {
+    send_buffer_.clear();
+    send_pos_ = 0;
+  } else if (send_pos_ > SOCKET_BATCH_BYTES) {
+    send_buffer_.erase(send_buffer_.begin(), send_buffer_.begin() + send_pos_);
+    send_pos_ = 0;
+  }
+  first_buffered_ts_ = now();
+  return stream != -1;
+}
+
+bool cbuf_ostream::flush() {
+  if (!is_socket_) return is_open();
+  return send_buffered(1000) && send_pos_ == send_buffer_.size();
 }
 
 static void split_namespace(const std::string& full_name, std::string& spname, std::string& name) {
@@ -165,9 +687,39 @@ bool cbuf_ostream::merge_packet(cbuf_istream* cis, const std::vector<std::string
   auto hash = cis->__get_next_hash();
   auto nsize = cis->__get_next_size();
 
+  // Packed records are unpacked and their messages merged one by one. Repeats are always
+  // expanded, the message they refer to would not be at the same distance on the output
+  if (hash == cbufmsg::repeat::TYPE_HASH) {
+    bool expand = cis->expand_repeats_;
+    cis->expand_repeats_ = true;
+    if (!cis->unpack_repeat()) cis->updatePtrAndSize(nsize);
+    cis->expand_repeats_ = expand;
+    return true;
+  }
+  if (cis->unpack_record()) {
+    return true;
+  }
+  if (hash == cbufmsg::batch::TYPE_HASH || hash == cbufmsg::delta::TYPE_HASH) {
+    // Could not be unpacked, most likely corrupted
+    cis->updatePtrAndSize(nsize);
+    return true;
+  }
+  if (hash == cbufmsg::file_index::TYPE_HASH || hash == cbufmsg::index_trailer::TYPE_HASH) {
+    // Indices of the inputs do not apply to the output
+    cis->updatePtrAndSize(nsize);
+    return true;
+  }
+
+  // Large headers are written again along with their message, if it passes the filters
+  if (hash == cbufmsg::large_header::TYPE_HASH) {
+    if (!cis->consume_large_header()) return false;
+    hash = cis->__get_next_hash();
+    nsize = cis->__get_next_size();
+  }
+
   if (hash == cbufmsg::metadata::TYPE_HASH) {
     cbufmsg::metadata mdata;
-    ret = mdata.decode((char*)cis->ptr, cis->rem_size);
+    ret = mdata.decode((char*)cis->ptr, cis->decode_size());
     if (!ret) return false;
 
     isMeta = true;
@@ -207,14 +759,17 @@ bool cbuf_ostream::merge_packet(cbuf_istream* cis, const std::vector<std::string
       return true;
     }
   }
-  auto num = write(stream, cis->ptr, nsize);
-  if (num != nsize) {
-    fprintf(stderr, "Error writing packet, wanted to write %d bytes but wrote %zd\n", nsize, num);
+  if (isMeta) {
+    size_t offset = offset_;
+    if (!write_bytes(cis->ptr, nsize)) {
+      fprintf(stderr, "Error writing metadata of %zu bytes\n", nsize);
+      return false;
+    }
+    if (indexing_) index_.add_metadata(offset, hash, msg_name);
+  } else if (!write_record(cis->ptr, nsize)) {
+    fprintf(stderr, "Error writing packet of %zu bytes\n", nsize);
     return false;
   }
-  if (file_write_callback_) {
-    file_write_callback_(cis->ptr, nsize, write_callback_usr_ptr_);
-  }
   cis->updatePtrAndSize(nsize);
   return true;
 }
@@ -261,6 +816,7 @@ bool cbuf_ostream::merge(const std::vector<cbuf_istream*>& inputs, const std::ve
 /// Return true if a packet was consumed, false otherwise
 bool cbuf_istream::consume_internal() {
   bool ret;
+  if (filtering_) skip_filtered();
   if (empty()) return false;
 
   auto hash = __get_next_hash();
@@ -269,60 +825,599 @@ bool cbuf_istream::consume_internal() {
 
   if (hash == cbufmsg::metadata::TYPE_HASH) {
     cbufmsg::metadata mdata;
-    ret = mdata.decode((char*)ptr, rem_size);
+    ret = mdata.decode((char*)ptr, decode_size());
     if (!ret) return false;
-    ptr += nsize;
-    rem_size -= nsize;
+    updatePtrAndSize(nsize);
     dictionary[mdata.msg_hash] = mdata.msg_name;
     metadictionary[mdata.msg_hash] = mdata.msg_meta;
 
     return true;
   }
+  if (hash == cbufmsg::large_header::TYPE_HASH) {
+    return consume_large_header();
+  }
+  if (hash == cbufmsg::file_index::TYPE_HASH || hash == cbufmsg::index_trailer::TYPE_HASH) {
+    updatePtrAndSize(nsize);
+    return true;
+  }
+  return unpack_record();
+}
+
+bool cbuf_istream::consume_large_header() {
+  auto nsize = __get_next_size();
+  cbufmsg::large_header hdr;
+  if (!hdr.decode((char*)ptr, decode_size())) return false;
+  if (nsize + sizeof(cbuf_preamble) > rem_size) return false;
+
+  // The message has to follow right away
+  const cbuf_preamble* pre = (const cbuf_preamble*)(ptr + nsize);
+  if (pre->magic != CBUF_MAGIC || pre->hash != hdr.msg_hash || hdr.msg_size < sizeof(cbuf_preamble)) {
+    return false;
+  }
+  updatePtrAndSize(nsize);
+  large_ptr_ = ptr;
+  large_size_ = hdr.msg_size;
+  return true;
+}
+
+bool cbuf_istream::unpack_record() {
+  // Records are never nested, the unpacked messages are plain ones
+  if (unpacking_ || empty() || !__check_next_preamble()) return false;
+
+  if (__get_next_hash() == cbufmsg::batch::TYPE_HASH) {
+    return unpack_batch();
+  }
+  if (__get_next_hash() == cbufmsg::repeat::TYPE_HASH) {
+    return unpack_repeat();
+  }
+  if (__get_next_hash() == cbufmsg::delta::TYPE_HASH) {
+    return unpack_delta();
+  }
+  keep_reference();
   return false;
 }
 
+void cbuf_istream::keep_reference() {
+  if (references_.empty()) return;
+  const cbuf_preamble* pre = (const cbuf_preamble*)ptr;
+  auto it = references_.find(std::make_pair(pre->hash, pre->variant()));
+  if (it == references_.end()) return;
+  size_t offset = get_current_offset();
+  size_t size = pre->size();
+  auto& ref = it->second;
+  if ((ref.offset == offset && !ref.data.empty()) || size < sizeof(cbuf_preamble) || size > rem_size) return;
+  ref.offset = offset;
+  ref.data.assign(ptr, ptr + size);
+}
+
+const cbuf_preamble* cbuf_istream::find_reference(uint64_t hash, uint8_t variant, size_t distance) {
+  size_t offset = get_current_offset();
+  if (distance < sizeof(cbuf_preamble) || distance > offset) return nullptr;
+  size_t ref_offset = offset - distance;
+  // Messages of the type are kept from now on
+  auto& ref = references_[std::make_pair(hash, variant)];
+  if (ref.offset == ref_offset && !ref.data.empty()) return (const cbuf_preamble*)ref.data.data();
+
+  // Not walked over, as with the first record of the type or after jumping
+  const cbuf_preamble* pre = (const cbuf_preamble*)(start_ptr + ref_offset);
+  if (pre->magic != CBUF_MAGIC || pre->hash != hash || pre->variant() != variant ||
+      pre->size() < sizeof(cbuf_preamble) || pre->size() > distance) {
+    return nullptr;
+  }
+  ref.offset = ref_offset;
+  ref.data.assign((const unsigned char*)pre, (const unsigned char*)pre + pre->size());
+  return (const cbuf_preamble*)ref.data.data();
+}
+
+// Rebuild the message of a delta record from its keyframe, which has to match it
+static bool rebuild_delta_message(const cbufmsg::delta& rec, const cbuf_preamble* key,
+                                  std::vector<unsigned char>& out) {
+  size_t msg_size = key->size();
+  out.assign((const unsigned char*)key, (const unsigned char*)key + msg_size);
+  ((cbuf_preamble*)out.data())->packet_timest = rec.preamble.packet_timest;
+  return rle_xor_decode(rec.rle.data(), rec.rle.size(), out.data() + sizeof(cbuf_preamble),
+                        msg_size - sizeof(cbuf_preamble));
+}
+
+// Batched messages always fit on a preamble with a variant
+static constexpr uint32_t MAX_VARIANT_SIZE = 0x07FFFFFF;
+
+// Rebuild every message of a batch record back to back, preamble included
+static bool unpack_batch_messages(const cbufmsg::batch& rec, std::vector<unsigned char>& out) {
+  size_t count = rec.ts_deltas.size();
+  size_t body_total = 0;
+  if (rec.msg_size == 0) {
+    if (rec.sizes.size() != count) return false;
+    for (auto sz : rec.sizes) {
+      if (sz < sizeof(cbuf_preamble) || sz >= MAX_VARIANT_SIZE) return false;
+      body_total += sz - sizeof(cbuf_preamble);
+    }
+  } else {
+    if (rec.msg_size < sizeof(cbuf_preamble) || rec.msg_size >= MAX_VARIANT_SIZE) return false;
+    body_total = count * (rec.msg_size - sizeof(cbuf_preamble));
+  }
+  if (body_total != rec.data.size()) return false;
+
+  // Rebuild every message, preamble included, so they can be decoded in place
+  out.resize(body_total + count * sizeof(cbuf_preamble));
+  unsigned char* dst = out.data();
+  const uint8_t* src = rec.data.data();
+  for (size_t i = 0; i < count; i++) {
+    uint32_t msg_size = rec.msg_size != 0 ? rec.msg_size : rec.sizes[i];
+    cbuf_preamble pre;
+    pre.magic = CBUF_MAGIC;
+    pre.setSize(msg_size);
+    pre.setVariant(rec.msg_variant);
+    pre.hash = rec.msg_hash;
+    pre.packet_timest = rec.preamble.packet_timest + double(rec.ts_deltas[i]);
+    memcpy(dst, &pre, sizeof(pre));
+    memcpy(dst + sizeof(pre), src, msg_size - sizeof(pre));
+    dst += msg_size;
+    src += msg_size - sizeof(pre);
+  }
+  return true;
+}
+
+// Copies of the message a repeat record stands for, with timestamps spread evenly
+static void expand_repeat_messages(const cbufmsg::repeat& rec, const cbuf_preamble* msg,
+                                   std::vector<unsigned char>& out) {
+  size_t msg_size = msg->size();
+  out.resize(msg_size * rec.count);
+  unsigned char* dst = out.data();
+  double first_ts = rec.preamble.packet_timest;
+  double step = rec.count > 1 ? (rec.last_ts - first_ts) / (rec.count - 1) : 0;
+  for (uint32_t i = 0; i < rec.count; i++) {
+    memcpy(dst, msg, msg_size);
+    ((cbuf_preamble*)dst)->packet_timest = (i + 1 == rec.count) ? rec.last_ts : first_ts + step * i;
+    dst += msg_size;
+  }
+}
+
+bool cbuf_istream::unpack_delta() {
+  auto nsize = __get_next_size();
+  if (nsize > rem_size) return false;
+  cbufmsg::delta rec;
+  const cbuf_preamble* key = nullptr;
+  if (rec.decode((char*)ptr, decode_size())) {
+    key = find_reference(rec.msg_hash, rec.msg_variant, rec.key_distance);
+  }
+  if (key == nullptr || !rebuild_delta_message(rec, key, unpacked_)) {
+    // Never handed out as it is, the message cannot be rebuilt without its keyframe
+    fprintf(stderr, "Skipping a delta record without its keyframe on %s [Offset %zu]\n", fname_.c_str(),
+            get_current_offset());
+    updatePtrAndSize(nsize);
+    return true;
+  }
+
+  start_unpacking(nsize);
+  return true;
+}
+
+bool cbuf_istream::restore_position(const position& pos) {
+  if (!jump_to_offset(pos.offset)) return false;
+  if (pos.unpacked == 0) return true;
+  // Unpack the record again and skip the messages read of it
+  if (!consume_internal() || !unpacking_ || pos.unpacked >= rem_size) return false;
+  updatePtrAndSize(pos.unpacked);
+  return true;
+}
+
+void cbuf_istream::start_unpacking(size_t nsize) {
+  record_offset_ = get_current_offset();
+  updatePtrAndSize(nsize);
+  if (unpacked_.empty()) return;
+
+  resume_ptr_ = ptr;
+  resume_rem_size_ = rem_size;
+  ptr = unpacked_.data();
+  rem_size = unpacked_.size();
+  unpacking_ = true;
+}
+
+bool cbuf_istream::unpack_batch() {
+  auto nsize = __get_next_size();
+  if (nsize > rem_size) return false;
+  cbufmsg::batch rec;
+  if (!rec.decode((char*)ptr, decode_size())) return false;
+  if (!unpack_batch_messages(rec, unpacked_)) return false;
+
+  start_unpacking(nsize);
+  return true;
+}
+
+bool cbuf_istream::unpack_repeat() {
+  auto nsize = __get_next_size();
+  if (nsize > rem_size) return false;
+  cbufmsg::repeat rec;
+  const cbuf_preamble* pre = nullptr;
+  bool decoded = rec.decode((char*)ptr, decode_size());
+  if (decoded && expand_repeats_ && rec.count > 0) {
+    pre = find_reference(rec.msg_hash, rec.msg_variant, rec.msg_distance);
+    if (pre == nullptr) {
+      fprintf(stderr, "Skipping a repeat record without the message repeated on %s [Offset %zu]\n",
+              fname_.c_str(), get_current_offset());
+    }
+  }
+  // Repeats are skipped unless expanding them, and never handed out as they are
+  if (pre == nullptr) {
+    updatePtrAndSize(nsize);
+    return true;
+  }
+  expand_repeat_messages(rec, pre, unpacked_);
+
+  start_unpacking(nsize);
+  return true;
+}
+
 const char* cbuf_istream::get_or_search_string_for_hash(uint64_t hash) {
   if (metadictionary.count(hash) > 0) {
     return metadictionary[hash].c_str();
   }
-  auto old_ptr = ptr;
-  auto old_size = rem_size;
-  while (!empty()) {
-    auto msghash = __get_next_hash();
-    auto nsize = __get_next_size();
+  // Search on the file itself, unpacked messages never hold metadata
+  const unsigned char* search_ptr = unpacking_ ? resume_ptr_ : ptr;
+  size_t search_size = unpacking_ ? resume_rem_size_ : rem_size;
+  while (search_size >= sizeof(cbuf_preamble)) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)search_ptr;
+    size_t nsize = pre->size();
+    if (pre->magic != CBUF_MAGIC || nsize == 0 || nsize > search_size) break;
 
-    if (msghash == cbufmsg::metadata::TYPE_HASH) {
+    if (pre->hash == cbufmsg::large_header::TYPE_HASH) {
+      // Skip the header and the message it describes at once
+      cbufmsg::large_header hdr;
+      if (!hdr.decode((char*)search_ptr, (unsigned int)std::min<size_t>(search_size, UINT_MAX))) break;
+      nsize += hdr.msg_size;
+      if (nsize > search_size) break;
+    } else if (pre->hash == cbufmsg::metadata::TYPE_HASH) {
       cbufmsg::metadata mdata;
-      bool ret = mdata.decode((char*)ptr, rem_size);
-      assert(ret);
-      (void)ret;
-      ptr += nsize;
-      rem_size -= nsize;
+      if (!mdata.decode((char*)search_ptr, (unsigned int)std::min<size_t>(search_size, UINT_MAX))) break;
       dictionary[mdata.msg_hash] = mdata.msg_name;
       metadictionary[mdata.msg_hash] = mdata.msg_meta;
 
       if (mdata.msg_hash == hash) {
-        ptr = old_ptr;
-        rem_size = old_size;
         return metadictionary[mdata.msg_hash].c_str();
       }
     }
-    // Consunme the current message since it was not what we looked for
-    skip_message();
+    // Consume the current message since it was not what we looked for
+    search_ptr += nsize;
+    search_size -= nsize;
   }
-  ptr = old_ptr;
-  rem_size = old_size;
   return nullptr;
 }
 
 void cbuf_istream::close() {
   if (memmap_ptr != nullptr) {
-    munmap((void*)memmap_ptr, filesize);
+    munmap((void*)memmap_ptr, mapped_size_);
+    memmap_ptr = nullptr;
   }
+  // Nothing points to the mapping released, an index is not looked for there
+  ptr = start_ptr = nullptr;
+  rem_size = filesize = 0;
+  mapped_size_ = 0;
+  growing_ = false;
+  advise_ptr_ = nullptr;
+  released_offset_ = 0;
   if (stream != -1) {
     ::close(stream);
   }
   stream = -1;
+  delete socket_;
+  socket_ = nullptr;
+  delete mcast_;
+  mcast_ = nullptr;
+  reset_internal_state();
+}
+
+void cbuf_istream::reset_internal_state() {
+  unpacking_ = false;
+  references_.clear();
+  large_ptr_ = nullptr;
+  index_.reset();
+  index_checked_ = false;
+  clear_type_filter();
+  metadata_gap_start_ = 0;
+  metadata_gap_end_ = 0;
+}
+
+const CBufIndex* cbuf_istream::get_index() {
+  // The footer of a file being written is not there yet
+  if (growing_) return nullptr;
+  if (!index_checked_) {
+    index_checked_ = true;
+    index_ = std::make_unique<CBufIndex>();
+    bool loaded = index_->load_footer(start_ptr, filesize);
+    // Only files on disk can have a sidecar, and it has to cover the bytes mapped
+    if (!loaded && memmap_ptr != nullptr && !fname_.empty()) {
+      loaded = index_->load_sidecar(fname_) && index_->file_size() == filesize;
+    }
+    if (!loaded) index_.reset();
+  }
+  return index_.get();
+}
+
+bool cbuf_istream::set_type_filter(const std::vector<std::string>& msg_names) {
+  clear_type_filter();
+  const CBufIndex* index = get_index();
+  if (index == nullptr) return false;
+
+  for (const auto& info : index->types()) {
+    if (std::find(msg_names.begin(), msg_names.end(), info.name) == msg_names.end()) continue;
+    filter_offsets_.insert(filter_offsets_.end(), info.offsets.begin(), info.offsets.end());
+  }
+  std::sort(filter_offsets_.begin(), filter_offsets_.end());
+  // Metadata records are jumped over as well
+  for (auto offset : index->metadata_offsets()) {
+    load_metadata_at(offset);
+  }
+  filtering_ = true;
+  return true;
+}
+
+void cbuf_istream::clear_type_filter() {
+  filter_offsets_.clear();
+  filtering_ = false;
+}
+
+void cbuf_istream::skip_filtered() {
+  // Unpacked messages and the ones after a large header belong to a record already visited
+  if (unpacking_ || ptr == large_ptr_ || empty()) return;
+  size_t offset = get_current_offset();
+  auto it = std::lower_bound(filter_offsets_.begin(), filter_offsets_.end(), offset);
+  if (it == filter_offsets_.end()) {
+    jump_to_offset(filesize);
+  } else if (*it != offset) {
+    jump_to_offset(*it);
+  }
+}
+
+bool cbuf_istream::load_metadata_at(size_t offset) {
+  if (offset + sizeof(cbuf_preamble) > filesize) return false;
+  const cbuf_preamble* pre = (const cbuf_preamble*)(start_ptr + offset);
+  if (pre->magic != CBUF_MAGIC || pre->hash != cbufmsg::metadata::TYPE_HASH) return false;
+  cbufmsg::metadata mdata;
+  if (!mdata.decode((char*)pre, (unsigned int)std::min<size_t>(filesize - offset, UINT_MAX))) return false;
+  dictionary[mdata.msg_hash] = mdata.msg_name;
+  metadictionary[mdata.msg_hash] = mdata.msg_meta;
+  return true;
+}
+
+static size_t find_magic_scalar(const unsigned char* data, size_t size) {
+  const uint32_t magic = CBUF_MAGIC;
+  const unsigned char first = (unsigned char)(magic & 0xFF);
+  size_t pos = 0;
+  while (pos + sizeof(magic) <= size) {
+    const void* hit = memchr(data + pos, first, size - pos - sizeof(magic) + 1);
+    if (hit == nullptr) break;
+    pos = (const unsigned char*)hit - data;
+    if (memcmp(data + pos, &magic, sizeof(magic)) == 0) return pos;
+    pos++;
+  }
+  return size < sizeof(magic) ? 0 : size - sizeof(magic) + 1;
+}
+
+#if defined(__x86_64__)
+// Compares 32 offsets at once, each against the 4 bytes of the magic
+__attribute__((target("avx2"))) static size_t find_magic_avx2(const unsigned char* data, size_t size) {
+  const uint32_t magic = CBUF_MAGIC;
+  const __m256i b0 = _mm256_set1_epi8(char(magic & 0xFF));
+  const __m256i b1 = _mm256_set1_epi8(char((magic >> 8) & 0xFF));
+  const __m256i b2 = _mm256_set1_epi8(char((magic >> 16) & 0xFF));
+  const __m256i b3 = _mm256_set1_epi8(char(magic >> 24));
+  size_t pos = 0;
+  for (; pos + 32 + sizeof(magic) - 1 <= size; pos += 32) {
+    const __m256i* p = (const __m256i*)(data + pos);
+    __m256i m = _mm256_cmpeq_epi8(_mm256_loadu_si256(p), b0);
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + pos + 1)), b1));
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + pos + 2)), b2));
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + pos + 3)), b3));
+    uint32_t mask = uint32_t(_mm256_movemask_epi8(m));
+    if (mask != 0) return pos + __builtin_ctz(mask);
+  }
+  return pos + find_magic_scalar(data + pos, size - pos);
+}
+#endif
+
+size_t cbuf_istream::find_magic(const unsigned char* data, size_t size) {
+#if defined(__x86_64__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) return find_magic_avx2(data, size);
+#endif
+  return find_magic_scalar(data, size);
+}
+
+static bool is_internal_hash(uint64_t hash) {
+  return hash == cbufmsg::metadata::TYPE_HASH || hash == cbufmsg::batch::TYPE_HASH ||
+         hash == cbufmsg::repeat::TYPE_HASH || hash == cbufmsg::delta::TYPE_HASH ||
+         hash == cbufmsg::large_header::TYPE_HASH || hash == cbufmsg::file_index::TYPE_HASH ||
+         hash == cbufmsg::index_trailer::TYPE_HASH;
+}
+
+int cbuf_istream::resync_quality(const unsigned char* p, size_t remaining) const {
+  const cbuf_preamble* pre = (const cbuf_preamble*)p;
+  size_t size = pre->size();
+  if (pre->magic != CBUF_MAGIC || size < sizeof(cbuf_preamble) || size > remaining) return 0;
+  if (!std::isfinite(pre->packet_timest)) return 0;
+  // A preamble followed by another one is real, even if its metadata was lost
+  if (size == remaining) return 2;
+  if (size + sizeof(cbuf_preamble) <= remaining && ((const cbuf_preamble*)(p + size))->magic == CBUF_MAGIC) {
+    return 2;
+  }
+  // Without any metadata yet every hash is unknown
+  if (!dictionary.empty() && dictionary.count(pre->hash) == 0 && !is_internal_hash(pre->hash)) return 1;
+  if (last_good_ts_ > 0 && pre->hash != cbufmsg::metadata::TYPE_HASH &&
+      (pre->packet_timest < last_good_ts_ - resync_options_.max_backstep ||
+       pre->packet_timest > last_good_ts_ + resync_options_.max_jump)) {
+    return 1;
+  }
+  return 2;
+}
+
+bool cbuf_istream::skip_corrupted() {
+  if (empty()) return true;
+  if (__check_next_preamble() && (__get_next_size() > 0)) return true;
+
+  // The first candidate with a plausible size is taken if none looks right
+  size_t fallback = 0;
+  size_t pos = 1;
+  while (pos + sizeof(cbuf_preamble) <= rem_size) {
+    pos += find_magic(ptr + pos, rem_size - pos);
+    if (pos + sizeof(cbuf_preamble) > rem_size) break;
+    int quality = resync_quality(ptr + pos, rem_size - pos);
+    if (quality == 2) {
+      updatePtrAndSize(pos);
+      return true;
+    }
+    if (quality == 1 && fallback == 0) fallback = pos;
+    pos++;
+  }
+  updatePtrAndSize(fallback > 0 ? fallback : rem_size);
+  return true;
+}
+
+size_t cbuf_istream::chained_record_size(size_t offset) const {
+  if (offset + sizeof(cbuf_preamble) > filesize) return 0;
+  const cbuf_preamble* pre = (const cbuf_preamble*)(start_ptr + offset);
+  size_t size = pre->size();
+  size_t remaining = filesize - offset;
+  if (pre->magic != CBUF_MAGIC || size < sizeof(cbuf_preamble) || size > remaining) return 0;
+  if (!std::isfinite(pre->packet_timest)) return 0;
+  if (size == remaining) return size;
+  if (size + sizeof(cbuf_preamble) > remaining) return 0;
+  return ((const cbuf_preamble*)(start_ptr + offset + size))->magic == CBUF_MAGIC ? size : 0;
+}
+
+bool cbuf_istream::find_timed_record(size_t offset, size_t limit, size_t& found, double& ts) const {
+  // Preambles nested in a message, as on arrays of structs, chain to a few others at most.
+  // Real records chain until the end of the file
+  const unsigned CHAIN_CHECK = 8;
+  size_t pos = offset;
+  while (pos < limit && pos + sizeof(cbuf_preamble) <= filesize) {
+    pos += find_magic(start_ptr + pos, filesize - pos);
+    if (pos >= limit || pos + sizeof(cbuf_preamble) > filesize) break;
+    // Follow the chain, the record found is the last one, past anything nested
+    size_t rec = pos;
+    size_t size = chained_record_size(rec);
+    unsigned hops = 0;
+    while (size > 0 && hops < CHAIN_CHECK && rec + size < filesize) {
+      size_t next_size = chained_record_size(rec + size);
+      // A record cut short ends the chain on files not closed cleanly
+      if (next_size == 0) {
+        const cbuf_preamble* next = (const cbuf_preamble*)(start_ptr + rec + size);
+        if (rec + size + sizeof(cbuf_preamble) > filesize || next->size() > filesize - rec - size) break;
+        size = 0;
+        break;
+      }
+      rec += size;
+      size = next_size;
+      hops++;
+    }
+    if (size == 0) {
+      pos++;
+      continue;
+    }
+    // Metadata and index records have no timestamps of messages
+    const cbuf_preamble* pre = (const cbuf_preamble*)(start_ptr + rec);
+    while (pre->hash == cbufmsg::metadata::TYPE_HASH || pre->hash == cbufmsg::file_index::TYPE_HASH ||
+           pre->hash == cbufmsg::index_trailer::TYPE_HASH) {
+      rec += pre->size();
+      if (chained_record_size(rec) == 0) return false;
+      pre = (const cbuf_preamble*)(start_ptr + rec);
+    }
+    if (rec >= limit) return false;
+    found = rec;
+    ts = pre->packet_timest;
+    return true;
+  }
+  return false;
+}
+
+bool cbuf_istream::search_metadata_gap(uint64_t hash) {
+  while (metadata_gap_start_ + sizeof(cbuf_preamble) <= metadata_gap_end_) {
+    size_t pos = metadata_gap_start_;
+    const cbuf_preamble* pre = (const cbuf_preamble*)(start_ptr + pos);
+    size_t nsize = pre->size();
+    if (pre->magic != CBUF_MAGIC || nsize < sizeof(cbuf_preamble) || nsize > filesize - pos) {
+      // Corrupted, continue on the next magic
+      metadata_gap_start_ = pos + 1 + find_magic(start_ptr + pos + 1, metadata_gap_end_ - pos - 1);
+      continue;
+    }
+    if (pre->hash == cbufmsg::large_header::TYPE_HASH) {
+      // Skip the header and the message it describes at once
+      cbufmsg::large_header hdr;
+      if (hdr.decode((char*)pre, (unsigned int)std::min<size_t>(filesize - pos, UINT_MAX))) {
+        nsize += hdr.msg_size;
+      }
+    }
+    metadata_gap_start_ = pos + nsize;
+    if (load_metadata_at(pos) && dictionary.count(hash) > 0) return true;
+  }
+  metadata_gap_start_ = metadata_gap_end_ = 0;
+  return false;
+}
+
+bool cbuf_istream::seek_to_time(double t) {
+  const CBufIndex* index = get_index();
+  if (index != nullptr) {
+    // Metadata before the offset would be missed otherwise
+    for (auto offset : index->metadata_offsets()) {
+      load_metadata_at(offset);
+    }
+    if (!jump_to_offset(index->offset_for_time(t))) return false;
+  } else {
+    // Narrow down to a record earlier than t by more than timestamps go back, so no message
+    // at t or later is before it. The last stretch is scanned
+    const size_t SCAN_SIZE = 64 * 1024;
+    size_t lo = 0;
+    size_t hi = filesize;
+    while (hi - lo > SCAN_SIZE) {
+      size_t mid = lo + (hi - lo) / 2;
+      size_t found;
+      double ts;
+      if (find_timed_record(mid, hi, found, ts) && ts < t - resync_options_.max_backstep) {
+        lo = found;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo > 0) {
+      if (metadata_gap_start_ == metadata_gap_end_) metadata_gap_start_ = 0;
+      metadata_gap_end_ = std::max(metadata_gap_end_, lo);
+    }
+    last_good_ts_ = 0;
+    if (!jump_to_offset(lo)) return false;
+  }
+
+  while (!empty_no_internal()) {
+    if (!__check_next_preamble() || __get_next_size() == 0) {
+      skip_corrupted();
+      continue;
+    }
+    if (get_next_timestamp() >= t || !skip_message()) break;
+  }
+  return true;
+}
+
+bool cbuf_istream::peek_start_time(const char* fname, double& ts) {
+  const size_t PEEK_SIZE = 64 * 1024;
+  ts = 0;
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1) return false;
+  std::vector<unsigned char> head(PEEK_SIZE);
+  ssize_t n = pread(fd, head.data(), head.size(), 0);
+  ::close(fd);
+  if (n < 0) return false;
+
+  size_t pos = 0;
+  while (pos + sizeof(cbuf_preamble) <= size_t(n)) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)(head.data() + pos);
+    size_t size = pre->size();
+    if (pre->magic != CBUF_MAGIC || size < sizeof(cbuf_preamble)) break;
+    if (pre->hash != cbufmsg::metadata::TYPE_HASH) {
+      if (std::isfinite(pre->packet_timest)) ts = pre->packet_timest;
+      break;
+    }
+    pos += size;
+  }
+  return true;
 }
 
 bool cbuf_istream::open_file(const char* fname) {
@@ -337,29 +1432,470 @@ bool cbuf_istream::open_file(const char* fname) {
   filesize = st.st_size;
   int flags = MAP_PRIVATE;
 #if defined(__linux__)
-  flags |= MAP_POPULATE;
+  if (map_options_.mode == MapMode::POPULATE) flags |= MAP_POPULATE;
 #endif
   memmap_ptr = (unsigned char*)mmap(nullptr, filesize, PROT_READ, flags, stream, 0);
   if (memmap_ptr == MAP_FAILED) {
+    memmap_ptr = nullptr;
     return false;
   }
+  mapped_size_ = filesize;
 
   rem_size = filesize;
   ptr = start_ptr = memmap_ptr;
+  reset_internal_state();
+  fname_ = fname;
+  if (map_options_.mode == MapMode::STREAMING) {
+    madvise((void*)memmap_ptr, filesize, MADV_SEQUENTIAL);
+    advise_window();
+  }
+  return true;
+}
+
+bool cbuf_istream::open_growing_file(const char* fname) {
+  close();
+  stream = open(fname, O_RDONLY);
+  if (stream == -1) {
+    perror("Error opening file ");
+    return false;
+  }
+  // Nothing is mapped until the file has whole records
+  open_memory(nullptr, 0);
   fname_ = fname;
+  growing_ = true;
+  return true;
+}
+
+void cbuf_istream::done_growing() {
+  if (!growing_) return;
+  growing_ = false;
+  map_appended();
+}
+
+bool cbuf_istream::remap(size_t size) {
+  void* mem;
+  if (memmap_ptr == nullptr) {
+    // Shared, so pages mapped before the writer got to them see what it writes later
+    mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, stream, 0);
+  } else {
+    mem = mremap((void*)memmap_ptr, mapped_size_, size, MREMAP_MAYMOVE);
+  }
+  if (mem == MAP_FAILED) return false;
+
+  const unsigned char* base = (const unsigned char*)mem;
+  if (memmap_ptr == nullptr) {
+    ptr = start_ptr = base;
+  } else if (base != memmap_ptr) {
+    // Unpacked messages are not on the file, only where to resume after them is
+    if (unpacking_) {
+      resume_ptr_ = base + (resume_ptr_ - memmap_ptr);
+    } else {
+      ptr = base + (ptr - memmap_ptr);
+    }
+    if (large_ptr_ != nullptr) large_ptr_ = base + (large_ptr_ - memmap_ptr);
+    start_ptr = base;
+  }
+  memmap_ptr = base;
+  mapped_size_ = size;
   return true;
 }
 
+void cbuf_istream::map_appended() {
+  struct stat st;
+  if (stream == -1 || fstat(stream, &st) != 0) return;
+  size_t size = size_t(st.st_size);
+  if (size > mapped_size_ && !remap(size)) return;
+
+  // Whole records only, walking from the end of the last one shown
+  size_t end = filesize;
+  while (growing_ && end + sizeof(cbuf_preamble) <= size) {
+    const cbuf_preamble* pre = (const cbuf_preamble*)(start_ptr + end);
+    size_t record = pre->size();
+    if (pre->magic != CBUF_MAGIC || record < sizeof(cbuf_preamble)) {
+      // Not written halfway but corrupted, left for the resync
+      end = size;
+      break;
+    }
+    if (pre->hash == cbufmsg::large_header::TYPE_HASH && end + record <= size) {
+      // The message described goes along with its header
+      cbufmsg::large_header hdr;
+      if (hdr.decode((char*)pre, (unsigned int)record)) record += hdr.msg_size;
+    }
+    if (end + record > size) break;
+    end += record;
+  }
+  if (!growing_) end = size;
+  if (end <= filesize) return;
+
+  if (unpacking_) {
+    resume_rem_size_ += end - filesize;
+  } else {
+    rem_size += end - filesize;
+  }
+  filesize = end;
+}
+
+void cbuf_istream::advise_window() {
+  if (memmap_ptr == nullptr || map_options_.mode != MapMode::STREAMING) {
+    advise_ptr_ = nullptr;
+    return;
+  }
+  const size_t page = size_t(sysconf(_SC_PAGESIZE));
+  size_t offset = get_current_offset();
+  size_t ahead_start = offset / page * page;
+  size_t ahead_end = std::min(filesize, offset + map_options_.readahead);
+  if (ahead_end > ahead_start) {
+    madvise((void*)(memmap_ptr + ahead_start), ahead_end - ahead_start, MADV_WILLNEED);
+  }
+
+  // Pages behind are dropped, reading them again faults them back from the file
+  size_t behind_end = offset > map_options_.keep_behind ? (offset - map_options_.keep_behind) / page * page : 0;
+  if (behind_end > released_offset_) {
+    madvise((void*)(memmap_ptr + released_offset_), behind_end - released_offset_, MADV_DONTNEED);
+  }
+  released_offset_ = behind_end;
+
+  // Advise again once half of the read ahead is consumed
+  advise_ptr_ = start_ptr + std::min(filesize, offset + std::max<size_t>(map_options_.readahead / 2, page));
+}
+
 bool cbuf_istream::open_memory(const unsigned char* data, size_t length) {
   rem_size = filesize = length;
   ptr = start_ptr = data;
+  reset_internal_state();
+  advise_ptr_ = nullptr;
   return true;
 }
 
+void cbuf_istream::start_live() {
+  live_.clear();
+  open_memory(live_.data(), 0);
+}
+
 bool cbuf_istream::open_socket(const char* ip, int port) {
-  (void)ip;
-  (void)port;
-  return false;
+  close();
+  fname_ = std::string(ip) + ":" + std::to_string(port);
+  socket_ = new cbuf_socket_receiver();
+  if (!socket_->open(ip, port)) {
+    delete socket_;
+    socket_ = nullptr;
+    return false;
+  }
+  socket_->set_include_metadata(true);
+  fname_ = std::string(ip) + ":" + std::to_string(socket_->local_port());
+  start_live();
+  return true;
+}
+
+bool cbuf_istream::open_unix_socket(const char* path) {
+  close();
+  fname_ = path;
+  socket_ = new cbuf_socket_receiver();
+  if (!socket_->open_unix(path)) {
+    delete socket_;
+    socket_ = nullptr;
+    return false;
+  }
+  socket_->set_include_metadata(true);
+  start_live();
+  return true;
+}
+
+bool cbuf_istream::open_multicast(const char* group, int port, const char* interface) {
+  close();
+  fname_ = std::string(group) + ":" + std::to_string(port);
+  mcast_ = new cbuf_mcast_subscriber();
+  if (!mcast_->open(group, port, interface)) {
+    delete mcast_;
+    mcast_ = nullptr;
+    return false;
+  }
+  mcast_->set_include_metadata(true);
+  start_live();
+  return true;
+}
+
+bool cbuf_istream::is_connected() const { return socket_ != nullptr && socket_->is_connected(); }
+
+int cbuf_istream::local_port() const { return socket_ != nullptr ? socket_->local_port() : 0; }
+
+void cbuf_istream::append_live(const cbuf_decoder::message& msg) {
+  const unsigned char* data = (const unsigned char*)msg.preamble;
+  if (msg.size < msg.preamble->maxSize()) {
+    live_.insert(live_.end(), data, data + msg.size);
+    return;
+  }
+  // Too large for its preamble, written as cbuf_ostream does with a large header first
+  cbufmsg::large_header hdr;
+  hdr.preamble.packet_timest = msg.preamble->packet_timest;
+  hdr.msg_hash = msg.preamble->hash;
+  hdr.msg_size = msg.size;
+  const unsigned char* hdr_data = (const unsigned char*)hdr.encode();
+  live_.insert(live_.end(), hdr_data, hdr_data + hdr.encode_size());
+  cbuf_preamble pre = *msg.preamble;
+  pre.setSize(0);
+  live_.insert(live_.end(), (const unsigned char*)&pre, (const unsigned char*)(&pre + 1));
+  live_.insert(live_.end(), data + sizeof(pre), data + msg.size);
+}
+
+void cbuf_istream::receive_live(int timeout_ms) {
+  // Bounded, so a fast sender does not keep the stream receiving
+  const size_t MAX_RECEIVE = 16 * 1024 * 1024;
+  cbuf_decoder::message msg;
+  size_t received = 0;
+  while (received < MAX_RECEIVE) {
+    int wait_ms = live_.empty() ? timeout_ms : 0;
+    if (socket_ != nullptr) {
+      socket_->set_expand_repeats(expand_repeats_);
+      if (!socket_->next(msg, wait_ms)) break;
+    } else {
+      mcast_->set_expand_repeats(expand_repeats_);
+      if (!mcast_->next(msg, wait_ms)) break;
+    }
+    received += msg.size;
+    append_live(msg);
+  }
+}
+
+bool cbuf_istream::receive(int timeout_ms) {
+  if (!is_live()) return !empty();
+
+  // Drop the messages consumed
+  const unsigned char* old_start = start_ptr;
+  size_t consumed = (unpacking_ ? resume_ptr_ : ptr) - start_ptr;
+  if (consumed > 0) live_.erase(live_.begin(), live_.begin() + consumed);
+
+  receive_live(timeout_ms);
+
+  // The buffer may have moved, position at its start
+  size_t large_offset = large_ptr_ != nullptr ? large_ptr_ - old_start : 0;
+  large_ptr_ = large_ptr_ != nullptr && large_offset >= consumed ? live_.data() + large_offset - consumed
+                                                                  : nullptr;
+  if (!unpacking_) {
+    ptr = start_ptr = live_.data();
+    rem_size = filesize = live_.size();
+  } else {
+    // Continue past the record being unpacked, already consumed
+    resume_ptr_ = start_ptr = live_.data();
+    resume_rem_size_ = filesize = live_.size();
+  }
+  return !empty();
+}
+
+void cbuf_decoder::feed(const void* data, size_t size) {
+  if (yielded_size_ > 0) {
+    consume(yielded_size_, yielded_from_buffer_);
+    yielded_size_ = 0;
+  }
+  // Whatever is left of the previous chunk goes first
+  take_from_chunk(chunk_rem_);
+  chunk_ptr_ = (const unsigned char*)data;
+  chunk_rem_ = size;
+}
+
+void cbuf_decoder::reset() {
+  dictionary.clear();
+  metadictionary.clear();
+  chunk_ptr_ = nullptr;
+  chunk_rem_ = 0;
+  buffer_.clear();
+  buf_start_ = 0;
+  yielded_size_ = 0;
+  unpacked_.clear();
+  unpacked_pos_ = 0;
+  references_.clear();
+  stream_offset_ = 0;
+  large_size_ = 0;
+  corrupted_bytes_ = 0;
+}
+
+size_t cbuf_decoder::record_size(const cbuf_preamble* pre) const {
+  if (pre->magic != CBUF_MAGIC) return 0;
+  if (large_size_ > 0) return pre->hash == large_hash_ ? large_size_ : 0;
+  size_t size = pre->size();
+  return size >= sizeof(cbuf_preamble) ? size : 0;
+}
+
+void cbuf_decoder::take_from_chunk(size_t size) {
+  if (size == 0) return;
+  if (buf_start_ > 0) {
+    buffer_.erase(buffer_.begin(), buffer_.begin() + buf_start_);
+    buf_start_ = 0;
+  }
+  buffer_.insert(buffer_.end(), chunk_ptr_, chunk_ptr_ + size);
+  chunk_ptr_ += size;
+  chunk_rem_ -= size;
+}
+
+void cbuf_decoder::consume(size_t size, bool from_buffer) {
+  stream_offset_ += size;
+  if (!from_buffer) {
+    chunk_ptr_ += size;
+    chunk_rem_ -= size;
+    return;
+  }
+  buf_start_ += size;
+  if (buf_start_ == buffer_.size()) {
+    // Keep the memory for the next partial message
+    buffer_.clear();
+    buf_start_ = 0;
+  }
+}
+
+bool cbuf_decoder::next(message& msg) {
+  if (yielded_size_ > 0) {
+    consume(yielded_size_, yielded_from_buffer_);
+    yielded_size_ = 0;
+  }
+
+  while (true) {
+    if (unpacked_pos_ < unpacked_.size()) {
+      msg.preamble = (const cbuf_preamble*)(unpacked_.data() + unpacked_pos_);
+      msg.size = msg.preamble->size();
+      unpacked_pos_ += msg.size;
+      return true;
+    }
+
+    const unsigned char* rec;
+    size_t size;
+    bool from_buffer = buf_start_ < buffer_.size();
+    if (from_buffer) {
+      // Complete the preamble and then the record on the buffer, from the chunk
+      size_t have = buffer_.size() - buf_start_;
+      if (have < sizeof(cbuf_preamble)) {
+        take_from_chunk(std::min(sizeof(cbuf_preamble) - have, chunk_rem_));
+        if (buffer_.size() - buf_start_ < sizeof(cbuf_preamble)) return false;
+      }
+      size = record_size((const cbuf_preamble*)(buffer_.data() + buf_start_));
+      if (size == 0) {
+        large_size_ = 0;
+        have = buffer_.size() - buf_start_;
+        size_t skip = 1 + cbuf_istream::find_magic(buffer_.data() + buf_start_ + 1, have - 1);
+        corrupted_bytes_ += skip;
+        consume(skip, true);
+        continue;
+      }
+      have = buffer_.size() - buf_start_;
+      if (have < size) {
+        take_from_chunk(std::min(size - have, chunk_rem_));
+        if (buffer_.size() - buf_start_ < size) return false;
+      }
+      rec = buffer_.data() + buf_start_;
+    } else {
+      if (chunk_rem_ < sizeof(cbuf_preamble)) {
+        take_from_chunk(chunk_rem_);
+        return false;
+      }
+      size = record_size((const cbuf_preamble*)chunk_ptr_);
+      if (size == 0) {
+        large_size_ = 0;
+        size_t skip = 1 + cbuf_istream::find_magic(chunk_ptr_ + 1, chunk_rem_ - 1);
+        corrupted_bytes_ += skip;
+        consume(skip, false);
+        continue;
+      }
+      if (chunk_rem_ < size) {
+        // Assembled on the buffer as the rest arrives
+        take_from_chunk(chunk_rem_);
+        return false;
+      }
+      rec = chunk_ptr_;
+    }
+
+    large_size_ = 0;
+    bool yielded = handle_record(rec, size, msg);
+    if (yielded && (const unsigned char*)msg.preamble == rec) {
+      // Zero copy, consumed on the next call so the message stays valid
+      yielded_size_ = size;
+      yielded_from_buffer_ = from_buffer;
+      return true;
+    }
+    consume(size, from_buffer);
+    if (yielded) return true;
+  }
+}
+
+const cbuf_preamble* cbuf_decoder::find_reference(uint64_t hash, uint8_t variant, size_t distance) {
+  // Messages of the type are kept from now on
+  auto& ref = references_[std::make_pair(hash, variant)];
+  if (distance < sizeof(cbuf_preamble) || distance > stream_offset_) return nullptr;
+  if (ref.data.empty() || ref.offset != stream_offset_ - distance) return nullptr;
+  return (const cbuf_preamble*)ref.data.data();
+}
+
+bool cbuf_decoder::handle_record(const unsigned char* rec, size_t size, message& msg) {
+  const cbuf_preamble* pre = (const cbuf_preamble*)rec;
+  unsigned int decode_size = (unsigned int)std::min<size_t>(size, UINT_MAX);
+  auto key = std::make_pair(pre->hash, pre->variant());
+
+  if (pre->hash == cbufmsg::metadata::TYPE_HASH) {
+    cbufmsg::metadata mdata;
+    if (mdata.decode((char*)rec, decode_size)) {
+      dictionary[mdata.msg_hash] = mdata.msg_name;
+      metadictionary[mdata.msg_hash] = mdata.msg_meta;
+    }
+    if (!include_metadata_) return false;
+    msg.preamble = pre;
+    msg.size = size;
+    return true;
+  }
+  if (pre->hash == cbufmsg::file_index::TYPE_HASH || pre->hash == cbufmsg::index_trailer::TYPE_HASH) {
+    return false;
+  }
+  if (pre->hash == cbufmsg::large_header::TYPE_HASH) {
+    cbufmsg::large_header hdr;
+    if (hdr.decode((char*)rec, decode_size) && hdr.msg_size >= sizeof(cbuf_preamble)) {
+      large_size_ = hdr.msg_size;
+      large_hash_ = hdr.msg_hash;
+    }
+    return false;
+  }
+  if (pre->hash == cbufmsg::batch::TYPE_HASH) {
+    cbufmsg::batch batch;
+    unpacked_pos_ = 0;
+    if (!batch.decode((char*)rec, decode_size) || !unpack_batch_messages(batch, unpacked_)) {
+      unpacked_.clear();
+    }
+    return false;
+  }
+  if (pre->hash == cbufmsg::repeat::TYPE_HASH) {
+    cbufmsg::repeat rep;
+    unpacked_.clear();
+    unpacked_pos_ = 0;
+    if (!expand_repeats_ || !rep.decode((char*)rec, decode_size) || rep.count == 0) return false;
+    const cbuf_preamble* ref = find_reference(rep.msg_hash, rep.msg_variant, rep.msg_distance);
+    if (ref == nullptr) {
+      fprintf(stderr, "Skipping a repeat record without the message repeated [Offset %zu]\n", stream_offset_);
+      return false;
+    }
+    expand_repeat_messages(rep, ref, unpacked_);
+    return false;
+  }
+  if (pre->hash == cbufmsg::delta::TYPE_HASH) {
+    cbufmsg::delta delta;
+    unpacked_.clear();
+    unpacked_pos_ = 0;
+    if (!delta.decode((char*)rec, decode_size)) return false;
+    const cbuf_preamble* keyframe = find_reference(delta.msg_hash, delta.msg_variant, delta.key_distance);
+    if (keyframe == nullptr || !rebuild_delta_message(delta, keyframe, unpacked_)) {
+      // Never handed out as it is, the message cannot be rebuilt without its keyframe
+      fprintf(stderr, "Skipping a delta record without its keyframe [Offset %zu]\n", stream_offset_);
+      unpacked_.clear();
+    }
+    return false;
+  }
+
+  if (size < pre->maxSize()) {
+    auto it = references_.find(key);
+    if (it == references_.end() && keep_references_) it = references_.emplace(key, reference()).first;
+    if (it != references_.end()) {
+      it->second.offset = stream_offset_;
+      it->second.data.assign(rec, rec + size);
+    }
+  }
+  msg.preamble = pre;
+  msg.size = size;
+  return true;
 }
 
 double cbuf_cstream::now() const { return ::now(); }
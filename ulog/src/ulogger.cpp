@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <mutex>
@@ -166,30 +167,27 @@ void ULogger::processPacket(void* data, int size, const char* metadata, const ch
     pre->setVariant(0);
   }
 
-  int bytes_to_write = size;
-  char* write_ptr = (char*)data;
-  int error_count = 0;
-  do {
-    int result = write(cos.stream, write_ptr, bytes_to_write);
-    if (result > 0) {
-      bytes_to_write -= result;
-      write_ptr += result;
-    } else {
-      if (errno != EAGAIN) {
-        reportError("Cbuf writing error " + std::to_string(errno) + ": " + strerror(errno));
-      }
-      error_count++;
-      if (error_count > 10) {
-        assert(false);
-      }
-    }
-  } while (bytes_to_write > 0);
+  if (type_options_dirty_) {
+    applyTypeOptions();
+  }
 
-  if (file_write_callback_) {
-    file_write_callback_(data, size);
+  // The file write callback, if any, is called by cos for every write
+  if (!cos.write_packet(data, size)) {
+    reportError("Cbuf writing error " + std::to_string(errno) + ": " + strerror(errno));
   }
 
-  current_file_size += size;
+  current_file_size = cos.stream_offset();
+
+  auto& info = current_file_info_;
+  if (info.type_hashes.empty()) {
+    info.start_time = info.end_time = pre->packet_timest;
+  }
+  info.start_time = std::min(info.start_time, pre->packet_timest);
+  info.end_time = std::max(info.end_time, pre->packet_timest);
+  if (std::find(info.type_hashes.begin(), info.type_hashes.end(), pre->hash) == info.type_hashes.end()) {
+    info.type_hashes.push_back(pre->hash);
+    info.type_names.push_back(type_name);
+  }
 
   // Paranoia
   if (pre->magic != CBUF_MAGIC) {
@@ -219,6 +217,36 @@ void ULogger::processPacket(void* data, int size, const char* metadata, const ch
   }
 }
 
+void ULogger::setBatching(uint64_t type_hash, unsigned max_messages, double max_window) {
+  std::lock_guard guard(type_options_mutex_);
+  auto& opts = type_options_[type_hash];
+  opts.batch_messages = max_messages;
+  opts.batch_window = max_window;
+  type_options_dirty_ = true;
+}
+
+void ULogger::setRepeatSuppression(uint64_t type_hash, bool enable, double keepalive_period) {
+  std::lock_guard guard(type_options_mutex_);
+  auto& opts = type_options_[type_hash];
+  opts.suppress_repeats = enable;
+  opts.keepalive_period = keepalive_period;
+  type_options_dirty_ = true;
+}
+
+void ULogger::setDeltaEncoding(uint64_t type_hash, unsigned keyframe_interval) {
+  std::lock_guard guard(type_options_mutex_);
+  type_options_[type_hash].delta_keyframe_interval = keyframe_interval;
+  type_options_dirty_ = true;
+}
+
+void ULogger::applyTypeOptions() {
+  std::lock_guard guard(type_options_mutex_);
+  for (const auto& [hash, opts] : type_options_) {
+    cos.set_type_options(hash, opts);
+  }
+  type_options_dirty_ = false;
+}
+
 // return a copy of the filename, not a reference
 std::string ULogger::getCurrentUlogPath() {
   std::lock_guard guard(g_file_mutex);
@@ -249,12 +277,14 @@ bool ULogger::openFile() {
   fillUlogFilename();
 
   // Open the serialization file
+  cos.set_write_index(write_index_);
   bool bret = cos.open_file(ulogfilename.c_str());
   if (!bret) {
     reportError("Could not open the ulog file for logging: " + ulogfilename);
     return false;
   }
   current_file_size = 0;
+  current_file_info_ = CBufCatalog::FileInfo();
   if (file_write_callback_) {
     cos.setFileWriteCallback(write_callback, this);
   }
@@ -290,6 +320,17 @@ void ULogger::closeFile() {
     std::lock_guard guard(g_file_mutex);
     fname = cos.filename();
     cos.close();
+    if (write_catalog_ && !fname.empty() && !current_file_info_.type_hashes.empty()) {
+      fs::path path(fname);
+      std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+      std::error_code ec;
+      current_file_info_.file_name = path.filename().string();
+      current_file_info_.file_size = fs::file_size(path, ec);
+      if (ec || !CBufCatalog::append(dir, current_file_info_)) {
+        reportError("Could not add " + fname + " to the log catalog");
+      }
+    }
+    current_file_info_ = CBufCatalog::FileInfo();
   }
   if (file_close_callback_) {
     file_close_callback_(fname);
@@ -310,6 +351,13 @@ void ULogger::initialize() {
     name_thread();
     while (!this->quit_thread) {
       if (ringbuffer.size() == 0) {
+        // Write the batches and repeats waiting for too long, even if nothing else comes
+        if (cos.is_open()) {
+          std::lock_guard guard(g_file_mutex);
+          double now = time_now();
+          cos.flush_batches(now);
+          cos.flush_repeats(now);
+        }
         usleep(1000);
         continue;
       }
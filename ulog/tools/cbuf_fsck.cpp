@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "cbuf_fsck.h"
+
+namespace fs = std::filesystem;
+
+struct FsckArgs {
+  std::vector<std::string> paths;
+  unsigned threads = 0;
+  std::string repair_dir;
+  bool quiet = false;
+  bool help = false;
+};
+
+void usage() {
+  printf("cbuf integrity checker, validates every record of cbuf files\n");
+  printf("  Usage: cbuf_fsck [OPTIONS] <ulog folder or cb file>...\n");
+  printf("\n");
+  printf("  Prints a line of JSON per file, with the ranges of bytes with problems.\n");
+  printf("  Exits with 0 if all files are valid, 1 if any has problems, -1 on errors\n");
+  printf("\n");
+  printf("  Options:\n");
+  printf("  -j <threads>  : maximum number of files checked in parallel, all cores by default\n");
+  printf("  -r <folder>   : write there a repaired copy of every file with problems\n");
+  printf("  -q            : print only the files with problems\n");
+  printf("  -h            : show this help\n");
+}
+
+bool parseArgs(FsckArgs& args, int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if ((argv[i][0] == '-') && (argv[i][1] == 'j')) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "The -j option needs a number of threads after it\n");
+        return false;
+      }
+      args.threads = unsigned(atoi(argv[i + 1]));
+      i++;
+    } else if ((argv[i][0] == '-') && (argv[i][1] == 'r')) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "The -r option needs a folder after it\n");
+        return false;
+      }
+      args.repair_dir = argv[i + 1];
+      i++;
+    } else if ((argv[i][0] == '-') && (argv[i][1] == 'q')) {
+      args.quiet = true;
+    } else if ((argv[i][0] == '-') && (argv[i][1] == 'h')) {
+      args.help = true;
+      return true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return false;
+    } else {
+      args.paths.push_back(argv[i]);
+    }
+  }
+  if (args.paths.empty()) {
+    fprintf(stderr, "No ulog folder or cb file given\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  FsckArgs args;
+  if (!parseArgs(args, argc, argv) || args.help) {
+    usage();
+    exit(args.help ? 0 : -1);
+  }
+
+  std::vector<std::string> cb_files;
+  for (const auto& path : args.paths) {
+    std::error_code ec;
+    if (fs::is_directory(path, ec)) {
+      for (const auto& f : fs::directory_iterator(path)) {
+        if (f.path().extension().string() == ".cb") cb_files.push_back(f.path().string());
+      }
+    } else if (fs::exists(path, ec)) {
+      cb_files.push_back(path);
+    } else {
+      fprintf(stderr, "Could not find %s\n", path.c_str());
+      return -1;
+    }
+  }
+
+  if (!args.repair_dir.empty()) {
+    std::error_code ec;
+    fs::create_directories(args.repair_dir, ec);
+    if (!fs::is_directory(args.repair_dir, ec)) {
+      fprintf(stderr, "Could not create the folder %s\n", args.repair_dir.c_str());
+      return -1;
+    }
+    // Repaired copies would replace the files being checked
+    for (const auto& f : cb_files) {
+      fs::path dir = fs::path(f).parent_path();
+      if (dir.empty()) dir = ".";
+      if (fs::equivalent(dir, args.repair_dir, ec)) {
+        fprintf(stderr, "Repaired copies cannot go to the folder of %s\n", f.c_str());
+        return -1;
+      }
+    }
+  }
+
+  std::vector<CBufFsck::Report> reports;
+  CBufFsck::check_files(cb_files, args.threads, args.repair_dir, reports);
+
+  size_t with_problems = 0;
+  bool errors = false;
+  for (const auto& report : reports) {
+    if (!report.error.empty()) errors = true;
+    if (!report.ok()) with_problems++;
+    if (args.quiet && report.ok()) continue;
+    printf("%s\n", CBufFsck::to_json(report).c_str());
+  }
+  fprintf(stderr, "Checked %zu files, %zu with problems\n", cb_files.size(), with_problems);
+  if (errors) return -1;
+  return with_problems > 0 ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "cbuf_index.h"
+
+namespace fs = std::filesystem;
+
+struct IndexArgs {
+  std::vector<std::string> paths;
+  unsigned threads = 0;
+  bool force = false;
+  bool help = false;
+};
+
+void usage() {
+  printf("ulog index builder, writes a sidecar index next to each cbuf file\n");
+  printf("  Usage: ulog_index [OPTIONS] <ulog folder or cb file>...\n");
+  printf("\n");
+  printf("  Options:\n");
+  printf("  -j <threads>  : maximum number of files indexed in parallel, all cores by default\n");
+  printf("  -f            : index again files with a valid sidecar already\n");
+  printf("  -h            : show this help\n");
+}
+
+bool parseArgs(IndexArgs& args, int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if ((argv[i][0] == '-') && (argv[i][1] == 'j')) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "The -j option needs a number of threads after it\n");
+        return false;
+      }
+      args.threads = unsigned(atoi(argv[i + 1]));
+      i++;
+    } else if ((argv[i][0] == '-') && (argv[i][1] == 'f')) {
+      args.force = true;
+    } else if ((argv[i][0] == '-') && (argv[i][1] == 'h')) {
+      args.help = true;
+      return true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return false;
+    } else {
+      args.paths.push_back(argv[i]);
+    }
+  }
+  if (args.paths.empty()) {
+    fprintf(stderr, "No ulog folder or cb file given\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  IndexArgs args;
+  if (!parseArgs(args, argc, argv) || args.help) {
+    usage();
+    exit(args.help ? 0 : -1);
+  }
+
+  std::vector<std::string> cb_files;
+  for (const auto& path : args.paths) {
+    std::error_code ec;
+    if (fs::is_directory(path, ec)) {
+      for (const auto& f : fs::directory_iterator(path)) {
+        if (f.path().extension().string() == ".cb") cb_files.push_back(f.path().string());
+      }
+    } else if (fs::exists(path, ec)) {
+      cb_files.push_back(path);
+    } else {
+      fprintf(stderr, "Could not find %s\n", path.c_str());
+      return -1;
+    }
+  }
+
+  std::vector<std::string> to_index;
+  for (const auto& f : cb_files) {
+    CBufIndex index;
+    if (!args.force && index.load_sidecar(f)) continue;
+    to_index.push_back(f);
+  }
+
+  std::vector<std::string> errors;
+  bool ok = CBufIndex::build_sidecars(to_index, args.threads, errors);
+  for (const auto& err : errors) {
+    fprintf(stderr, "%s\n", err.c_str());
+  }
+  printf("Indexed %zu of %zu files\n", to_index.size() - errors.size(), cb_files.size());
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cbuf_stream.h"
+
+struct BenchArgs {
+  std::string unix_path;
+  size_t message_size = 4096;
+  size_t total_mb = 2048;
+  bool help = false;
+};
+
+void usage() {
+  printf("ulog socket benchmark, sends messages from a cbuf_ostream to a cbuf_istream\n");
+  printf("  Usage: ulog_socket_bench [OPTIONS]\n");
+  printf("\n");
+  printf("  Options:\n");
+  printf("  -s <bytes>    : size of each message, preamble included, 4096 by default\n");
+  printf("  -n <MB>       : megabytes to send, 2048 by default\n");
+  printf("  -u <path>     : use a Unix socket on this path instead of TCP loopback\n");
+  printf("  -h            : show this help\n");
+}
+
+bool parseArgs(BenchArgs& args, int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] != '-' || argv[i][1] == 0) {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return false;
+    }
+    char opt = argv[i][1];
+    if (opt == 'h') {
+      args.help = true;
+      return true;
+    }
+    if (opt != 's' && opt != 'n' && opt != 'u') {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return false;
+    }
+    if (i + 1 == argc) {
+      fprintf(stderr, "The %s option needs a value after it\n", argv[i]);
+      return false;
+    }
+    const char* value = argv[++i];
+    if (opt == 's') args.message_size = strtoul(value, nullptr, 10);
+    if (opt == 'n') args.total_mb = strtoul(value, nullptr, 10);
+    if (opt == 'u') args.unix_path = value;
+  }
+  if (args.message_size < sizeof(cbuf_preamble)) {
+    fprintf(stderr, "Messages need at least %zu bytes\n", sizeof(cbuf_preamble));
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  BenchArgs args;
+  if (!parseArgs(args, argc, argv) || args.help) {
+    usage();
+    return args.help ? 0 : -1;
+  }
+
+  cbuf_istream cis;
+  bool listening = args.unix_path.empty() ? cis.open_socket("127.0.0.1", 0)
+                                          : cis.open_unix_socket(args.unix_path.c_str());
+  if (!listening) {
+    fprintf(stderr, "Could not listen on %s\n", cis.filename().c_str());
+    return -1;
+  }
+
+  // Raw messages of a made up type, described once on the metadata
+  const uint64_t BENCH_HASH = 0xB5E7C40A0001ULL;
+  const size_t num_messages = args.total_mb * 1024 * 1024 / args.message_size;
+  int port = cis.local_port();
+  std::thread sender([&] {
+    cbuf_ostream cos;
+    bool connected = args.unix_path.empty() ? cos.open_socket("127.0.0.1", port)
+                                            : cos.open_unix_socket(args.unix_path.c_str());
+    if (!connected) {
+      fprintf(stderr, "Could not connect to %s\n", cis.filename().c_str());
+      return;
+    }
+    cos.serialize_metadata("struct bench { u8 data[]; }", BENCH_HASH, "bench");
+    std::vector<uint8_t> packet(args.message_size, 0xAB);
+    cbuf_preamble* pre = (cbuf_preamble*)packet.data();
+    *pre = cbuf_preamble();
+    pre->magic = CBUF_MAGIC;
+    pre->hash = BENCH_HASH;
+    pre->setSize(uint32_t(args.message_size));
+    size_t unflushed = 0;
+    for (size_t i = 0; i < num_messages; i++) {
+      pre->packet_timest = double(i);
+      if (!cos.write_packet(packet.data(), packet.size())) break;
+      // Writes never block, wait for the receiver now and then so the buffer does not overflow
+      unflushed += packet.size();
+      if (unflushed >= 8 * 1024 * 1024) {
+        cos.flush();
+        unflushed = 0;
+      }
+    }
+    cos.flush();
+    cos.close();
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  size_t received = 0, bytes = 0;
+  while (received < num_messages) {
+    if (!cis.receive(1000)) {
+      if (!cis.is_connected() && received > 0) break;
+      continue;
+    }
+    while (!cis.empty_no_internal()) {
+      bytes += cis.get_next_size();
+      received++;
+      cis.skip_message();
+    }
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  sender.join();
+
+  printf("Received %zu of %zu messages of %zu bytes over %s\n", received, num_messages, args.message_size,
+         args.unix_path.empty() ? "TCP loopback" : "a Unix socket");
+  printf("%.1f MB in %.3f s: %.2f GB/s, %.0f messages/s\n", bytes / 1e6, elapsed, bytes / elapsed / 1e9,
+         received / elapsed);
+  return received == num_messages ? 0 : -1;
+}